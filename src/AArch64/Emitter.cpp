@@ -1,6 +1,8 @@
 #include "AArch64/Emitter.h"
 #include <algorithm>
+#include <optional>
 #include <sstream>
+#include <unordered_map>
 
 namespace riscy::aarch64 {
 
@@ -12,8 +14,24 @@ static std::string pc_hex(uint64_t pc) {
 
 static std::string rx(int p) { return "x" + std::to_string(p); }
 static std::string rw(int p) { return "w" + std::to_string(p); }
+static std::string rq(int p) { return "q" + std::to_string(p); }
+
+// `vN.<T>` for the lanes of SIMD operations.
+static std::string rv(int p, Lanes lanes) {
+  const char *t = lanes == Lanes::B16  ? ".16b"
+                  : lanes == Lanes::H8 ? ".8h"
+                  : lanes == Lanes::S4 ? ".4s"
+                                       : ".2d";
+  return "v" + std::to_string(p) + t;
+}
+
+// Operands rewritten to a fixed host register, such as a spill scratch
+// register, carry it as kPhysRegBase + p.
+static constexpr VReg kPhysRegBase = 0x80000000u;
 
 static int map_v(const RegAssignment &asg, VReg v) {
+  if (v >= kPhysRegBase)
+    return static_cast<int>(v - kPhysRegBase);
   auto it = asg.v2p.find(v);
   if (it == asg.v2p.end()) {
     fprintf(stderr,
@@ -31,7 +49,564 @@ static int map_any_reg(const RegAssignment &asg, const Operand &op) {
   return 9;
 }
 
-ModuleAsm Emitter::emit(const std::vector<Block> &blocks,
+static const char *condName(Cond c) {
+  switch (c) {
+  case Cond::EQ:
+    return "eq";
+  case Cond::NE:
+    return "ne";
+  case Cond::LO:
+    return "lo";
+  case Cond::LS:
+    return "ls";
+  case Cond::HI:
+    return "hi";
+  case Cond::HS:
+    return "hs";
+  case Cond::LT:
+    return "lt";
+  case Cond::LE:
+    return "le";
+  case Cond::GT:
+    return "gt";
+  case Cond::GE:
+    return "ge";
+  }
+  return "al";
+}
+
+// Prints a branch to `label` taken if `test` holds for register `reg`, or
+// if `cc` holds for the flags.
+static void emitBranch(std::stringstream &s, BranchTest test, Cond cc,
+                       unsigned bit, const std::string &reg,
+                       const std::string &label) {
+  switch (test) {
+  case BranchTest::Flags:
+    s << "  b." << condName(cc) << " " << label << "\n";
+    break;
+  case BranchTest::Zero:
+  case BranchTest::NonZero:
+    s << (test == BranchTest::Zero ? "  cbz " : "  cbnz ") << reg << ", "
+      << label << "\n";
+    break;
+  case BranchTest::BitClear:
+  case BranchTest::BitSet:
+    s << (test == BranchTest::BitClear ? "  tbz " : "  tbnz ") << reg << ", #"
+      << bit << ", " << label << "\n";
+    break;
+  }
+}
+
+// `[xB, #offset]`, or `[x21, xB]` / `[x21, wB, uxtw]` for the register-offset
+// form.
+static std::string address(const RegAssignment &asg, const OpMem &mem) {
+  int pbase = mem.base.id ? map_v(asg, mem.base.id) : 0; // vreg 0 -> x0
+  if (mem.guest)
+    return "[x21, " + (mem.uxtw ? rw(pbase) + ", uxtw]" : rx(pbase) + "]");
+  return "[" + rx(pbase) + ", #" + std::to_string(mem.offset) + "]";
+}
+
+static const char *shiftName(Shift shift) {
+  switch (shift) {
+  case Shift::LSL:
+    return "lsl";
+  case Shift::LSR:
+    return "lsr";
+  case Shift::ASR:
+    return "asr";
+  }
+  return "lsl";
+}
+
+// `#imm` for the immediate of `op`; arithmetic immediates from 4096 up
+// take their shifted form.
+static std::string immediate(Op op, uint64_t imm) {
+  bool logic = op == Op::And || op == Op::Orr || op == Op::Eor;
+  if (logic || imm < 4096)
+    return "#" + std::to_string(imm);
+  return "#" + std::to_string(imm >> 12) + ", lsl #12";
+}
+
+static void emitInstr(std::stringstream &s, const RegAssignment &asg,
+                      const Instr &I) {
+  auto r = [&](int p) { return I.w ? rw(p) : rx(p); };
+  switch (I.op) {
+  case Op::Mov: {
+    const auto &a = I.ops[0];
+    const auto &b0 = I.ops[1];
+    int pd = map_v(asg, std::get<OpRegV>(a).id);
+    if (std::holds_alternative<OpRegV>(b0) ||
+        std::holds_alternative<OpRegP>(b0)) {
+      int ps = map_any_reg(asg, b0);
+      // Copies between coalesced vregs, e.g. for phis, vanish. A 32-bit
+      // copy still clears the upper half.
+      if (ps != pd || I.w)
+        s << "  mov " << r(pd) << ", " << r(ps) << "\n";
+    } else if (std::holds_alternative<OpImm>(b0)) {
+      s << "  mov " << rx(pd) << ", #" << std::get<OpImm>(b0).value << "\n";
+    }
+    break;
+  }
+  case Op::MovZ:
+  case Op::MovN: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    auto imm = std::get<OpImm>(I.ops[1]).value;
+    s << (I.op == Op::MovZ ? "  movz " : "  movn ") << rx(pd) << ", #" << imm;
+    if (I.ops.size() > 2 && std::get<OpImm>(I.ops[2]).value)
+      s << ", lsl #" << std::get<OpImm>(I.ops[2]).value;
+    s << "\n";
+    break;
+  }
+  case Op::MovK: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    auto imm = std::get<OpImm>(I.ops[1]).value;
+    auto lsl = std::get<OpImm>(I.ops[2]).value;
+    s << "  movk " << rx(pd) << ", #" << imm << ", lsl #" << lsl << "\n";
+    break;
+  }
+  case Op::Add:
+  case Op::Sub:
+  case Op::And:
+  case Op::Orr:
+  case Op::Eor:
+  case Op::Lsl:
+  case Op::Lsr:
+  case Op::Asr: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int pa = map_any_reg(asg, I.ops[1]);
+    const char *mn = I.op == Op::Add   ? "add"
+                     : I.op == Op::Sub ? "sub"
+                     : I.op == Op::And ? "and"
+                     : I.op == Op::Orr ? "orr"
+                     : I.op == Op::Eor ? "eor"
+                     : I.op == Op::Lsl ? "lsl"
+                     : I.op == Op::Lsr ? "lsr"
+                                       : "asr";
+    s << "  " << mn << " " << r(pd) << ", " << r(pa) << ", ";
+    if (auto *imm = std::get_if<OpImm>(&I.ops[2]))
+      s << immediate(I.op, imm->value) << "\n";
+    else if (I.amount)
+      s << r(map_any_reg(asg, I.ops[2])) << ", " << shiftName(I.shift) << " #"
+        << I.amount << "\n";
+    else
+      s << r(map_any_reg(asg, I.ops[2])) << "\n";
+    break;
+  }
+  case Op::Ubfx:
+  case Op::Sbfx:
+  case Op::Ubfiz:
+  case Op::Sbfiz:
+  case Op::Bfi: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_any_reg(asg, I.ops[1]);
+    const char *mn = I.op == Op::Ubfx    ? "ubfx"
+                     : I.op == Op::Sbfx  ? "sbfx"
+                     : I.op == Op::Ubfiz ? "ubfiz"
+                     : I.op == Op::Sbfiz ? "sbfiz"
+                                         : "bfi";
+    s << "  " << mn << " " << r(pd) << ", " << r(ps) << ", #"
+      << std::get<OpImm>(I.ops[2]).value << ", #"
+      << std::get<OpImm>(I.ops[3]).value << "\n";
+    break;
+  }
+  case Op::LdrX:
+  case Op::LdrW:
+  case Op::LdrB:
+  case Op::LdrH:
+  case Op::LdrSW: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    const auto &mem = std::get<OpMem>(I.ops[1]);
+    const char *mn = I.op == Op::LdrX   ? "ldr"
+                     : I.op == Op::LdrW ? "ldr"
+                     : I.op == Op::LdrB ? "ldrb"
+                     : I.op == Op::LdrH ? "ldrh"
+                                        : "ldrsw";
+    auto reg = (I.op == Op::LdrW || I.op == Op::LdrB || I.op == Op::LdrH)
+                   ? rw(pd)
+                   : rx(pd);
+    s << "  " << mn << " " << reg << ", " << address(asg, mem) << "\n";
+    break;
+  }
+  case Op::StrX:
+  case Op::StrW:
+  case Op::StrB:
+  case Op::StrH: {
+    int pv = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    const auto &mem = std::get<OpMem>(I.ops[1]);
+    const char *mn = I.op == Op::StrX   ? "str"
+                     : I.op == Op::StrW ? "str"
+                     : I.op == Op::StrB ? "strb"
+                                        : "strh";
+    auto reg = (I.op == Op::StrW || I.op == Op::StrB || I.op == Op::StrH)
+                   ? rw(pv)
+                   : rx(pv);
+    s << "  " << mn << " " << reg << ", " << address(asg, mem) << "\n";
+    break;
+  }
+  case Op::VLdr:
+  case Op::VStr: {
+    int pv = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    const auto &mem = std::get<OpMem>(I.ops[1]);
+    // Offsets that are not a multiple of 16 take the unscaled form.
+    bool scaled = mem.guest || (mem.offset >= 0 && mem.offset % 16 == 0);
+    const char *mn = I.op == Op::VLdr ? (scaled ? "ldr" : "ldur")
+                                      : (scaled ? "str" : "stur");
+    s << "  " << mn << " " << rq(pv) << ", " << address(asg, mem) << "\n";
+    break;
+  }
+  case Op::VAdd:
+  case Op::VSub:
+  case Op::VAnd:
+  case Op::VOrr:
+  case Op::VEor:
+  case Op::VCmeq: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int pa = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    int pb = map_v(asg, std::get<OpRegV>(I.ops[2]).id);
+    // Bitwise operations do not care about lanes.
+    bool logic = I.op == Op::VAnd || I.op == Op::VOrr || I.op == Op::VEor;
+    Lanes lanes = logic ? Lanes::B16 : I.lanes;
+    const char *mn = I.op == Op::VAdd    ? "add"
+                     : I.op == Op::VSub  ? "sub"
+                     : I.op == Op::VAnd  ? "and"
+                     : I.op == Op::VOrr  ? "orr"
+                     : I.op == Op::VCmeq ? "cmeq"
+                                         : "eor";
+    s << "  " << mn << " " << rv(pd, lanes) << ", " << rv(pa, lanes) << ", "
+      << rv(pb, lanes) << "\n";
+    break;
+  }
+  case Op::VDup: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_any_reg(asg, I.ops[1]);
+    s << "  dup " << rv(pd, I.lanes) << ", "
+      << (I.lanes == Lanes::D2 ? rx(ps) : rw(ps)) << "\n";
+    break;
+  }
+  case Op::VMov: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    if (ps != pd)
+      s << "  mov " << rv(pd, Lanes::B16) << ", " << rv(ps, Lanes::B16)
+        << "\n";
+    break;
+  }
+  case Op::VAddv: {
+    // Pairs of doublewords are summed by addp; narrower lanes by addv.
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    const char *scalar = I.lanes == Lanes::B16  ? "b"
+                         : I.lanes == Lanes::H8 ? "h"
+                         : I.lanes == Lanes::S4 ? "s"
+                                                : "d";
+    s << (I.lanes == Lanes::D2 ? "  addp " : "  addv ") << scalar << pd
+      << ", " << rv(ps, I.lanes) << "\n";
+    break;
+  }
+  case Op::VUmaxv: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    const char *scalar = I.lanes == Lanes::B16  ? "b"
+                         : I.lanes == Lanes::H8 ? "h"
+                                                : "s";
+    s << "  umaxv " << scalar << pd << ", " << rv(ps, I.lanes) << "\n";
+    break;
+  }
+  case Op::VUmov: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    if (I.lanes == Lanes::D2)
+      s << "  fmov " << rx(pd) << ", d" << ps << "\n";
+    else
+      s << "  umov " << rw(pd) << ", v" << ps
+        << (I.lanes == Lanes::B16  ? ".b"
+            : I.lanes == Lanes::H8 ? ".h"
+                                   : ".s")
+        << "[0]\n";
+    break;
+  }
+  case Op::Cmp:
+  case Op::Cmn: {
+    int pa = map_any_reg(asg, I.ops[0]);
+    s << (I.op == Op::Cmp ? "  cmp " : "  cmn ") << r(pa) << ", ";
+    if (auto *imm = std::get_if<OpImm>(&I.ops[1]))
+      s << immediate(I.op, imm->value) << "\n";
+    else
+      s << r(map_any_reg(asg, I.ops[1])) << "\n";
+    break;
+  }
+  case Op::CsetEq:
+  case Op::CsetNe:
+  case Op::CsetLo:
+  case Op::CsetLs:
+  case Op::CsetHi:
+  case Op::CsetHs:
+  case Op::CsetLt:
+  case Op::CsetLe:
+  case Op::CsetGt:
+  case Op::CsetGe: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    const char *cc = I.op == Op::CsetEq   ? "eq"
+                     : I.op == Op::CsetNe ? "ne"
+                     : I.op == Op::CsetLo ? "lo"
+                     : I.op == Op::CsetLs ? "ls"
+                     : I.op == Op::CsetHi ? "hi"
+                     : I.op == Op::CsetHs ? "hs"
+                     : I.op == Op::CsetLt ? "lt"
+                     : I.op == Op::CsetLe ? "le"
+                     : I.op == Op::CsetGt ? "gt"
+                                          : "ge";
+    s << "  cset " << rx(pd) << ", " << cc << "\n";
+    break;
+  }
+  case Op::Csel:
+  case Op::Csinc:
+  case Op::Csneg: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int pa = map_any_reg(asg, I.ops[1]);
+    int pb = map_any_reg(asg, I.ops[2]);
+    // With the same register twice, csinc and csneg read as increment or
+    // negate unless the inverted condition holds.
+    if (pa == pb && I.op != Op::Csel)
+      s << (I.op == Op::Csinc ? "  cinc " : "  cneg ") << r(pd) << ", "
+        << r(pa) << ", " << condName(inverse(I.cc)) << "\n";
+    else
+      s << (I.op == Op::Csel    ? "  csel "
+            : I.op == Op::Csinc ? "  csinc "
+                                : "  csneg ")
+        << r(pd) << ", " << r(pa) << ", " << r(pb) << ", " << condName(I.cc)
+        << "\n";
+    break;
+  }
+  case Op::Sxtw: {
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    s << "  sxtw " << rx(pd) << ", " << rw(ps) << "\n";
+    break;
+  }
+  case Op::Sxtb:
+  case Op::Sxth:
+  case Op::Uxtb:
+  case Op::Uxth: {
+    // The unsigned forms only exist on w registers, which clear the upper
+    // half anyway.
+    int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
+    bool sign = I.op == Op::Sxtb || I.op == Op::Sxth;
+    bool byte = I.op == Op::Sxtb || I.op == Op::Uxtb;
+    s << "  " << (sign ? "sxt" : "uxt") << (byte ? "b " : "h ")
+      << (sign && !I.w ? rx(pd) : rw(pd)) << ", " << rw(ps) << "\n";
+    break;
+  }
+  case Op::BCond:
+    emitBranch(s, BranchTest::Flags, I.cc, 0, "",
+               std::get<OpLabel>(I.ops[0]).name);
+    break;
+  case Op::Cbz:
+  case Op::Cbnz: {
+    int pc = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    emitBranch(s, I.op == Op::Cbz ? BranchTest::Zero : BranchTest::NonZero,
+               I.cc, 0, r(pc), std::get<OpLabel>(I.ops[1]).name);
+    break;
+  }
+  case Op::Tbz:
+  case Op::Tbnz: {
+    int pc = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
+    auto bit = static_cast<unsigned>(std::get<OpImm>(I.ops[1]).value);
+    emitBranch(s, I.op == Op::Tbz ? BranchTest::BitClear : BranchTest::BitSet,
+               I.cc, bit, r(pc), std::get<OpLabel>(I.ops[2]).name);
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+// Emits `def`, the definition of a rematerialized constant, into host
+// register `p`.
+static void rematerialize(std::stringstream &s, const RegAssignment &asg,
+                          Instr def, PReg p) {
+  def.ops[0] = OpRegV{kPhysRegBase + static_cast<VReg>(p)};
+  emitInstr(s, asg, def);
+}
+
+// Emits `I`, staging spilled vregs through the scratch registers: values it
+// reads are loaded, or rematerialized, before it and the value it writes is
+// stored after it. The definition of a rematerialized value vanishes.
+static void emitWithSpills(std::stringstream &s, const RegAssignment &asg,
+                           const Instr &I) {
+  if (asg.spill.empty() && asg.remat.empty()) {
+    emitInstr(s, asg, I);
+    return;
+  }
+  Instr J = I;
+  std::unordered_map<VReg, PReg> staged;
+  size_t nextScratch = 0, nextVecScratch = 0;
+  std::optional<std::pair<PReg, int32_t>> store;
+  bool storeVector = false;
+  // Branches only read the register they test; their other operands just
+  // keep the values of a side exit live.
+  size_t n = J.ops.size();
+  if (I.op == Op::BCond)
+    n = 0;
+  else if (I.op == Op::Cbz || I.op == Op::Cbnz || I.op == Op::Tbz ||
+           I.op == Op::Tbnz)
+    n = 1;
+  for (size_t i = 0; i < n; ++i) {
+    VReg *v = nullptr;
+    if (auto *r = std::get_if<OpRegV>(&J.ops[i]))
+      v = &r->id;
+    else if (auto *m = std::get_if<OpMem>(&J.ops[i]); m && m->base.id)
+      v = &m->base.id;
+    if (!v)
+      continue;
+    bool def = i == 0 && std::holds_alternative<OpRegV>(J.ops[i]) &&
+               definesFirstOperand(I.op);
+    if (auto re = asg.remat.find(*v); re != asg.remat.end()) {
+      if (def)
+        return;
+      auto st = staged.find(*v);
+      PReg p = st == staged.end() ? kScratchRegs[nextScratch++] : st->second;
+      if (st == staged.end())
+        rematerialize(s, asg, re->second, p);
+      staged[*v] = p;
+      *v = kPhysRegBase + static_cast<VReg>(p);
+      continue;
+    }
+    auto slot = asg.spill.find(*v);
+    if (slot == asg.spill.end())
+      continue;
+    bool vector = *v & kVecRegBit;
+    auto reg = vector ? rq : rx;
+    PReg p = vector ? kVecScratchRegs[0] : kScratchRegs[0];
+    if (!def || readsFirstOperand(I.op)) {
+      auto st = staged.find(*v);
+      if (st == staged.end()) {
+        p = vector ? kVecScratchRegs[nextVecScratch++]
+                   : kScratchRegs[nextScratch++];
+        s << "  ldr " << reg(p) << ", [x0, #" << slot->second << "]\n";
+        staged[*v] = p;
+      } else {
+        p = st->second;
+      }
+    }
+    // A written value can share a scratch register with the operands: they
+    // are all read before it is written.
+    if (def) {
+      store = {p, slot->second};
+      storeVector = vector;
+    }
+    *v = kPhysRegBase + static_cast<VReg>(p);
+  }
+  emitInstr(s, asg, J);
+  if (store)
+    s << "  str " << (storeVector ? rq : rx)(store->first) << ", [x0, #"
+      << store->second << "]\n";
+}
+
+// Host register holding `v` for a terminator, reloading or rematerializing
+// it if spilled.
+static int useReg(std::stringstream &s, const RegAssignment &asg, VReg v) {
+  if (auto re = asg.remat.find(v); re != asg.remat.end()) {
+    rematerialize(s, asg, re->second, kScratchRegs[0]);
+    return kScratchRegs[0];
+  }
+  auto slot = asg.spill.find(v);
+  if (slot == asg.spill.end())
+    return map_v(asg, v);
+  s << "  ldr " << rx(kScratchRegs[0]) << ", [x0, #" << slot->second << "]\n";
+  return kScratchRegs[0];
+}
+
+static std::string labelOf(const Block &b) {
+  if (!b.label.empty())
+    return b.label;
+  return "__riscy_block_0x" + pc_hex(b.guest_pc);
+}
+
+// How far, in bytes either way, tbz/tbnz and cbz/cbnz/b.<cc> reach.
+static constexpr int64_t kTestBranchReach = 32 * 1024;
+static constexpr int64_t kCondBranchReach = 1024 * 1024;
+
+// The conditional branch with the inverse test of the branch mnemonic `mn`,
+// or "" if `mn` is not one.
+static std::string inverseBranch(const std::string &mn) {
+  if (mn == "tbz" || mn == "cbz")
+    return mn.substr(0, 2) + "nz";
+  if (mn == "tbnz" || mn == "cbnz")
+    return mn.substr(0, 2) + "z";
+  for (Cond c : {Cond::EQ, Cond::NE, Cond::LO, Cond::LS, Cond::HI, Cond::HS,
+                 Cond::LT, Cond::LE, Cond::GT, Cond::GE})
+    if (mn == std::string("b.") + condName(c))
+      return std::string("b.") + condName(inverse(c));
+  return "";
+}
+
+// Rewrites each conditional branch of the assembly `text` whose target is
+// out of its reach into the inverse branch over a `b`, which reaches 128MiB:
+//   tbz x1, #3, far  ->  tbnz x1, #3, __riscy_relax_0; b far; __riscy_relax_0:
+// That moves other branches further apart, so repeat until all are in reach.
+static std::string relaxBranches(const std::string &text) {
+  std::vector<std::string> lines;
+  std::istringstream is(text);
+  for (std::string line; std::getline(is, line);)
+    lines.push_back(line);
+  auto isInstr = [](const std::string &line) {
+    return line.size() > 2 && line[0] == ' ' && line[2] != '.';
+  };
+  if (4 * std::count_if(lines.begin(), lines.end(), isInstr) <
+      kTestBranchReach)
+    return text;
+
+  unsigned relaxed = 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    std::unordered_map<std::string, int64_t> at;
+    int64_t pc = 0;
+    for (const auto &line : lines) {
+      if (isInstr(line))
+        pc += 4;
+      else if (!line.empty() && line.back() == ':')
+        at[line.substr(0, line.size() - 1)] = pc;
+    }
+    std::vector<std::string> out;
+    pc = 0;
+    for (const auto &line : lines) {
+      if (!isInstr(line)) {
+        out.push_back(line);
+        continue;
+      }
+      // The target is the last operand.
+      auto space = line.find(' ', 2);
+      std::string mn = line.substr(2, space - 2);
+      std::string inv = inverseBranch(mn);
+      auto comma = line.rfind(", ");
+      auto cut = comma == std::string::npos ? space + 1 : comma + 2;
+      auto it = inv.empty() ? at.end() : at.find(line.substr(cut));
+      int64_t reach = mn[0] == 't' ? kTestBranchReach : kCondBranchReach;
+      if (it == at.end() ||
+          (it->second - pc >= -reach && it->second - pc < reach)) {
+        out.push_back(line);
+        pc += 4;
+        continue;
+      }
+      std::string target = line.substr(cut);
+      std::string skip = "__riscy_relax_" + std::to_string(relaxed++);
+      out.push_back("  " + inv + line.substr(space, cut - space) + skip);
+      out.push_back("  b " + target);
+      out.push_back(skip + ":");
+      pc += 8;
+      changed = true;
+    }
+    lines.swap(out);
+  }
+  std::string result;
+  for (const auto &line : lines)
+    result += line + "\n";
+  return result;
+}
+
+ModuleAsm Emitter::emit(const std::vector<std::vector<Block>> &units,
                         const std::vector<RegAssignment> &assignments,
                         uint64_t entry_pc) const {
   ModuleAsm out{};
@@ -40,190 +615,125 @@ ModuleAsm Emitter::emit(const std::vector<Block> &blocks,
   s << ".global _riscy_entry\n";
   s << "// x0 = struct RiscyGuestState*; x1 = start guest PC\n";
   s << "_riscy_entry:\n";
-  s << "  mov x19, x30\n";
+  // Translated code allocates from callee-saved registers, so preserve them
+  // (and the frame record) for our C caller.
+  s << "  stp x29, x30, [sp, #-96]!\n";
+  s << "  stp x19, x20, [sp, #16]\n";
+  s << "  stp x21, x22, [sp, #32]\n";
+  s << "  stp x23, x24, [sp, #48]\n";
+  s << "  stp x25, x26, [sp, #64]\n";
+  s << "  stp x27, x28, [sp, #80]\n";
   s << "  bl _riscy_indirect_jump\n";
-  s << "  ret x19\n\n";
+  s << "  ldp x27, x28, [sp, #80]\n";
+  s << "  ldp x25, x26, [sp, #64]\n";
+  s << "  ldp x23, x24, [sp, #48]\n";
+  s << "  ldp x21, x22, [sp, #32]\n";
+  s << "  ldp x19, x20, [sp, #16]\n";
+  s << "  ldp x29, x30, [sp], #96\n";
+  s << "  ret\n\n";
 
-  // Tables
+  // Tables: blocks entered by guest address, sorted so that the runtime finds
+  // the image base first.
+  std::vector<uint64_t> entries;
+  for (const auto &unit : units)
+    for (const auto &b : unit)
+      if (b.label.empty())
+        entries.push_back(b.guest_pc);
+  std::sort(entries.begin(), entries.end());
   s << ".data\n";
   s << ".align 3\n";
   s << ".global _riscy_entry_pc\n";
   s << "_riscy_entry_pc:\n  .quad 0x" << pc_hex(entry_pc) << "\n";
   s << ".global _riscy_num_blocks\n";
-  s << "_riscy_num_blocks:\n  .quad " << blocks.size() << "\n";
+  s << "_riscy_num_blocks:\n  .quad " << entries.size() << "\n";
   s << ".global _riscy_block_addrs\n";
   s << "_riscy_block_addrs:\n";
-  for (auto &b : blocks)
-    s << "  .quad 0x" << pc_hex(b.guest_pc) << "\n";
+  for (auto pc : entries)
+    s << "  .quad 0x" << pc_hex(pc) << "\n";
   s << ".global _riscy_block_ptrs\n";
   s << "_riscy_block_ptrs:\n";
-  for (auto &b : blocks)
-    s << "  .quad __riscy_block_0x" << pc_hex(b.guest_pc) << "\n";
+  for (auto pc : entries)
+    s << "  .quad __riscy_block_0x" << pc_hex(pc) << "\n";
   s << "\n.text\n";
+  auto blocksStart = static_cast<size_t>(s.tellp());
 
-  // Emit blocks
-  for (size_t i = 0; i < blocks.size(); ++i) {
-    const auto &b = blocks[i];
-    const auto &asg = assignments[i];
-    s << "__riscy_block_0x" << pc_hex(b.guest_pc) << ":\n";
-    // Load guest memory base (offset 256 after 32 xregs)
-    s << "  ldr x21, [x0, #256]\n";
-    for (const auto &I : b.instrs) {
-      switch (I.op) {
-      case Op::Mov: {
-        const auto &a = I.ops[0];
-        const auto &b0 = I.ops[1];
-        int pd = map_v(asg, std::get<OpRegV>(a).id);
-        if (std::holds_alternative<OpRegV>(b0) ||
-            std::holds_alternative<OpRegP>(b0)) {
-          int ps = map_any_reg(asg, b0);
-          s << "  mov " << rx(pd) << ", " << rx(ps) << "\n";
-        } else if (std::holds_alternative<OpImm>(b0)) {
-          s << "  mov " << rx(pd) << ", #" << std::get<OpImm>(b0).value << "\n";
-        }
-        break;
-      }
-      case Op::MovZ: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        auto imm = std::get<OpImm>(I.ops[1]).value;
-        s << "  movz " << rx(pd) << ", #" << imm << "\n";
-        break;
-      }
-      case Op::MovK: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        auto imm = std::get<OpImm>(I.ops[1]).value;
-        auto lsl = std::get<OpImm>(I.ops[2]).value;
-        s << "  movk " << rx(pd) << ", #" << imm << ", lsl #" << lsl << "\n";
-        break;
-      }
-      case Op::Add:
-      case Op::Sub:
-      case Op::And:
-      case Op::Orr:
-      case Op::Eor:
-      case Op::Lsl:
-      case Op::Lsr:
-      case Op::Asr: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        int pa = map_any_reg(asg, I.ops[1]);
-        int pb = map_any_reg(asg, I.ops[2]);
-        const char *mn = I.op == Op::Add   ? "add"
-                         : I.op == Op::Sub ? "sub"
-                         : I.op == Op::And ? "and"
-                         : I.op == Op::Orr ? "orr"
-                         : I.op == Op::Eor ? "eor"
-                         : I.op == Op::Lsl ? "lsl"
-                         : I.op == Op::Lsr ? "lsr"
-                                           : "asr";
-        s << "  " << mn << " " << rx(pd) << ", " << rx(pa) << ", " << rx(pb)
-          << "\n";
-        break;
-      }
-      case Op::LdrX:
-      case Op::LdrW:
-      case Op::LdrB:
-      case Op::LdrH:
-      case Op::LdrSW: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        const auto &mem = std::get<OpMem>(I.ops[1]);
-        int pbase = mem.base.id ? map_v(asg, mem.base.id) : 0; // vreg 0 -> x0
-        const char *mn = I.op == Op::LdrX   ? "ldr"
-                         : I.op == Op::LdrW ? "ldr"
-                         : I.op == Op::LdrB ? "ldrb"
-                         : I.op == Op::LdrH ? "ldrh"
-                                            : "ldrsw";
-        auto reg = (I.op == Op::LdrW || I.op == Op::LdrB || I.op == Op::LdrH)
-                       ? rw(pd)
-                       : rx(pd);
-        s << "  " << mn << " " << reg << ", [" << rx(pbase) << ", #"
-          << mem.offset << "]\n";
-        break;
-      }
-      case Op::StrX:
-      case Op::StrW:
-      case Op::StrB:
-      case Op::StrH: {
-        int pv = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        const auto &mem = std::get<OpMem>(I.ops[1]);
-        int pbase = mem.base.id ? map_v(asg, mem.base.id) : 0;
-        const char *mn = I.op == Op::StrX   ? "str"
-                         : I.op == Op::StrW ? "str"
-                         : I.op == Op::StrB ? "strb"
-                                            : "strh";
-        auto reg = (I.op == Op::StrW || I.op == Op::StrB || I.op == Op::StrH)
-                       ? rw(pv)
-                       : rx(pv);
-        s << "  " << mn << " " << reg << ", [" << rx(pbase) << ", #"
-          << mem.offset << "]\n";
-        break;
-      }
-      case Op::Cmp: {
-        int pa = map_any_reg(asg, I.ops[0]);
-        int pb = map_any_reg(asg, I.ops[1]);
-        s << "  cmp " << rx(pa) << ", " << rx(pb) << "\n";
-        break;
-      }
-      case Op::CsetEq:
-      case Op::CsetNe:
-      case Op::CsetLo:
-      case Op::CsetLs:
-      case Op::CsetHi:
-      case Op::CsetHs:
-      case Op::CsetLt:
-      case Op::CsetLe:
-      case Op::CsetGt:
-      case Op::CsetGe: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        const char *cc = I.op == Op::CsetEq   ? "eq"
-                         : I.op == Op::CsetNe ? "ne"
-                         : I.op == Op::CsetLo ? "lo"
-                         : I.op == Op::CsetLs ? "ls"
-                         : I.op == Op::CsetHi ? "hi"
-                         : I.op == Op::CsetHs ? "hs"
-                         : I.op == Op::CsetLt ? "lt"
-                         : I.op == Op::CsetLe ? "le"
-                         : I.op == Op::CsetGt ? "gt"
-                                              : "ge";
-        s << "  cset " << rx(pd) << ", " << cc << "\n";
-        break;
-      }
-      case Op::Sxtw: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
-        s << "  sxtw " << rx(pd) << ", " << rw(ps) << "\n";
-        break;
-      }
-      case Op::Uxtw: {
-        int pd = map_v(asg, std::get<OpRegV>(I.ops[0]).id);
-        int ps = map_v(asg, std::get<OpRegV>(I.ops[1]).id);
-        s << "  uxtw " << rx(pd) << ", " << rw(ps) << "\n";
-        break;
-      }
-      default:
-        break;
-      }
-    }
+  // Emit blocks in order, so a branch to the label that follows is dropped.
+  std::vector<std::pair<const Block *, const RegAssignment *>> order;
+  for (size_t u = 0; u < units.size(); ++u)
+    for (const auto &b : units[u])
+      order.push_back({&b, &assignments[u]});
+  for (size_t i = 0; i < order.size(); ++i) {
+    const auto &b = *order[i].first;
+    const auto &asg = *order[i].second;
+    std::string next;
+    if (!b.exits.empty())
+      next = b.exits.front().label;
+    else if (i + 1 < order.size())
+      next = labelOf(*order[i + 1].first);
+
+    s << labelOf(b) << ":\n";
+    // Load guest memory base (offset 256 after 32 xregs) on entry by address;
+    // it stays live across the internal blocks of a unit.
+    if (b.label.empty())
+      s << "  ldr x21, [x0, #256]\n";
+    for (const auto &I : b.instrs)
+      emitWithSpills(s, asg, I);
 
     // Terminator
     switch (b.term.kind) {
     case TermKind::Br: {
       auto t = std::get<TermBr>(b.term.data);
-      s << "  b " << t.target << "\n";
+      if (t.target != next)
+        s << "  b " << t.target << "\n";
       break;
     }
     case TermKind::CBr: {
       auto t = std::get<TermCBr>(b.term.data);
-      int pc = map_v(asg, t.cond);
-      s << "  cmp " << rx(pc) << ", #0\n";
-      s << "  b.ne " << t.t << "\n";
-      s << "  b " << t.f << "\n";
+      // Branch on the inverse test when the true target follows.
+      if (t.t == next && t.f != next) {
+        std::swap(t.t, t.f);
+        t.test = inverse(t.test);
+        t.cc = inverse(t.cc);
+      }
+      std::string reg;
+      if (t.test != BranchTest::Flags) {
+        int pc = useReg(s, asg, t.cond);
+        reg = t.w ? rw(pc) : rx(pc);
+      }
+      emitBranch(s, t.test, t.cc, t.bit, reg, t.t);
+      if (t.f != next)
+        s << "  b " << t.f << "\n";
       break;
     }
     case TermKind::BrIndirect: {
       auto t = std::get<TermBrIndirect>(b.term.data);
-      int pt = map_v(asg, t.target);
+      int pt = useReg(s, asg, t.target);
+      // Tail-call the dispatcher so the target block returns to our caller.
+      s << "  mov x1, " << rx(pt) << "\n";
+      s << "  b _riscy_indirect_jump\n";
+      break;
+    }
+    case TermKind::Call: {
+      // Guest calls become native calls: the callee's `ret` lands back here
+      // and we continue at the return site. x0 is caller-saved for the
+      // dispatcher, so keep the state pointer alongside the link register.
+      auto t = std::get<TermCall>(b.term.data);
+      s << "  stp x0, x30, [sp, #-16]!\n";
+      s << "  bl " << t.target << "\n";
+      s << "  ldp x0, x30, [sp], #16\n";
+      if (t.ret != next)
+        s << "  b " << t.ret << "\n";
+      break;
+    }
+    case TermKind::CallIndirect: {
+      auto t = std::get<TermCallIndirect>(b.term.data);
+      int pt = useReg(s, asg, t.target);
+      s << "  stp x0, x30, [sp, #-16]!\n";
       s << "  mov x1, " << rx(pt) << "\n";
       s << "  bl _riscy_indirect_jump\n";
+      s << "  ldp x0, x30, [sp], #16\n";
+      if (t.ret != next)
+        s << "  b " << t.ret << "\n";
       break;
     }
     case TermKind::Ret:
@@ -236,10 +746,20 @@ ModuleAsm Emitter::emit(const std::vector<Block> &blocks,
       break;
     }
 
+    for (const auto &x : b.exits) {
+      s << x.label << ":\n";
+      for (const auto &I : x.instrs)
+        emitWithSpills(s, asg, I);
+      s << "  b " << x.target << "\n";
+    }
+
     s << "\n";
   }
 
+  // Far conditional branches only show up once the code is laid out.
   out.text = s.str();
+  out.text.replace(blocksStart, std::string::npos,
+                   relaxBranches(out.text.substr(blocksStart)));
   return out;
 }
 
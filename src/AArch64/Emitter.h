@@ -13,8 +13,10 @@ struct ModuleAsm {
 
 class Emitter {
 public:
-  // Emit a full translation unit with blocks and their assignments (same order)
-  ModuleAsm emit(const std::vector<Block> &blocks,
+  // Emit a full translation unit from units of blocks that share one
+  // register assignment each (same order). Only blocks entered by guest
+  // address appear in the dispatch tables.
+  ModuleAsm emit(const std::vector<std::vector<Block>> &units,
                  const std::vector<RegAssignment> &assignments,
                  uint64_t entry_pc) const;
 };
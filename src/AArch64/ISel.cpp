@@ -1,5 +1,13 @@
 #include "AArch64/ISel.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
 #include <sstream>
+#include <unordered_map>
+
+#include "IR/DefUse.h"
+#include "IR/KnownBits.h"
 
 namespace riscy::aarch64 {
 
@@ -17,249 +25,1255 @@ static inline Instr make3(Op op, Operand a, Operand b, Operand c) {
   return Instr{op, {std::move(a), std::move(b), std::move(c)}};
 }
 
-Block ISel::select(const ir::Block &bb) const {
-  Block out{};
-  out.guest_pc = bb.start;
+// Whether `v` fits the 12-bit, optionally shifted, immediate of add, sub
+// and cmp.
+static bool isArithImm(uint64_t v) {
+  return v < 4096 || ((v & 0xfff) == 0 && v < (4096u << 12));
+}
+
+// Whether the low `width` bits of `v` form a logical (bitmask) immediate of
+// and, orr and eor: a replicated element of 2 to 64 bits holding one
+// rotated run of ones.
+static bool isLogicalImm(uint64_t v, unsigned width) {
+  if (width == 32)
+    v = (v & 0xffffffffu) | (v << 32);
+  if (v == 0 || v == ~0ull)
+    return false;
+  unsigned size = 64;
+  while (size > 2) {
+    unsigned half = size / 2;
+    uint64_t mask = (1ull << half) - 1;
+    if (((v >> half) & mask) != (v & mask))
+      break;
+    size = half;
+  }
+  uint64_t mask = size == 64 ? ~0ull : (1ull << size) - 1;
+  uint64_t elt = v & mask;
+  // A run that wraps around is a run of zeros that does not.
+  uint64_t run = elt & 1 ? ~elt & mask : elt;
+  return (((run | (run - 1)) + 1) & run) == 0;
+}
+
+// Materialize a 64-bit constant with the fewest instructions. A single Mov
+// covers values that movz, movn or a logical immediate encode. Otherwise
+// start with MovZ or MovN of the first half-word that differs from the more
+// common background (zeros or ones) and patch the others with MovK, unless
+// a logical immediate plus one MovK is shorter.
+static void materializeConst(std::vector<Instr> &out, VReg v, uint64_t val) {
+  if ((val >> 16) == 0 || isLogicalImm(val, 64)) {
+    out.push_back(make2(Op::Mov, OpRegV{v}, OpImm{val}));
+    return;
+  }
+  unsigned zeros = 0, ones = 0;
+  for (unsigned sh = 0; sh < 64; sh += 16) {
+    uint16_t hw = (val >> sh) & 0xffffu;
+    zeros += hw == 0;
+    ones += hw == 0xffff;
+  }
+  bool inverted = ones > zeros;
+  if (4 - std::max(zeros, ones) > 2) {
+    for (unsigned sh = 0; sh < 64; sh += 16) {
+      for (unsigned from = 0; from < 64; from += 16) {
+        uint64_t base = (val & ~(0xffffull << sh)) |
+                        (((val >> from) & 0xffffu) << sh);
+        if (from == sh || !isLogicalImm(base, 64))
+          continue;
+        out.push_back(make2(Op::Mov, OpRegV{v}, OpImm{base}));
+        out.push_back(make3(Op::MovK, OpRegV{v},
+                            OpImm{(val >> sh) & 0xffffu}, OpImm{sh}));
+        return;
+      }
+    }
+  }
+  uint16_t background = inverted ? 0xffff : 0;
+  bool first = true;
+  for (unsigned sh = 0; sh < 64; sh += 16) {
+    uint16_t hw = (val >> sh) & 0xffffu;
+    if (hw == background)
+      continue;
+    if (first) {
+      Op op = inverted ? Op::MovN : Op::MovZ;
+      uint16_t imm = inverted ? static_cast<uint16_t>(~hw) : hw;
+      out.push_back(make3(op, OpRegV{v}, OpImm{imm}, OpImm{sh}));
+      first = false;
+    } else {
+      out.push_back(make3(Op::MovK, OpRegV{v}, OpImm{hw}, OpImm{sh}));
+    }
+  }
+  if (first) // all ones
+    out.push_back(make3(Op::MovN, OpRegV{v}, OpImm{0}, OpImm{0}));
+}
+
+static inline VReg vreg_of(ir::ValueId id) { return static_cast<VReg>(id + 1); }
 
-  // Map IR ValueId -> virtual reg
-  std::vector<VReg> vmap(bb.insts.size() + 1, 0);
-  auto vreg_of = [&](ir::ValueId id) {
-    if (id >= vmap.size())
-      vmap.resize(id + 1, 0);
-    if (!vmap[id])
-      vmap[id] = static_cast<VReg>(id + 1);
-    return vmap[id];
+namespace {
+
+// What selection needs to know about the values of a unit. i32 values live
+// in the low half of a host register and are only read by W-form
+// instructions, so the upper half is undefined and a Trunc to i32 shares
+// the register of its source instead of copying it.
+class ValueInfo {
+public:
+  // How a Select is lowered: `op` picks `a` if the condition holds, else
+  // `b`, incremented for Csinc or negated for Csneg. `invert` swaps the
+  // arms when the increment or negation is the true one.
+  struct SelectPlan {
+    Op op = Op::Csel;
+    ir::ValueId a = 0, b = 0;
+    bool invert = false;
+  };
+  // An operation on register `reg` and an immediate instead of a constant:
+  // `op` is Add, Sub, And, Orr, Eor, Lsl, Lsr or Asr for a BinOp and Cmp or
+  // Cmn for an ICmp. `swapped` compares the immediate with `reg` rather
+  // than the converse.
+  struct ImmPlan {
+    Op op = Op::Add;
+    ir::ValueId reg = 0;
+    uint64_t imm = 0;
+    bool swapped = false;
+  };
+  // A bitfield instruction computing a shift or mask of another shift or
+  // mask: `op` takes `width` bits of `src` at `lsb`, or for Bfi inserts
+  // them into a copy of `base`.
+  struct FieldPlan {
+    Op op = Op::Ubfx;
+    ir::ValueId src = 0, base = 0;
+    unsigned lsb = 0, width = 0;
+  };
+  // An operation on `lhs` and `rhs` shifted by `amount` in the instruction.
+  struct ShiftedPlan {
+    Op op = Op::Add;
+    ir::ValueId lhs = 0, rhs = 0;
+    Shift shift = Shift::LSL;
+    unsigned amount = 0;
+  };
+  // A branch on a comparison with zero that tests register `reg` without a
+  // Cmp: for zero, or for bit `bit` if `test` is a bit test.
+  struct BranchPlan {
+    BranchTest test = BranchTest::NonZero;
+    ir::ValueId reg = 0;
+    unsigned bit = 0;
   };
 
-  for (const auto &I : bb.insts) {
-    if (std::holds_alternative<ir::Const>(I.payload)) {
-      if (I.dest) {
-        auto v = vreg_of(*I.dest);
-        auto &C = std::get<ir::Const>(I.payload);
-        // Use Mov/MovZ/MovK sequence; start with MovZ low 16 bits, then MovK
-        uint64_t val = C.value;
-        if ((val >> 16) == 0) {
-          out.instrs.push_back(make2(Op::Mov, OpRegV{v}, OpImm{val}));
-        } else {
-          out.instrs.push_back(make2(Op::MovZ, OpRegV{v}, OpImm{val & 0xffff}));
-          uint16_t hi1 = (val >> 16) & 0xffffu;
-          uint16_t hi2 = (val >> 32) & 0xffffu;
-          uint16_t hi3 = (val >> 48) & 0xffffu;
-          if (hi1)
-            out.instrs.push_back(
-                make3(Op::MovK, OpRegV{v}, OpImm{hi1}, OpImm{16}));
-          if (hi2)
-            out.instrs.push_back(
-                make3(Op::MovK, OpRegV{v}, OpImm{hi2}, OpImm{32}));
-          if (hi3)
-            out.instrs.push_back(
-                make3(Op::MovK, OpRegV{v}, OpImm{hi3}, OpImm{48}));
-        }
+  explicit ValueInfo(ir::ValueId numValues)
+      : types(numValues, ir::Type::i64()), alias(numValues),
+        defs(numValues, nullptr), uses(numValues, 0),
+        condUses(numValues, 0), branchUses(numValues, 0),
+        absorbed(numValues, false) {
+    for (ir::ValueId v = 0; v < numValues; ++v)
+      alias[v] = v;
+  }
+  void add(const ir::Block &bb) {
+    auto count = [&](ir::ValueId &v) { ++uses[v]; };
+    for (const auto &I : bb.insts) {
+      ir::Instr copy = I;
+      ir::forEachUse(copy, count);
+      if (auto *S = std::get_if<ir::Select>(&I.payload)) {
+        ++condUses[S->cond];
+        if (I.dest)
+          selects.push_back(&I);
       }
-    } else if (std::holds_alternative<ir::ReadReg>(I.payload)) {
-      if (I.dest) {
-        auto v = vreg_of(*I.dest);
-        auto r = std::get<ir::ReadReg>(I.payload).reg;
-        out.instrs.push_back(
-            make2(Op::LdrX, OpRegV{v},
-                  OpMem{OpRegV{0}, guest_reg_offset_bytes(
-                                       r)})); // base vreg 0 denotes x0 (state)
+      if (auto *E = std::get_if<ir::ExitIf>(&I.payload))
+        addBranch(E->cond);
+      if (auto *L = std::get_if<ir::Load>(&I.payload)) {
+        if (L->offset == 0)
+          unoffsetBases.push_back(L->base);
+      } else if (auto *S = std::get_if<ir::Store>(&I.payload)) {
+        if (S->offset == 0)
+          unoffsetBases.push_back(S->base);
       }
-    } else if (std::holds_alternative<ir::WriteReg>(I.payload)) {
-      auto W = std::get<ir::WriteReg>(I.payload);
-      out.instrs.push_back(
-          make2(Op::StrX, OpRegV{vreg_of(W.value)},
-                OpMem{OpRegV{0}, guest_reg_offset_bytes(W.reg)}));
-    } else if (std::holds_alternative<ir::BinOp>(I.payload)) {
-      auto &B = std::get<ir::BinOp>(I.payload);
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        switch (B.kind) {
-        case ir::BinOpKind::Add:
-          out.instrs.push_back(make3(Op::Add, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::Sub:
-          out.instrs.push_back(make3(Op::Sub, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::And:
-          out.instrs.push_back(make3(Op::And, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::Or:
-          out.instrs.push_back(make3(Op::Orr, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::Xor:
-          out.instrs.push_back(make3(Op::Eor, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::Shl:
-          out.instrs.push_back(make3(Op::Lsl, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::LShr:
-          out.instrs.push_back(make3(Op::Lsr, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        case ir::BinOpKind::AShr:
-          out.instrs.push_back(make3(Op::Asr, OpRegV{vd},
-                                     OpRegV{vreg_of(B.lhs)},
-                                     OpRegV{vreg_of(B.rhs)}));
-          break;
-        }
+      if (!I.dest)
+        continue;
+      defs[*I.dest] = &I;
+      types[*I.dest] = ir::resultType(I);
+      auto *T = std::get_if<ir::Trunc>(&I.payload);
+      if (T && T->to.kind == ir::TypeKind::I32)
+        alias[*I.dest] = T->src;
+    }
+    ir::Terminator term = bb.term;
+    ir::forEachUse(term, count);
+    if (auto *T = std::get_if<ir::TermCBr>(&bb.term.data))
+      addBranch(T->cond);
+    else if (auto *T = std::get_if<ir::TermCondGoto>(&bb.term.data))
+      addBranch(T->cond);
+  }
+  // Plans the selects once every block is added: an arm that is only
+  // `x + 1` or `0 - x` for the select folds into csinc or csneg of x.
+  void planSelects() {
+    for (const ir::Instr *I : selects) {
+      const auto &S = std::get<ir::Select>(I->payload);
+      SelectPlan plan{Op::Csel, S.t, S.f, false};
+      ir::ValueId x = 0;
+      if (auto op = foldableArm(S.f, x)) {
+        plan = {*op, S.t, x, false};
+        absorb(S.f);
+      } else if (auto op = foldableArm(S.t, x)) {
+        plan = {*op, S.f, x, true};
+        absorb(S.t);
       }
-    } else if (std::holds_alternative<ir::ICmp>(I.payload)) {
-      auto &C = std::get<ir::ICmp>(I.payload);
-      out.instrs.push_back(
-          make2(Op::Cmp, OpRegV{vreg_of(C.lhs)}, OpRegV{vreg_of(C.rhs)}));
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        switch (C.cond) {
-        case ir::ICmpCond::EQ:
-          out.instrs.push_back(make1(Op::CsetEq, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::NE:
-          out.instrs.push_back(make1(Op::CsetNe, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::ULT:
-          out.instrs.push_back(make1(Op::CsetLo, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::ULE:
-          out.instrs.push_back(make1(Op::CsetLs, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::UGT:
-          out.instrs.push_back(make1(Op::CsetHi, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::UGE:
-          out.instrs.push_back(make1(Op::CsetHs, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::SLT:
-          out.instrs.push_back(make1(Op::CsetLt, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::SLE:
-          out.instrs.push_back(make1(Op::CsetLe, OpRegV{vd}));
-          break;
-        case ir::ICmpCond::SGT:
-          out.instrs.push_back(make1(Op::CsetGt, OpRegV{vd}));
+      plans[*I->dest] = plan;
+    }
+  }
+  // Plans the branches on comparisons with zero that only branches use: an
+  // (in)equality becomes cbz or cbnz, or tbz or tbnz of a single-bit mask,
+  // and a sign test becomes tbz or tbnz of the sign bit.
+  void planBranches() {
+    for (ir::ValueId v : branches) {
+      auto *C = defs[v] ? std::get_if<ir::ICmp>(&defs[v]->payload) : nullptr;
+      if (!C || uses[v] != branchUses[v] || branchPlans.count(v))
+        continue;
+      ir::ValueId x = C->lhs, zero = C->rhs;
+      if (constant(zero) != 0u && C->cond != ir::ICmpCond::SLT &&
+          C->cond != ir::ICmpCond::SGE)
+        std::swap(x, zero);
+      if (constant(zero) != 0u)
+        continue;
+      BranchPlan plan{BranchTest::NonZero, x, 0};
+      switch (C->cond) {
+      case ir::ICmpCond::EQ:
+      case ir::ICmpCond::NE: {
+        bool eq = C->cond == ir::ICmpCond::EQ;
+        plan.test = eq ? BranchTest::Zero : BranchTest::NonZero;
+        auto *B = defs[x] ? std::get_if<ir::BinOp>(&defs[x]->payload)
+                          : nullptr;
+        if (!B || B->kind != ir::BinOpKind::And || uses[x] != 1)
           break;
-        case ir::ICmpCond::SGE:
-          out.instrs.push_back(make1(Op::CsetGe, OpRegV{vd}));
+        ir::ValueId src = B->lhs, mask = B->rhs;
+        if (!singleBit(mask))
+          std::swap(src, mask);
+        auto bit = singleBit(mask);
+        if (!bit)
           break;
-        }
+        plan = {eq ? BranchTest::BitClear : BranchTest::BitSet, src, *bit};
+        absorbed[x] = true;
+        release(mask);
+        break;
       }
-    } else if (std::holds_alternative<ir::ZExt>(I.payload)) {
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        auto ps = vreg_of(std::get<ir::ZExt>(I.payload).src);
-        auto &Z = std::get<ir::ZExt>(I.payload);
-        if (Z.to.kind == ir::TypeKind::I64) {
-          out.instrs.push_back(make2(Op::Uxtw, OpRegV{vd}, OpRegV{ps}));
-        } else {
-          out.instrs.push_back(make2(Op::Mov, OpRegV{vd}, OpRegV{ps}));
-        }
+      case ir::ICmpCond::SLT:
+      case ir::ICmpCond::SGE:
+        plan = {C->cond == ir::ICmpCond::SLT ? BranchTest::BitSet
+                                             : BranchTest::BitClear,
+                x, is32(x) ? 31u : 63u};
+        break;
+      default:
+        continue;
       }
-    } else if (std::holds_alternative<ir::SExt>(I.payload)) {
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        auto ps = vreg_of(std::get<ir::SExt>(I.payload).src);
-        auto &S = std::get<ir::SExt>(I.payload);
-        if (S.to.kind == ir::TypeKind::I64) {
-          out.instrs.push_back(make2(Op::Sxtw, OpRegV{vd}, OpRegV{ps}));
-        } else {
-          out.instrs.push_back(make2(Op::Mov, OpRegV{vd}, OpRegV{ps}));
-        }
+      release(zero);
+      branchPlans[v] = plan;
+    }
+  }
+  // Plans the guest accesses off a zero-extended i32 value: they read the
+  // i32 register with uxtw, so a ZExt that only accesses at offset 0 use is
+  // not computed.
+  void planAddresses() {
+    std::unordered_map<ir::ValueId, uint32_t> accessUses;
+    for (ir::ValueId base : unoffsetBases)
+      if (zextSource(base))
+        ++accessUses[base];
+    for (auto [v, n] : accessUses)
+      if (n == uses[v])
+        absorbed[v] = true;
+  }
+  // Plans the shifts and masks of a shift or mask used once that one
+  // bitfield instruction computes, and the operations on a shift used once
+  // that shift their operand themselves. Later values go first so that
+  // they take in as much as they can. Needs the known bits.
+  void planBitfields() {
+    for (ir::ValueId v = static_cast<ir::ValueId>(defs.size()); v-- > 0;) {
+      auto *B = defs[v] ? std::get_if<ir::BinOp>(&defs[v]->payload) : nullptr;
+      if (!B || absorbed[v])
+        continue;
+      if (auto plan = planField(*B))
+        fieldPlans[v] = *plan;
+      else if (auto plan = planShifted(*B))
+        shiftedPlans[v] = *plan;
+    }
+  }
+  // Plans the operations with a constant operand that fits an immediate:
+  // arithmetic and compares take 12 bits, optionally shifted, of it or of
+  // its negation, logical operations a bitmask and shifts any amount.
+  // Needs the known bits.
+  void planImmediates() {
+    for (ir::ValueId v = 0; v < defs.size(); ++v) {
+      if (!defs[v] || absorbed[v] || fieldPlans.count(v) ||
+          shiftedPlans.count(v))
+        continue;
+      if (auto *B = std::get_if<ir::BinOp>(&defs[v]->payload))
+        planImmediate(v, *B);
+      else if (auto *C = std::get_if<ir::ICmp>(&defs[v]->payload);
+               C && !branchPlans.count(v))
+        planImmediate(v, *C);
+    }
+  }
+  VReg vreg(ir::ValueId v) const {
+    while (alias[v] != v)
+      v = alias[v];
+    if (types[v].kind == ir::TypeKind::V128)
+      return vreg_of(v) | kVecRegBit;
+    return vreg_of(v);
+  }
+  bool is32(ir::ValueId v) const { return types[v].kind == ir::TypeKind::I32; }
+  ir::Type typeOf(ir::ValueId v) const { return types[v]; }
+  bool aliased(ir::ValueId v) const { return alias[v] != v; }
+  // Whether `v` is computed by the selects that use it instead.
+  bool isAbsorbed(ir::ValueId v) const { return absorbed[v]; }
+  const SelectPlan &selectPlan(ir::ValueId v) const { return plans.at(v); }
+  const BranchPlan *branchPlan(ir::ValueId v) const {
+    auto it = branchPlans.find(v);
+    return it == branchPlans.end() ? nullptr : &it->second;
+  }
+  const ImmPlan *immPlan(ir::ValueId v) const {
+    auto it = immPlans.find(v);
+    return it == immPlans.end() ? nullptr : &it->second;
+  }
+  const FieldPlan *fieldPlan(ir::ValueId v) const {
+    auto it = fieldPlans.find(v);
+    return it == fieldPlans.end() ? nullptr : &it->second;
+  }
+  const ShiftedPlan *shiftedPlan(ir::ValueId v) const {
+    auto it = shiftedPlans.find(v);
+    return it == shiftedPlans.end() ? nullptr : &it->second;
+  }
+  // The comparison defining `v` if it is only used as the condition of
+  // selects and branches, which then compare for themselves.
+  const ir::ICmp *foldedCompare(ir::ValueId v) const {
+    auto *C = defs[v] ? std::get_if<ir::ICmp>(&defs[v]->payload) : nullptr;
+    return C && uses[v] == condUses[v] ? C : nullptr;
+  }
+
+  void useKnownBits(const ir::KnownBitsAnalysis *kb) { known = kb; }
+  // Whether `v` is a wider value whose bits from `bits` up are known to be
+  // zero, so that a W-form instruction sees all of it.
+  bool narrow(ir::ValueId v, unsigned bits) const {
+    return known && !is32(v) && known->upperZero(v, bits);
+  }
+  // Whether `B` can use the W form: wider operations on values that fit in
+  // 32 bits, with a result that does too, clear the upper half.
+  bool useW(const ir::BinOp &B) const {
+    bool logic = B.kind == ir::BinOpKind::And ||
+                 B.kind == ir::BinOpKind::Or || B.kind == ir::BinOpKind::Xor;
+    bool fits = logic ? narrow(B.lhs, 32) && narrow(B.rhs, 32)
+                      : B.kind == ir::BinOpKind::Add && narrow(B.lhs, 31) &&
+                            narrow(B.rhs, 31);
+    return B.ty.kind == ir::TypeKind::I32 || fits;
+  }
+  // Whether `C` can compare the W views of its operands.
+  bool useW(const ir::ICmp &C) const {
+    bool isSigned = C.cond == ir::ICmpCond::SLT ||
+                    C.cond == ir::ICmpCond::SLE ||
+                    C.cond == ir::ICmpCond::SGT || C.cond == ir::ICmpCond::SGE;
+    unsigned bits = isSigned ? 31 : 32;
+    return is32(C.lhs) || (narrow(C.lhs, bits) && narrow(C.rhs, bits));
+  }
+  // Whether the register of a byte or halfword `v` is zero above it: loads
+  // zero-extend, other operations leave the upper bits undefined.
+  bool zeroExtended(ir::ValueId v) const {
+    return defs[v] && std::holds_alternative<ir::Load>(defs[v]->payload);
+  }
+  // The i32 value that `v` zero-extends to 64 bits, if any.
+  std::optional<ir::ValueId> zextSource(ir::ValueId v) const {
+    auto *Z = defs[v] ? std::get_if<ir::ZExt>(&defs[v]->payload) : nullptr;
+    if (!Z || !is32(Z->src))
+      return std::nullopt;
+    return Z->src;
+  }
+  // The guest address `base + offset` as a root value plus a constant,
+  // looking through 64-bit adds and subtracts of constants.
+  std::pair<ir::ValueId, int64_t> address(ir::ValueId base,
+                                          int64_t offset) const {
+    for (;;) {
+      auto *B = defs[base] ? std::get_if<ir::BinOp>(&defs[base]->payload)
+                           : nullptr;
+      if (!B || B->ty.kind != ir::TypeKind::I64 ||
+          (B->kind != ir::BinOpKind::Add && B->kind != ir::BinOpKind::Sub))
+        return {base, offset};
+      auto c = constant(B->rhs);
+      if (!c)
+        return {base, offset};
+      auto delta = static_cast<int64_t>(*c);
+      offset += B->kind == ir::BinOpKind::Add ? delta : -delta;
+      base = B->lhs;
+    }
+  }
+
+private:
+  std::optional<uint64_t> constant(ir::ValueId v) const {
+    if (auto *C = defs[v] ? std::get_if<ir::Const>(&defs[v]->payload)
+                          : nullptr)
+      return C->value;
+    return std::nullopt;
+  }
+  // The Csinc or Csneg that computes `v` from `x`, if `v` is used once.
+  std::optional<Op> foldableArm(ir::ValueId v, ir::ValueId &x) const {
+    auto *B = defs[v] ? std::get_if<ir::BinOp>(&defs[v]->payload) : nullptr;
+    if (!B || uses[v] != 1 || absorbed[v])
+      return std::nullopt;
+    if (B->kind == ir::BinOpKind::Add && constant(B->rhs) == 1u) {
+      x = B->lhs;
+      return Op::Csinc;
+    }
+    if (B->kind == ir::BinOpKind::Sub && constant(B->lhs) == 0u) {
+      x = B->rhs;
+      return Op::Csneg;
+    }
+    return std::nullopt;
+  }
+  // Marks `v` and the constant it no longer needs as computed elsewhere.
+  void absorb(ir::ValueId v) {
+    absorbed[v] = true;
+    const auto &B = std::get<ir::BinOp>(defs[v]->payload);
+    release(B.kind == ir::BinOpKind::Add ? B.rhs : B.lhs);
+  }
+  // Drops a use of constant `c`, which is not materialized once unused.
+  void release(ir::ValueId c) {
+    if (--uses[c] == 0)
+      absorbed[c] = true;
+  }
+  void planImmediate(ir::ValueId v, const ir::BinOp &B) {
+    uint64_t mask = useW(B) ? 0xffffffffu : ~0ull;
+    ir::ValueId x = B.lhs, c = B.rhs;
+    bool commutes = B.kind == ir::BinOpKind::Add ||
+                    B.kind == ir::BinOpKind::And ||
+                    B.kind == ir::BinOpKind::Or || B.kind == ir::BinOpKind::Xor;
+    if (!constant(c) && commutes)
+      std::swap(x, c);
+    auto value = constant(c);
+    if (!value)
+      return;
+    uint64_t imm = *value & mask, neg = (0 - *value) & mask;
+    ImmPlan plan{Op::Add, x, imm, false};
+    switch (B.kind) {
+    case ir::BinOpKind::Add:
+    case ir::BinOpKind::Sub: {
+      bool add = B.kind == ir::BinOpKind::Add;
+      if (isArithImm(imm))
+        plan.op = add ? Op::Add : Op::Sub;
+      else if (isArithImm(neg))
+        plan = {add ? Op::Sub : Op::Add, x, neg, false};
+      else
+        return;
+      break;
+    }
+    case ir::BinOpKind::And:
+    case ir::BinOpKind::Or:
+    case ir::BinOpKind::Xor:
+      if (!isLogicalImm(imm, mask == ~0ull ? 64 : 32))
+        return;
+      plan.op = B.kind == ir::BinOpKind::And  ? Op::And
+                : B.kind == ir::BinOpKind::Or ? Op::Orr
+                                              : Op::Eor;
+      break;
+    case ir::BinOpKind::Shl:
+    case ir::BinOpKind::LShr:
+    case ir::BinOpKind::AShr:
+      // The amount wraps at the operand width, as in the IR.
+      plan.imm = *value & (ir::bitWidth(B.ty) - 1);
+      plan.op = B.kind == ir::BinOpKind::Shl    ? Op::Lsl
+                : B.kind == ir::BinOpKind::LShr ? Op::Lsr
+                                                : Op::Asr;
+      break;
+    }
+    release(c);
+    immPlans[v] = plan;
+  }
+  // A compare with the negated immediate, cmn, sets the same flags unless
+  // the immediate is 0 or the most negative value, neither of which needs
+  // it.
+  void planImmediate(ir::ValueId v, const ir::ICmp &C) {
+    uint64_t mask = useW(C) ? 0xffffffffu : ~0ull;
+    ir::ValueId x = C.lhs, c = C.rhs;
+    bool swapped = !constant(c);
+    if (swapped)
+      std::swap(x, c);
+    auto value = constant(c);
+    if (!value)
+      return;
+    uint64_t imm = *value & mask, neg = (0 - *value) & mask;
+    if (isArithImm(imm))
+      immPlans[v] = {Op::Cmp, x, imm, swapped};
+    else if (isArithImm(neg))
+      immPlans[v] = {Op::Cmn, x, neg, swapped};
+    else
+      return;
+    release(c);
+  }
+  // The shift or mask of type `ty` defining `v` if it is used once, only by
+  // the operation being planned, and `kind` is its kind.
+  const ir::BinOp *single(ir::ValueId v, ir::BinOpKind kind,
+                          ir::Type ty) const {
+    auto *B = defs[v] ? std::get_if<ir::BinOp>(&defs[v]->payload) : nullptr;
+    if (!B || B->kind != kind || B->ty.kind != ty.kind || uses[v] != 1 ||
+        absorbed[v] || fieldPlans.count(v) || shiftedPlans.count(v))
+      return nullptr;
+    return B;
+  }
+  // The amount of shift `B` by a constant.
+  std::optional<unsigned> shiftAmount(const ir::BinOp &B) const {
+    auto c = constant(B.rhs);
+    if (!c)
+      return std::nullopt;
+    return static_cast<unsigned>(*c & (ir::bitWidth(B.ty) - 1));
+  }
+  // The n of constant `v` = 2^n - 1 in `bits` bits, for n from 1 to `bits`.
+  std::optional<unsigned> lowMask(ir::ValueId v, unsigned bits) const {
+    auto c = constant(v);
+    if (!c)
+      return std::nullopt;
+    uint64_t m = bits == 64 ? *c : *c & ((1ull << bits) - 1);
+    if (!m || (m & (m + 1)))
+      return std::nullopt;
+    unsigned n = 0;
+    while (n < bits && (m >> n & 1))
+      ++n;
+    return n;
+  }
+  // Marks the shift or mask `v` as computed by its user and drops its use
+  // of the constant `c`.
+  void absorbInto(ir::ValueId v, ir::ValueId c) {
+    absorbed[v] = true;
+    release(c);
+  }
+  // Matches, with `bits` the width of the operations:
+  //   (x << a) >> b         as ubfx or sbfx if b >= a, else ubfiz or sbfiz
+  //   (x >> a) & (2^n - 1)  as ubfx of n bits at a
+  //   (x & (2^n - 1)) << a  as ubfiz of n bits at a
+  //   (y & ~F) | t          as bfi into y, with t the field F of x
+  std::optional<FieldPlan> planField(const ir::BinOp &B) {
+    unsigned bits = ir::bitWidth(B.ty);
+    switch (B.kind) {
+    case ir::BinOpKind::LShr:
+    case ir::BinOpKind::AShr: {
+      auto b = shiftAmount(B);
+      auto *S = single(B.lhs, ir::BinOpKind::Shl, B.ty);
+      auto a = S ? shiftAmount(*S) : std::nullopt;
+      if (!b || !a)
+        return std::nullopt;
+      bool zero = B.kind == ir::BinOpKind::LShr;
+      FieldPlan plan{zero ? Op::Ubfx : Op::Sbfx, S->lhs, 0, *b - *a,
+                     bits - *b};
+      if (*b < *a)
+        plan = {zero ? Op::Ubfiz : Op::Sbfiz, S->lhs, 0, *a - *b, bits - *a};
+      absorbInto(B.lhs, S->rhs);
+      release(B.rhs);
+      return plan;
+    }
+    case ir::BinOpKind::And: {
+      ir::ValueId x = B.lhs, m = B.rhs;
+      if (!lowMask(m, bits))
+        std::swap(x, m);
+      auto n = lowMask(m, bits);
+      auto *S = single(x, ir::BinOpKind::LShr, B.ty);
+      if (!S)
+        S = single(x, ir::BinOpKind::AShr, B.ty);
+      auto a = S ? shiftAmount(*S) : std::nullopt;
+      if (!n || !a || *a + *n > bits)
+        return std::nullopt;
+      absorbInto(x, S->rhs);
+      release(m);
+      return FieldPlan{Op::Ubfx, S->lhs, 0, *a, *n};
+    }
+    case ir::BinOpKind::Shl: {
+      auto a = shiftAmount(B);
+      auto *M = single(B.lhs, ir::BinOpKind::And, B.ty);
+      if (!a || !M)
+        return std::nullopt;
+      ir::ValueId x = M->lhs, m = M->rhs;
+      if (!lowMask(m, bits))
+        std::swap(x, m);
+      auto n = lowMask(m, bits);
+      if (!n)
+        return std::nullopt;
+      absorbInto(B.lhs, m);
+      release(B.rhs);
+      return FieldPlan{Op::Ubfiz, x, 0, *a, std::min(*n, bits - *a)};
+    }
+    case ir::BinOpKind::Or:
+      for (auto [y, t] : {std::pair{B.lhs, B.rhs}, std::pair{B.rhs, B.lhs}})
+        if (auto plan = planInsert(y, t, B.ty))
+          return plan;
+      return std::nullopt;
+    default:
+      return std::nullopt;
+    }
+  }
+  // Whether `v` is x & (2^width - 1), used once; sets `x` and the mask `m`.
+  bool masked(ir::ValueId v, unsigned width, ir::Type ty, ir::ValueId &x,
+              ir::ValueId &m) const {
+    auto *M = single(v, ir::BinOpKind::And, ty);
+    if (!M)
+      return false;
+    x = M->lhs;
+    m = M->rhs;
+    if (lowMask(m, ir::bitWidth(ty)) != width)
+      std::swap(x, m);
+    return lowMask(m, ir::bitWidth(ty)) == width;
+  }
+  // The bfi of `y | t` into z if `y` is z with a field cleared and `t` is
+  // (x & (2^width - 1)) << lsb, x & (2^width - 1) if lsb is 0, or x << lsb
+  // if the field reaches the top.
+  std::optional<FieldPlan> planInsert(ir::ValueId y, ir::ValueId t,
+                                      ir::Type ty) {
+    unsigned bits = ir::bitWidth(ty);
+    auto *K = single(y, ir::BinOpKind::And, ty);
+    if (!K)
+      return std::nullopt;
+    ir::ValueId z = K->lhs, keep = K->rhs;
+    if (!constant(keep))
+      std::swap(z, keep);
+    auto k = constant(keep);
+    uint64_t all = bits == 64 ? ~0ull : (1ull << bits) - 1;
+    uint64_t field = k ? ~*k & all : 0;
+    if (!field)
+      return std::nullopt;
+    unsigned lsb = 0, width = 0;
+    while (!(field >> lsb & 1))
+      ++lsb;
+    while (lsb + width < bits && (field >> (lsb + width) & 1))
+      ++width;
+    if (field != ((all >> (bits - width)) << lsb))
+      return std::nullopt;
+    ir::ValueId x = 0, m = 0;
+    if (auto *S = single(t, ir::BinOpKind::Shl, ty);
+        S && shiftAmount(*S) == lsb) {
+      if (masked(S->lhs, width, ty, x, m))
+        absorbInto(S->lhs, m);
+      else if (lsb + width == bits)
+        x = S->lhs;
+      else
+        return std::nullopt;
+      absorbInto(t, S->rhs);
+    } else if (lsb == 0 && masked(t, width, ty, x, m)) {
+      absorbInto(t, m);
+    } else {
+      return std::nullopt;
+    }
+    absorbInto(y, keep);
+    return FieldPlan{Op::Bfi, x, z, lsb, width};
+  }
+  // Matches an add, sub, and, or or xor with an operand shifted by a
+  // constant and used once, which the instruction shifts itself. Only left
+  // shifts keep their value in the W form of i64 operations.
+  std::optional<ShiftedPlan> planShifted(const ir::BinOp &B) {
+    Op op = Op::Add;
+    switch (B.kind) {
+    case ir::BinOpKind::Add:
+      op = Op::Add;
+      break;
+    case ir::BinOpKind::Sub:
+      op = Op::Sub;
+      break;
+    case ir::BinOpKind::And:
+      op = Op::And;
+      break;
+    case ir::BinOpKind::Or:
+      op = Op::Orr;
+      break;
+    case ir::BinOpKind::Xor:
+      op = Op::Eor;
+      break;
+    default:
+      return std::nullopt;
+    }
+    bool w = useW(B), wide = w && B.ty.kind != ir::TypeKind::I32;
+    std::vector<std::pair<ir::ValueId, ir::ValueId>> orders = {
+        {B.lhs, B.rhs}};
+    if (B.kind != ir::BinOpKind::Sub)
+      orders.push_back({B.rhs, B.lhs});
+    for (auto [lhs, rhs] : orders) {
+      // A constant is left to planImmediates: address() looks through adds
+      // of constants, so their other operand must stay computed.
+      if (constant(lhs))
+        continue;
+      for (auto kind : {ir::BinOpKind::Shl, ir::BinOpKind::LShr,
+                        ir::BinOpKind::AShr}) {
+        auto *S = single(rhs, kind, B.ty);
+        auto k = S ? shiftAmount(*S) : std::nullopt;
+        if (!k || (wide && (kind != ir::BinOpKind::Shl || *k >= 32)))
+          continue;
+        Shift shift = kind == ir::BinOpKind::Shl    ? Shift::LSL
+                      : kind == ir::BinOpKind::LShr ? Shift::LSR
+                                                    : Shift::ASR;
+        absorbInto(rhs, S->rhs);
+        return ShiftedPlan{op, lhs, S->lhs, shift, *k};
       }
-    } else if (std::holds_alternative<ir::Trunc>(I.payload)) {
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        auto ps = vreg_of(std::get<ir::Trunc>(I.payload).src);
-        out.instrs.push_back(make2(Op::Mov, OpRegV{vd}, OpRegV{ps}));
+    }
+    return std::nullopt;
+  }
+  // The bit set in constant `v` if it is a single one.
+  std::optional<unsigned> singleBit(ir::ValueId v) const {
+    auto c = constant(v);
+    if (!c || !*c || (*c & (*c - 1)))
+      return std::nullopt;
+    unsigned bit = 0;
+    while (!(*c >> bit & 1))
+      ++bit;
+    return bit;
+  }
+  void addBranch(ir::ValueId cond) {
+    ++condUses[cond];
+    ++branchUses[cond];
+    branches.push_back(cond);
+  }
+
+  std::vector<ir::Type> types;
+  std::vector<ir::ValueId> alias;
+  std::vector<const ir::Instr *> defs;
+  std::vector<uint32_t> uses, condUses, branchUses;
+  std::vector<bool> absorbed;
+  std::vector<const ir::Instr *> selects;
+  std::unordered_map<ir::ValueId, SelectPlan> plans;
+  std::vector<ir::ValueId> branches;
+  std::vector<ir::ValueId> unoffsetBases;
+  std::unordered_map<ir::ValueId, BranchPlan> branchPlans;
+  std::unordered_map<ir::ValueId, ImmPlan> immPlans;
+  std::unordered_map<ir::ValueId, FieldPlan> fieldPlans;
+  std::unordered_map<ir::ValueId, ShiftedPlan> shiftedPlans;
+  const ir::KnownBitsAnalysis *known = nullptr;
+};
+
+// Host addresses of guest memory shared by the accesses of one block: an
+// access off a root that several accesses use is addressed from the root
+// plus x21, computed once, and its constant offset.
+class HostAddresses {
+public:
+  // Counts the accesses of `bb` per root and forgets the previous block.
+  void reset(const ir::Block &bb, const ValueInfo &V) {
+    accesses.clear();
+    host.clear();
+    for (const auto &I : bb.insts) {
+      if (auto *L = std::get_if<ir::Load>(&I.payload))
+        ++accesses[V.address(L->base, L->offset).first];
+      else if (auto *S = std::get_if<ir::Store>(&I.payload))
+        ++accesses[V.address(S->base, S->offset).first];
+    }
+  }
+  bool shared(ir::ValueId root) const {
+    auto it = accesses.find(root);
+    return it != accesses.end() && it->second > 1;
+  }
+  // The vreg holding `root` + x21, if computed.
+  std::optional<VReg> find(ir::ValueId root) const {
+    auto it = host.find(root);
+    if (it == host.end())
+      return std::nullopt;
+    return it->second;
+  }
+  void add(ir::ValueId root, VReg v) { host[root] = v; }
+
+private:
+  std::unordered_map<ir::ValueId, unsigned> accesses;
+  std::unordered_map<ir::ValueId, VReg> host;
+};
+
+} // namespace
+
+static Cond condOf(ir::ICmpCond c) {
+  switch (c) {
+  case ir::ICmpCond::EQ:
+    return Cond::EQ;
+  case ir::ICmpCond::NE:
+    return Cond::NE;
+  case ir::ICmpCond::ULT:
+    return Cond::LO;
+  case ir::ICmpCond::ULE:
+    return Cond::LS;
+  case ir::ICmpCond::UGT:
+    return Cond::HI;
+  case ir::ICmpCond::UGE:
+    return Cond::HS;
+  case ir::ICmpCond::SLT:
+    return Cond::LT;
+  case ir::ICmpCond::SLE:
+    return Cond::LE;
+  case ir::ICmpCond::SGT:
+    return Cond::GT;
+  case ir::ICmpCond::SGE:
+    return Cond::GE;
+  }
+  return Cond::EQ;
+}
+
+static Lanes lanesOf(ir::Type lane) {
+  switch (lane.kind) {
+  case ir::TypeKind::I8:
+    return Lanes::B16;
+  case ir::TypeKind::I16:
+    return Lanes::H8;
+  case ir::TypeKind::I32:
+    return Lanes::S4;
+  default:
+    return Lanes::D2;
+  }
+}
+
+// The condition that holds for `b`, `a` when `c` holds for `a`, `b`.
+static Cond commuted(Cond c) {
+  switch (c) {
+  case Cond::LO:
+    return Cond::HI;
+  case Cond::LS:
+    return Cond::HS;
+  case Cond::HI:
+    return Cond::LO;
+  case Cond::HS:
+    return Cond::LS;
+  case Cond::LT:
+    return Cond::GT;
+  case Cond::LE:
+    return Cond::GE;
+  case Cond::GT:
+    return Cond::LT;
+  case Cond::GE:
+    return Cond::LE;
+  default:
+    return c;
+  }
+}
+
+// The Cmp or Cmn of value `v`, defined by `C`, that sets the flags for the
+// returned condition.
+static Instr compare(ir::ValueId v, const ir::ICmp &C, const ValueInfo &V,
+                     Cond &cc) {
+  cc = condOf(C.cond);
+  Instr cmp;
+  if (const auto *P = V.immPlan(v)) {
+    cmp = make2(P->op, OpRegV{V.vreg(P->reg)}, OpImm{P->imm});
+    if (P->swapped)
+      cc = commuted(cc);
+  } else {
+    cmp = make2(Op::Cmp, OpRegV{V.vreg(C.lhs)}, OpRegV{V.vreg(C.rhs)});
+  }
+  cmp.w = V.useW(C);
+  return cmp;
+}
+
+static Op csetOf(Cond c) {
+  switch (c) {
+  case Cond::EQ:
+    return Op::CsetEq;
+  case Cond::NE:
+    return Op::CsetNe;
+  case Cond::LO:
+    return Op::CsetLo;
+  case Cond::LS:
+    return Op::CsetLs;
+  case Cond::HI:
+    return Op::CsetHi;
+  case Cond::HS:
+    return Op::CsetHs;
+  case Cond::LT:
+    return Op::CsetLt;
+  case Cond::LE:
+    return Op::CsetLe;
+  case Cond::GT:
+    return Op::CsetGt;
+  case Cond::GE:
+    return Op::CsetGe;
+  }
+  return Op::CsetEq;
+}
+
+// Fills in how `br` tests `cond`, appending the Cmp that a flags test reads
+// to `instrs`. Nothing may be emitted between that Cmp and the branch.
+static void branchOn(ir::ValueId cond, const ValueInfo &V,
+                     std::vector<Instr> &instrs, TermCBr &br) {
+  if (const auto *P = V.branchPlan(cond)) {
+    br.cond = V.vreg(P->reg);
+    br.test = P->test;
+    br.bit = P->bit;
+    br.w = V.is32(P->reg);
+  } else if (const auto *C = V.foldedCompare(cond)) {
+    instrs.push_back(compare(cond, *C, V, br.cc));
+    br.cond = 0;
+    br.test = BranchTest::Flags;
+  } else {
+    br.cond = V.vreg(cond);
+    br.test = BranchTest::NonZero;
+    br.w = V.is32(cond);
+  }
+}
+
+// The instruction that branches to `label` if the test of `br` holds.
+static Instr branchTo(const TermCBr &br, const std::string &label) {
+  Instr b;
+  switch (br.test) {
+  case BranchTest::Flags:
+    b = make1(Op::BCond, OpLabel{label});
+    b.cc = br.cc;
+    break;
+  case BranchTest::Zero:
+  case BranchTest::NonZero:
+    b = make2(br.test == BranchTest::Zero ? Op::Cbz : Op::Cbnz,
+              OpRegV{br.cond}, OpLabel{label});
+    break;
+  case BranchTest::BitClear:
+  case BranchTest::BitSet:
+    b = make3(br.test == BranchTest::BitClear ? Op::Tbz : Op::Tbnz,
+              OpRegV{br.cond}, OpImm{br.bit}, OpLabel{label});
+    break;
+  }
+  b.w = br.w;
+  return b;
+}
+
+// Whether `offset` fits the immediate of a `size`-byte load or store: scaled
+// and unsigned, or unscaled in 9 signed bits.
+static bool encodableOffset(int64_t offset, unsigned size) {
+  if (offset >= -256 && offset <= 255)
+    return true;
+  return offset >= 0 && offset % size == 0 && offset / size <= 4095;
+}
+
+// The operand addressing guest memory at `base + offset` for a `size`-byte
+// access, emitting what it needs into `out`.
+static OpMem guestAddress(ir::ValueId base, int64_t offset, unsigned size,
+                          const ValueInfo &V, HostAddresses &H, Block &out,
+                          VReg &nextTemp) {
+  auto [root, off] = V.address(base, offset);
+  if (H.shared(root) && !V.is32(root) && !V.isAbsorbed(root) &&
+      encodableOffset(off, size)) {
+    auto h = H.find(root);
+    if (!h) {
+      h = nextTemp++;
+      out.instrs.push_back(
+          make3(Op::Add, OpRegV{*h}, OpRegV{V.vreg(root)}, OpRegP{21}));
+      H.add(root, *h);
+    }
+    return OpMem{OpRegV{*h}, static_cast<int32_t>(off)};
+  }
+  // A single access adds the guest address to x21 in the access itself,
+  // reading an i32 base, or the i32 source of a zero-extended one, with
+  // uxtw.
+  if (offset == 0) {
+    if (auto src = V.zextSource(base))
+      return OpMem{OpRegV{V.vreg(*src)}, 0, true, true};
+    return OpMem{OpRegV{V.vreg(base)}, 0, true, V.is32(base)};
+  }
+  VReg addr = nextTemp++;
+  if (encodableOffset(offset, size)) {
+    out.instrs.push_back(
+        make3(Op::Add, OpRegV{addr}, OpRegV{V.vreg(base)}, OpRegP{21}));
+    return OpMem{OpRegV{addr}, static_cast<int32_t>(offset)};
+  }
+  VReg c = nextTemp++;
+  materializeConst(out.instrs, c, static_cast<uint64_t>(offset));
+  out.instrs.push_back(
+      make3(Op::Add, OpRegV{addr}, OpRegV{V.vreg(base)}, OpRegV{c}));
+  return OpMem{OpRegV{addr}, 0, true};
+}
+
+// Selects one IR instruction into `out`. Temporaries are numbered from
+// `nextTemp`; `unitPc` names the side-exit stubs of the unit.
+static void selectInstr(const ir::Instr &I, const ValueInfo &V,
+                        HostAddresses &H, Block &out, VReg &nextTemp,
+                        uint64_t unitPc) {
+  if (I.dest && V.isAbsorbed(*I.dest))
+    return;
+  if (std::holds_alternative<ir::Const>(I.payload)) {
+    if (I.dest) {
+      auto v = V.vreg(*I.dest);
+      auto &C = std::get<ir::Const>(I.payload);
+      materializeConst(out.instrs, v, C.value);
+    }
+  } else if (std::holds_alternative<ir::ReadReg>(I.payload)) {
+    if (I.dest) {
+      auto v = V.vreg(*I.dest);
+      auto r = std::get<ir::ReadReg>(I.payload).reg;
+      // Base vreg 0 denotes x0 (state)
+      out.instrs.push_back(make2(
+          Op::LdrX, OpRegV{v}, OpMem{OpRegV{0}, guest_reg_offset_bytes(r)}));
+    }
+  } else if (std::holds_alternative<ir::WriteReg>(I.payload)) {
+    auto W = std::get<ir::WriteReg>(I.payload);
+    out.instrs.push_back(
+        make2(Op::StrX, OpRegV{V.vreg(W.value)},
+              OpMem{OpRegV{0}, guest_reg_offset_bytes(W.reg)}));
+  } else if (std::holds_alternative<ir::BinOp>(I.payload)) {
+    auto &B = std::get<ir::BinOp>(I.payload);
+    if (I.dest) {
+      Op op = Op::Add;
+      switch (B.kind) {
+      case ir::BinOpKind::Add:
+        op = Op::Add;
+        break;
+      case ir::BinOpKind::Sub:
+        op = Op::Sub;
+        break;
+      case ir::BinOpKind::And:
+        op = Op::And;
+        break;
+      case ir::BinOpKind::Or:
+        op = Op::Orr;
+        break;
+      case ir::BinOpKind::Xor:
+        op = Op::Eor;
+        break;
+      case ir::BinOpKind::Shl:
+        op = Op::Lsl;
+        break;
+      case ir::BinOpKind::LShr:
+        op = Op::Lsr;
+        break;
+      case ir::BinOpKind::AShr:
+        op = Op::Asr;
+        break;
       }
-    } else if (std::holds_alternative<ir::Load>(I.payload)) {
-      auto &L = std::get<ir::Load>(I.payload);
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        // Compute guest EA: base + mem_base(x21); carry IR offset in
-        // OpMem.offset
-        auto vbase = vreg_of(L.base);
-        VReg vaddr = static_cast<VReg>(vmap.size() + 1);
-        vmap.push_back(vaddr);
-        out.instrs.push_back(
-            make3(Op::Add, OpRegV{vaddr}, OpRegV{vbase}, OpRegP{21}));
-        Op op = Op::LdrX;
-        switch (L.ty.kind) {
-        case ir::TypeKind::I64:
-          op = Op::LdrX;
-          break;
-        case ir::TypeKind::I32:
-          op = Op::LdrW;
-          break;
-        case ir::TypeKind::I16:
-          op = Op::LdrH;
-          break;
-        case ir::TypeKind::I8:
-          op = Op::LdrB;
-          break;
-        default:
-          op = Op::LdrX;
-          break;
+      Instr bin = make3(op, OpRegV{V.vreg(*I.dest)}, OpRegV{V.vreg(B.lhs)},
+                        OpRegV{V.vreg(B.rhs)});
+      if (const auto *P = V.immPlan(*I.dest)) {
+        bin = make3(P->op, OpRegV{V.vreg(*I.dest)}, OpRegV{V.vreg(P->reg)},
+                    OpImm{P->imm});
+      } else if (const auto *P = V.shiftedPlan(*I.dest)) {
+        bin = make3(P->op, OpRegV{V.vreg(*I.dest)}, OpRegV{V.vreg(P->lhs)},
+                    OpRegV{V.vreg(P->rhs)});
+        bin.shift = P->shift;
+        bin.amount = P->amount;
+      } else if (const auto *P = V.fieldPlan(*I.dest)) {
+        auto vd = V.vreg(*I.dest);
+        bool w = B.ty.kind == ir::TypeKind::I32;
+        if (P->op == Op::Bfi) {
+          Instr copy = make2(Op::Mov, OpRegV{vd}, OpRegV{V.vreg(P->base)});
+          copy.w = w;
+          out.instrs.push_back(std::move(copy));
         }
+        Instr field = Instr{P->op, {OpRegV{vd}, OpRegV{V.vreg(P->src)},
+                                    OpImm{P->lsb}, OpImm{P->width}}};
+        field.w = w;
+        out.instrs.push_back(std::move(field));
+        return;
+      }
+      bin.w = V.useW(B);
+      out.instrs.push_back(std::move(bin));
+    }
+  } else if (std::holds_alternative<ir::ICmp>(I.payload)) {
+    auto &C = std::get<ir::ICmp>(I.payload);
+    if (!I.dest || V.foldedCompare(*I.dest))
+      return;
+    Cond cc;
+    out.instrs.push_back(compare(*I.dest, C, V, cc));
+    out.instrs.push_back(make1(csetOf(cc), OpRegV{V.vreg(*I.dest)}));
+  } else if (auto *S = std::get_if<ir::Select>(&I.payload)) {
+    if (I.dest) {
+      // Compare right before the select so nothing in between can clobber
+      // the flags.
+      Cond cc = Cond::NE;
+      if (const auto *C = V.foldedCompare(S->cond)) {
+        out.instrs.push_back(compare(S->cond, *C, V, cc));
+      } else {
         out.instrs.push_back(
-            Instr{op,
-                  {OpRegV{vd},
-                   OpMem{OpRegV{vaddr}, static_cast<int32_t>(L.offset)}}});
+            make2(Op::Cmp, OpRegV{V.vreg(S->cond)}, OpImm{0}));
       }
-    } else if (std::holds_alternative<ir::Store>(I.payload)) {
-      auto &S = std::get<ir::Store>(I.payload);
-      // Compute guest EA: base + mem_base(x21); carry IR offset in OpMem.offset
-      auto vbase = vreg_of(S.base);
-      VReg vaddr = static_cast<VReg>(vmap.size() + 1);
-      vmap.push_back(vaddr);
-      out.instrs.push_back(
-          make3(Op::Add, OpRegV{vaddr}, OpRegV{vbase}, OpRegP{21}));
-      Op op = Op::StrX;
-      switch (S.ty.kind) {
+      const auto &plan = V.selectPlan(*I.dest);
+      Instr sel = make3(plan.op, OpRegV{V.vreg(*I.dest)},
+                        OpRegV{V.vreg(plan.a)}, OpRegV{V.vreg(plan.b)});
+      sel.cc = plan.invert ? inverse(cc) : cc;
+      sel.w = S->ty.kind == ir::TypeKind::I32;
+      out.instrs.push_back(std::move(sel));
+    }
+  } else if (auto *Z = std::get_if<ir::ZExt>(&I.payload)) {
+    if (I.dest) {
+      // A 32-bit copy clears the upper half; bytes and halfwords may need
+      // clearing above their width as well.
+      auto ps = V.vreg(Z->src);
+      Op op = Op::Mov;
+      if (!V.zeroExtended(Z->src)) {
+        if (V.typeOf(Z->src).kind == ir::TypeKind::I8)
+          op = Op::Uxtb;
+        else if (V.typeOf(Z->src).kind == ir::TypeKind::I16)
+          op = Op::Uxth;
+      }
+      Instr ext = make2(op, OpRegV{V.vreg(*I.dest)}, OpRegV{ps});
+      ext.w = true;
+      out.instrs.push_back(std::move(ext));
+    }
+  } else if (auto *S = std::get_if<ir::SExt>(&I.payload)) {
+    if (I.dest) {
+      auto vd = V.vreg(*I.dest);
+      auto ps = V.vreg(S->src);
+      Op op = Op::Mov;
+      switch (V.typeOf(S->src).kind) {
+      case ir::TypeKind::I8:
+        op = Op::Sxtb;
+        break;
+      case ir::TypeKind::I16:
+        op = Op::Sxth;
+        break;
+      case ir::TypeKind::I32:
+        if (S->to.kind == ir::TypeKind::I64)
+          op = Op::Sxtw;
+        break;
+      default:
+        break;
+      }
+      Instr ext = make2(op, OpRegV{vd}, OpRegV{ps});
+      ext.w = S->to.kind != ir::TypeKind::I64;
+      out.instrs.push_back(std::move(ext));
+    }
+  } else if (std::holds_alternative<ir::Trunc>(I.payload)) {
+    if (I.dest && !V.aliased(*I.dest)) {
+      auto vd = V.vreg(*I.dest);
+      auto ps = V.vreg(std::get<ir::Trunc>(I.payload).src);
+      out.instrs.push_back(make2(Op::Mov, OpRegV{vd}, OpRegV{ps}));
+    }
+  } else if (std::holds_alternative<ir::Load>(I.payload)) {
+    auto &L = std::get<ir::Load>(I.payload);
+    if (I.dest) {
+      auto vd = V.vreg(*I.dest);
+      Op op = Op::LdrX;
+      switch (L.ty.kind) {
+      case ir::TypeKind::V128:
+        op = Op::VLdr;
+        break;
       case ir::TypeKind::I64:
-        op = Op::StrX;
+        op = Op::LdrX;
         break;
       case ir::TypeKind::I32:
-        op = Op::StrW;
+        op = Op::LdrW;
         break;
       case ir::TypeKind::I16:
-        op = Op::StrH;
+        op = Op::LdrH;
         break;
       case ir::TypeKind::I8:
-        op = Op::StrB;
+        op = Op::LdrB;
         break;
       default:
-        op = Op::StrX;
+        op = Op::LdrX;
         break;
       }
-      out.instrs.push_back(
-          Instr{op,
-                {OpRegV{vreg_of(S.value)},
-                 OpMem{OpRegV{vaddr}, static_cast<int32_t>(S.offset)}}});
-    } else if (std::holds_alternative<ir::GetPC>(I.payload)) {
-      if (I.dest) {
-        auto vd = vreg_of(*I.dest);
-        out.instrs.push_back(make2(Op::Mov, OpRegV{vd}, OpImm{bb.start}));
+      auto mem = guestAddress(L.base, L.offset, ir::bitWidth(L.ty) / 8, V, H,
+                              out, nextTemp);
+      out.instrs.push_back(Instr{op, {OpRegV{vd}, mem}});
+    }
+  } else if (std::holds_alternative<ir::Store>(I.payload)) {
+    auto &S = std::get<ir::Store>(I.payload);
+    Op op = Op::StrX;
+    switch (S.ty.kind) {
+    case ir::TypeKind::V128:
+      op = Op::VStr;
+      break;
+    case ir::TypeKind::I64:
+      op = Op::StrX;
+      break;
+    case ir::TypeKind::I32:
+      op = Op::StrW;
+      break;
+    case ir::TypeKind::I16:
+      op = Op::StrH;
+      break;
+    case ir::TypeKind::I8:
+      op = Op::StrB;
+      break;
+    default:
+      op = Op::StrX;
+      break;
+    }
+    auto mem = guestAddress(S.base, S.offset, ir::bitWidth(S.ty) / 8, V, H,
+                            out, nextTemp);
+    out.instrs.push_back(Instr{op, {OpRegV{V.vreg(S.value)}, mem}});
+  } else if (auto *S = std::get_if<ir::Splat>(&I.payload)) {
+    if (I.dest) {
+      Instr dup = make2(Op::VDup, OpRegV{V.vreg(*I.dest)},
+                        OpRegV{V.vreg(S->src)});
+      dup.lanes = lanesOf(S->lane);
+      out.instrs.push_back(std::move(dup));
+    }
+  } else if (auto *B = std::get_if<ir::VecBinOp>(&I.payload)) {
+    if (I.dest) {
+      Op op = Op::VAdd;
+      switch (B->kind) {
+      case ir::BinOpKind::Add:
+        op = Op::VAdd;
+        break;
+      case ir::BinOpKind::Sub:
+        op = Op::VSub;
+        break;
+      case ir::BinOpKind::And:
+        op = Op::VAnd;
+        break;
+      case ir::BinOpKind::Or:
+        op = Op::VOrr;
+        break;
+      case ir::BinOpKind::Xor:
+        op = Op::VEor;
+        break;
+      case ir::BinOpKind::Shl:
+      case ir::BinOpKind::LShr:
+      case ir::BinOpKind::AShr:
+        fprintf(stderr, "ISel error: no vector shifts\n");
+        abort();
+      }
+      Instr bin = make3(op, OpRegV{V.vreg(*I.dest)}, OpRegV{V.vreg(B->lhs)},
+                        OpRegV{V.vreg(B->rhs)});
+      bin.lanes = lanesOf(B->lane);
+      out.instrs.push_back(std::move(bin));
+    }
+  } else if (auto *C = std::get_if<ir::VecCmpEq>(&I.payload)) {
+    if (I.dest) {
+      Instr cmeq = make3(Op::VCmeq, OpRegV{V.vreg(*I.dest)},
+                         OpRegV{V.vreg(C->lhs)}, OpRegV{V.vreg(C->rhs)});
+      cmeq.lanes = lanesOf(C->lane);
+      out.instrs.push_back(std::move(cmeq));
+    }
+  } else if (auto *R = std::get_if<ir::ReduceUMax>(&I.payload)) {
+    if (I.dest) {
+      if (R->lane.kind == ir::TypeKind::I64) {
+        fprintf(stderr, "ISel error: no maximum across doublewords\n");
+        abort();
       }
+      VReg max = nextTemp++ | kVecRegBit;
+      Instr umaxv = make2(Op::VUmaxv, OpRegV{max}, OpRegV{V.vreg(R->src)});
+      Instr umov = make2(Op::VUmov, OpRegV{V.vreg(*I.dest)}, OpRegV{max});
+      umaxv.lanes = umov.lanes = lanesOf(R->lane);
+      out.instrs.push_back(std::move(umaxv));
+      out.instrs.push_back(std::move(umov));
+    }
+  } else if (auto *R = std::get_if<ir::ReduceAdd>(&I.payload)) {
+    if (I.dest) {
+      VReg sum = nextTemp++ | kVecRegBit;
+      Instr addv = make2(Op::VAddv, OpRegV{sum}, OpRegV{V.vreg(R->src)});
+      Instr umov = make2(Op::VUmov, OpRegV{V.vreg(*I.dest)}, OpRegV{sum});
+      addv.lanes = umov.lanes = lanesOf(R->lane);
+      out.instrs.push_back(std::move(addv));
+      out.instrs.push_back(std::move(umov));
+    }
+  } else if (std::holds_alternative<ir::GetPC>(I.payload)) {
+    if (I.dest) {
+      auto vd = V.vreg(*I.dest);
+      materializeConst(out.instrs, vd, std::get<ir::GetPC>(I.payload).pc);
+    }
+  } else if (std::holds_alternative<ir::ExitIf>(I.payload)) {
+    const auto &E = std::get<ir::ExitIf>(I.payload);
+    std::stringstream ss;
+    ss << std::hex << E.target;
+    std::string target = "__riscy_block_0x" + ss.str();
+    TermCBr test{};
+    branchOn(E.cond, V, out.instrs, test);
+    if (E.writebacks.empty()) {
+      out.instrs.push_back(branchTo(test, target));
+      return;
+    }
+    std::stringstream ls;
+    ls << "__riscy_exit_0x" << std::hex << unitPc << "_" << std::dec
+       << out.exits.size();
+    ExitStub stub{ls.str(), {}, target};
+    Instr br = branchTo(test, stub.label);
+    for (const auto &W : E.writebacks) {
+      br.ops.push_back(OpRegV{V.vreg(W.value)});
+      stub.instrs.push_back(
+          make2(Op::StrX, OpRegV{V.vreg(W.value)},
+                OpMem{OpRegV{0}, guest_reg_offset_bytes(W.reg)}));
     }
+    out.instrs.push_back(std::move(br));
+    out.exits.push_back(std::move(stub));
   }
+}
 
-  // Terminator
-  switch (bb.term.kind) {
+// Lowers the terminators that do not depend on the unit layout.
+static void selectTerminator(const ir::Terminator &term, const ValueInfo &V,
+                             Block &out) {
+  switch (term.kind) {
   case ir::TermKind::Br: {
-    auto t = std::get<ir::TermBr>(bb.term.data);
+    auto t = std::get<ir::TermBr>(term.data);
     std::stringstream ss;
     ss << std::hex << t.target;
     out.term.kind = TermKind::Br;
@@ -267,19 +1281,40 @@ Block ISel::select(const ir::Block &bb) const {
     break;
   }
   case ir::TermKind::CBr: {
-    auto t = std::get<ir::TermCBr>(bb.term.data);
+    auto t = std::get<ir::TermCBr>(term.data);
     std::stringstream sst, ssf;
     sst << std::hex << t.t;
     ssf << std::hex << t.f;
+    TermCBr br{0, "__riscy_block_0x" + sst.str(),
+               "__riscy_block_0x" + ssf.str()};
+    branchOn(t.cond, V, out.instrs, br);
     out.term.kind = TermKind::CBr;
-    out.term.data = TermCBr{vreg_of(t.cond), "__riscy_block_0x" + sst.str(),
-                            "__riscy_block_0x" + ssf.str()};
+    out.term.data = br;
     break;
   }
   case ir::TermKind::BrIndirect: {
-    auto t = std::get<ir::TermBrIndirect>(bb.term.data);
+    auto t = std::get<ir::TermBrIndirect>(term.data);
     out.term.kind = TermKind::BrIndirect;
-    out.term.data = TermBrIndirect{vreg_of(t.target)};
+    out.term.data = TermBrIndirect{V.vreg(t.target)};
+    break;
+  }
+  case ir::TermKind::Call: {
+    auto t = std::get<ir::TermCall>(term.data);
+    std::stringstream sst, ssr;
+    sst << std::hex << t.target;
+    ssr << std::hex << t.ret;
+    out.term.kind = TermKind::Call;
+    out.term.data = TermCall{"__riscy_block_0x" + sst.str(),
+                             "__riscy_block_0x" + ssr.str()};
+    break;
+  }
+  case ir::TermKind::CallIndirect: {
+    auto t = std::get<ir::TermCallIndirect>(term.data);
+    std::stringstream ssr;
+    ssr << std::hex << t.ret;
+    out.term.kind = TermKind::CallIndirect;
+    out.term.data =
+        TermCallIndirect{V.vreg(t.target), "__riscy_block_0x" + ssr.str()};
     break;
   }
   case ir::TermKind::Ret:
@@ -289,10 +1324,144 @@ Block ISel::select(const ir::Block &bb) const {
     out.term.kind = TermKind::Trap;
     break;
   case ir::TermKind::None:
+  case ir::TermKind::Goto:
+  case ir::TermKind::CondGoto:
+    // Internal edges are laid out by select(const ir::Function &).
     out.term.kind = TermKind::None;
     break;
   }
+}
+
+Block ISel::select(const ir::Block &bb) const {
+  Block out{};
+  out.guest_pc = bb.start;
+  // Values map to vregs id + 1; temporaries follow them. Optimized blocks may
+  // have fewer instructions than values, so look at the ids themselves.
+  ir::ValueId numValues = static_cast<ir::ValueId>(bb.insts.size());
+  for (const auto &I : bb.insts)
+    if (I.dest)
+      numValues = std::max(numValues, *I.dest + 1);
+  ValueInfo V(numValues);
+  V.add(bb);
+  V.planSelects();
+  V.planBranches();
+  V.planAddresses();
+  ir::KnownBitsAnalysis known(bb);
+  V.useKnownBits(&known);
+  V.planBitfields();
+  V.planImmediates();
+  VReg nextTemp = static_cast<VReg>(numValues + 1);
+  HostAddresses H;
+  H.reset(bb, V);
+  for (const auto &I : bb.insts)
+    selectInstr(I, V, H, out, nextTemp, bb.start);
+  selectTerminator(bb.term, V, out);
+  return out;
+}
+
+std::vector<Block> ISel::select(const ir::Function &fn) const {
+  std::vector<Block> out;
+  ValueInfo V(fn.numValues);
+  for (const auto &bb : fn.blocks)
+    V.add(bb);
+  V.planSelects();
+  V.planBranches();
+  V.planAddresses();
+  ir::KnownBitsAnalysis known(fn);
+  V.useKnownBits(&known);
+  V.planBitfields();
+  V.planImmediates();
+  VReg nextTemp = static_cast<VReg>(fn.numValues + 1);
+  HostAddresses H;
+  auto labelOf = [&](ir::BlockId id) {
+    std::stringstream ss;
+    ss << "__riscy_fn_0x" << std::hex << fn.entry << "_" << std::dec << id;
+    return ss.str();
+  };
+  auto hasPhis = [&](ir::BlockId id) {
+    const auto &insts = fn.blocks[id].insts;
+    return !insts.empty() && std::holds_alternative<ir::Phi>(insts[0].payload);
+  };
+  // The phis of `succ` read their operands simultaneously on the edge from
+  // `pred`. Copy the sources that are overwritten by another phi of the same
+  // block to temporaries first.
+  auto phiCopies = [&](ir::BlockId pred, ir::BlockId succ,
+                       std::vector<Instr> &instrs) {
+    std::vector<std::pair<VReg, VReg>> copies; // dst <- src
+    for (const auto &I : fn.blocks[succ].insts) {
+      const auto *phi = std::get_if<ir::Phi>(&I.payload);
+      if (!phi)
+        break;
+      for (const auto &in : phi->incoming)
+        if (in.first == pred && in.second != *I.dest)
+          copies.push_back({V.vreg(*I.dest), V.vreg(in.second)});
+    }
+    auto copy = [&](VReg dst, VReg src) {
+      Op op = dst & kVecRegBit ? Op::VMov : Op::Mov;
+      instrs.push_back(make2(op, OpRegV{dst}, OpRegV{src}));
+    };
+    for (auto &c : copies) {
+      auto overwrites = [&](const auto &d) { return d.first == c.second; };
+      if (std::none_of(copies.begin(), copies.end(), overwrites))
+        continue;
+      VReg tmp = nextTemp++ | (c.second & kVecRegBit);
+      copy(tmp, c.second);
+      c.second = tmp;
+    }
+    for (const auto &c : copies)
+      copy(c.first, c.second);
+  };
 
+  for (const auto &bb : fn.blocks) {
+    Block blk{};
+    blk.guest_pc = bb.start;
+    if (!bb.external)
+      blk.label = labelOf(bb.id);
+    H.reset(bb, V);
+    for (const auto &I : bb.insts)
+      selectInstr(I, V, H, blk, nextTemp, bb.start);
+
+    std::vector<Block> edges;
+    // Returns the label to branch to for the edge to `succ`, splitting the
+    // edge if the copies for its phis need a block of their own.
+    auto edgeTo = [&](ir::BlockId succ, const char *suffix) {
+      if (!hasPhis(succ))
+        return labelOf(succ);
+      Block e{};
+      e.guest_pc = bb.start;
+      e.label = labelOf(bb.id) + suffix;
+      phiCopies(bb.id, succ, e.instrs);
+      e.term.kind = TermKind::Br;
+      e.term.data = TermBr{labelOf(succ)};
+      edges.push_back(std::move(e));
+      return edges.back().label;
+    };
+    switch (bb.term.kind) {
+    case ir::TermKind::Goto: {
+      auto t = std::get<ir::TermGoto>(bb.term.data);
+      phiCopies(bb.id, t.target, blk.instrs);
+      blk.term.kind = TermKind::Br;
+      blk.term.data = TermBr{labelOf(t.target)};
+      break;
+    }
+    case ir::TermKind::CondGoto: {
+      auto t = std::get<ir::TermCondGoto>(bb.term.data);
+      // The false edge is laid out first so it can fall through.
+      auto f = edgeTo(t.f, "_f");
+      TermCBr br{0, edgeTo(t.t, "_t"), f};
+      branchOn(t.cond, V, blk.instrs, br);
+      blk.term.kind = TermKind::CBr;
+      blk.term.data = br;
+      break;
+    }
+    default:
+      selectTerminator(bb.term, V, blk);
+      break;
+    }
+    out.push_back(std::move(blk));
+    for (auto &e : edges)
+      out.push_back(std::move(e));
+  }
   return out;
 }
 
@@ -13,6 +13,10 @@ class ISel {
 public:
   // Select a single block. Assumes x0 holds `struct RiscyGuestState*`.
   Block select(const ir::Block &bb) const;
+  // Select a whole SSA function into one unit of blocks. External blocks are
+  // labelled by guest address; the others get labels local to the function.
+  // Phis become copies on their incoming edges.
+  std::vector<Block> select(const ir::Function &fn) const;
 };
 
 } // namespace riscy::aarch64
@@ -9,12 +9,17 @@ namespace riscy::aarch64 {
 
 using VReg = uint32_t; // virtual register id
 
+// Vregs with this bit set hold 128-bit vectors and live in the SIMD
+// registers v0..v31 instead.
+constexpr VReg kVecRegBit = 0x40000000u;
+
 // Physical registers are encoded as 0..30 for x0..x30 (x31 is sp/zero, avoid)
 using PReg = int;
 
 enum class Op {
   Mov,
   MovZ,
+  MovN,
   MovK,
   Add,
   Sub,
@@ -24,6 +29,12 @@ enum class Op {
   Lsl,
   Lsr,
   Asr,
+  // Bitfields: ops are the destination, the source, lsb and width.
+  Ubfx,  // d = zero-extended source bits [lsb, lsb + width)
+  Sbfx,  // d = sign-extended source bits [lsb, lsb + width)
+  Ubfiz, // d = zero-extended low width source bits << lsb
+  Sbfiz, // d = sign-extended low width source bits << lsb
+  Bfi,   // d bits [lsb, lsb + width) = low width source bits
   LdrX,
   LdrW,
   LdrB,
@@ -34,6 +45,7 @@ enum class Op {
   StrB,
   StrH,
   Cmp,
+  Cmn, // compare with the negated immediate
   CsetEq,
   CsetNe,
   CsetLo,
@@ -44,19 +56,81 @@ enum class Op {
   CsetLe,
   CsetGt,
   CsetGe,
+  Csel,  // d = cc ? a : b
+  Csinc, // d = cc ? a : b + 1
+  Csneg, // d = cc ? a : -b
+  Sxtb,
+  Sxth,
   Sxtw,
-  Uxtw,
+  Uxtb,
+  Uxth,
+  // SIMD, on the lanes given by Instr::lanes.
+  VLdr,  // q register from [base, #offset]
+  VStr,  // q register to [base, #offset]
+  VAdd,
+  VSub,
+  VAnd,
+  VOrr,
+  VEor,
+  VCmeq,  // lanes all ones where equal
+  VDup,   // every lane = general register
+  VMov,   // whole register copy
+  VAddv,  // sum of the lanes into lane 0
+  VUmaxv, // unsigned maximum of the lanes into lane 0
+  VUmov,  // general register = lane 0
   Bl,
   Br,
   B,
   Bne,
   Beq,
+  BCond, // b.<cc> to ops[0]
+  Cbz,
+  Cbnz,
+  Tbz,  // ops: register, bit, label
+  Tbnz,
   Ret,
   Brk,
   // Pseudo for labels
   Label,
 };
 
+// Shifts applied to the last register operand of an arithmetic or logical
+// instruction.
+enum class Shift { LSL, LSR, ASR };
+
+// Lane arrangements of a 128-bit vector.
+enum class Lanes { B16, H8, S4, D2 };
+
+// Condition codes read by conditional selects and branches, after a Cmp.
+enum class Cond { EQ, NE, LO, LS, HI, HS, LT, LE, GT, GE };
+
+// The condition that holds exactly when `c` does not.
+inline Cond inverse(Cond c) {
+  switch (c) {
+  case Cond::EQ:
+    return Cond::NE;
+  case Cond::NE:
+    return Cond::EQ;
+  case Cond::LO:
+    return Cond::HS;
+  case Cond::LS:
+    return Cond::HI;
+  case Cond::HI:
+    return Cond::LS;
+  case Cond::HS:
+    return Cond::LO;
+  case Cond::LT:
+    return Cond::GE;
+  case Cond::LE:
+    return Cond::GT;
+  case Cond::GT:
+    return Cond::LE;
+  case Cond::GE:
+    return Cond::LT;
+  }
+  return c;
+}
+
 struct OpRegV {
   VReg id = 0;
 };
@@ -69,6 +143,10 @@ struct OpImm {
 struct OpMem {
   OpRegV base;
   int32_t offset = 0;
+  // Register-offset form: the address is the guest memory base x21 plus
+  // `base`, zero-extended from 32 bits if `uxtw`, and `offset` is 0.
+  bool guest = false;
+  bool uxtw = false;
 };
 struct OpLabel {
   std::string name;
@@ -79,30 +157,134 @@ using Operand = std::variant<OpRegV, OpRegP, OpImm, OpMem, OpLabel>;
 struct Instr {
   Op op{};
   std::vector<Operand> ops{};
+  // Operate on the 32-bit (wN) views of the register operands. Writing a
+  // wN register clears the upper half of xN.
+  bool w = false;
+  // The condition of Csel, Csinc, Csneg and BCond.
+  Cond cc = Cond::EQ;
+  // The lanes of SIMD operations.
+  Lanes lanes = Lanes::D2;
+  // Add, Sub, And, Orr and Eor of registers shift the last one by `amount`
+  // first.
+  Shift shift = Shift::LSL;
+  unsigned amount = 0;
 };
 
-enum class TermKind { None, Br, CBr, BrIndirect, Ret, Trap };
+// True if ops[0] is written by `op`. All other register operands are read;
+// MovK and Bfi also read their destination (see readsFirstOperand).
+inline bool definesFirstOperand(Op op) {
+  switch (op) {
+  case Op::StrX:
+  case Op::StrW:
+  case Op::StrB:
+  case Op::StrH:
+  case Op::VStr:
+  case Op::Cmp:
+  case Op::Cmn:
+  case Op::Bl:
+  case Op::Br:
+  case Op::B:
+  case Op::Bne:
+  case Op::Beq:
+  case Op::BCond:
+  case Op::Cbz:
+  case Op::Cbnz:
+  case Op::Tbz:
+  case Op::Tbnz:
+  case Op::Ret:
+  case Op::Brk:
+  case Op::Label:
+    return false;
+  default:
+    return true;
+  }
+}
+
+// True if `op` merges into its destination, ops[0], instead of replacing it.
+inline bool readsFirstOperand(Op op) {
+  return op == Op::MovK || op == Op::Bfi;
+}
+
+enum class TermKind {
+  None,
+  Br,
+  CBr,
+  BrIndirect,
+  Ret,
+  Trap,
+  Call,        // native call to a block; continue at the return site
+  CallIndirect // native call through the dispatcher
+};
 
 struct TermBr {
   std::string target;
 };
+// What a conditional branch tests: the flags of the Cmp right before it, a
+// register being zero or not, or a single bit of a register.
+enum class BranchTest { Flags, Zero, NonZero, BitClear, BitSet };
+
+// The test that holds exactly when `t` does not.
+inline BranchTest inverse(BranchTest t) {
+  switch (t) {
+  case BranchTest::Flags:
+    return BranchTest::Flags;
+  case BranchTest::Zero:
+    return BranchTest::NonZero;
+  case BranchTest::NonZero:
+    return BranchTest::Zero;
+  case BranchTest::BitClear:
+    return BranchTest::BitSet;
+  case BranchTest::BitSet:
+    return BranchTest::BitClear;
+  }
+  return t;
+}
+
+// Branches to `t` if the test holds, else to `f`.
 struct TermCBr {
-  VReg cond;
+  VReg cond; // the register tested; unused for BranchTest::Flags
   std::string t, f;
+  BranchTest test = BranchTest::NonZero;
+  Cond cc = Cond::NE; // for BranchTest::Flags
+  unsigned bit = 0;   // for BitClear and BitSet
+  bool w = false;     // test the 32-bit view of `cond`
 };
 struct TermBrIndirect {
   VReg target;
 };
+struct TermCall {
+  std::string target, ret;
+};
+struct TermCallIndirect {
+  VReg target;
+  std::string ret;
+};
 
 struct Terminator {
   TermKind kind = TermKind::None;
-  std::variant<std::monostate, TermBr, TermCBr, TermBrIndirect> data{};
+  std::variant<std::monostate, TermBr, TermCBr, TermBrIndirect, TermCall,
+               TermCallIndirect>
+      data{};
+};
+
+// Out-of-line tail of a side exit, emitted after the terminator: stores the
+// registers the exit writes back, then branches to `target`. The Cbnz that
+// jumps here lists the stored vregs as extra operands so they stay live up
+// to the exit.
+struct ExitStub {
+  std::string label;
+  std::vector<Instr> instrs;
+  std::string target;
 };
 
 struct Block {
   uint64_t guest_pc = 0;
+  // Label of a block internal to a function unit. Empty for blocks entered by
+  // guest address, which are labelled __riscy_block_0x<guest_pc>.
+  std::string label;
   std::vector<Instr> instrs;
   Terminator term;
+  std::vector<ExitStub> exits;
 };
 
 } // namespace riscy::aarch64
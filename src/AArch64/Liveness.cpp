@@ -1,50 +1,153 @@
 #include "AArch64/Liveness.h"
 
+#include <optional>
+#include <unordered_set>
+
 namespace riscy::aarch64 {
 
+// Calls `f(vreg, isDef)` for every virtual register operand of `I`.
+template <typename F> static void forEachVReg(const Instr &I, F &&f) {
+  for (size_t i = 0; i < I.ops.size(); ++i) {
+    const auto &op = I.ops[i];
+    if (std::holds_alternative<OpRegV>(op)) {
+      bool def = i == 0 && definesFirstOperand(I.op);
+      if (def && readsFirstOperand(I.op))
+        f(std::get<OpRegV>(op).id, false);
+      f(std::get<OpRegV>(op).id, def);
+    } else if (std::holds_alternative<OpMem>(op)) {
+      auto base = std::get<OpMem>(op).base.id;
+      // Base.id == 0 denotes x0 (state pointer), not a vreg; skip it.
+      if (base != 0)
+        f(base, false);
+    }
+  }
+}
+
+static std::optional<VReg> terminatorUse(const Terminator &term) {
+  switch (term.kind) {
+  case TermKind::CBr: {
+    // A branch on the flags reads no register.
+    const auto &t = std::get<TermCBr>(term.data);
+    if (t.test == BranchTest::Flags)
+      return std::nullopt;
+    return t.cond;
+  }
+  case TermKind::BrIndirect:
+    return std::get<TermBrIndirect>(term.data).target;
+  case TermKind::CallIndirect:
+    return std::get<TermCallIndirect>(term.data).target;
+  default:
+    return std::nullopt;
+  }
+}
+
 LivenessMap Liveness::analyze(const Block &b) const {
+  return analyze(std::vector<const Block *>{&b});
+}
+
+LivenessMap Liveness::analyze(const std::vector<Block> &blocks) const {
+  std::vector<const Block *> ptrs;
+  ptrs.reserve(blocks.size());
+  for (const auto &b : blocks)
+    ptrs.push_back(&b);
+  return analyze(ptrs);
+}
+
+LivenessMap
+Liveness::analyze(const std::vector<const Block *> &blocks) const {
+  // Successors through internal labels; branches by guest address leave the
+  // unit with every live value stored to RiscyGuestState.
+  std::unordered_map<std::string, size_t> indexOf;
+  for (size_t i = 0; i < blocks.size(); ++i)
+    if (!blocks[i]->label.empty())
+      indexOf[blocks[i]->label] = i;
+  std::vector<std::vector<size_t>> succs(blocks.size());
+  auto addSucc = [&](size_t from, const std::string &label) {
+    auto it = indexOf.find(label);
+    if (it != indexOf.end())
+      succs[from].push_back(it->second);
+  };
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const auto &term = blocks[i]->term;
+    if (term.kind == TermKind::Br) {
+      addSucc(i, std::get<TermBr>(term.data).target);
+    } else if (term.kind == TermKind::CBr) {
+      addSucc(i, std::get<TermCBr>(term.data).t);
+      addSucc(i, std::get<TermCBr>(term.data).f);
+    }
+  }
+
+  // Upward-exposed uses and definitions per block.
+  using VSet = std::unordered_set<VReg>;
+  std::vector<VSet> use(blocks.size()), def(blocks.size());
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    auto note = [&](VReg v, bool isDef) {
+      if (isDef)
+        def[i].insert(v);
+      else if (!def[i].count(v))
+        use[i].insert(v);
+    };
+    for (const auto &I : blocks[i]->instrs) {
+      // Reads happen before the write of the same instruction.
+      forEachVReg(I, [&](VReg v, bool isDef) {
+        if (!isDef)
+          note(v, false);
+      });
+      forEachVReg(I, [&](VReg v, bool isDef) {
+        if (isDef)
+          note(v, true);
+      });
+    }
+    if (auto v = terminatorUse(blocks[i]->term))
+      note(*v, false);
+  }
+
+  std::vector<VSet> liveIn(blocks.size()), liveOut(blocks.size());
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t i = blocks.size(); i-- > 0;) {
+      VSet out;
+      for (auto s : succs[i])
+        out.insert(liveIn[s].begin(), liveIn[s].end());
+      VSet in = use[i];
+      for (auto v : out)
+        if (!def[i].count(v))
+          in.insert(v);
+      if (in.size() != liveIn[i].size() || out.size() != liveOut[i].size()) {
+        liveIn[i] = std::move(in);
+        liveOut[i] = std::move(out);
+        changed = true;
+      }
+    }
+  }
+
+  // Intervals are the hull of every position a vreg is touched or live at.
   LivenessMap map;
   auto touch = [&](VReg v, uint32_t pos) {
-    auto &lr = map[v];
-    if (lr.start == 0 && lr.end == 0) {
-      lr.start = pos;
-      lr.end = pos;
-    }
+    auto [it, inserted] = map.try_emplace(v, LiveRange{pos, pos});
+    if (inserted)
+      return;
+    auto &lr = it->second;
     if (pos < lr.start)
       lr.start = pos;
     if (pos > lr.end)
       lr.end = pos;
   };
-
   uint32_t pos = 0;
-  for (const auto &I : b.instrs) {
-    for (const auto &op : I.ops) {
-      if (std::holds_alternative<OpRegV>(op)) {
-        touch(std::get<OpRegV>(op).id, pos);
-      } else if (std::holds_alternative<OpMem>(op)) {
-        auto base = std::get<OpMem>(op).base.id;
-        // Base.id == 0 denotes x0 (state pointer), not a vreg; skip it.
-        if (base != 0)
-          touch(base, pos);
-      }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    for (auto v : liveIn[i])
+      touch(v, pos);
+    for (const auto &I : blocks[i]->instrs) {
+      forEachVReg(I, [&](VReg v, bool) { touch(v, pos); });
+      ++pos;
     }
+    // Terminator
+    if (auto v = terminatorUse(blocks[i]->term))
+      touch(*v, pos);
+    for (auto v : liveOut[i])
+      touch(v, pos);
     ++pos;
   }
-  // Terminator
-  switch (b.term.kind) {
-  case TermKind::CBr: {
-    auto t = std::get<TermCBr>(b.term.data);
-    touch(t.cond, pos);
-    break;
-  }
-  case TermKind::BrIndirect: {
-    auto t = std::get<TermBrIndirect>(b.term.data);
-    touch(t.target, pos);
-    break;
-  }
-  default:
-    break;
-  }
   return map;
 }
 
@@ -12,12 +12,18 @@ struct LiveRange {
   uint32_t end = 0;
 };
 
-// Map VReg -> live interval within a block
+// Map VReg -> live interval within a block or unit. Positions number the
+// instructions and terminators of the unit's blocks in order.
 using LivenessMap = std::unordered_map<VReg, LiveRange>;
 
 class Liveness {
 public:
   LivenessMap analyze(const Block &b) const;
+  // Intervals over a unit whose blocks branch to each other by label.
+  LivenessMap analyze(const std::vector<Block> &blocks) const;
+
+private:
+  LivenessMap analyze(const std::vector<const Block *> &blocks) const;
 };
 
 } // namespace riscy::aarch64
@@ -1,10 +1,42 @@
 #include "AArch64/RegAlloc.h"
 #include <algorithm>
+#include <iterator>
 
 namespace riscy::aarch64 {
 
-RegAssignment RegAlloc::allocate(const Block &b,
+// The definition of each vreg that a single Mov, MovZ or MovN of an
+// immediate defines. Rematerializing it costs no more than reloading it and
+// saves the store; longer constants are spilled.
+static std::unordered_map<VReg, Instr>
+rematerializable(const std::vector<Block> &blocks) {
+  std::unordered_map<VReg, unsigned> defs;
+  std::unordered_map<VReg, Instr> out;
+  for (const auto &b : blocks) {
+    for (const auto &I : b.instrs) {
+      auto *d = I.ops.empty() ? nullptr : std::get_if<OpRegV>(&I.ops[0]);
+      if (!d || !definesFirstOperand(I.op) || ++defs[d->id] > 1)
+        continue;
+      bool mov = I.op == Op::Mov || I.op == Op::MovZ || I.op == Op::MovN;
+      if (mov && std::holds_alternative<OpImm>(I.ops[1]))
+        out[d->id] = I;
+    }
+  }
+  for (auto it = out.begin(); it != out.end();)
+    it = defs[it->first] > 1 ? out.erase(it) : std::next(it);
+  return out;
+}
+
+RegAssignment RegAlloc::allocate(const Block &, const LivenessMap &live) const {
+  return allocate(live);
+}
+
+RegAssignment RegAlloc::allocate(const LivenessMap &live) const {
+  return allocate(std::vector<Block>{}, live);
+}
+
+RegAssignment RegAlloc::allocate(const std::vector<Block> &blocks,
                                  const LivenessMap &live) const {
+  auto remat = rematerializable(blocks);
   // Collect intervals
   struct Item {
     VReg v;
@@ -15,21 +47,36 @@ RegAssignment RegAlloc::allocate(const Block &b,
   for (auto &kv : live)
     items.push_back({kv.first, kv.second});
   std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) {
-    return a.lr.start < b.lr.start;
+    return a.lr.start != b.lr.start ? a.lr.start < b.lr.start : a.v < b.v;
   });
 
   RegAssignment asg{};
-  // Expanded pool: use x1..x28 excluding x0 (arg), x19 (LR save), x21 (mem
-  // base), x29 (fp), x30 (lr) Do not include x1 in pool; it is used to pass
-  // target PC in indirect branches
-  std::vector<PReg> pool = {2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14,
-                            15, 16, 17, 18, 20, 22, 23, 24, 25, 26, 27, 28};
+  // Expanded pool: use x1..x28 excluding x0 (arg), x1 (target PC for indirect
+  // branches), x16/x17 (spill scratch), x19 (LR save), x21 (mem base), x29
+  // (fp) and x30 (lr)
+  std::vector<PReg> pool = {2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12,
+                            13, 14, 15, 18, 20, 22, 23, 24, 25, 26, 27, 28};
+  // Vectors take the SIMD registers whose contents the caller of the
+  // translated code does not expect preserved (v8..v15 are callee-saved),
+  // except the spill scratch registers v30/v31.
+  std::vector<PReg> vectorPool = {0,  1,  2,  3,  4,  5,  6,  7,  16, 17, 18,
+                                  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29};
   struct Active {
     PReg p;
     LiveRange lr;
     VReg v;
   };
-  std::vector<Active> active;
+  std::vector<Active> active, vectorActive;
+  struct Spilled {
+    int slot;
+    LiveRange lr;
+    bool vector;
+  };
+  std::vector<Spilled> spilled;
+  // Released slots, or even pairs of them for vectors, and the position from
+  // which each one is free.
+  std::vector<std::pair<int, uint32_t>> freeSlots, freeVectorSlots;
+  int numSlots = 0;
 
   auto expire = [&](uint32_t cur) {
     // Return expired physical registers to the pool
@@ -45,22 +92,83 @@ RegAssignment RegAlloc::allocate(const Block &b,
                  active.end());
     for (auto p : freed)
       pool.push_back(p);
+    vectorActive.erase(std::remove_if(vectorActive.begin(), vectorActive.end(),
+                                      [&](const Active &a) {
+                                        if (a.lr.end <= cur) {
+                                          vectorPool.push_back(a.p);
+                                          return true;
+                                        }
+                                        return false;
+                                      }),
+                       vectorActive.end());
+    auto done = [&](const Spilled &s) { return s.lr.end <= cur; };
+    for (const auto &s : spilled)
+      if (done(s))
+        (s.vector ? freeVectorSlots : freeSlots).push_back({s.slot, s.lr.end});
+    spilled.erase(std::remove_if(spilled.begin(), spilled.end(), done),
+                  spilled.end());
   };
-
-  for (const auto &it : items) {
-    expire(it.lr.start);
-    if (pool.empty()) {
-      // Out of registers: fail hard for now so we can diagnose.
+  auto spill = [&](VReg v, LiveRange lr) {
+    if (auto it = remat.find(v); it != remat.end()) {
+      asg.remat[v] = it->second;
+      return;
+    }
+    // An evicted interval started earlier, so it may only take a slot that
+    // was already free when it began.
+    bool vector = v & kVecRegBit;
+    auto &slots = vector ? freeVectorSlots : freeSlots;
+    auto freeAtStart = [&](const auto &f) { return f.second <= lr.start; };
+    auto reuse = std::find_if(slots.begin(), slots.end(), freeAtStart);
+    int slot = numSlots;
+    if (reuse != slots.end()) {
+      slot = reuse->first;
+      slots.erase(reuse);
+    } else if (vector) {
+      // The area is 16-byte aligned, so an even slot is too.
+      slot = (numSlots + 1) & ~1;
+      numSlots = slot + 2;
+    } else {
+      ++numSlots;
+    }
+    if (slot + vector >= kNumSpillSlots) {
       fprintf(stderr,
-              "RegAlloc error: out of physical registers; vreg %d cannot be "
+              "RegAlloc error: out of spill slots; vreg %d cannot be "
               "assigned\n",
-              it.v);
+              v);
       abort();
-    } else {
-      PReg p = pool.back();
-      pool.pop_back();
+    }
+    asg.spill[v] = kSpillAreaOffset + 8 * slot;
+    spilled.push_back({slot, lr, vector});
+  };
+
+  for (const auto &it : items) {
+    expire(it.lr.start);
+    // Vectors compete for the SIMD registers only.
+    bool vector = it.v & kVecRegBit;
+    auto &regs = vector ? vectorPool : pool;
+    auto &taken = vector ? vectorActive : active;
+    if (!regs.empty()) {
+      PReg p = regs.back();
+      regs.pop_back();
       asg.v2p[it.v] = p;
-      active.push_back({p, it.lr, it.v});
+      taken.push_back({p, it.lr, it.v});
+      continue;
+    }
+    // Out of registers: spill whichever of the current interval and the
+    // active ones ends last, preferring one that is rematerialized on a tie.
+    auto before = [&](const Active &a, const Active &b) {
+      if (a.lr.end != b.lr.end)
+        return a.lr.end < b.lr.end;
+      return !remat.count(a.v) && remat.count(b.v);
+    };
+    auto last = std::max_element(taken.begin(), taken.end(), before);
+    if (before(Active{0, it.lr, it.v}, *last)) {
+      asg.v2p[it.v] = last->p;
+      asg.v2p.erase(last->v);
+      spill(last->v, last->lr);
+      *last = {last->p, it.lr, it.v};
+    } else {
+      spill(it.v, it.lr);
     }
   }
   return asg;
@@ -7,16 +7,37 @@
 
 namespace riscy::aarch64 {
 
-// Result of allocation within a block
+// Spilled vregs live in RiscyGuestState::spill and are staged through the
+// scratch registers x16/x17, which the allocator never hands out. Nothing is
+// live across a native call, so one spill area per guest state suffices.
+// Vectors take two adjacent 8-byte slots, 16-byte aligned, and are staged
+// through v30/v31.
+constexpr int kSpillAreaOffset = 272; // offsetof(RiscyGuestState, spill)
+constexpr int kNumSpillSlots = 1024;  // RISCY_SPILL_SLOTS
+constexpr PReg kScratchRegs[] = {16, 17};
+constexpr PReg kVecScratchRegs[] = {30, 31};
+
+// Result of allocation within a block or unit
 struct RegAssignment {
   std::unordered_map<VReg, PReg> v2p;
+  std::unordered_map<VReg, int32_t> spill; // vreg -> offset into guest state
+  // Evicted constants that are materialized again at each use instead of
+  // being spilled: vreg -> the Mov, MovZ or MovN defining it.
+  std::unordered_map<VReg, Instr> remat;
 };
 
 class RegAlloc {
 public:
-  // Simple per-block linear-scan over caller-saved pool {x9..x15}; no spills
-  // yet
+  // Linear scan over the callee- and caller-saved pool; when it runs out,
+  // the interval that ends last is spilled (Poletto & Sarkar). Vector vregs
+  // are assigned SIMD register numbers from a pool of their own and spilled
+  // the same way.
   RegAssignment allocate(const Block &b, const LivenessMap &live) const;
+  RegAssignment allocate(const LivenessMap &live) const;
+  // Allocates for the unit `blocks`, evicting the constants they
+  // materialize in one instruction first and rematerializing them.
+  RegAssignment allocate(const std::vector<Block> &blocks,
+                         const LivenessMap &live) const;
 };
 
 } // namespace riscy::aarch64
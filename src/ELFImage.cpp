@@ -1,11 +1,15 @@
 #include "ELFImage.h"
 
+#include <algorithm>
+
 namespace riscy {
 
 bool ELFImage::load(const std::filesystem::path &path, std::string &err) {
   loaded = false;
   err.clear();
   execSections.clear();
+  readOnlySections.clear();
+  functions.clear();
   if (!reader.load(path)) {
     err = "Failed to load ELF file: " + path.string();
     return false;
@@ -27,24 +31,51 @@ bool ELFImage::load(const std::filesystem::path &path, std::string &err) {
 
   entry = reader.get_entry();
 
-  // Collect executable sections with SHF_EXECINSTR
+  // Collect executable sections with SHF_EXECINSTR, loaded sections without
+  // SHF_WRITE, and the function symbols
   for (const auto &secPtr : reader.sections) {
     const ELFIO::section *sec = secPtr.get();
     if (!sec)
       continue;
+    if (sec->get_type() == ELFIO::SHT_SYMTAB) {
+      ELFIO::symbol_section_accessor symbols(reader, sec);
+      for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i) {
+        std::string name;
+        ELFIO::Elf64_Addr value = 0;
+        ELFIO::Elf_Xword size = 0;
+        unsigned char bind = 0, type = 0, other = 0;
+        ELFIO::Elf_Half shndx = 0;
+        if (symbols.get_symbol(i, name, value, size, bind, type, shndx,
+                               other) &&
+            type == ELFIO::STT_FUNC && !name.empty())
+          functions.push_back({name, value, size});
+      }
+      continue;
+    }
     auto flags = sec->get_flags();
-    if ((flags & ELFIO::SHF_EXECINSTR) == 0)
+    bool exec = (flags & ELFIO::SHF_EXECINSTR) != 0;
+    bool readOnly =
+        (flags & ELFIO::SHF_ALLOC) != 0 && (flags & ELFIO::SHF_WRITE) == 0;
+    if (!exec && !readOnly)
       continue;
     const char *data = sec->get_data();
-    if (data == nullptr)
+    if (data == nullptr || sec->get_type() == ELFIO::SHT_NOBITS)
       continue;
     SectionSpan span;
     span.va = sec->get_address();
     span.size = static_cast<size_t>(sec->get_size());
     span.data = data;
-    execSections.push_back(span);
+    if (exec)
+      execSections.push_back(span);
+    if (readOnly)
+      readOnlySections.push_back(span);
   }
 
+  std::sort(functions.begin(), functions.end(),
+            [](const FunctionSymbol &a, const FunctionSymbol &b) {
+              return a.addr < b.addr;
+            });
+
   if (execSections.empty()) {
     err = "No executable sections found";
     return false;
@@ -55,9 +86,16 @@ bool ELFImage::load(const std::filesystem::path &path, std::string &err) {
 }
 
 bool ELFImage::read(uint64_t va, void *dst, size_t n) const {
-  if (!loaded)
-    return false;
-  for (const auto &s : execSections) {
+  return loaded && readFrom(execSections, va, dst, n);
+}
+
+bool ELFImage::readReadOnly(uint64_t va, void *dst, size_t n) const {
+  return loaded && readFrom(readOnlySections, va, dst, n);
+}
+
+bool ELFImage::readFrom(const std::vector<SectionSpan> &sections, uint64_t va,
+                        void *dst, size_t n) {
+  for (const auto &s : sections) {
     if (va < s.va)
       continue;
     uint64_t end = s.va + s.size;
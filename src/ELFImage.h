@@ -8,6 +8,13 @@
 
 namespace riscy {
 
+// A function symbol of the image's symbol table.
+struct FunctionSymbol {
+  std::string name;
+  uint64_t addr = 0;
+  uint64_t size = 0; // in bytes; 0 if unknown
+};
+
 // Thin executable image backed by ELFIO executable sections.
 class ELFImage {
 public:
@@ -20,6 +27,14 @@ public:
 
   // Read n bytes from VA into Dst. Returns false if address is unmapped or OOB.
   bool read(uint64_t va, void *dst, size_t n) const;
+  // Like read(), but over every loaded section the program cannot write
+  // (code and read-only data), whose contents are fixed at translation time.
+  bool readReadOnly(uint64_t va, void *dst, size_t n) const;
+  // The function symbols of .symtab, in address order. Stripped images have
+  // none.
+  const std::vector<FunctionSymbol> &functionSymbols() const {
+    return functions;
+  }
 
 private:
   struct SectionSpan {
@@ -28,8 +43,13 @@ private:
     const char *data = nullptr; // pointer owned by ELFIO reader
   };
 
+  static bool readFrom(const std::vector<SectionSpan> &sections, uint64_t va,
+                       void *dst, size_t n);
+
   ELFIO::elfio reader;
   std::vector<SectionSpan> execSections;
+  std::vector<SectionSpan> readOnlySections;
+  std::vector<FunctionSymbol> functions;
   uint64_t entry = 0;
   bool loaded = false;
 };
@@ -0,0 +1,127 @@
+#include "HLE.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace riscy {
+
+const std::vector<HLERoutine> &hleRoutines() {
+  static const std::vector<HLERoutine> routines = {
+      {"memcpy", "riscy_hle_memcpy"},   {"memset", "riscy_hle_memset"},
+      {"strlen", "riscy_hle_strlen"},   {"memcmp", "riscy_hle_memcmp"},
+      {"__muldi3", "riscy_hle_muldi3"}, {"__udivdi3", "riscy_hle_udivdi3"},
+  };
+  return routines;
+}
+
+// The bits of the instruction `word` that do not depend on where the linker
+// placed the function or what it refers to. `auipcRd` is the destination of
+// the previous instruction if that was an auipc, else -1; the low 12 bits
+// that pair with it are cleared along with the jal and auipc immediates.
+static uint32_t stableBits(uint32_t word, int &auipcRd) {
+  int paired = auipcRd;
+  auipcRd = -1;
+  int rd = static_cast<int>((word >> 7) & 0x1f);
+  int rs1 = static_cast<int>((word >> 15) & 0x1f);
+  switch (word & 0x7f) {
+  case 0x17: // auipc
+    auipcRd = rd;
+    return word & 0xfff;
+  case 0x6f: // jal
+    return word & 0xfff;
+  case 0x03: // loads
+  case 0x13: // addi
+  case 0x67: // jalr
+    return rs1 == paired ? word & 0xfffff : word;
+  case 0x23: // stores
+    return rs1 == paired ? word & 0x01fff07f : word;
+  default:
+    return word;
+  }
+}
+
+uint64_t fingerprint(const ELFImage &image, const FunctionSymbol &fn) {
+  if (fn.size == 0)
+    return 0;
+  std::vector<unsigned char> bytes(fn.size);
+  if (!image.read(fn.addr, bytes.data(), bytes.size()))
+    return 0;
+  int auipcRd = -1;
+  for (size_t i = 0; i + 4 <= bytes.size(); i += 4) {
+    uint32_t word = static_cast<uint32_t>(bytes[i]) |
+                    (static_cast<uint32_t>(bytes[i + 1]) << 8) |
+                    (static_cast<uint32_t>(bytes[i + 2]) << 16) |
+                    (static_cast<uint32_t>(bytes[i + 3]) << 24);
+    word = stableBits(word, auipcRd);
+    for (int b = 0; b < 4; ++b)
+      bytes[i + b] = static_cast<unsigned char>(word >> (8 * b));
+  }
+  // 64-bit FNV-1a
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (auto b : bytes) {
+    h ^= b;
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+bool HLETable::load(const std::filesystem::path &path, std::string &err) {
+  std::ifstream is(path);
+  if (!is) {
+    err = "failed to open HLE table: " + path.string();
+    return false;
+  }
+  std::string line;
+  unsigned lineNo = 0;
+  while (std::getline(is, line)) {
+    ++lineNo;
+    line = line.substr(0, line.find('#'));
+    std::istringstream ls(line);
+    std::string symbol, hash;
+    if (!(ls >> symbol))
+      continue;
+    auto where = path.string() + ":" + std::to_string(lineNo) + ": ";
+    if (!(ls >> hash)) {
+      err = where + "missing fingerprint for '" + symbol + "'";
+      return false;
+    }
+    try {
+      add(symbol, std::stoull(hash, nullptr, 0));
+    } catch (const std::exception &) {
+      err = where + "bad fingerprint '" + hash + "'";
+      return false;
+    }
+  }
+  return true;
+}
+
+void HLETable::add(const std::string &symbol, uint64_t hash) {
+  known[symbol].push_back(hash);
+}
+
+std::vector<HLEMatch> HLETable::match(const ELFImage &image) const {
+  std::vector<HLEMatch> out;
+  for (const auto &fn : image.functionSymbols()) {
+    auto it = known.find(fn.name);
+    if (it == known.end())
+      continue;
+    const auto &routines = hleRoutines();
+    auto r = std::find_if(
+        routines.begin(), routines.end(),
+        [&](const HLERoutine &r) { return fn.name == r.symbol; });
+    if (r == routines.end())
+      continue;
+    uint64_t h = fingerprint(image, fn);
+    if (h == 0 || std::find(it->second.begin(), it->second.end(), h) ==
+                      it->second.end())
+      continue;
+    // Aliases of one function match once.
+    if (!out.empty() && out.back().addr == fn.addr)
+      continue;
+    out.push_back({fn.addr, fn.size, &*r});
+  }
+  return out;
+}
+
+} // namespace riscy
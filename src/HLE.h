@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ELFImage.h"
+
+namespace riscy {
+
+// A guest library function with a host implementation in the runtime. The
+// thunk takes the guest state, reads its arguments from a0-a2 and writes the
+// result to a0 (see runtime.h).
+struct HLERoutine {
+  const char *symbol; // guest symbol name
+  const char *thunk;  // runtime entry point, without the assembler prefix
+};
+
+// The routines the runtime implements.
+const std::vector<HLERoutine> &hleRoutines();
+
+// Hash of a function's instruction bytes. The immediates of jal and auipc and
+// the low 12 bits an auipc pairs with are masked out, since they change when
+// the function or its callees move; so the same library build hashes the
+// same wherever the linker placed it. 0 if the function has no size or lies
+// outside the image.
+uint64_t fingerprint(const ELFImage &image, const FunctionSymbol &fn);
+
+// A guest function to replace by a thunk into the runtime.
+struct HLEMatch {
+  uint64_t addr = 0;
+  uint64_t size = 0;
+  const HLERoutine *routine = nullptr;
+};
+
+// Verified fingerprints of guest library functions, read from a table of
+// `<symbol> 0x<fingerprint>` lines ('#' starts a comment). A symbol may list
+// several fingerprints, one per known library build. A function is emulated
+// only if its symbol names a routine and its fingerprint is in the table, so
+// a same-named function with other semantics keeps being translated.
+class HLETable {
+public:
+  bool load(const std::filesystem::path &path, std::string &err);
+  void add(const std::string &symbol, uint64_t hash);
+
+  // The matching function symbols of `image`, in address order.
+  std::vector<HLEMatch> match(const ELFImage &image) const;
+
+private:
+  std::unordered_map<std::string, std::vector<uint64_t>> known;
+};
+
+} // namespace riscy
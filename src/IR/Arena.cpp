@@ -0,0 +1,39 @@
+#include "IR/Arena.h"
+
+#include <algorithm>
+
+namespace riscy::ir {
+
+static std::byte *alignUp(std::byte *p, size_t align) {
+  auto v = reinterpret_cast<uintptr_t>(p);
+  return reinterpret_cast<std::byte *>((v + align - 1) & ~(align - 1));
+}
+
+void *Arena::allocate(size_t bytes, size_t align) {
+  std::byte *p = cur ? alignUp(cur, align) : nullptr;
+  if (!p || p + bytes > end) {
+    // Chunks grow geometrically; oversized requests get a chunk of their own.
+    size_t size = std::max(nextChunk, bytes + align);
+    nextChunk = std::min(nextChunk * 2, kMaxChunk);
+    chunks.emplace_back(new std::byte[size]);
+    reserved += size;
+    cur = chunks.back().get();
+    end = cur + size;
+    p = alignUp(cur, align);
+  }
+  cur = p + bytes;
+  last = p;
+  used += bytes;
+  return p;
+}
+
+bool Arena::tryExtend(void *ptr, size_t oldBytes, size_t newBytes) {
+  auto *p = static_cast<std::byte *>(ptr);
+  if (p != last || p + oldBytes != cur || p + newBytes > end)
+    return false;
+  cur = p + newBytes;
+  used += newBytes - oldBytes;
+  return true;
+}
+
+} // namespace riscy::ir
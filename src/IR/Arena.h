@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace riscy::ir {
+
+// Bump allocator for IR storage. Memory is carved out of chunks that are
+// only released, all at once, when the arena is destroyed, so it may only
+// hold trivially destructible objects.
+class Arena {
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void *allocate(size_t bytes, size_t align);
+  // Grows the most recent allocation in place if the current chunk has
+  // room; returns false otherwise.
+  bool tryExtend(void *ptr, size_t oldBytes, size_t newBytes);
+
+  template <typename T> T *allocateArray(size_t n) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena memory is released without running destructors");
+    return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+  }
+
+  // Bytes handed out so far and bytes reserved from the system.
+  size_t bytesAllocated() const { return used; }
+  size_t bytesReserved() const { return reserved; }
+
+private:
+  static constexpr size_t kMinChunk = 4096;
+  static constexpr size_t kMaxChunk = 1 << 20;
+
+  std::vector<std::unique_ptr<std::byte[]>> chunks;
+  std::byte *cur = nullptr;
+  std::byte *end = nullptr;
+  std::byte *last = nullptr; // start of the most recent allocation
+  size_t nextChunk = kMinChunk;
+  size_t used = 0;
+  size_t reserved = 0;
+};
+
+// Fixed-length array whose elements live in an Arena. Copies alias the same
+// elements.
+template <typename T> class Span {
+public:
+  Span() = default;
+  Span(T *data, uint32_t size) : ptr(data), n(size) {}
+
+  // Copies `elems` into `arena`.
+  static Span copy(Arena &arena, const std::vector<T> &elems) {
+    if (elems.empty())
+      return {};
+    T *data = arena.allocateArray<T>(elems.size());
+    std::uninitialized_copy(elems.begin(), elems.end(), data);
+    return {data, static_cast<uint32_t>(elems.size())};
+  }
+
+  T *begin() const { return ptr; }
+  T *end() const { return ptr + n; }
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  T &operator[](size_t i) const { return ptr[i]; }
+
+private:
+  T *ptr = nullptr;
+  uint32_t n = 0;
+};
+
+} // namespace riscy::ir
@@ -0,0 +1,125 @@
+#include "IR/DefUse.h"
+
+namespace riscy::ir {
+
+DefUse::DefUse(Function &fn) : fn(fn) {
+  defs.resize(fn.numValues);
+  useLists.resize(fn.numValues);
+  auto grow = [&](ValueId v) {
+    if (v >= defs.size()) {
+      defs.resize(v + 1);
+      useLists.resize(v + 1);
+    }
+  };
+  for (auto &bb : fn.blocks) {
+    for (uint32_t i = 0; i < bb.insts.size(); ++i) {
+      auto &I = bb.insts[i];
+      if (I.dest) {
+        grow(*I.dest);
+        defs[*I.dest] = InstrRef{bb.id, i};
+      }
+      forEachUse(I, [&](ValueId &v) {
+        grow(v);
+        useLists[v].push_back({bb.id, i});
+      });
+    }
+    auto term = static_cast<uint32_t>(bb.insts.size());
+    forEachUse(bb.term, [&](ValueId &v) {
+      grow(v);
+      useLists[v].push_back({bb.id, term});
+    });
+  }
+}
+
+Instr *DefUse::def(ValueId v) const {
+  auto site = defSite(v);
+  if (!site)
+    return nullptr;
+  return &fn.blocks[site->block].insts[site->index];
+}
+
+std::optional<InstrRef> DefUse::defSite(ValueId v) const {
+  if (v >= defs.size())
+    return std::nullopt;
+  return defs[v];
+}
+
+const std::vector<InstrRef> &DefUse::uses(ValueId v) const {
+  static const std::vector<InstrRef> none;
+  return v < useLists.size() ? useLists[v] : none;
+}
+
+Type DefUse::typeOf(ValueId v) const {
+  const Instr *I = def(v);
+  if (!I)
+    return Type::i64();
+  return resultType(*I);
+}
+
+std::optional<uint64_t> DefUse::constant(ValueId v) const {
+  const Instr *I = def(v);
+  if (!I)
+    return std::nullopt;
+  if (auto *c = std::get_if<Const>(&I->payload))
+    return truncTo(c->ty, c->value);
+  if (auto *g = std::get_if<GetPC>(&I->payload))
+    return g->pc;
+  return std::nullopt;
+}
+
+void DefUse::replaceAllUsesWith(ValueId from, ValueId to) {
+  if (from == to)
+    return;
+  auto rewrite = [&](ValueId &v) {
+    if (v == from)
+      v = to;
+  };
+  std::vector<InstrRef> moved = std::move(useLists[from]);
+  useLists[from].clear();
+  for (const auto &use : moved) {
+    auto &bb = fn.blocks[use.block];
+    if (use.index == bb.insts.size())
+      forEachUse(bb.term, rewrite);
+    else
+      forEachUse(bb.insts[use.index], rewrite);
+  }
+  if (to >= useLists.size()) {
+    defs.resize(to + 1);
+    useLists.resize(to + 1);
+  }
+  useLists[to].insert(useLists[to].end(), moved.begin(), moved.end());
+}
+
+unsigned bitWidth(Type ty) {
+  switch (ty.kind) {
+  case TypeKind::I1:
+    return 1;
+  case TypeKind::I8:
+    return 8;
+  case TypeKind::I16:
+    return 16;
+  case TypeKind::I32:
+    return 32;
+  case TypeKind::I64:
+    return 64;
+  case TypeKind::V128:
+    return 128;
+  }
+  return 64;
+}
+
+uint64_t truncTo(Type ty, uint64_t v) {
+  unsigned w = bitWidth(ty);
+  return w >= 64 ? v : v & ((uint64_t{1} << w) - 1);
+}
+
+int64_t sextFrom(Type ty, uint64_t v) {
+  unsigned w = bitWidth(ty);
+  if (w >= 64)
+    return static_cast<int64_t>(v);
+  uint64_t sign = uint64_t{1} << (w - 1);
+  v = truncTo(ty, v);
+  return static_cast<int64_t>((v ^ sign) - sign);
+}
+
+} // namespace riscy::ir
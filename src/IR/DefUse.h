@@ -0,0 +1,49 @@
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "IR/IR.h"
+
+namespace riscy::ir {
+
+// Position of an instruction in a function. `index == insts.size()` denotes
+// the block's terminator.
+struct InstrRef {
+  BlockId block = 0;
+  uint32_t index = 0;
+};
+
+// Def-use chains of a function: where each value is defined and every place
+// it is used. Built from scratch and kept up to date by replaceAllUsesWith();
+// passes that insert or erase instructions rebuild it afterwards.
+class DefUse {
+public:
+  explicit DefUse(Function &fn);
+
+  // Defining instruction of `v`, or null if it is not defined in `fn`.
+  Instr *def(ValueId v) const;
+  std::optional<InstrRef> defSite(ValueId v) const;
+  const std::vector<InstrRef> &uses(ValueId v) const;
+  bool hasUses(ValueId v) const { return !uses(v).empty(); }
+  Type typeOf(ValueId v) const;
+  // Value of `v` if it is known at translation time (Const or GetPC).
+  std::optional<uint64_t> constant(ValueId v) const;
+
+  // Rewrites every use of `from` to use `to` instead.
+  void replaceAllUsesWith(ValueId from, ValueId to);
+
+private:
+  Function &fn;
+  std::vector<std::optional<InstrRef>> defs;
+  std::vector<std::vector<InstrRef>> useLists;
+};
+
+// Number of bits of a type.
+unsigned bitWidth(Type ty);
+// `v` truncated to the width of `ty`.
+uint64_t truncTo(Type ty, uint64_t v);
+// `v`, truncated to the width of `ty`, sign-extended to 64 bits.
+int64_t sextFrom(Type ty, uint64_t v);
+
+} // namespace riscy::ir
@@ -0,0 +1,105 @@
+#include "IR/Dominators.h"
+
+#include <functional>
+
+namespace riscy::ir {
+
+std::vector<BlockId> successors(const Block &bb) {
+  if (bb.term.kind == TermKind::Goto)
+    return {std::get<TermGoto>(bb.term.data).target};
+  if (bb.term.kind == TermKind::CondGoto) {
+    const auto &cg = std::get<TermCondGoto>(bb.term.data);
+    if (cg.t == cg.f)
+      return {cg.t};
+    return {cg.t, cg.f};
+  }
+  return {};
+}
+
+DominatorTree::DominatorTree(const Function &fn) {
+  size_t n = fn.blocks.size();
+  idom.assign(n, kNone);
+  kids.resize(n);
+
+  // Postorder from the virtual root. Blocks in cycles nobody enters are
+  // treated as further entries so that every block gets a tree position.
+  std::vector<BlockId> postorder;
+  std::vector<bool> visited(n, false);
+  std::function<void(BlockId)> dfs = [&](BlockId b) {
+    visited[b] = true;
+    for (BlockId s : successors(fn.blocks[b]))
+      if (!visited[s])
+        dfs(s);
+    postorder.push_back(b);
+  };
+  std::vector<BlockId> entries;
+  for (const auto &bb : fn.blocks)
+    if (bb.preds.empty()) {
+      entries.push_back(bb.id);
+      dfs(bb.id);
+    }
+  for (const auto &bb : fn.blocks)
+    if (!visited[bb.id]) {
+      entries.push_back(bb.id);
+      dfs(bb.id);
+    }
+
+  // The virtual root takes postorder number n; entries are its children.
+  std::vector<size_t> order(n + 1, 0);
+  for (size_t i = 0; i < postorder.size(); ++i)
+    order[postorder[i]] = i;
+  order[n] = n;
+  std::vector<BlockId> dom(n + 1, kNone);
+  const BlockId root = static_cast<BlockId>(n);
+  dom[root] = root;
+  for (BlockId e : entries)
+    dom[e] = root;
+
+  auto intersect = [&](BlockId a, BlockId b) {
+    while (a != b) {
+      while (order[a] < order[b])
+        a = dom[a];
+      while (order[b] < order[a])
+        b = dom[b];
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+      BlockId b = *it;
+      if (dom[b] == root)
+        continue;
+      BlockId newIdom = kNone;
+      for (BlockId p : fn.blocks[b].preds) {
+        if (dom[p] == kNone)
+          continue;
+        newIdom = newIdom == kNone ? p : intersect(p, newIdom);
+      }
+      if (newIdom != kNone && dom[b] != newIdom) {
+        dom[b] = newIdom;
+        changed = true;
+      }
+    }
+  }
+
+  for (auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+    BlockId b = *it;
+    if (dom[b] == root) {
+      rootBlocks.push_back(b);
+    } else {
+      idom[b] = dom[b];
+      kids[dom[b]].push_back(b);
+    }
+  }
+}
+
+bool DominatorTree::dominates(BlockId a, BlockId b) const {
+  for (; b != kNone; b = idom[b])
+    if (a == b)
+      return true;
+  return false;
+}
+
+} // namespace riscy::ir
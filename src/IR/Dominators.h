@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+
+#include "IR/IR.h"
+
+namespace riscy::ir {
+
+// Successors of a block within its function (Goto/CondGoto targets).
+std::vector<BlockId> successors(const Block &bb);
+
+// Dominator tree of an ir::Function (Cooper, Harvey and Kennedy, "A Simple,
+// Fast Dominance Algorithm"). A function may be entered through any of its
+// external blocks, so every block without predecessors hangs off a virtual
+// root; these blocks have no immediate dominator.
+class DominatorTree {
+public:
+  explicit DominatorTree(const Function &fn);
+
+  bool isRoot(BlockId b) const { return idom[b] == kNone; }
+  BlockId immediateDominator(BlockId b) const { return idom[b]; }
+  const std::vector<BlockId> &children(BlockId b) const { return kids[b]; }
+  // Blocks without an immediate dominator, in reverse postorder.
+  const std::vector<BlockId> &roots() const { return rootBlocks; }
+  bool dominates(BlockId a, BlockId b) const;
+
+  static constexpr BlockId kNone = ~BlockId{0};
+
+private:
+  std::vector<BlockId> idom;
+  std::vector<std::vector<BlockId>> kids;
+  std::vector<BlockId> rootBlocks;
+};
+
+} // namespace riscy::ir
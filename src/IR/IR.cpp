@@ -1,9 +1,179 @@
 #include "IR/IR.h"
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <sstream>
 
 namespace riscy::ir {
 
+InstrList::InstrList(const InstrList &other) : owner(other.owner) {
+  reserve(other.n);
+  std::copy(other.begin(), other.end(), data);
+  n = other.n;
+}
+
+InstrList::InstrList(InstrList &&other) noexcept
+    : owner(std::move(other.owner)), data(other.data), n(other.n),
+      cap(other.cap) {
+  other.data = nullptr;
+  other.n = other.cap = 0;
+}
+
+InstrList &InstrList::operator=(const InstrList &other) {
+  if (this != &other) {
+    InstrList copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+InstrList &InstrList::operator=(InstrList &&other) noexcept {
+  owner = std::move(other.owner);
+  data = other.data;
+  n = other.n;
+  cap = other.cap;
+  other.data = nullptr;
+  other.n = other.cap = 0;
+  return *this;
+}
+
+Arena &InstrList::arena() {
+  if (!owner)
+    owner = std::make_shared<Arena>();
+  return *owner;
+}
+
+void InstrList::reserve(size_t capacity) {
+  if (capacity <= cap)
+    return;
+  Arena &a = arena();
+  if (data &&
+      a.tryExtend(data, cap * sizeof(Instr), capacity * sizeof(Instr))) {
+    cap = static_cast<uint32_t>(capacity);
+    return;
+  }
+  Instr *fresh = a.allocateArray<Instr>(capacity);
+  if (n)
+    std::memcpy(static_cast<void *>(fresh), data, n * sizeof(Instr));
+  data = fresh;
+  cap = static_cast<uint32_t>(capacity);
+}
+
+size_t InstrList::grow(const_iterator pos, size_t extra) {
+  size_t index = static_cast<size_t>(pos - data);
+  if (n + extra > cap)
+    reserve(std::max<size_t>({n + extra, size_t{cap} * 2, 8}));
+  return index;
+}
+
+void InstrList::push_back(const Instr &I) {
+  Instr copy = I; // `I` may live in this list
+  grow(end(), 1);
+  data[n++] = copy;
+}
+
+InstrList::iterator InstrList::insert(const_iterator pos, const Instr &I) {
+  Instr copy = I;
+  size_t index = grow(pos, 1);
+  std::memmove(static_cast<void *>(data + index + 1), data + index,
+               (n - index) * sizeof(Instr));
+  data[index] = copy;
+  ++n;
+  return data + index;
+}
+
+InstrList::iterator InstrList::insert(const_iterator pos, const Instr *first,
+                                      const Instr *last) {
+  size_t count = static_cast<size_t>(last - first);
+  if (!count)
+    return const_cast<iterator>(pos);
+  // A range taken from this list would move while making room.
+  std::vector<Instr> copy;
+  std::less<const Instr *> before;
+  if (data && !before(first, data) && before(first, data + cap)) {
+    copy.assign(first, last);
+    first = copy.data();
+    last = first + count;
+  }
+  size_t index = grow(pos, count);
+  std::memmove(static_cast<void *>(data + index + count), data + index,
+               (n - index) * sizeof(Instr));
+  std::copy(first, last, data + index);
+  n += static_cast<uint32_t>(count);
+  return data + index;
+}
+
+InstrList::iterator InstrList::erase(const_iterator first,
+                                     const_iterator last) {
+  size_t index = static_cast<size_t>(first - data);
+  size_t count = static_cast<size_t>(last - first);
+  std::memmove(static_cast<void *>(data + index), data + index + count,
+               (n - index - count) * sizeof(Instr));
+  n -= static_cast<uint32_t>(count);
+  return data + index;
+}
+
+Block &Function::addBlock(uint64_t start) {
+  Block &bb = blocks.emplace_back();
+  bb.start = start;
+  bb.id = static_cast<BlockId>(blocks.size() - 1);
+  bb.insts = InstrList(arena);
+  return bb;
+}
+
+ICmpCond inverse(ICmpCond c) {
+  switch (c) {
+  case ICmpCond::EQ:
+    return ICmpCond::NE;
+  case ICmpCond::NE:
+    return ICmpCond::EQ;
+  case ICmpCond::ULT:
+    return ICmpCond::UGE;
+  case ICmpCond::ULE:
+    return ICmpCond::UGT;
+  case ICmpCond::UGT:
+    return ICmpCond::ULE;
+  case ICmpCond::UGE:
+    return ICmpCond::ULT;
+  case ICmpCond::SLT:
+    return ICmpCond::SGE;
+  case ICmpCond::SLE:
+    return ICmpCond::SGT;
+  case ICmpCond::SGT:
+    return ICmpCond::SLE;
+  case ICmpCond::SGE:
+    return ICmpCond::SLT;
+  }
+  return c;
+}
+
+Type resultType(const Instr &I) {
+  return std::visit(
+      [](const auto &node) -> Type {
+        using T = std::decay_t<decltype(node)>;
+        if constexpr (std::is_same_v<T, Const> || std::is_same_v<T, BinOp> ||
+                      std::is_same_v<T, Select> || std::is_same_v<T, Load> ||
+                      std::is_same_v<T, Phi>)
+          return node.ty;
+        else if constexpr (std::is_same_v<T, ZExt> || std::is_same_v<T, SExt> ||
+                           std::is_same_v<T, Trunc>)
+          return node.to;
+        else if constexpr (std::is_same_v<T, ICmp>)
+          return Type::i1();
+        else if constexpr (std::is_same_v<T, Splat> ||
+                           std::is_same_v<T, VecBinOp> ||
+                           std::is_same_v<T, VecCmpEq>)
+          return Type::v128();
+        else if constexpr (std::is_same_v<T, ReduceAdd> ||
+                           std::is_same_v<T, ReduceUMax>)
+          return node.lane;
+        else
+          return Type::i64();
+      },
+      I.payload);
+}
+
 static inline const char *tyStr(TypeKind k) {
   switch (k) {
   case TypeKind::I1:
@@ -16,6 +186,8 @@ static inline const char *tyStr(TypeKind k) {
     return "i32";
   case TypeKind::I64:
     return "i64";
+  case TypeKind::V128:
+    return "v128";
   }
   return "i64";
 }
@@ -68,12 +240,9 @@ static inline const char *icmpStr(ICmpCond c) {
   return "icmp";
 }
 
-std::string toString(const Block &bb) {
-  std::ostringstream os;
-  os << "block @0x" << std::hex << bb.start << std::dec << "\n";
+static void printInsts(std::ostream &os, const InstrList &insts) {
   auto printValue = [&](ValueId v) { os << "%" << v; };
-
-  for (const auto &ins : bb.insts) {
+  for (const auto &ins : insts) {
     if (ins.dest)
       os << "%" << *ins.dest << " = ";
     std::visit(
@@ -96,6 +265,13 @@ std::string toString(const Block &bb) {
             printValue(node.lhs);
             os << ", ";
             printValue(node.rhs);
+          } else if constexpr (std::is_same_v<T, Select>) {
+            os << "select " << tyStr(node.ty.kind) << " ";
+            printValue(node.cond);
+            os << ", ";
+            printValue(node.t);
+            os << ", ";
+            printValue(node.f);
           } else if constexpr (std::is_same_v<T, ZExt>) {
             os << "zext ";
             printValue(node.src);
@@ -119,15 +295,53 @@ std::string toString(const Block &bb) {
             printValue(node.base);
             os << ", off=" << node.offset;
           } else if constexpr (std::is_same_v<T, GetPC>) {
-            os << "get_pc";
+            os << "get_pc @0x" << std::hex << node.pc << std::dec;
+          } else if constexpr (std::is_same_v<T, ExitIf>) {
+            os << "exit_if ";
+            printValue(node.cond);
+            os << ", @0x" << std::hex << node.target << std::dec;
+            for (const auto &w : node.writebacks) {
+              os << ", x" << unsigned(w.reg) << "=";
+              printValue(w.value);
+            }
+          } else if constexpr (std::is_same_v<T, Splat>) {
+            os << "splat " << tyStr(node.lane.kind) << " ";
+            printValue(node.src);
+          } else if constexpr (std::is_same_v<T, VecBinOp>) {
+            os << "v" << binopStr(node.kind) << " " << tyStr(node.lane.kind)
+               << " ";
+            printValue(node.lhs);
+            os << ", ";
+            printValue(node.rhs);
+          } else if constexpr (std::is_same_v<T, VecCmpEq>) {
+            os << "vcmpeq " << tyStr(node.lane.kind) << " ";
+            printValue(node.lhs);
+            os << ", ";
+            printValue(node.rhs);
+          } else if constexpr (std::is_same_v<T, ReduceAdd>) {
+            os << "reduce_add " << tyStr(node.lane.kind) << " ";
+            printValue(node.src);
+          } else if constexpr (std::is_same_v<T, ReduceUMax>) {
+            os << "reduce_umax " << tyStr(node.lane.kind) << " ";
+            printValue(node.src);
+          } else if constexpr (std::is_same_v<T, Phi>) {
+            os << "phi " << tyStr(node.ty.kind);
+            for (size_t i = 0; i < node.incoming.size(); ++i) {
+              os << (i ? ", [bb" : " [bb") << node.incoming[i].first << ": ";
+              printValue(node.incoming[i].second);
+              os << "]";
+            }
           }
         },
         ins.payload);
     os << "\n";
   }
+}
 
+static void printTerm(std::ostream &os, const Terminator &term) {
+  auto printValue = [&](ValueId v) { os << "%" << v; };
   os << "  term ";
-  switch (bb.term.kind) {
+  switch (term.kind) {
   case TermKind::None:
     os << "none";
     break;
@@ -138,26 +352,76 @@ std::string toString(const Block &bb) {
     os << "ret";
     break;
   case TermKind::Br: {
-    const auto &t = std::get<TermBr>(bb.term.data);
+    const auto &t = std::get<TermBr>(term.data);
     os << "br @0x" << std::hex << t.target << std::dec;
     break;
   }
   case TermKind::CBr: {
-    const auto &t = std::get<TermCBr>(bb.term.data);
+    const auto &t = std::get<TermCBr>(term.data);
     os << "cbr ";
     printValue(t.cond);
     os << ", @0x" << std::hex << t.t << ", @0x" << t.f << std::dec;
     break;
   }
   case TermKind::BrIndirect: {
-    const auto &t = std::get<TermBrIndirect>(bb.term.data);
+    const auto &t = std::get<TermBrIndirect>(term.data);
     os << "br_indirect ";
     printValue(t.target);
     break;
   }
+  case TermKind::Call: {
+    const auto &t = std::get<TermCall>(term.data);
+    os << "call @0x" << std::hex << t.target << ", ret @0x" << t.ret
+       << std::dec;
+    break;
+  }
+  case TermKind::CallIndirect: {
+    const auto &t = std::get<TermCallIndirect>(term.data);
+    os << "call_indirect ";
+    printValue(t.target);
+    os << ", ret @0x" << std::hex << t.ret << std::dec;
+    break;
+  }
+  case TermKind::Goto: {
+    const auto &t = std::get<TermGoto>(term.data);
+    os << "goto bb" << t.target;
+    break;
+  }
+  case TermKind::CondGoto: {
+    const auto &t = std::get<TermCondGoto>(term.data);
+    os << "condgoto ";
+    printValue(t.cond);
+    os << ", bb" << t.t << ", bb" << t.f;
+    break;
+  }
   }
   os << "\n";
+}
+
+std::string toString(const Block &bb) {
+  std::ostringstream os;
+  os << "block @0x" << std::hex << bb.start << std::dec << "\n";
+  printInsts(os, bb.insts);
+  printTerm(os, bb.term);
+  return os.str();
+}
 
+std::string toString(const Function &fn) {
+  std::ostringstream os;
+  os << "function @0x" << std::hex << fn.entry << std::dec << "\n";
+  for (const auto &bb : fn.blocks) {
+    os << "bb" << bb.id << " @0x" << std::hex << bb.start << std::dec;
+    if (bb.external)
+      os << " external";
+    if (!bb.preds.empty()) {
+      os << " preds:";
+      for (auto p : bb.preds)
+        os << " bb" << p;
+    }
+    os << "\n";
+    printInsts(os, bb.insts);
+    printTerm(os, bb.term);
+  }
   return os.str();
 }
 
@@ -1,10 +1,21 @@
 #pragma once
 
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
 
+#include "IR/Arena.h"
+
 namespace riscy::ir {
 
-enum class TypeKind { I1, I8, I16, I32, I64 };
+// V128 is a 128-bit vector; the operations on it say how many lanes it has.
+enum class TypeKind { I1, I8, I16, I32, I64, V128 };
 
 struct Type {
   TypeKind kind = TypeKind::I64;
@@ -13,9 +24,11 @@ struct Type {
   static inline Type i16() { return {TypeKind::I16}; }
   static inline Type i32() { return {TypeKind::I32}; }
   static inline Type i64() { return {TypeKind::I64}; }
+  static inline Type v128() { return {TypeKind::V128}; }
 };
 
-using ValueId = uint32_t; // virtual register id local to a block
+using ValueId = uint32_t; // virtual register id local to a block or function
+using BlockId = uint32_t; // index of a block within an ir::Function
 
 struct Const {
   Type ty{};
@@ -68,6 +81,14 @@ struct ICmp {
   ValueId rhs = 0;
 };
 
+// `cond` (i1) ? t : f, without a branch.
+struct Select {
+  ValueId cond = 0;
+  ValueId t = 0;
+  ValueId f = 0;
+  Type ty{};
+};
+
 struct ZExt {
   ValueId src = 0;
   Type to{};
@@ -97,16 +118,135 @@ struct Store {
   Type ty{}; // size of store source
 };
 
-struct GetPC {};
+struct GetPC {
+  uint64_t pc = 0; // guest PC of the instruction reading it
+};
+
+// Side exit from a trace: leave to `target` when `cond` (i1) is true,
+// storing `writebacks` on the way out only.
+struct ExitIf {
+  ValueId cond = 0;
+  uint64_t target = 0;
+  Span<WriteReg> writebacks; // in the arena of the block's unit
+};
+
+// A v128 with `src` truncated to `lane` in every lane.
+struct Splat {
+  ValueId src = 0;
+  Type lane{};
+};
+
+// A lane-wise Add, Sub, And, Or or Xor of two v128 values.
+struct VecBinOp {
+  BinOpKind kind{};
+  ValueId lhs = 0;
+  ValueId rhs = 0;
+  Type lane{};
+};
+
+// A v128 with every bit of a lane set where the lanes of `lhs` and `rhs`
+// are equal and clear elsewhere.
+struct VecCmpEq {
+  ValueId lhs = 0;
+  ValueId rhs = 0;
+  Type lane{};
+};
+
+// The sum of the lanes of a v128, as a `lane` value.
+struct ReduceAdd {
+  ValueId src = 0;
+  Type lane{};
+};
+
+// The largest lane of a v128 read as unsigned, as a `lane` value. Lanes are
+// at most 32 bits wide.
+struct ReduceUMax {
+  ValueId src = 0;
+  Type lane{};
+};
+
+// Merges one value per predecessor at the top of a function block.
+struct Phi {
+  Type ty{};
+  Span<std::pair<BlockId, ValueId>> incoming; // in the function's arena
+};
 
 // Generic instruction payloads. dest is optional; non-producing ops
-// (WriteReg/Store) don't define a dest.
+// (WriteReg/Store) don't define a dest. Instructions are fixed-size records
+// with no storage of their own, so blocks keep them in flat arena arrays.
 struct Instr {
   std::optional<ValueId> dest{};
-  std::variant<Const, ReadReg, WriteReg, BinOp, ICmp, ZExt, SExt, Trunc, Load,
-               Store, GetPC>
+  std::variant<Const, ReadReg, WriteReg, BinOp, ICmp, Select, ZExt, SExt,
+               Trunc, Load, Store, GetPC, ExitIf, Splat, VecBinOp, VecCmpEq,
+               ReduceAdd, ReduceUMax, Phi>
       payload{};
 };
+static_assert(std::is_trivially_copyable_v<Instr> &&
+                  std::is_trivially_destructible_v<Instr>,
+              "Instr must stay a plain record to live in an Arena");
+
+// The instructions of a block: a growable array in an Arena shared with the
+// other blocks of the unit. Growing moves the array within the arena; the
+// space it leaves behind is reclaimed with the arena. A list without an
+// arena creates its own on first use.
+class InstrList {
+public:
+  using iterator = Instr *;
+  using const_iterator = const Instr *;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  InstrList() = default;
+  explicit InstrList(std::shared_ptr<Arena> arena)
+      : owner(std::move(arena)) {}
+  InstrList(const InstrList &other);
+  InstrList(InstrList &&other) noexcept;
+  InstrList &operator=(const InstrList &other);
+  InstrList &operator=(InstrList &&other) noexcept;
+
+  Arena &arena();
+  const std::shared_ptr<Arena> &arenaPtr() const { return owner; }
+
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  void reserve(size_t capacity);
+  void clear() { n = 0; }
+
+  Instr &operator[](size_t i) { return data[i]; }
+  const Instr &operator[](size_t i) const { return data[i]; }
+  Instr &front() { return data[0]; }
+  const Instr &front() const { return data[0]; }
+  Instr &back() { return data[n - 1]; }
+  const Instr &back() const { return data[n - 1]; }
+
+  iterator begin() { return data; }
+  iterator end() { return data + n; }
+  const_iterator begin() const { return data; }
+  const_iterator end() const { return data + n; }
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+
+  void push_back(const Instr &I);
+  iterator insert(const_iterator pos, const Instr &I);
+  iterator insert(const_iterator pos, const Instr *first, const Instr *last);
+  iterator erase(const_iterator pos) { return erase(pos, pos + 1); }
+  iterator erase(const_iterator first, const_iterator last);
+
+private:
+  // Makes room for `extra` more instructions; returns the index of `pos`.
+  size_t grow(const_iterator pos, size_t extra);
+
+  std::shared_ptr<Arena> owner;
+  Instr *data = nullptr;
+  uint32_t n = 0;
+  uint32_t cap = 0;
+};
 
 enum class TermKind {
   None,
@@ -115,6 +255,10 @@ enum class TermKind {
   BrIndirect, // indirect jump by value
   Ret,        // return to caller
   Trap,       // ecall/ebreak or invalid
+  Call,       // direct call; execution resumes at the return site
+  CallIndirect, // call by value; execution resumes at the return site
+  Goto,         // edge to another block of the same ir::Function
+  CondGoto,     // conditional edge within the same ir::Function
 };
 
 struct TermBr {
@@ -131,18 +275,131 @@ struct TermBrIndirect {
   ValueId target = 0; // i64 target PC
 };
 
+struct TermCall {
+  uint64_t target = 0; // callee entry PC
+  uint64_t ret = 0;    // return continuation PC
+};
+
+struct TermCallIndirect {
+  ValueId target = 0; // i64 callee PC
+  uint64_t ret = 0;   // return continuation PC
+};
+
+struct TermGoto {
+  BlockId target = 0;
+};
+
+struct TermCondGoto {
+  ValueId cond = 0; // i1
+  BlockId t = 0;
+  BlockId f = 0;
+};
+
 struct Terminator {
   TermKind kind = TermKind::None;
-  std::variant<std::monostate, TermBr, TermCBr, TermBrIndirect> data{};
+  std::variant<std::monostate, TermBr, TermCBr, TermBrIndirect, TermCall,
+               TermCallIndirect, TermGoto, TermCondGoto>
+      data{};
 };
 
 struct Block {
   uint64_t start = 0;
-  std::vector<Instr> insts;
+  InstrList insts;
   Terminator term;
+
+  // Only meaningful for blocks of an ir::Function.
+  BlockId id = 0;
+  std::vector<BlockId> preds;
+  // Entered by guest address with guest registers in RiscyGuestState, rather
+  // than through a Goto/CondGoto from another block of the function.
+  bool external = false;
 };
 
+// A guest function in SSA form. Guest registers are read from
+// RiscyGuestState in external blocks only and flow between blocks as SSA
+// values; they are written back before control leaves the function.
+// Blocks are indexed by BlockId and ValueIds are unique across the function.
+// The instructions of all blocks live in `arena` and are freed with it.
+struct Function {
+  uint64_t entry = 0;
+  std::vector<Block> blocks;
+  ValueId numValues = 0;
+  std::shared_ptr<Arena> arena = std::make_shared<Arena>();
+
+  // Appends an empty block that allocates from `arena`.
+  Block &addBlock(uint64_t start);
+};
+
+// The type of the value `I` defines. Guest registers and PCs are i64.
+Type resultType(const Instr &I);
+// The condition that holds exactly when `c` does not.
+ICmpCond inverse(ICmpCond c);
+
+// Calls `f` on every value operand of an instruction or terminator.
+template <typename F> void forEachUse(Instr &I, F &&f);
+template <typename F> void forEachUse(Terminator &T, F &&f);
+
 // A simple printer for tests/debug
 std::string toString(const Block &bb);
+std::string toString(const Function &fn);
+
+template <typename F> void forEachUse(Instr &I, F &&f) {
+  std::visit(
+      [&](auto &node) {
+        using T = std::decay_t<decltype(node)>;
+        if constexpr (std::is_same_v<T, WriteReg>) {
+          f(node.value);
+        } else if constexpr (std::is_same_v<T, BinOp> ||
+                             std::is_same_v<T, ICmp> ||
+                             std::is_same_v<T, VecBinOp> ||
+                             std::is_same_v<T, VecCmpEq>) {
+          f(node.lhs);
+          f(node.rhs);
+        } else if constexpr (std::is_same_v<T, Select>) {
+          f(node.cond);
+          f(node.t);
+          f(node.f);
+        } else if constexpr (std::is_same_v<T, ZExt> ||
+                             std::is_same_v<T, SExt> ||
+                             std::is_same_v<T, Trunc> ||
+                             std::is_same_v<T, Splat> ||
+                             std::is_same_v<T, ReduceAdd> ||
+                             std::is_same_v<T, ReduceUMax>) {
+          f(node.src);
+        } else if constexpr (std::is_same_v<T, Load>) {
+          f(node.base);
+        } else if constexpr (std::is_same_v<T, Store>) {
+          f(node.value);
+          f(node.base);
+        } else if constexpr (std::is_same_v<T, ExitIf>) {
+          f(node.cond);
+          for (auto &w : node.writebacks)
+            f(w.value);
+        } else if constexpr (std::is_same_v<T, Phi>) {
+          for (auto &in : node.incoming)
+            f(in.second);
+        }
+      },
+      I.payload);
+}
+
+template <typename F> void forEachUse(Terminator &T, F &&f) {
+  switch (T.kind) {
+  case TermKind::CBr:
+    f(std::get<TermCBr>(T.data).cond);
+    break;
+  case TermKind::BrIndirect:
+    f(std::get<TermBrIndirect>(T.data).target);
+    break;
+  case TermKind::CallIndirect:
+    f(std::get<TermCallIndirect>(T.data).target);
+    break;
+  case TermKind::CondGoto:
+    f(std::get<TermCondGoto>(T.data).cond);
+    break;
+  default:
+    break;
+  }
+}
 
 } // namespace riscy::ir
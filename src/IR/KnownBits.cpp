@@ -0,0 +1,265 @@
+#include "IR/KnownBits.h"
+
+#include <algorithm>
+
+#include "IR/DefUse.h"
+
+namespace riscy::ir {
+
+static uint64_t maskOf(Type ty) { return truncTo(ty, ~uint64_t{0}); }
+
+static uint64_t signBit(Type ty) { return uint64_t{1} << (bitWidth(ty) - 1); }
+
+bool KnownBits::isConstant(Type ty) const {
+  return ((zero | one) & maskOf(ty)) == maskOf(ty);
+}
+
+uint64_t KnownBits::umax(Type ty) const { return ~zero & maskOf(ty); }
+
+int64_t KnownBits::smin(Type ty) const {
+  // Set the sign bit unless it is known zero; clear every other unknown bit.
+  uint64_t v = one;
+  if (!(zero & signBit(ty)))
+    v |= signBit(ty);
+  return sextFrom(ty, v);
+}
+
+int64_t KnownBits::smax(Type ty) const {
+  uint64_t v = ~zero & maskOf(ty);
+  if (!(one & signBit(ty)))
+    v &= ~signBit(ty);
+  return sextFrom(ty, v);
+}
+
+std::optional<bool> knownICmp(ICmpCond cond, const KnownBits &a,
+                              const KnownBits &b, Type ty) {
+  bool differ = (a.one & b.zero) || (a.zero & b.one);
+  bool same = a.isConstant(ty) && b.isConstant(ty) && a.one == b.one;
+  auto decide = [](bool yes, bool no) -> std::optional<bool> {
+    if (yes)
+      return true;
+    if (no)
+      return false;
+    return std::nullopt;
+  };
+  switch (cond) {
+  case ICmpCond::EQ:
+    return decide(same, differ);
+  case ICmpCond::NE:
+    return decide(differ, same);
+  case ICmpCond::ULT:
+    return decide(a.umax(ty) < b.umin(), a.umin() >= b.umax(ty));
+  case ICmpCond::ULE:
+    return decide(a.umax(ty) <= b.umin(), a.umin() > b.umax(ty));
+  case ICmpCond::UGT:
+    return decide(a.umin() > b.umax(ty), a.umax(ty) <= b.umin());
+  case ICmpCond::UGE:
+    return decide(a.umin() >= b.umax(ty), a.umax(ty) < b.umin());
+  case ICmpCond::SLT:
+    return decide(a.smax(ty) < b.smin(ty), a.smin(ty) >= b.smax(ty));
+  case ICmpCond::SLE:
+    return decide(a.smax(ty) <= b.smin(ty), a.smin(ty) > b.smax(ty));
+  case ICmpCond::SGT:
+    return decide(a.smin(ty) > b.smax(ty), a.smax(ty) <= b.smin(ty));
+  case ICmpCond::SGE:
+    return decide(a.smin(ty) >= b.smax(ty), a.smax(ty) < b.smin(ty));
+  }
+  return std::nullopt;
+}
+
+static KnownBits constantBits(Type ty, uint64_t value) {
+  return {~value & maskOf(ty), value & maskOf(ty)};
+}
+
+// Known bits of `a + b + carry` where the carry in is known to be `carry`
+// (Hacker's Delight style carry propagation, as in LLVM).
+static KnownBits addBits(const KnownBits &a, const KnownBits &b, bool carry,
+                         Type ty) {
+  uint64_t sumZero = ~a.zero + ~b.zero + carry;
+  uint64_t sumOne = a.one + b.one + carry;
+  uint64_t carryZero = ~(sumZero ^ a.zero ^ b.zero);
+  uint64_t carryOne = sumOne ^ a.one ^ b.one;
+  uint64_t known =
+      (a.zero | a.one) & (b.zero | b.one) & (carryZero | carryOne);
+  return {~sumZero & known & maskOf(ty), sumOne & known & maskOf(ty)};
+}
+
+KnownBitsAnalysis::KnownBitsAnalysis(const Function &fn) {
+  std::vector<const Block *> blocks;
+  for (const auto &bb : fn.blocks)
+    blocks.push_back(&bb);
+  solve(blocks);
+}
+
+KnownBitsAnalysis::KnownBitsAnalysis(const Block &bb) { solve({&bb}); }
+
+KnownBits KnownBitsAnalysis::get(ValueId v) const {
+  if (v >= known.size() || !reached[v])
+    return {};
+  return known[v];
+}
+
+Type KnownBitsAnalysis::typeOf(ValueId v) const {
+  return v < types.size() ? types[v] : Type::i64();
+}
+
+bool KnownBitsAnalysis::upperZero(ValueId v, unsigned bits) const {
+  uint64_t upper =
+      bits >= 64 ? 0 : maskOf(typeOf(v)) & (~uint64_t{0} << bits);
+  return (get(v).zero & upper) == upper;
+}
+
+KnownBits KnownBitsAnalysis::transfer(const Instr &I) const {
+  Type ty = resultType(I);
+  uint64_t mask = maskOf(ty);
+  return std::visit(
+      [&](const auto &node) -> KnownBits {
+        using T = std::decay_t<decltype(node)>;
+        if constexpr (std::is_same_v<T, Const>) {
+          return constantBits(ty, node.value);
+        } else if constexpr (std::is_same_v<T, GetPC>) {
+          return constantBits(ty, node.pc);
+        } else if constexpr (std::is_same_v<T, BinOp>) {
+          KnownBits a = get(node.lhs), b = get(node.rhs);
+          auto shift = [&]() -> std::optional<unsigned> {
+            if (!b.isConstant(ty))
+              return std::nullopt;
+            return static_cast<unsigned>(b.one & (bitWidth(ty) - 1));
+          };
+          switch (node.kind) {
+          case BinOpKind::Add:
+            return addBits(a, b, false, ty);
+          case BinOpKind::Sub:
+            // a - b = a + ~b + 1
+            return addBits(a, {b.one, b.zero}, true, ty);
+          case BinOpKind::And:
+            return {a.zero | b.zero, a.one & b.one};
+          case BinOpKind::Or:
+            return {a.zero & b.zero, a.one | b.one};
+          case BinOpKind::Xor:
+            return {((a.zero & b.zero) | (a.one & b.one)) & mask,
+                    (a.zero & b.one) | (a.one & b.zero)};
+          case BinOpKind::Shl:
+            if (auto sh = shift()) {
+              uint64_t low = (uint64_t{1} << *sh) - 1;
+              return {((a.zero << *sh) | low) & mask, (a.one << *sh) & mask};
+            }
+            return {};
+          case BinOpKind::LShr:
+            if (auto sh = shift()) {
+              uint64_t high = mask & ~(mask >> *sh);
+              return {(a.zero >> *sh) | high, a.one >> *sh};
+            }
+            return {};
+          case BinOpKind::AShr:
+            if (auto sh = shift())
+              return {static_cast<uint64_t>(sextFrom(ty, a.zero) >> *sh) &
+                          mask,
+                      static_cast<uint64_t>(sextFrom(ty, a.one) >> *sh) &
+                          mask};
+            return {};
+          }
+          return {};
+        } else if constexpr (std::is_same_v<T, ICmp>) {
+          Type opTy = typeOf(node.lhs);
+          auto r = knownICmp(node.cond, get(node.lhs), get(node.rhs), opTy);
+          return r ? constantBits(ty, *r) : KnownBits{};
+        } else if constexpr (std::is_same_v<T, Select>) {
+          KnownBits c = get(node.cond), t = get(node.t), f = get(node.f);
+          if (c.one & 1)
+            return t;
+          if (c.zero & 1)
+            return f;
+          return {t.zero & f.zero, t.one & f.one};
+        } else if constexpr (std::is_same_v<T, ZExt>) {
+          KnownBits s = get(node.src);
+          return {s.zero | (mask & ~maskOf(typeOf(node.src))), s.one};
+        } else if constexpr (std::is_same_v<T, SExt>) {
+          Type from = typeOf(node.src);
+          KnownBits s = get(node.src);
+          return {static_cast<uint64_t>(sextFrom(from, s.zero)) & mask,
+                  static_cast<uint64_t>(sextFrom(from, s.one)) & mask};
+        } else if constexpr (std::is_same_v<T, Trunc>) {
+          KnownBits s = get(node.src);
+          return {s.zero & mask, s.one & mask};
+        } else {
+          return {};
+        }
+      },
+      I.payload);
+}
+
+void KnownBitsAnalysis::solve(const std::vector<const Block *> &blocks) {
+  // The defining instructions in order, with their operands. forEachUse()
+  // wants a mutable instruction, so read them off a copy.
+  std::vector<std::pair<const Instr *, std::vector<ValueId>>> defs;
+  ValueId n = 0;
+  for (const auto *bb : blocks) {
+    for (const auto &I : bb->insts) {
+      std::vector<ValueId> ops;
+      Instr copy = I;
+      forEachUse(copy, [&](ValueId &v) { ops.push_back(v); });
+      for (ValueId v : ops)
+        n = std::max(n, v + 1);
+      if (!I.dest)
+        continue;
+      n = std::max(n, *I.dest + 1);
+      defs.push_back({&I, std::move(ops)});
+    }
+  }
+  known.assign(n, KnownBits{});
+  // Values without a definition here are reached but unknown.
+  reached.assign(n, true);
+  types.assign(n, Type::i64());
+  for (const auto &[I, ops] : defs) {
+    reached[*I->dest] = false;
+    types[*I->dest] = resultType(*I);
+  }
+
+  // Revisit the users of a value whenever it changes.
+  std::vector<std::vector<size_t>> users(n);
+  for (size_t i = 0; i < defs.size(); ++i)
+    for (ValueId v : defs[i].second)
+      users[v].push_back(i);
+  std::vector<size_t> worklist(defs.size());
+  for (size_t i = 0; i < defs.size(); ++i)
+    worklist[i] = defs.size() - 1 - i;
+  std::vector<bool> queued(defs.size(), true);
+  while (!worklist.empty()) {
+    size_t i = worklist.back();
+    worklist.pop_back();
+    queued[i] = false;
+    const auto &[I, ops] = defs[i];
+    std::optional<KnownBits> bits;
+    if (std::holds_alternative<Phi>(I->payload)) {
+      for (ValueId v : ops) {
+        if (!reached[v])
+          continue;
+        bits = bits ? KnownBits{bits->zero & known[v].zero,
+                                bits->one & known[v].one}
+                    : known[v];
+      }
+    } else if (std::all_of(ops.begin(), ops.end(),
+                           [&](ValueId v) { return reached[v]; })) {
+      bits = transfer(*I);
+    }
+    if (!bits)
+      continue;
+    ValueId d = *I->dest;
+    // Only ever forget bits, so that the iteration terminates.
+    KnownBits next = reached[d] ? KnownBits{known[d].zero & bits->zero,
+                                            known[d].one & bits->one}
+                                : *bits;
+    if (reached[d] && next.zero == known[d].zero && next.one == known[d].one)
+      continue;
+    reached[d] = true;
+    known[d] = next;
+    for (size_t u : users[d])
+      if (!queued[u]) {
+        queued[u] = true;
+        worklist.push_back(u);
+      }
+  }
+}
+
+} // namespace riscy::ir
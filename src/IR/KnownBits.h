@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "IR/IR.h"
+
+namespace riscy::ir {
+
+// Bits of a value known to be zero or one. Only the bits within the width of
+// the value's type are meaningful; the others are neither.
+struct KnownBits {
+  uint64_t zero = 0;
+  uint64_t one = 0;
+
+  bool isConstant(Type ty) const;
+  // Bounds implied by the known bits when read as unsigned or signed.
+  uint64_t umin() const { return one; }
+  uint64_t umax(Type ty) const;
+  int64_t smin(Type ty) const;
+  int64_t smax(Type ty) const;
+};
+
+// The result of comparing values of type `ty` with known bits `a` and `b`,
+// if the bits decide it.
+std::optional<bool> knownICmp(ICmpCond cond, const KnownBits &a,
+                              const KnownBits &b, Type ty);
+
+// Known bits of every value of a function or block (after "Known bits" in
+// LLVM's ValueTracking). Phis are solved optimistically: values start out
+// unreached and lose known bits until a fixed point, so facts that hold all
+// around a loop survive its back edge.
+class KnownBitsAnalysis {
+public:
+  explicit KnownBitsAnalysis(const Function &fn);
+  explicit KnownBitsAnalysis(const Block &bb);
+
+  // Nothing is known about values that are not defined or never reached.
+  KnownBits get(ValueId v) const;
+  Type typeOf(ValueId v) const;
+  // Whether every bit of `v` above the low `bits` is known to be zero.
+  bool upperZero(ValueId v, unsigned bits) const;
+
+private:
+  void solve(const std::vector<const Block *> &blocks);
+  KnownBits transfer(const Instr &I) const;
+
+  std::vector<KnownBits> known;
+  std::vector<bool> reached;
+  std::vector<Type> types;
+};
+
+} // namespace riscy::ir
@@ -0,0 +1,89 @@
+#include "IR/PassManager.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "IR/Passes.h"
+
+namespace riscy::ir {
+
+void PassManager::add(std::unique_ptr<FunctionPass> pass) {
+  passStats.push_back({pass->name(), 0, 0, std::chrono::nanoseconds{0}});
+  passes.push_back(std::move(pass));
+}
+
+size_t PassManager::run(Function &fn) {
+  size_t total = 0;
+  for (unsigned round = 0; round < maxRounds; ++round) {
+    size_t changes = 0;
+    for (size_t i = 0; i < passes.size(); ++i) {
+      auto begin = std::chrono::steady_clock::now();
+      size_t n = passes[i]->run(fn);
+      passStats[i].time += std::chrono::steady_clock::now() - begin;
+      ++passStats[i].runs;
+      passStats[i].changes += n;
+      changes += n;
+    }
+    total += changes;
+    if (changes == 0)
+      break;
+  }
+  return total;
+}
+
+size_t PassManager::run(Block &bb) {
+  Function fn;
+  fn.entry = bb.start;
+  if (bb.insts.arenaPtr())
+    fn.arena = bb.insts.arenaPtr();
+  bb.id = 0;
+  bb.external = true;
+  for (const auto &I : bb.insts)
+    if (I.dest)
+      fn.numValues = std::max(fn.numValues, *I.dest + 1);
+  fn.blocks.push_back(std::move(bb));
+  size_t changes = run(fn);
+  bb = std::move(fn.blocks.front());
+  return changes;
+}
+
+std::string PassManager::formatStats() const {
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(3);
+  for (const auto &s : passStats) {
+    double ms = std::chrono::duration<double, std::milli>(s.time).count();
+    os << "  " << std::left << std::setw(10) << s.name << std::right
+       << std::setw(6) << s.runs << " runs " << std::setw(8) << s.changes
+       << " changes " << std::setw(9) << ms << " ms\n";
+  }
+  return os.str();
+}
+
+void addStandardPipeline(PassManager &pm, ReadOnlyMemory readOnly,
+                         size_t unrollBudget, bool vectorize) {
+  pm.add(std::make_unique<ConstantFolding>());
+  if (readOnly)
+    pm.add(std::make_unique<ConstantLoadFolding>(std::move(readOnly)));
+  pm.add(std::make_unique<CopyPropagation>());
+  pm.add(std::make_unique<AlgebraicSimplify>());
+  pm.add(std::make_unique<SignExtensionElimination>());
+  pm.add(std::make_unique<KnownBitsSimplification>());
+  pm.add(std::make_unique<StackPromotion>());
+  pm.add(std::make_unique<IfConversion>());
+  pm.add(std::make_unique<LoopInvariantCodeMotion>());
+  pm.add(std::make_unique<GVN>());
+  pm.add(std::make_unique<LoadStoreOptimization>());
+  pm.add(std::make_unique<DeadCodeElimination>());
+  // Last, so that loops are measured once they are cleaned up; the next
+  // round optimizes the copies. Vector loops are formed before unrolling
+  // copies the scalar ones.
+  if (vectorize) {
+    pm.add(std::make_unique<LoopIdiomRecognition>());
+    pm.add(std::make_unique<LoopVectorization>());
+  }
+  if (unrollBudget)
+    pm.add(std::make_unique<LoopUnrolling>(unrollBudget));
+}
+
+} // namespace riscy::ir
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IR/IR.h"
+
+namespace riscy::ir {
+
+// A transformation over one ir::Function. run() returns the number of
+// changes it made; zero means the function was left untouched.
+class FunctionPass {
+public:
+  virtual ~FunctionPass() = default;
+  virtual const char *name() const = 0;
+  virtual size_t run(Function &fn) = 0;
+};
+
+struct PassStats {
+  std::string name;
+  size_t runs = 0;
+  size_t changes = 0;
+  std::chrono::nanoseconds time{0};
+};
+
+// Runs a sequence of passes over functions. The sequence is repeated while
+// any pass reports a change, up to `maxRounds` times, since folding often
+// exposes more folding. Statistics accumulate over every function run.
+class PassManager {
+public:
+  explicit PassManager(unsigned maxRounds = 4) : maxRounds(maxRounds) {}
+
+  void add(std::unique_ptr<FunctionPass> pass);
+  // Returns the total number of changes.
+  size_t run(Function &fn);
+  // Optimizes a single block (e.g. a trace) as a one-block function.
+  size_t run(Block &bb);
+
+  const std::vector<PassStats> &stats() const { return passStats; }
+  // One line per pass: name, runs, changes and accumulated time.
+  std::string formatStats() const;
+
+private:
+  unsigned maxRounds;
+  std::vector<std::unique_ptr<FunctionPass>> passes;
+  std::vector<PassStats> passStats;
+};
+
+// Reads `size` bytes of memory that never changes at `addr`; false if the
+// range is not read-only.
+using ReadOnlyMemory = std::function<bool(uint64_t addr, void *dst,
+                                          size_t size)>;
+
+// Constant folding, copy propagation, algebraic and sign-extension
+// simplification, known-bits simplification, stack promotion, if-conversion,
+// loop-invariant code motion, global value numbering, load/store
+// optimization and dead code elimination, in that order. With `readOnly`,
+// loads from constant read-only addresses fold right after constant folding.
+// Single-block loops, search idioms included, are then vectorized if
+// `vectorize` is set and unrolled within `unrollBudget` instructions; 0
+// disables unrolling.
+void addStandardPipeline(PassManager &pm, ReadOnlyMemory readOnly = nullptr,
+                         size_t unrollBudget = 32, bool vectorize = true);
+
+} // namespace riscy::ir
@@ -0,0 +1,2401 @@
+#include "IR/Passes.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <unordered_map>
+
+#include "IR/DefUse.h"
+#include "IR/Dominators.h"
+#include "IR/KnownBits.h"
+#include "IR/SSA.h"
+
+namespace riscy::ir {
+
+static uint64_t allOnes(Type ty) { return truncTo(ty, ~uint64_t{0}); }
+
+static bool isCommutative(BinOpKind k) {
+  return k == BinOpKind::Add || k == BinOpKind::And || k == BinOpKind::Or ||
+         k == BinOpKind::Xor;
+}
+
+static uint64_t foldBinOp(BinOpKind k, Type ty, uint64_t a, uint64_t b) {
+  // Shift amounts wrap at the operand width like AArch64's register shifts.
+  unsigned sh = static_cast<unsigned>(b & (bitWidth(ty) - 1));
+  uint64_t r = 0;
+  switch (k) {
+  case BinOpKind::Add:
+    r = a + b;
+    break;
+  case BinOpKind::Sub:
+    r = a - b;
+    break;
+  case BinOpKind::And:
+    r = a & b;
+    break;
+  case BinOpKind::Or:
+    r = a | b;
+    break;
+  case BinOpKind::Xor:
+    r = a ^ b;
+    break;
+  case BinOpKind::Shl:
+    r = a << sh;
+    break;
+  case BinOpKind::LShr:
+    r = truncTo(ty, a) >> sh;
+    break;
+  case BinOpKind::AShr:
+    r = static_cast<uint64_t>(sextFrom(ty, a) >> sh);
+    break;
+  }
+  return truncTo(ty, r);
+}
+
+static bool foldICmp(ICmpCond c, Type ty, uint64_t a, uint64_t b) {
+  uint64_t ua = truncTo(ty, a), ub = truncTo(ty, b);
+  int64_t sa = sextFrom(ty, a), sb = sextFrom(ty, b);
+  switch (c) {
+  case ICmpCond::EQ:
+    return ua == ub;
+  case ICmpCond::NE:
+    return ua != ub;
+  case ICmpCond::ULT:
+    return ua < ub;
+  case ICmpCond::ULE:
+    return ua <= ub;
+  case ICmpCond::UGT:
+    return ua > ub;
+  case ICmpCond::UGE:
+    return ua >= ub;
+  case ICmpCond::SLT:
+    return sa < sb;
+  case ICmpCond::SLE:
+    return sa <= sb;
+  case ICmpCond::SGT:
+    return sa > sb;
+  case ICmpCond::SGE:
+    return sa >= sb;
+  }
+  return false;
+}
+
+static void makeConst(Instr &I, Type ty, uint64_t value) {
+  I.payload = Const{ty, truncTo(ty, value)};
+}
+
+size_t ConstantFolding::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts) {
+      if (auto *B = std::get_if<BinOp>(&I.payload)) {
+        auto a = du.constant(B->lhs), b = du.constant(B->rhs);
+        if (a && b) {
+          makeConst(I, B->ty, foldBinOp(B->kind, B->ty, *a, *b));
+          ++changes;
+        }
+      } else if (auto *C = std::get_if<ICmp>(&I.payload)) {
+        auto a = du.constant(C->lhs), b = du.constant(C->rhs);
+        if (a && b) {
+          Type ty = du.typeOf(C->lhs);
+          makeConst(I, Type::i1(), foldICmp(C->cond, ty, *a, *b));
+          ++changes;
+        }
+      } else if (auto *S = std::get_if<Select>(&I.payload)) {
+        auto c = du.constant(S->cond);
+        if (c && I.dest && du.hasUses(*I.dest)) {
+          du.replaceAllUsesWith(*I.dest, *c ? S->t : S->f);
+          ++changes;
+        }
+      } else if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+        if (auto a = du.constant(Z->src)) {
+          makeConst(I, Z->to, *a);
+          ++changes;
+        }
+      } else if (auto *S = std::get_if<SExt>(&I.payload)) {
+        if (auto a = du.constant(S->src)) {
+          Type from = du.typeOf(S->src);
+          makeConst(I, S->to, static_cast<uint64_t>(sextFrom(from, *a)));
+          ++changes;
+        }
+      } else if (auto *T = std::get_if<Trunc>(&I.payload)) {
+        if (auto a = du.constant(T->src)) {
+          makeConst(I, T->to, *a);
+          ++changes;
+        }
+      }
+    }
+
+    if (bb.term.kind == TermKind::CBr) {
+      auto cbr = std::get<TermCBr>(bb.term.data);
+      if (auto c = du.constant(cbr.cond)) {
+        bb.term.kind = TermKind::Br;
+        bb.term.data = TermBr{*c ? cbr.t : cbr.f};
+        ++changes;
+      }
+    }
+  }
+
+  // Side exits that can never be taken disappear. Erasing shifts
+  // instructions, so every block is checked before any is changed.
+  std::vector<std::vector<uint32_t>> neverTaken(fn.blocks.size());
+  for (auto &bb : fn.blocks)
+    for (uint32_t i = 0; i < bb.insts.size(); ++i)
+      if (auto *E = std::get_if<ExitIf>(&bb.insts[i].payload))
+        if (auto c = du.constant(E->cond); c && *c == 0)
+          neverTaken[bb.id].push_back(i);
+  for (auto &bb : fn.blocks) {
+    for (auto it = neverTaken[bb.id].rbegin(); it != neverTaken[bb.id].rend();
+         ++it)
+      bb.insts.erase(bb.insts.begin() + *it);
+    changes += neverTaken[bb.id].size();
+  }
+  return changes;
+}
+
+size_t ConstantLoadFolding::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts) {
+      auto *L = std::get_if<Load>(&I.payload);
+      if (!L || L->ty.kind == TypeKind::V128)
+        continue;
+      auto base = du.constant(L->base);
+      if (!base)
+        continue;
+      // Guest memory is little-endian.
+      unsigned char bytes[8] = {};
+      size_t size = bitWidth(L->ty) / 8;
+      if (!memory(*base + static_cast<uint64_t>(L->offset), bytes, size))
+        continue;
+      uint64_t value = 0;
+      for (size_t i = 0; i < size; ++i)
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+      makeConst(I, L->ty, value);
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+size_t CopyPropagation::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+  auto sameType = [](Type a, Type b) { return a.kind == b.kind; };
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts) {
+      if (!I.dest || !du.hasUses(*I.dest))
+        continue;
+      ValueId dest = *I.dest;
+      std::optional<ValueId> copyOf;
+      if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+        if (sameType(du.typeOf(Z->src), Z->to)) {
+          copyOf = Z->src;
+        } else if (auto *inner = du.def(Z->src)) {
+          if (auto *Z2 = std::get_if<ZExt>(&inner->payload)) {
+            Z->src = Z2->src;
+            ++changes;
+          }
+        }
+      } else if (auto *S = std::get_if<SExt>(&I.payload)) {
+        if (sameType(du.typeOf(S->src), S->to)) {
+          copyOf = S->src;
+        } else if (auto *inner = du.def(S->src)) {
+          if (auto *S2 = std::get_if<SExt>(&inner->payload)) {
+            S->src = S2->src;
+            ++changes;
+          }
+        }
+      } else if (auto *T = std::get_if<Trunc>(&I.payload)) {
+        if (sameType(du.typeOf(T->src), T->to)) {
+          copyOf = T->src;
+        } else if (auto *inner = du.def(T->src)) {
+          std::optional<ValueId> src;
+          if (auto *Z = std::get_if<ZExt>(&inner->payload))
+            src = Z->src;
+          else if (auto *S = std::get_if<SExt>(&inner->payload))
+            src = S->src;
+          else if (auto *T2 = std::get_if<Trunc>(&inner->payload))
+            src = T2->src;
+          if (src && sameType(du.typeOf(*src), T->to)) {
+            copyOf = *src;
+          } else if (src &&
+                     std::holds_alternative<Trunc>(inner->payload)) {
+            T->src = *src;
+            ++changes;
+          }
+        }
+      } else if (auto *P = std::get_if<Phi>(&I.payload)) {
+        std::optional<ValueId> same;
+        bool unique = true;
+        for (const auto &in : P->incoming) {
+          if (in.second == dest || (same && in.second == *same))
+            continue;
+          if (same)
+            unique = false;
+          same = in.second;
+        }
+        if (same && unique)
+          copyOf = *same;
+      }
+      if (copyOf) {
+        du.replaceAllUsesWith(dest, *copyOf);
+        ++changes;
+      }
+    }
+  }
+  return changes;
+}
+
+size_t AlgebraicSimplify::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+  // Constants created by reassociation, inserted once the walk is done.
+  std::vector<std::pair<InstrRef, Instr>> inserts;
+  for (auto &bb : fn.blocks) {
+    for (uint32_t i = 0; i < bb.insts.size(); ++i) {
+      auto &I = bb.insts[i];
+      if (!I.dest || !du.hasUses(*I.dest))
+        continue;
+      ValueId dest = *I.dest;
+
+      if (auto *S = std::get_if<Select>(&I.payload)) {
+        if (S->t == S->f) {
+          du.replaceAllUsesWith(dest, S->t);
+          ++changes;
+        }
+        continue;
+      }
+
+      if (auto *C = std::get_if<ICmp>(&I.payload)) {
+        if (C->lhs != C->rhs)
+          continue;
+        bool eq = C->cond == ICmpCond::EQ || C->cond == ICmpCond::ULE ||
+                  C->cond == ICmpCond::UGE || C->cond == ICmpCond::SLE ||
+                  C->cond == ICmpCond::SGE;
+        makeConst(I, Type::i1(), eq);
+        ++changes;
+        continue;
+      }
+
+      auto *B = std::get_if<BinOp>(&I.payload);
+      if (!B)
+        continue;
+      if (isCommutative(B->kind) && du.constant(B->lhs) &&
+          !du.constant(B->rhs)) {
+        std::swap(B->lhs, B->rhs);
+        ++changes;
+      }
+
+      std::optional<ValueId> replacement;
+      auto c = du.constant(B->rhs);
+      if (B->lhs == B->rhs) {
+        switch (B->kind) {
+        case BinOpKind::Sub:
+        case BinOpKind::Xor:
+          makeConst(I, B->ty, 0);
+          ++changes;
+          continue;
+        case BinOpKind::And:
+        case BinOpKind::Or:
+          replacement = B->lhs;
+          break;
+        default:
+          break;
+        }
+      } else if (c) {
+        bool zero = *c == 0;
+        bool ones = *c == allOnes(B->ty);
+        switch (B->kind) {
+        case BinOpKind::Add:
+        case BinOpKind::Sub:
+        case BinOpKind::Or:
+        case BinOpKind::Xor:
+          if (zero)
+            replacement = B->lhs;
+          else if (B->kind == BinOpKind::Or && ones) {
+            makeConst(I, B->ty, *c);
+            ++changes;
+            continue;
+          }
+          break;
+        case BinOpKind::And:
+          if (ones)
+            replacement = B->lhs;
+          else if (zero) {
+            makeConst(I, B->ty, 0);
+            ++changes;
+            continue;
+          }
+          break;
+        case BinOpKind::Shl:
+        case BinOpKind::LShr:
+        case BinOpKind::AShr:
+          if ((*c & (bitWidth(B->ty) - 1)) == 0)
+            replacement = B->lhs;
+          break;
+        }
+      }
+      if (replacement) {
+        du.replaceAllUsesWith(dest, *replacement);
+        ++changes;
+        continue;
+      }
+
+      // (x op c1) op c2 -> x op (c1 op c2)
+      if (!c || !isCommutative(B->kind))
+        continue;
+      auto *inner = du.def(B->lhs);
+      auto *IB = inner ? std::get_if<BinOp>(&inner->payload) : nullptr;
+      if (!IB || IB->kind != B->kind || IB->ty.kind != B->ty.kind)
+        continue;
+      auto c1 = du.constant(IB->rhs);
+      if (!c1)
+        continue;
+      Instr folded{};
+      folded.dest = fn.numValues++;
+      folded.payload = Const{B->ty, foldBinOp(B->kind, B->ty, *c1, *c)};
+      B->lhs = IB->lhs;
+      B->rhs = *folded.dest;
+      inserts.push_back({InstrRef{bb.id, i}, std::move(folded)});
+      ++changes;
+    }
+  }
+  // Insert back to front so earlier positions stay valid.
+  for (auto it = inserts.rbegin(); it != inserts.rend(); ++it) {
+    auto &insts = fn.blocks[it->first.block].insts;
+    insts.insert(insts.begin() + it->first.index, std::move(it->second));
+  }
+  return changes;
+}
+
+size_t KnownBitsSimplification::run(Function &fn) {
+  DefUse du(fn);
+  KnownBitsAnalysis kb(fn);
+  size_t changes = 0;
+  // Whether `v` is `x << k` for the constant `k`; sets `x`.
+  auto shlBy = [&](ValueId v, uint64_t k, ValueId &x) {
+    const Instr *D = du.def(v);
+    auto *S = D ? std::get_if<BinOp>(&D->payload) : nullptr;
+    if (!S || S->kind != BinOpKind::Shl || du.constant(S->rhs) != k)
+      return false;
+    x = S->lhs;
+    return true;
+  };
+  // Whether the bits of `v` from `bit` up are all known zero, or all known
+  // one if `ones`.
+  auto topKnown = [&](ValueId v, unsigned bit, bool ones) {
+    Type ty = kb.typeOf(v);
+    uint64_t top = truncTo(ty, ~uint64_t{0} << bit);
+    KnownBits k = kb.get(v);
+    return ((ones ? k.one : k.zero) & top) == top;
+  };
+
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts) {
+      if (!I.dest || !du.hasUses(*I.dest) ||
+          std::holds_alternative<Const>(I.payload) ||
+          std::holds_alternative<GetPC>(I.payload))
+        continue;
+      ValueId dest = *I.dest;
+      Type ty = kb.typeOf(dest);
+      KnownBits known = kb.get(dest);
+      if (known.isConstant(ty)) {
+        makeConst(I, ty, known.one);
+        ++changes;
+        continue;
+      }
+
+      std::optional<ValueId> replacement;
+      if (auto *B = std::get_if<BinOp>(&I.payload)) {
+        KnownBits a = kb.get(B->lhs), b = kb.get(B->rhs);
+        uint64_t maybeA = ~a.zero & allOnes(ty), maybeB = ~b.zero & allOnes(ty);
+        auto k = du.constant(B->rhs);
+        ValueId x = 0;
+        switch (B->kind) {
+        case BinOpKind::And:
+          // A mask that keeps every bit that may be set.
+          if ((maybeA & ~b.one) == 0)
+            replacement = B->lhs;
+          else if ((maybeB & ~a.one) == 0)
+            replacement = B->rhs;
+          break;
+        case BinOpKind::Or:
+          // Setting bits that are already set.
+          if ((maybeB & ~a.one) == 0)
+            replacement = B->lhs;
+          else if ((maybeA & ~b.one) == 0)
+            replacement = B->rhs;
+          break;
+        case BinOpKind::LShr:
+        case BinOpKind::AShr: {
+          // (x << k) >> k shifts back bits equal to the ones shifted out.
+          unsigned w = bitWidth(ty);
+          if (!k || *k == 0 || *k >= w || !shlBy(B->lhs, *k, x) ||
+              kb.typeOf(x).kind != ty.kind)
+            break;
+          unsigned from = static_cast<unsigned>(w - *k);
+          if (B->kind == BinOpKind::LShr ? topKnown(x, from, false)
+                                         : topKnown(x, from - 1, false) ||
+                                               topKnown(x, from - 1, true))
+            replacement = x;
+          break;
+        }
+        default:
+          break;
+        }
+      } else if (auto *C = std::get_if<ICmp>(&I.payload)) {
+        // A boolean widened and compared against zero is the boolean itself
+        // or its inverse.
+        if (C->cond != ICmpCond::EQ && C->cond != ICmpCond::NE)
+          continue;
+        ValueId other = C->lhs;
+        if (du.constant(C->lhs) == 0)
+          other = C->rhs;
+        else if (du.constant(C->rhs) != 0)
+          continue;
+        const Instr *D = du.def(other);
+        auto *Z = D ? std::get_if<ZExt>(&D->payload) : nullptr;
+        if (!Z || kb.typeOf(Z->src).kind != TypeKind::I1)
+          continue;
+        if (C->cond == ICmpCond::NE) {
+          replacement = Z->src;
+        } else if (auto *Def = du.def(Z->src)) {
+          if (auto *inner = std::get_if<ICmp>(&Def->payload)) {
+            I.payload = ICmp{inverse(inner->cond), inner->lhs, inner->rhs};
+            ++changes;
+          }
+        }
+      } else if (auto *S = std::get_if<SExt>(&I.payload)) {
+        Type from = kb.typeOf(S->src);
+        unsigned sign = bitWidth(from) - 1;
+        const Instr *D = du.def(S->src);
+        auto *T = D ? std::get_if<Trunc>(&D->payload) : nullptr;
+        if (T && kb.typeOf(T->src).kind == ty.kind &&
+            (topKnown(T->src, sign, false) || topKnown(T->src, sign, true)))
+          replacement = T->src;
+      } else if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+        const Instr *D = du.def(Z->src);
+        auto *T = D ? std::get_if<Trunc>(&D->payload) : nullptr;
+        if (T && kb.typeOf(T->src).kind == ty.kind &&
+            topKnown(T->src, bitWidth(T->to), false))
+          replacement = T->src;
+      }
+      if (replacement) {
+        du.replaceAllUsesWith(dest, *replacement);
+        ++changes;
+      }
+    }
+  }
+  return changes;
+}
+
+// True if `I` defines an i64 that equals the sign extension of its low 32
+// bits, given the same facts about the values it reads in `known`.
+static bool isSignExtended(const Instr &I, const DefUse &du,
+                           const std::vector<bool> &known) {
+  if (resultType(I).kind != TypeKind::I64)
+    return false;
+  if (auto *C = std::get_if<Const>(&I.payload))
+    return sextFrom(Type::i32(), C->value) == static_cast<int64_t>(C->value);
+  if (auto *S = std::get_if<SExt>(&I.payload))
+    return bitWidth(du.typeOf(S->src)) <= 32;
+  if (auto *Z = std::get_if<ZExt>(&I.payload))
+    return bitWidth(du.typeOf(Z->src)) < 32;
+  if (auto *P = std::get_if<Phi>(&I.payload))
+    return std::all_of(P->incoming.begin(), P->incoming.end(),
+                       [&](const auto &in) { return known[in.second]; });
+  if (auto *S = std::get_if<Select>(&I.payload))
+    return known[S->t] && known[S->f];
+  auto *B = std::get_if<BinOp>(&I.payload);
+  if (!B)
+    return false;
+  auto c = du.constant(B->rhs);
+  switch (B->kind) {
+  case BinOpKind::AShr:
+    return c && (*c & 63) >= 32;
+  case BinOpKind::LShr:
+    return c && (*c & 63) >= 33;
+  case BinOpKind::And:
+    if (c && *c < (uint64_t{1} << 31))
+      return true;
+    return known[B->lhs] && known[B->rhs];
+  case BinOpKind::Or:
+  case BinOpKind::Xor:
+    return known[B->lhs] && known[B->rhs];
+  default:
+    return false;
+  }
+}
+
+size_t SignExtensionElimination::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+
+  // Optimistically assume that phis and bitwise operations of unknown
+  // operands are sign-extended and refute until nothing changes, so that
+  // loop-carried values can be proven.
+  std::vector<bool> known(fn.numValues, false);
+  std::vector<const Instr *> dependent;
+  for (const auto &bb : fn.blocks) {
+    for (const auto &I : bb.insts) {
+      if (!I.dest)
+        continue;
+      auto *B = std::get_if<BinOp>(&I.payload);
+      if (std::holds_alternative<Phi>(I.payload) ||
+          std::holds_alternative<Select>(I.payload) ||
+          (B && (B->kind == BinOpKind::And || B->kind == BinOpKind::Or ||
+                 B->kind == BinOpKind::Xor))) {
+        known[*I.dest] = resultType(I).kind == TypeKind::I64;
+        dependent.push_back(&I);
+      }
+    }
+  }
+  for (const auto &bb : fn.blocks)
+    for (const auto &I : bb.insts)
+      if (I.dest && !known[*I.dest])
+        known[*I.dest] = isSignExtended(I, du, known);
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const Instr *I : dependent) {
+      if (known[*I->dest] && !isSignExtended(*I, du, known)) {
+        known[*I->dest] = false;
+        changed = true;
+      }
+    }
+  }
+
+  // Truncs that rewritten shift pairs read, inserted once the walk is done.
+  std::vector<std::pair<InstrRef, Instr>> inserts;
+  for (auto &bb : fn.blocks) {
+    for (uint32_t i = 0; i < bb.insts.size(); ++i) {
+      auto &I = bb.insts[i];
+      if (!I.dest || !du.hasUses(*I.dest))
+        continue;
+      ValueId dest = *I.dest;
+
+      // sext(trunc(x)) where x is already sign-extended
+      if (auto *S = std::get_if<SExt>(&I.payload)) {
+        auto *inner = du.def(S->src);
+        auto *T = inner ? std::get_if<Trunc>(&inner->payload) : nullptr;
+        if (T && T->to.kind == TypeKind::I32 && S->to.kind == TypeKind::I64 &&
+            du.typeOf(T->src).kind == TypeKind::I64 && known[T->src]) {
+          du.replaceAllUsesWith(dest, T->src);
+          ++changes;
+        }
+        continue;
+      }
+
+      // (x << 32) >> 32, the 64-bit spelling of sext.w
+      auto *B = std::get_if<BinOp>(&I.payload);
+      if (!B || B->kind != BinOpKind::AShr || B->ty.kind != TypeKind::I64)
+        continue;
+      auto c = du.constant(B->rhs);
+      auto *inner = du.def(B->lhs);
+      auto *shl = inner ? std::get_if<BinOp>(&inner->payload) : nullptr;
+      if (!c || (*c & 63) != 32 || !shl || shl->kind != BinOpKind::Shl)
+        continue;
+      auto c1 = du.constant(shl->rhs);
+      if (!c1 || (*c1 & 63) != 32)
+        continue;
+      ValueId x = shl->lhs;
+      if (known[x]) {
+        du.replaceAllUsesWith(dest, x);
+      } else {
+        Instr trunc{};
+        trunc.dest = fn.numValues++;
+        trunc.payload = Trunc{x, Type::i32()};
+        I.payload = SExt{*trunc.dest, Type::i64()};
+        inserts.push_back({InstrRef{bb.id, i}, trunc});
+      }
+      ++changes;
+    }
+  }
+  // Insert back to front so earlier positions stay valid.
+  for (auto it = inserts.rbegin(); it != inserts.rend(); ++it) {
+    auto &insts = fn.blocks[it->first.block].insts;
+    insts.insert(insts.begin() + it->first.index, std::move(it->second));
+  }
+  return changes;
+}
+
+// Operation key for value numbering: payload kind, opcode, type, operands
+// and immediates.
+static std::optional<std::vector<uint64_t>> gvnKey(const Instr &I,
+                                                   BlockId block) {
+  std::vector<uint64_t> key{I.payload.index()};
+  if (auto *C = std::get_if<Const>(&I.payload)) {
+    key.insert(key.end(), {static_cast<uint64_t>(C->ty.kind), C->value,
+                           block});
+  } else if (auto *G = std::get_if<GetPC>(&I.payload)) {
+    key.insert(key.end(), {G->pc, block});
+  } else if (auto *B = std::get_if<BinOp>(&I.payload)) {
+    ValueId a = B->lhs, b = B->rhs;
+    if (isCommutative(B->kind) && b < a)
+      std::swap(a, b);
+    key.insert(key.end(), {static_cast<uint64_t>(B->kind),
+                           static_cast<uint64_t>(B->ty.kind), a, b});
+  } else if (auto *C = std::get_if<ICmp>(&I.payload)) {
+    key.insert(key.end(), {static_cast<uint64_t>(C->cond), C->lhs, C->rhs});
+  } else if (auto *S = std::get_if<Select>(&I.payload)) {
+    key.insert(key.end(),
+               {static_cast<uint64_t>(S->ty.kind), S->cond, S->t, S->f});
+  } else if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+    key.insert(key.end(), {static_cast<uint64_t>(Z->to.kind), Z->src});
+  } else if (auto *S = std::get_if<SExt>(&I.payload)) {
+    key.insert(key.end(), {static_cast<uint64_t>(S->to.kind), S->src});
+  } else if (auto *T = std::get_if<Trunc>(&I.payload)) {
+    key.insert(key.end(), {static_cast<uint64_t>(T->to.kind), T->src});
+  } else {
+    return std::nullopt;
+  }
+  return key;
+}
+
+size_t GVN::run(Function &fn) {
+  DefUse du(fn);
+  DominatorTree dt(fn);
+  std::map<std::vector<uint64_t>, ValueId> available;
+  size_t changes = 0;
+  // Walk the dominator tree, dropping a block's entries when leaving it.
+  std::vector<std::pair<BlockId, bool>> stack;
+  for (auto it = dt.roots().rbegin(); it != dt.roots().rend(); ++it)
+    stack.push_back({*it, false});
+  std::vector<std::vector<std::vector<uint64_t>>> scopes(fn.blocks.size());
+  while (!stack.empty()) {
+    auto [b, leaving] = stack.back();
+    stack.pop_back();
+    if (leaving) {
+      for (const auto &key : scopes[b])
+        available.erase(key);
+      continue;
+    }
+    stack.push_back({b, true});
+    for (auto &I : fn.blocks[b].insts) {
+      if (!I.dest)
+        continue;
+      auto key = gvnKey(I, b);
+      if (!key)
+        continue;
+      auto [it, inserted] = available.emplace(*key, *I.dest);
+      if (inserted) {
+        scopes[b].push_back(std::move(*key));
+      } else if (du.hasUses(*I.dest)) {
+        du.replaceAllUsesWith(*I.dest, it->second);
+        ++changes;
+      }
+    }
+    const auto &kids = dt.children(b);
+    for (auto it = kids.rbegin(); it != kids.rend(); ++it)
+      stack.push_back({*it, false});
+  }
+  return changes;
+}
+
+namespace {
+
+// A guest address as a root value plus a constant byte offset. Constant
+// addresses have no root.
+struct Address {
+  static constexpr ValueId kAbsolute = ~ValueId{0};
+  ValueId root = kAbsolute;
+  int64_t offset = 0;
+};
+
+// An access of `size` bytes at `addr`.
+struct MemAccess {
+  Address addr;
+  int64_t size = 0;
+
+  bool sameAs(const MemAccess &o) const {
+    return addr.root == o.addr.root && addr.offset == o.addr.offset &&
+           size == o.size;
+  }
+  // Accesses off different roots may overlap; off the same root they
+  // overlap only if their byte ranges do.
+  bool mayAlias(const MemAccess &o) const {
+    if (addr.root != o.addr.root)
+      return true;
+    return addr.offset < o.addr.offset + o.size &&
+           o.addr.offset < addr.offset + size;
+  }
+};
+
+} // namespace
+
+// Strips constant adds and subtracts off `base`.
+static MemAccess memAccess(const DefUse &du, ValueId base, int64_t offset,
+                           Type ty) {
+  MemAccess a{{base, offset}, static_cast<int64_t>(bitWidth(ty) / 8)};
+  for (;;) {
+    if (auto c = du.constant(a.addr.root)) {
+      a.addr.offset += static_cast<int64_t>(*c);
+      a.addr.root = Address::kAbsolute;
+      return a;
+    }
+    const Instr *I = du.def(a.addr.root);
+    auto *B = I ? std::get_if<BinOp>(&I->payload) : nullptr;
+    if (!B || B->ty.kind != TypeKind::I64 ||
+        (B->kind != BinOpKind::Add && B->kind != BinOpKind::Sub))
+      return a;
+    auto c = du.constant(B->rhs);
+    if (!c)
+      return a;
+    auto delta = static_cast<int64_t>(*c);
+    a.addr.offset += B->kind == BinOpKind::Add ? delta : -delta;
+    a.addr.root = B->lhs;
+  }
+}
+
+size_t LoadStoreOptimization::run(Function &fn) {
+  DefUse du(fn);
+  size_t changes = 0;
+  for (auto &bb : fn.blocks) {
+    // Memory known to hold the low bytes of a value.
+    struct Available {
+      MemAccess access;
+      ValueId value;
+    };
+    std::vector<Available> available;
+    // Stores not yet read, by index; overwriting one exactly kills it.
+    std::vector<std::pair<MemAccess, uint32_t>> pending;
+    std::vector<uint32_t> deadStores;
+
+    for (uint32_t i = 0; i < bb.insts.size(); ++i) {
+      auto &I = bb.insts[i];
+      if (auto *L = std::get_if<Load>(&I.payload)) {
+        auto a = memAccess(du, L->base, L->offset, L->ty);
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                     [&](const auto &p) {
+                                       return p.first.mayAlias(a);
+                                     }),
+                      pending.end());
+        // Vectors are only forwarded whole.
+        bool vector = L->ty.kind == TypeKind::V128;
+        auto it = std::find_if(
+            available.begin(), available.end(), [&](const Available &e) {
+              return e.access.addr.root == a.addr.root &&
+                     e.access.addr.offset == a.addr.offset &&
+                     e.access.size >= a.size &&
+                     (du.typeOf(e.value).kind == TypeKind::V128) == vector;
+            });
+        if (it == available.end()) {
+          if (I.dest)
+            available.push_back({a, *I.dest});
+          continue;
+        }
+        if (!I.dest)
+          continue;
+        // Little-endian: the loaded bytes are the low bytes of the value.
+        if (du.typeOf(it->value).kind == L->ty.kind)
+          du.replaceAllUsesWith(*I.dest, it->value);
+        else
+          I.payload = Trunc{it->value, L->ty};
+        ++changes;
+      } else if (auto *S = std::get_if<Store>(&I.payload)) {
+        auto a = memAccess(du, S->base, S->offset, S->ty);
+        bool redundant = std::any_of(
+            available.begin(), available.end(), [&](const Available &e) {
+              return e.access.sameAs(a) && e.value == S->value;
+            });
+        if (redundant) {
+          deadStores.push_back(i);
+          continue;
+        }
+        for (auto &p : pending) {
+          if (p.first.sameAs(a)) {
+            deadStores.push_back(p.second);
+            p.second = ~uint32_t{0};
+          }
+        }
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                     [](const auto &p) {
+                                       return p.second == ~uint32_t{0};
+                                     }),
+                      pending.end());
+        pending.push_back({a, i});
+        available.erase(std::remove_if(available.begin(), available.end(),
+                                       [&](const Available &e) {
+                                         return e.access.mayAlias(a);
+                                       }),
+                        available.end());
+        available.push_back({a, S->value});
+      } else if (std::holds_alternative<ExitIf>(I.payload)) {
+        // Memory is visible to the exit's target.
+        pending.clear();
+      }
+    }
+
+    std::sort(deadStores.begin(), deadStores.end());
+    for (auto it = deadStores.rbegin(); it != deadStores.rend(); ++it)
+      bb.insts.erase(bb.insts.begin() + *it);
+    changes += deadStores.size();
+  }
+  return changes;
+}
+
+// True if every use of `derived` values is as the base of a memory access,
+// in a constant offset from them, or in a register write on the way out.
+// Phis, arithmetic and stores of the values themselves let addresses escape,
+// except for stores into frame slots off `sp` that the function never reads
+// back, such as an inlined callee's spills once they are forwarded.
+static bool addressesStayLocal(Function &fn, const DefUse &du, ValueId sp,
+                               std::vector<bool> &derived) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const auto &bb : fn.blocks) {
+      for (const auto &I : bb.insts) {
+        auto *B = std::get_if<BinOp>(&I.payload);
+        if (B && I.dest && !derived[*I.dest] && derived[B->lhs] &&
+            B->ty.kind == TypeKind::I64 && du.constant(B->rhs) &&
+            (B->kind == BinOpKind::Add || B->kind == BinOpKind::Sub)) {
+          derived[*I.dest] = true;
+          changed = true;
+        }
+      }
+    }
+  }
+  std::vector<MemAccess> frameLoads;
+  for (const auto &bb : fn.blocks)
+    for (const auto &I : bb.insts)
+      if (auto *L = std::get_if<Load>(&I.payload)) {
+        auto a = memAccess(du, L->base, L->offset, L->ty);
+        if (a.addr.root == sp)
+          frameLoads.push_back(a);
+      }
+  auto unread = [&](const Store &S) {
+    auto a = memAccess(du, S.base, S.offset, S.ty);
+    return a.addr.root == sp &&
+           std::none_of(frameLoads.begin(), frameLoads.end(),
+                        [&](const MemAccess &l) { return l.mayAlias(a); });
+  };
+  bool local = true;
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts) {
+      bool allowed = std::holds_alternative<WriteReg>(I.payload) ||
+                     std::holds_alternative<Load>(I.payload);
+      if (auto *S = std::get_if<Store>(&I.payload))
+        allowed = !derived[S->value] || unread(*S);
+      if (I.dest && derived[*I.dest])
+        allowed = true; // the offset's operands were checked above
+      if (!allowed)
+        forEachUse(I, [&](ValueId &v) { local = local && !derived[v]; });
+    }
+    forEachUse(bb.term, [&](ValueId &v) { local = local && !derived[v]; });
+  }
+  return local;
+}
+
+size_t StackPromotion::run(Function &fn) {
+  // Frame slots live below the stack pointer the function is called with.
+  auto entryIt = std::find_if(
+      fn.blocks.begin(), fn.blocks.end(),
+      [&](const Block &bb) { return bb.external && bb.start == fn.entry; });
+  if (entryIt == fn.blocks.end())
+    return 0;
+  Block &entry = *entryIt;
+  std::optional<ValueId> sp;
+  for (const auto &I : entry.insts)
+    if (auto *R = std::get_if<ReadReg>(&I.payload); R && R->reg == 2)
+      sp = *I.dest;
+  if (!sp)
+    return 0;
+  for (const auto &bb : fn.blocks)
+    for (const auto &I : bb.insts)
+      if (std::holds_alternative<ExitIf>(I.payload))
+        return 0;
+
+  DefUse du(fn);
+  std::vector<bool> derived(fn.numValues, false);
+  derived[*sp] = true;
+  if (!addressesStayLocal(fn, du, *sp, derived))
+    return 0;
+  // Control may only leave the blocks the entry dominates through their
+  // exits, so that every path to an access starts at the entry.
+  DominatorTree dt(fn);
+  auto inRegion = [&](BlockId b) { return dt.dominates(entry.id, b); };
+  for (const auto &bb : fn.blocks)
+    if (inRegion(bb.id))
+      for (BlockId succ : successors(bb))
+        if (!inRegion(succ))
+          return 0;
+
+  // Collect the frame accesses. A slot is promoted if all accesses that
+  // overlap it agree on its offset and size and moving it to a register
+  // removes memory traffic from inside the function.
+  struct Slot {
+    MemAccess access;
+    Type ty;
+    bool valid = true;
+    bool profitable = false;
+    std::optional<ValueId> entryLoad;
+  };
+  std::vector<Slot> slots;
+  struct Access {
+    BlockId block;
+    uint32_t index;
+    size_t slot;
+  };
+  std::vector<Access> accesses;
+  // Visit dominators first, so that a load is replaced before a store of
+  // its value is.
+  std::vector<BlockId> order{entry.id};
+  for (size_t k = 0; k < order.size(); ++k)
+    for (BlockId kid : dt.children(order[k]))
+      order.push_back(kid);
+  for (BlockId b : order) {
+    const Block &bb = fn.blocks[b];
+    bool leaves = bb.term.kind != TermKind::Goto &&
+                  bb.term.kind != TermKind::CondGoto;
+    for (uint32_t i = 0; i < bb.insts.size(); ++i) {
+      const auto &I = bb.insts[i];
+      auto *L = std::get_if<Load>(&I.payload);
+      auto *S = std::get_if<Store>(&I.payload);
+      if (!L && !S)
+        continue;
+      auto a = L ? memAccess(du, L->base, L->offset, L->ty)
+                 : memAccess(du, S->base, S->offset, S->ty);
+      if (a.addr.root != *sp)
+        continue;
+      auto it = std::find_if(slots.begin(), slots.end(), [&](const Slot &sl) {
+        return sl.access.mayAlias(a);
+      });
+      if (it == slots.end()) {
+        Slot sl{};
+        sl.access = a;
+        sl.ty = L ? L->ty : S->ty;
+        slots.push_back(sl);
+        it = slots.end() - 1;
+      }
+      if (!it->access.sameAs(a) || a.addr.offset + a.size > 0) {
+        it->valid = false;
+        // Keep the larger range so later overlaps find this slot.
+        if (a.size > it->access.size)
+          it->access = a;
+        continue;
+      }
+      if (L && bb.id == entry.id && !it->entryLoad)
+        it->entryLoad = *I.dest;
+      if ((L && bb.id != entry.id) || (S && !leaves))
+        it->profitable = true;
+      if (bb.id != entry.id)
+        accesses.push_back({bb.id, i, static_cast<size_t>(it - slots.begin())});
+    }
+  }
+  std::vector<int> varOf(slots.size(), -1);
+  std::vector<size_t> promoted;
+  for (size_t k = 0; k < slots.size(); ++k) {
+    if (slots[k].valid && slots[k].profitable) {
+      varOf[k] = static_cast<int>(promoted.size());
+      promoted.push_back(k);
+    }
+  }
+  if (promoted.empty())
+    return 0;
+
+  SSABuilder ssa(
+      fn,
+      [&](BlockId, SSABuilder::Var var) {
+        // Only the entry lacks predecessors among the blocks it dominates.
+        Slot &sl = slots[promoted[var]];
+        if (!sl.entryLoad) {
+          Instr load{};
+          load.dest = fn.numValues++;
+          load.payload = Load{*sp, sl.access.addr.offset, sl.ty};
+          entry.insts.push_back(load);
+          sl.entryLoad = load.dest;
+        }
+        return *sl.entryLoad;
+      },
+      [&](SSABuilder::Var var) { return slots[promoted[var]].ty; });
+
+  size_t changes = 0;
+  std::vector<std::vector<uint32_t>> erase(fn.blocks.size());
+  for (const auto &a : accesses) {
+    if (varOf[a.slot] < 0)
+      continue;
+    auto var = static_cast<SSABuilder::Var>(varOf[a.slot]);
+    auto &I = fn.blocks[a.block].insts[a.index];
+    if (std::holds_alternative<Load>(I.payload)) {
+      du.replaceAllUsesWith(*I.dest, ssa.readVariable(var, a.block));
+    } else {
+      const auto &S = std::get<Store>(I.payload);
+      Type ty = slots[a.slot].ty;
+      if (du.typeOf(S.value).kind == ty.kind) {
+        ssa.writeVariable(var, a.block, S.value);
+        erase[a.block].push_back(a.index);
+      } else {
+        // Keep the stored bytes only.
+        I.dest = fn.numValues++;
+        I.payload = Trunc{S.value, ty};
+        ssa.writeVariable(var, a.block, *I.dest);
+      }
+    }
+    ++changes;
+  }
+
+  // Memory is up to date whenever control leaves the function.
+  std::vector<uint32_t> writebacks(fn.blocks.size(), 0);
+  for (auto &bb : fn.blocks) {
+    if (!inRegion(bb.id) || bb.term.kind == TermKind::Goto ||
+        bb.term.kind == TermKind::CondGoto)
+      continue;
+    for (size_t var = 0; var < promoted.size(); ++var) {
+      const Slot &sl = slots[promoted[var]];
+      ValueId v = ssa.readVariable(static_cast<SSABuilder::Var>(var), bb.id);
+      bb.insts.push_back(
+          Instr{std::nullopt, Store{v, *sp, sl.access.addr.offset, sl.ty}});
+      ++writebacks[bb.id];
+    }
+  }
+  for (auto &bb : fn.blocks) {
+    auto &idx = erase[bb.id];
+    std::sort(idx.begin(), idx.end());
+    for (auto it = idx.rbegin(); it != idx.rend(); ++it)
+      bb.insts.erase(bb.insts.begin() + *it);
+  }
+  ssa.finish();
+
+  // Slots that still hold their value from the entry need no store.
+  std::vector<ValueId> unchanged;
+  for (size_t k : promoted)
+    if (slots[k].entryLoad)
+      unchanged.push_back(*slots[k].entryLoad);
+  for (auto &bb : fn.blocks) {
+    auto first = bb.insts.end() - writebacks[bb.id];
+    auto keepsEntryValue = [&](const Instr &I) {
+      ValueId v = std::get<Store>(I.payload).value;
+      return std::count(unchanged.begin(), unchanged.end(), v) > 0;
+    };
+    bb.insts.erase(std::remove_if(first, bb.insts.end(), keepsEntryValue),
+                   bb.insts.end());
+  }
+  return changes;
+}
+
+// Operations that may run whether or not their block would have: no memory
+// access, no guest state and no side exit.
+static bool isSpeculatable(const Instr &I) {
+  return std::holds_alternative<Const>(I.payload) ||
+         std::holds_alternative<GetPC>(I.payload) ||
+         std::holds_alternative<BinOp>(I.payload) ||
+         std::holds_alternative<ICmp>(I.payload) ||
+         std::holds_alternative<Select>(I.payload) ||
+         std::holds_alternative<ZExt>(I.payload) ||
+         std::holds_alternative<SExt>(I.payload) ||
+         std::holds_alternative<Trunc>(I.payload);
+}
+
+static ValueId incomingFrom(const Phi &phi, BlockId pred) {
+  for (const auto &in : phi.incoming)
+    if (in.first == pred)
+      return in.second;
+  return 0;
+}
+
+// Lays out the blocks of `fn` in `order` and renumbers them accordingly.
+// Blocks left out must no longer be entered.
+static void reorderBlocks(Function &fn, const std::vector<BlockId> &order) {
+  std::vector<BlockId> newId(fn.blocks.size(), 0);
+  for (BlockId i = 0; i < order.size(); ++i)
+    newId[order[i]] = i;
+  std::vector<Block> kept;
+  kept.reserve(order.size());
+  for (BlockId b : order) {
+    Block &bb = fn.blocks[b];
+    bb.id = newId[bb.id];
+    for (auto &p : bb.preds)
+      p = newId[p];
+    for (auto &I : bb.insts)
+      if (auto *P = std::get_if<Phi>(&I.payload))
+        for (auto &in : P->incoming)
+          in.first = newId[in.first];
+    if (auto *G = std::get_if<TermGoto>(&bb.term.data))
+      G->target = newId[G->target];
+    if (auto *C = std::get_if<TermCondGoto>(&bb.term.data)) {
+      C->t = newId[C->t];
+      C->f = newId[C->f];
+    }
+    kept.push_back(std::move(bb));
+  }
+  fn.blocks = std::move(kept);
+}
+
+// Drops the blocks marked `dead`, which nothing enters any more, and
+// renumbers the others in order.
+static void removeBlocks(Function &fn, const std::vector<bool> &dead) {
+  std::vector<BlockId> order;
+  for (BlockId b = 0; b < fn.blocks.size(); ++b)
+    if (!dead[b])
+      order.push_back(b);
+  reorderBlocks(fn, order);
+}
+
+size_t IfConversion::run(Function &fn) {
+  size_t changes = 0;
+  std::vector<bool> dead(fn.blocks.size(), false);
+  // Phis of merged joins and the single value they merged.
+  std::unordered_map<ValueId, ValueId> replaced;
+  for (BlockId h = 0; h < fn.blocks.size(); ++h) {
+    Block &head = fn.blocks[h];
+    if (dead[h] || head.term.kind != TermKind::CondGoto)
+      continue;
+    auto c = std::get<TermCondGoto>(head.term.data);
+    if (c.t == c.f)
+      continue;
+    // The block that `b` goes on to, if it can be an arm of the branch.
+    auto joinOf = [&](BlockId b) -> std::optional<BlockId> {
+      const Block &arm = fn.blocks[b];
+      if (b == h || arm.external || arm.preds != std::vector<BlockId>{h} ||
+          arm.term.kind != TermKind::Goto ||
+          arm.insts.size() > kMaxArmSize ||
+          !std::all_of(arm.insts.begin(), arm.insts.end(), isSpeculatable))
+        return std::nullopt;
+      return std::get<TermGoto>(arm.term.data).target;
+    };
+    auto tJoin = joinOf(c.t), fJoin = joinOf(c.f);
+    // The blocks that enter the join on either side of the branch.
+    BlockId join = 0, tFrom = h, fFrom = h;
+    if (tJoin && fJoin && *tJoin == *fJoin) {
+      join = *tJoin;
+      tFrom = c.t;
+      fFrom = c.f;
+    } else if (tJoin && *tJoin == c.f) {
+      join = c.f;
+      tFrom = c.t;
+    } else if (fJoin && *fJoin == c.t) {
+      join = c.t;
+      fFrom = c.f;
+    } else {
+      continue;
+    }
+    if (join == h)
+      continue;
+    Block &joinBlock = fn.blocks[join];
+    size_t selects = 0;
+    for (const auto &I : joinBlock.insts) {
+      auto *P = std::get_if<Phi>(&I.payload);
+      if (!P)
+        break;
+      selects += incomingFrom(*P, tFrom) != incomingFrom(*P, fFrom);
+    }
+    if (selects > kMaxSelects)
+      continue;
+
+    // Run both arms unconditionally and pick the join's values.
+    for (BlockId arm : {tFrom, fFrom}) {
+      if (arm == h)
+        continue;
+      auto &insts = fn.blocks[arm].insts;
+      head.insts.insert(head.insts.end(), insts.begin(), insts.end());
+      insts.clear();
+      fn.blocks[arm].preds.clear();
+      dead[arm] = true;
+    }
+    for (auto &I : joinBlock.insts) {
+      auto *P = std::get_if<Phi>(&I.payload);
+      if (!P)
+        break;
+      ValueId vt = incomingFrom(*P, tFrom), vf = incomingFrom(*P, fFrom);
+      ValueId v = vt;
+      if (vt != vf) {
+        Instr S{};
+        S.dest = v = fn.numValues++;
+        S.payload = Select{c.cond, vt, vf, P->ty};
+        head.insts.push_back(S);
+      }
+      std::vector<std::pair<BlockId, ValueId>> incoming;
+      for (const auto &in : P->incoming)
+        if (in.first != tFrom && in.first != fFrom)
+          incoming.push_back(in);
+      incoming.push_back({h, v});
+      P->incoming = Span<std::pair<BlockId, ValueId>>::copy(*fn.arena,
+                                                            incoming);
+    }
+    auto &preds = joinBlock.preds;
+    preds.erase(std::remove_if(preds.begin(), preds.end(),
+                               [&](BlockId p) {
+                                 return p == tFrom || p == fFrom;
+                               }),
+                preds.end());
+    preds.push_back(h);
+    head.term.kind = TermKind::Goto;
+    head.term.data = TermGoto{join};
+    ++changes;
+
+    // A join left with a single way in becomes the rest of the head.
+    if (preds.size() != 1 || joinBlock.external)
+      continue;
+    for (const auto &I : joinBlock.insts) {
+      if (auto *P = std::get_if<Phi>(&I.payload))
+        replaced[*I.dest] = P->incoming[0].second;
+      else
+        head.insts.push_back(I);
+    }
+    head.term = joinBlock.term;
+    for (BlockId succ : successors(joinBlock)) {
+      auto &succPreds = fn.blocks[succ].preds;
+      std::replace(succPreds.begin(), succPreds.end(), join, h);
+      for (auto &I : fn.blocks[succ].insts)
+        if (auto *P = std::get_if<Phi>(&I.payload))
+          for (auto &in : P->incoming)
+            if (in.first == join)
+              in.first = h;
+    }
+    joinBlock.insts.clear();
+    joinBlock.preds.clear();
+    joinBlock.term = Terminator{};
+    dead[join] = true;
+  }
+  if (!changes)
+    return 0;
+
+  auto resolve = [&](ValueId &v) {
+    for (auto it = replaced.find(v); it != replaced.end();
+         it = replaced.find(v))
+      v = it->second;
+  };
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts)
+      forEachUse(I, resolve);
+    forEachUse(bb.term, resolve);
+  }
+  removeBlocks(fn, dead);
+  return changes;
+}
+
+// Natural loops of `fn` by header, outermost first: the blocks that reach a
+// back edge to the header without passing through it. Loops sharing a
+// header are merged.
+static std::vector<std::pair<BlockId, std::vector<bool>>>
+naturalLoops(const Function &fn, const DominatorTree &dt) {
+  std::map<BlockId, std::vector<bool>> loops;
+  for (const auto &bb : fn.blocks) {
+    for (BlockId h : successors(bb)) {
+      if (!dt.dominates(h, bb.id))
+        continue;
+      auto &body = loops[h];
+      body.resize(fn.blocks.size(), false);
+      body[h] = true;
+      std::vector<BlockId> worklist{bb.id};
+      while (!worklist.empty()) {
+        BlockId b = worklist.back();
+        worklist.pop_back();
+        if (body[b])
+          continue;
+        body[b] = true;
+        for (BlockId p : fn.blocks[b].preds)
+          worklist.push_back(p);
+      }
+    }
+  }
+  std::vector<std::pair<BlockId, std::vector<bool>>> out(loops.begin(),
+                                                         loops.end());
+  auto size = [](const auto &l) {
+    return std::count(l.second.begin(), l.second.end(), true);
+  };
+  std::stable_sort(out.begin(), out.end(), [&](const auto &a, const auto &b) {
+    return size(a) > size(b);
+  });
+  return out;
+}
+
+// Whether a constant takes more than one instruction to materialize, so that
+// keeping it in a register across a loop beats rebuilding it.
+static bool isWideConstant(uint64_t value) {
+  return (value >> 16) != 0 && (~value >> 16) != 0;
+}
+
+size_t LoopInvariantCodeMotion::run(Function &fn) {
+  DominatorTree dt(fn);
+  size_t changes = 0;
+  for (const auto &[h, body] : naturalLoops(fn, dt)) {
+    DefUse du(fn);
+    // Hoist into the only block entering the loop from outside. It dominates
+    // the loop, so it also sees every value defined outside of it.
+    std::optional<BlockId> pre;
+    bool single = true;
+    for (BlockId p : fn.blocks[h].preds) {
+      if (body[p])
+        continue;
+      single = single && (!pre || *pre == p);
+      pre = p;
+    }
+    if (!pre || !single)
+      continue;
+    // Loads may only move where the loop is entered unconditionally, and
+    // only if nothing in the loop can store over them.
+    bool loadsMove = successors(fn.blocks[*pre]).size() == 1;
+    std::vector<MemAccess> stores;
+    for (const auto &bb : fn.blocks)
+      if (body[bb.id])
+        for (const auto &I : bb.insts)
+          if (auto *S = std::get_if<Store>(&I.payload))
+            stores.push_back(memAccess(du, S->base, S->offset, S->ty));
+
+    std::vector<bool> invariant(fn.numValues, false);
+    auto definedOutside = [&](ValueId v) {
+      auto site = du.defSite(v);
+      return !site || !body[site->block] || invariant[v];
+    };
+    auto canHoist = [&](Instr &I, BlockId b) {
+      if (auto *C = std::get_if<Const>(&I.payload))
+        return isWideConstant(C->value);
+      if (auto *G = std::get_if<GetPC>(&I.payload))
+        return isWideConstant(G->pc);
+      if (auto *L = std::get_if<Load>(&I.payload)) {
+        if (!loadsMove || b != h || !definedOutside(L->base))
+          return false;
+        auto a = memAccess(du, L->base, L->offset, L->ty);
+        return std::none_of(stores.begin(), stores.end(),
+                            [&](const MemAccess &s) { return s.mayAlias(a); });
+      }
+      if (!isSpeculatable(I))
+        return false;
+      bool ok = true;
+      forEachUse(I, [&](ValueId &v) { ok = ok && definedOutside(v); });
+      return ok;
+    };
+
+    // Collect in dependency order: an instruction is only marked once its
+    // operands are.
+    std::vector<Instr> hoisted;
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (auto &bb : fn.blocks) {
+        if (!body[bb.id])
+          continue;
+        for (auto &I : bb.insts) {
+          if (!I.dest || invariant[*I.dest] || !canHoist(I, bb.id))
+            continue;
+          invariant[*I.dest] = true;
+          hoisted.push_back(I);
+          changed = true;
+        }
+      }
+    }
+    if (hoisted.empty())
+      continue;
+    for (auto &bb : fn.blocks)
+      if (body[bb.id])
+        bb.insts.erase(std::remove_if(bb.insts.begin(), bb.insts.end(),
+                                      [&](const Instr &I) {
+                                        return I.dest && invariant[*I.dest];
+                                      }),
+                       bb.insts.end());
+    auto &insts = fn.blocks[*pre].insts;
+    insts.insert(insts.end(), hoisted.data(), hoisted.data() + hoisted.size());
+    changes += hoisted.size();
+  }
+  return changes;
+}
+
+// log2(v) if `v` is a power of two.
+static std::optional<unsigned> exactLog2(uint64_t v) {
+  if (!v || (v & (v - 1)))
+    return std::nullopt;
+  unsigned k = 0;
+  while (!(v >> k & 1))
+    ++k;
+  return k;
+}
+
+// Vectorizes the single-block loop `b` if it has the shape
+// LoopVectorization describes.
+static bool vectorizeLoop(Function &fn, BlockId b) {
+  const Block &loop = fn.blocks[b];
+  if (loop.external || loop.term.kind != TermKind::CondGoto ||
+      loop.preds.size() != 2)
+    return false;
+  auto term = std::get<TermCondGoto>(loop.term.data);
+  if ((term.t == b) == (term.f == b))
+    return false;
+  BlockId pre = loop.preds[0] == b ? loop.preds[1] : loop.preds[0];
+  if (pre == b)
+    return false;
+  DefUse du(fn);
+  auto inLoop = [&](ValueId v) {
+    auto site = du.defSite(v);
+    return site && site->block == b;
+  };
+  // Constants in the loop are rebuilt in front of it.
+  auto invariant = [&](ValueId v) {
+    return !inLoop(v) || du.constant(v).has_value();
+  };
+
+  // Phis either step by a constant (inductions) or sum a value (reductions).
+  struct Induction {
+    ValueId init = 0, next = 0;
+    int64_t step = 0;
+  };
+  struct Reduction {
+    ValueId phi = 0, init = 0, next = 0, addend = 0;
+  };
+  std::map<ValueId, Induction> inductions;
+  std::vector<Reduction> reductions;
+  for (const auto &I : loop.insts) {
+    auto *P = std::get_if<Phi>(&I.payload);
+    if (!P)
+      break;
+    ValueId phi = *I.dest;
+    ValueId init = incomingFrom(*P, pre), next = incomingFrom(*P, b);
+    auto *D = inLoop(next) ? du.def(next) : nullptr;
+    auto *B = D ? std::get_if<BinOp>(&D->payload) : nullptr;
+    if (P->incoming.size() != 2 || P->ty.kind != TypeKind::I64 || !B ||
+        B->ty.kind != TypeKind::I64)
+      return false;
+    auto c = du.constant(B->rhs);
+    if (B->lhs == phi && c &&
+        (B->kind == BinOpKind::Add || B->kind == BinOpKind::Sub)) {
+      auto step = static_cast<int64_t>(*c);
+      inductions[phi] = {init, next,
+                         B->kind == BinOpKind::Add ? step : -step};
+    } else if (B->kind == BinOpKind::Add &&
+               (B->lhs == phi) != (B->rhs == phi)) {
+      reductions.push_back(
+          {phi, init, next, B->lhs == phi ? B->rhs : B->lhs});
+    } else {
+      return false;
+    }
+  }
+  auto nextOf = [&](ValueId v) -> std::optional<ValueId> {
+    for (const auto &[phi, ind] : inductions)
+      if (ind.next == v)
+        return phi;
+    return std::nullopt;
+  };
+
+  // The loop goes on while `counter`'s next value compares `cond` to `bound`.
+  auto *C = inLoop(term.cond) ? std::get_if<ICmp>(&du.def(term.cond)->payload)
+                              : nullptr;
+  if (!C)
+    return false;
+  ICmpCond cond = term.t == b ? C->cond : inverse(C->cond);
+  ValueId bound = C->rhs;
+  auto counter = nextOf(C->lhs);
+  if (!counter) {
+    counter = nextOf(C->rhs);
+    bound = C->lhs;
+    switch (cond) {
+    case ICmpCond::ULT:
+      cond = ICmpCond::UGT;
+      break;
+    case ICmpCond::SLT:
+      cond = ICmpCond::SGT;
+      break;
+    case ICmpCond::UGT:
+      cond = ICmpCond::ULT;
+      break;
+    case ICmpCond::SGT:
+      cond = ICmpCond::SLT;
+      break;
+    default:
+      break;
+    }
+  }
+  if (!counter || !invariant(bound))
+    return false;
+  const Induction &count = inductions.at(*counter);
+  bool up = count.step > 0;
+  bool counted = cond == ICmpCond::NE ||
+                 (up && (cond == ICmpCond::ULT || cond == ICmpCond::SLT)) ||
+                 (!up && (cond == ICmpCond::UGT || cond == ICmpCond::SGT));
+  if (!counted)
+    return false;
+  for (const auto &[phi, ind] : inductions)
+    if (ind.step == INT64_MIN ||
+        !exactLog2(static_cast<uint64_t>(std::abs(ind.step))))
+      return false;
+
+  // The rest of the body must work on whole lanes of one element type.
+  struct Access {
+    ValueId phi = 0;
+    int64_t offset = 0;
+    uint32_t index = 0;
+    bool store = false;
+  };
+  std::vector<Access> accesses;
+  std::optional<Type> elem;
+  std::vector<bool> lanes(fn.numValues, false);
+  std::vector<ValueId> splats;
+  size_t vectorValues = 2 * reductions.size();
+  auto isReduction = [&](ValueId v) {
+    return std::any_of(reductions.begin(), reductions.end(),
+                       [&](const Reduction &r) { return r.next == v; });
+  };
+  auto access = [&](ValueId base, int64_t offset, Type ty, uint32_t index,
+                    bool store) {
+    if (ty.kind == TypeKind::I1 || ty.kind == TypeKind::V128 ||
+        (elem && elem->kind != ty.kind))
+      return false;
+    elem = ty;
+    if (auto phi = nextOf(base)) {
+      offset += inductions.at(*phi).step;
+      base = *phi;
+    }
+    // Vector loads and stores take 9-bit unscaled offsets.
+    if (!inductions.count(base) || offset < -256 || offset > 255)
+      return false;
+    accesses.push_back({base, offset, index, store});
+    return true;
+  };
+  auto operand = [&](ValueId v) {
+    if (lanes[v])
+      return true;
+    if (!invariant(v))
+      return false;
+    if (std::find(splats.begin(), splats.end(), v) == splats.end())
+      splats.push_back(v);
+    return true;
+  };
+  for (uint32_t i = 0; i < loop.insts.size(); ++i) {
+    const Instr &I = loop.insts[i];
+    if (std::holds_alternative<Phi>(I.payload))
+      continue;
+    if (I.dest && (*I.dest == term.cond || nextOf(*I.dest) ||
+                   isReduction(*I.dest) || du.constant(*I.dest)))
+      continue;
+    bool ok = false;
+    if (auto *L = std::get_if<Load>(&I.payload)) {
+      ok = access(L->base, L->offset, L->ty, i, false);
+      lanes[*I.dest] = true;
+      ++vectorValues;
+    } else if (auto *S = std::get_if<Store>(&I.payload)) {
+      ok = access(S->base, S->offset, S->ty, i, true) && operand(S->value);
+    } else if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+      ok = lanes[Z->src];
+    } else if (auto *X = std::get_if<SExt>(&I.payload)) {
+      ok = lanes[X->src];
+    } else if (auto *T = std::get_if<Trunc>(&I.payload)) {
+      ok = lanes[T->src] && bitWidth(T->to) >= bitWidth(*elem);
+    } else if (auto *B = std::get_if<BinOp>(&I.payload)) {
+      ok = (B->kind == BinOpKind::Add || B->kind == BinOpKind::Sub ||
+            B->kind == BinOpKind::And || B->kind == BinOpKind::Or ||
+            B->kind == BinOpKind::Xor) &&
+           (lanes[B->lhs] || lanes[B->rhs]) &&
+           bitWidth(B->ty) >= bitWidth(*elem) && operand(B->lhs) &&
+           operand(B->rhs);
+      ++vectorValues;
+    }
+    if (!ok)
+      return false;
+    if (I.dest)
+      lanes[*I.dest] = true;
+  }
+  if (!elem || accesses.empty())
+    return false;
+  unsigned size = bitWidth(*elem) / 8;
+  unsigned logSize = *exactLog2(size);
+  unsigned logLanes = 4 - logSize;
+  if (lanes[C->lhs] || lanes[C->rhs])
+    return false;
+
+  // Inductions only address memory and count; sums only feed themselves.
+  // Lanes narrower than the values they hold are only right in the low
+  // bits, which is all stores and the lane operations read.
+  auto usedOnlyBy = [&](ValueId v, auto &&allowed) {
+    for (const auto &u : du.uses(v)) {
+      if (u.block != b || u.index == loop.insts.size())
+        continue;
+      if (!allowed(loop.insts[u.index]))
+        return false;
+    }
+    return true;
+  };
+  for (const auto &[phi, ind] : inductions) {
+    auto asBase = [&](ValueId v) {
+      return [&, v](const Instr &U) {
+        if (auto *L = std::get_if<Load>(&U.payload))
+          return L->base == v;
+        if (auto *S = std::get_if<Store>(&U.payload))
+          return S->base == v && S->value != v;
+        return std::holds_alternative<Phi>(U.payload) ||
+               U.dest == ind.next || U.dest == term.cond;
+      };
+    };
+    if (!usedOnlyBy(phi, asBase(phi)) ||
+        !usedOnlyBy(ind.next, asBase(ind.next)))
+      return false;
+    bool accessed = std::any_of(accesses.begin(), accesses.end(),
+                                [&](const Access &a) { return a.phi == phi; });
+    if (accessed && ind.step != static_cast<int64_t>(size))
+      return false;
+  }
+  for (const auto &r : reductions) {
+    auto byNext = [&](const Instr &U) { return U.dest == r.next; };
+    auto byPhi = [&](const Instr &U) {
+      return std::holds_alternative<Phi>(U.payload);
+    };
+    if (elem->kind != TypeKind::I64 || !operand(r.addend) ||
+        !usedOnlyBy(r.phi, byNext) || !usedOnlyBy(r.next, byPhi))
+      return false;
+  }
+  if (vectorValues + splats.size() > LoopVectorization::kMaxVectorValues)
+    return false;
+
+  // Stores may not feed loads of a later iteration through memory: off the
+  // same base, loads come first and read at or after the stored element.
+  // Other bases are checked for overlap at run time.
+  std::vector<std::pair<ValueId, ValueId>> aliasChecks;
+  for (const auto &s : accesses) {
+    if (!s.store)
+      continue;
+    for (const auto &a : accesses) {
+      if (a.phi != s.phi) {
+        std::pair<ValueId, ValueId> pair = std::minmax(a.phi, s.phi);
+        if (std::find(aliasChecks.begin(), aliasChecks.end(), pair) ==
+            aliasChecks.end())
+          aliasChecks.push_back(pair);
+      } else if (a.store ? a.offset != s.offset
+                         : a.index > s.index || a.offset < s.offset) {
+        return false;
+      }
+    }
+  }
+  if (aliasChecks.size() > LoopVectorization::kMaxAliasChecks)
+    return false;
+
+  // guard: computes the trip count and decides; vector: the vector loop;
+  // middle: where the original loop resumes.
+  BlockId guard = fn.addBlock(fn.blocks[b].start).id;
+  BlockId vector = fn.addBlock(fn.blocks[b].start).id;
+  BlockId middle = fn.addBlock(fn.blocks[b].start).id;
+  auto emit = [&](BlockId at, auto payload) {
+    Instr I{};
+    I.dest = fn.numValues++;
+    I.payload = payload;
+    fn.blocks[at].insts.push_back(I);
+    return *I.dest;
+  };
+  std::unordered_map<uint64_t, ValueId> consts;
+  auto constant = [&](uint64_t value) {
+    auto [it, inserted] = consts.emplace(value, 0);
+    if (inserted)
+      it->second = emit(guard, Const{Type::i64(), value});
+    return it->second;
+  };
+  std::unordered_map<ValueId, ValueId> hoisted;
+  auto outside = [&](ValueId v) {
+    if (!inLoop(v))
+      return v;
+    auto [it, inserted] = hoisted.emplace(v, 0);
+    if (inserted) {
+      Instr copy = *du.def(v);
+      it->second = *copy.dest = fn.numValues++;
+      fn.blocks[guard].insts.push_back(copy);
+    }
+    return it->second;
+  };
+  auto binop = [&](BlockId at, BinOpKind kind, ValueId lhs, ValueId rhs) {
+    return emit(at, BinOp{kind, lhs, rhs, Type::i64()});
+  };
+
+  // Iterations of the original loop, and whether the vector loop may run.
+  ValueId x0 = count.init, end = outside(bound);
+  uint64_t step = static_cast<uint64_t>(std::abs(count.step));
+  unsigned logStep = *exactLog2(step);
+  ValueId diff = up ? binop(guard, BinOpKind::Sub, end, x0)
+                    : binop(guard, BinOpKind::Sub, x0, end);
+  std::vector<ValueId> checks;
+  if (cond == ICmpCond::NE) {
+    // The counter must hit the bound exactly.
+    checks.push_back(emit(guard, ICmp{ICmpCond::NE, diff, constant(0)}));
+    if (step > 1) {
+      ValueId rem = binop(guard, BinOpKind::And, diff, constant(step - 1));
+      checks.push_back(emit(guard, ICmp{ICmpCond::EQ, rem, constant(0)}));
+    }
+  } else {
+    checks.push_back(emit(guard, ICmp{cond, x0, end}));
+  }
+  // The loop runs ceil(diff / step) times; at least one of them is left to
+  // the original loop, which exits.
+  ValueId vectorTrips =
+      binop(guard, BinOpKind::LShr,
+            binop(guard, BinOpKind::Sub, diff, constant(1)),
+            constant(logStep + logLanes));
+  checks.push_back(
+      emit(guard, ICmp{ICmpCond::NE, vectorTrips, constant(0)}));
+  // Bytes each accessed base moves through in the vector loop.
+  ValueId bytes = binop(guard, BinOpKind::Shl, vectorTrips, constant(4));
+  // [lo, hi) holds every byte the vector loop accesses off `phi`.
+  auto range = [&](ValueId phi) {
+    int64_t lo = INT64_MAX, last = INT64_MIN;
+    for (const auto &a : accesses) {
+      if (a.phi == phi) {
+        lo = std::min(lo, a.offset);
+        last = std::max(last, a.offset);
+      }
+    }
+    ValueId init = inductions.at(phi).init;
+    ValueId top = binop(guard, BinOpKind::Add, init, bytes);
+    auto at = [&](ValueId v, int64_t offset) {
+      return binop(guard, BinOpKind::Add, v,
+                   constant(static_cast<uint64_t>(offset)));
+    };
+    return std::pair{at(init, lo), at(top, last)};
+  };
+  for (const auto &[p, q] : aliasChecks) {
+    auto [pLo, pHi] = range(p);
+    auto [qLo, qHi] = range(q);
+    checks.push_back(
+        binop(guard, BinOpKind::Or,
+              emit(guard, ICmp{ICmpCond::ULE, pHi, qLo}),
+              emit(guard, ICmp{ICmpCond::ULE, qHi, pLo})));
+  }
+  ValueId go = checks[0];
+  for (size_t i = 1; i < checks.size(); ++i)
+    go = emit(guard, BinOp{BinOpKind::And, go, checks[i], Type::i1()});
+  std::unordered_map<ValueId, ValueId> splatOf;
+  for (ValueId v : splats)
+    splatOf[v] = emit(guard, Splat{outside(v), *elem});
+
+  // The vector loop: one phi per base, the trip counter and partial sums.
+  struct Carried {
+    ValueId phi = 0, next = 0;
+  };
+  auto carried = [&]() {
+    Carried c{fn.numValues, fn.numValues + 1};
+    fn.numValues += 2;
+    return c;
+  };
+  std::map<ValueId, Carried> bases;
+  for (const auto &a : accesses)
+    if (!bases.count(a.phi))
+      bases[a.phi] = carried();
+  Carried trip = carried();
+  std::vector<Carried> partial;
+  for (size_t i = 0; i < reductions.size(); ++i)
+    partial.push_back(carried());
+  using Incoming = std::vector<std::pair<BlockId, ValueId>>;
+  auto phi = [&](Carried c, Type ty, ValueId init) {
+    Incoming incoming{{guard, init}, {vector, c.next}};
+    Instr P{};
+    P.dest = c.phi;
+    P.payload = Phi{ty, Span<std::pair<BlockId, ValueId>>::copy(*fn.arena,
+                                                              incoming)};
+    fn.blocks[vector].insts.push_back(P);
+  };
+  for (const auto &[p, c] : bases)
+    phi(c, Type::i64(), inductions.at(p).init);
+  phi(trip, Type::i64(), vectorTrips);
+  if (!reductions.empty()) {
+    ValueId zero = emit(guard, Splat{constant(0), *elem});
+    for (const auto &c : partial)
+      phi(c, Type::v128(), zero);
+  }
+
+  std::unordered_map<ValueId, ValueId> vec;
+  auto vecOf = [&](ValueId v) { return lanes[v] ? vec.at(v) : splatOf.at(v); };
+  auto baseOf = [&](ValueId base, int64_t offset) {
+    if (auto p = nextOf(base)) {
+      offset += inductions.at(*p).step;
+      base = *p;
+    }
+    return std::pair{bases.at(base).phi, offset};
+  };
+  for (const auto &I : fn.blocks[b].insts) {
+    if (auto *L = std::get_if<Load>(&I.payload)) {
+      auto [base, offset] = baseOf(L->base, L->offset);
+      vec[*I.dest] = emit(vector, Load{base, offset, Type::v128()});
+    } else if (auto *S = std::get_if<Store>(&I.payload)) {
+      auto [base, offset] = baseOf(S->base, S->offset);
+      Instr store{};
+      store.payload = Store{vecOf(S->value), base, offset, Type::v128()};
+      fn.blocks[vector].insts.push_back(store);
+    } else if (!I.dest || !lanes[*I.dest]) {
+      continue;
+    } else if (auto *Z = std::get_if<ZExt>(&I.payload)) {
+      vec[*I.dest] = vecOf(Z->src);
+    } else if (auto *X = std::get_if<SExt>(&I.payload)) {
+      vec[*I.dest] = vecOf(X->src);
+    } else if (auto *T = std::get_if<Trunc>(&I.payload)) {
+      vec[*I.dest] = vecOf(T->src);
+    } else if (auto *B = std::get_if<BinOp>(&I.payload)) {
+      vec[*I.dest] = emit(
+          vector, VecBinOp{B->kind, vecOf(B->lhs), vecOf(B->rhs), *elem});
+    }
+  }
+  auto define = [&](BlockId at, ValueId dest, auto payload) {
+    Instr I{};
+    I.dest = dest;
+    I.payload = payload;
+    fn.blocks[at].insts.push_back(I);
+  };
+  for (size_t i = 0; i < reductions.size(); ++i)
+    define(vector, partial[i].next,
+           VecBinOp{BinOpKind::Add, partial[i].phi,
+                    vecOf(reductions[i].addend), *elem});
+  for (const auto &[p, c] : bases)
+    define(vector, c.next,
+           BinOp{BinOpKind::Add, c.phi, constant(16), Type::i64()});
+  define(vector, trip.next,
+         BinOp{BinOpKind::Sub, trip.phi, constant(1), Type::i64()});
+  ValueId again =
+      emit(vector, ICmp{ICmpCond::NE, trip.next, constant(0)});
+  fn.blocks[vector].term.kind = TermKind::CondGoto;
+  fn.blocks[vector].term.data = TermCondGoto{again, vector, middle};
+  fn.blocks[vector].preds = {guard, vector};
+
+  // The original loop resumes where the vector loop stopped.
+  std::unordered_map<ValueId, ValueId> resume;
+  for (const auto &[p, ind] : inductions) {
+    uint64_t stride = static_cast<uint64_t>(std::abs(ind.step));
+    ValueId advance = binop(middle, BinOpKind::Shl, vectorTrips,
+                            constant(logLanes + *exactLog2(stride)));
+    resume[p] = binop(middle, ind.step > 0 ? BinOpKind::Add : BinOpKind::Sub,
+                      ind.init, advance);
+  }
+  for (size_t i = 0; i < reductions.size(); ++i) {
+    ValueId sum = emit(middle, ReduceAdd{partial[i].next, *elem});
+    resume[reductions[i].phi] =
+        binop(middle, BinOpKind::Add, reductions[i].init, sum);
+  }
+  fn.blocks[middle].term.kind = TermKind::Goto;
+  fn.blocks[middle].term.data = TermGoto{b};
+  fn.blocks[middle].preds = {vector};
+
+  fn.blocks[guard].term.kind = TermKind::CondGoto;
+  fn.blocks[guard].term.data = TermCondGoto{go, vector, b};
+  fn.blocks[guard].preds = {pre};
+  auto &preTerm = fn.blocks[pre].term;
+  if (auto *G = std::get_if<TermGoto>(&preTerm.data))
+    G->target = guard;
+  if (auto *CG = std::get_if<TermCondGoto>(&preTerm.data))
+    (CG->t == b ? CG->t : CG->f) = guard;
+  for (auto &I : fn.blocks[b].insts) {
+    auto *P = std::get_if<Phi>(&I.payload);
+    if (!P)
+      break;
+    Incoming incoming;
+    for (const auto &in : P->incoming)
+      incoming.push_back({in.first == pre ? guard : in.first, in.second});
+    incoming.push_back({middle, resume.at(*I.dest)});
+    P->incoming = Span<std::pair<BlockId, ValueId>>::copy(*fn.arena,
+                                                          incoming);
+  }
+  auto &preds = fn.blocks[b].preds;
+  std::replace(preds.begin(), preds.end(), pre, guard);
+  preds.push_back(middle);
+  return true;
+}
+
+size_t LoopVectorization::run(Function &fn) {
+  // The blocks added in front of each vectorized loop. They are laid out
+  // there, so that the values they share with the loop live nearby.
+  auto n = static_cast<BlockId>(fn.blocks.size());
+  std::vector<std::vector<BlockId>> before(n);
+  size_t changes = 0;
+  for (BlockId b = 0; b < n; ++b) {
+    BlockId first = static_cast<BlockId>(fn.blocks.size());
+    if (!vectorizeLoop(fn, b))
+      continue;
+    for (BlockId id = first; id < fn.blocks.size(); ++id)
+      before[b].push_back(id);
+    ++changes;
+  }
+  if (!changes)
+    return 0;
+  std::vector<BlockId> order;
+  for (BlockId b = 0; b < n; ++b) {
+    order.insert(order.end(), before[b].begin(), before[b].end());
+    order.push_back(b);
+  }
+  reorderBlocks(fn, order);
+  return changes;
+}
+
+// Rewrites the single-block search loop `b` as LoopIdiomRecognition
+// describes.
+static bool recognizeSearch(Function &fn, BlockId b) {
+  const Block &loop = fn.blocks[b];
+  if (loop.external || loop.term.kind != TermKind::CondGoto ||
+      loop.preds.size() != 2)
+    return false;
+  auto term = std::get<TermCondGoto>(loop.term.data);
+  if ((term.t == b) == (term.f == b))
+    return false;
+  BlockId pre = loop.preds[0] == b ? loop.preds[1] : loop.preds[0];
+  if (pre == b)
+    return false;
+  DefUse du(fn);
+  auto inLoop = [&](ValueId v) {
+    auto site = du.defSite(v);
+    return site && site->block == b;
+  };
+
+  // Every phi steps by a power of two.
+  struct Induction {
+    ValueId next = 0;
+    int64_t step = 0;
+  };
+  std::map<ValueId, Induction> inductions;
+  for (const auto &I : loop.insts) {
+    auto *P = std::get_if<Phi>(&I.payload);
+    if (!P)
+      break;
+    ValueId next = incomingFrom(*P, b);
+    auto *D = inLoop(next) ? du.def(next) : nullptr;
+    auto *B = D ? std::get_if<BinOp>(&D->payload) : nullptr;
+    if (P->incoming.size() != 2 || P->ty.kind != TypeKind::I64 || !B ||
+        B->ty.kind != TypeKind::I64 || B->lhs != *I.dest ||
+        (B->kind != BinOpKind::Add && B->kind != BinOpKind::Sub))
+      return false;
+    auto c = du.constant(B->rhs);
+    if (!c)
+      return false;
+    auto step = static_cast<int64_t>(*c);
+    if (B->kind == BinOpKind::Sub)
+      step = -step;
+    if (step == INT64_MIN ||
+        !exactLog2(static_cast<uint64_t>(std::abs(step))))
+      return false;
+    inductions[*I.dest] = {next, step};
+  }
+  auto nextOf = [&](ValueId v) -> std::optional<ValueId> {
+    for (const auto &[phi, ind] : inductions)
+      if (ind.next == v)
+        return phi;
+    return std::nullopt;
+  };
+
+  // The loop stops at the first element for which `stop` holds.
+  auto *C = inLoop(term.cond) ? std::get_if<ICmp>(&du.def(term.cond)->payload)
+                              : nullptr;
+  if (!C)
+    return false;
+  ICmpCond stop = term.t == b ? inverse(C->cond) : C->cond;
+  if (stop != ICmpCond::EQ && stop != ICmpCond::NE)
+    return false;
+
+  // Besides, the body only loads elements through the inductions and
+  // extends them.
+  enum class Ext { None, Zero, Sign };
+  struct Element {
+    ValueId load = 0;
+    Ext ext = Ext::None;
+  };
+  std::unordered_map<ValueId, Element> elements;
+  std::vector<std::pair<ValueId, ValueId>> loads; // (load, induction)
+  std::optional<Type> elem;
+  for (const auto &I : loop.insts) {
+    if (std::holds_alternative<Phi>(I.payload) ||
+        (I.dest && (*I.dest == term.cond || nextOf(*I.dest) ||
+                    du.constant(*I.dest))))
+      continue;
+    if (auto *L = std::get_if<Load>(&I.payload)) {
+      ValueId base = L->base;
+      int64_t offset = L->offset;
+      if (auto phi = nextOf(base)) {
+        offset += inductions.at(*phi).step;
+        base = *phi;
+      }
+      bool lane = L->ty.kind == TypeKind::I8 || L->ty.kind == TypeKind::I16 ||
+                  L->ty.kind == TypeKind::I32;
+      if (!lane || (elem && elem->kind != L->ty.kind) ||
+          !inductions.count(base) || offset != 0)
+        return false;
+      elem = L->ty;
+      elements[*I.dest] = {*I.dest, Ext::None};
+      loads.push_back({*I.dest, base});
+      continue;
+    }
+    auto *Z = std::get_if<ZExt>(&I.payload);
+    auto *X = std::get_if<SExt>(&I.payload);
+    ValueId src = Z ? Z->src : X ? X->src : 0;
+    auto it = Z || X ? elements.find(src) : elements.end();
+    if (it == elements.end() || it->second.ext != Ext::None)
+      return false;
+    elements[*I.dest] = {src, Z ? Ext::Zero : Ext::Sign};
+  }
+  if (loads.empty())
+    return false;
+
+  // Elements are compared with each other or with a constant that an
+  // element can equal. Both sides must be extended alike, so that equal
+  // values mean equal elements.
+  auto lhs = elements.find(C->lhs), rhs = elements.find(C->rhs);
+  std::optional<uint64_t> k;
+  if (lhs == elements.end())
+    std::swap(lhs, rhs);
+  if (lhs == elements.end())
+    return false;
+  if (rhs != elements.end()) {
+    if (lhs->second.ext != rhs->second.ext)
+      return false;
+  } else {
+    k = du.constant(lhs == elements.find(C->lhs) ? C->rhs : C->lhs);
+    if (!k)
+      return false;
+    Type cmpTy = du.typeOf(lhs->first);
+    uint64_t lane = truncTo(*elem, *k);
+    uint64_t widened =
+        lhs->second.ext == Ext::Sign
+            ? truncTo(cmpTy, static_cast<uint64_t>(sextFrom(*elem, lane)))
+            : lane;
+    if (widened != *k)
+      return false;
+    k = lane;
+  }
+
+  // Bases step one element at a time; the others only count.
+  std::vector<ValueId> bases;
+  unsigned size = bitWidth(*elem) / 8;
+  unsigned logSize = *exactLog2(size);
+  for (const auto &[load, phi] : loads) {
+    if (inductions.at(phi).step != static_cast<int64_t>(size))
+      return false;
+    if (std::find(bases.begin(), bases.end(), phi) == bases.end())
+      bases.push_back(phi);
+  }
+  if (bases.size() > LoopIdiomRecognition::kMaxBases)
+    return false;
+
+  // check: after each scalar iteration, whether the vector loop may take
+  // over; guard: whether the other bases are aligned with the first;
+  // vector: the vector loop; middle: where the scalar loop resumes.
+  BlockId check = fn.addBlock(fn.blocks[b].start).id;
+  BlockId guard =
+      bases.size() > 1 ? fn.addBlock(fn.blocks[b].start).id : check;
+  BlockId vector = fn.addBlock(fn.blocks[b].start).id;
+  BlockId middle = fn.addBlock(fn.blocks[b].start).id;
+  auto emit = [&](BlockId at, auto payload) {
+    Instr I{};
+    I.dest = fn.numValues++;
+    I.payload = payload;
+    fn.blocks[at].insts.push_back(I);
+    return *I.dest;
+  };
+  auto constant = [&](BlockId at, uint64_t value) {
+    return emit(at, Const{Type::i64(), value});
+  };
+  auto binop = [&](BlockId at, BinOpKind kind, ValueId lhs, ValueId rhs) {
+    return emit(at, BinOp{kind, lhs, rhs, Type::i64()});
+  };
+
+  // Whole vectors are only loaded from 16-byte aligned addresses, which
+  // never cross a page, so they read no further than the scalar loop could
+  // fault. Every base must be aligned at once; bases apart by other than a
+  // multiple of 16 stay so, and are only told apart once the first one is
+  // aligned.
+  ValueId first = inductions.at(bases[0]).next;
+  auto aligned = [&](BlockId at, ValueId v) {
+    ValueId low = binop(at, BinOpKind::And, v, constant(at, 15));
+    return emit(at, ICmp{ICmpCond::EQ, low, constant(at, 0)});
+  };
+  fn.blocks[check].term.kind = TermKind::CondGoto;
+  fn.blocks[check].term.data =
+      TermCondGoto{aligned(check, first), guard == check ? vector : guard, b};
+  fn.blocks[check].preds = {b};
+  if (guard != check) {
+    std::optional<ValueId> go;
+    for (size_t i = 1; i < bases.size(); ++i) {
+      ValueId apart = binop(guard, BinOpKind::Xor, first,
+                            inductions.at(bases[i]).next);
+      ValueId together = aligned(guard, apart);
+      go = go ? emit(guard, BinOp{BinOpKind::And, *go, together, Type::i1()})
+              : together;
+    }
+    fn.blocks[guard].term.kind = TermKind::CondGoto;
+    fn.blocks[guard].term.data = TermCondGoto{*go, vector, b};
+    fn.blocks[guard].preds = {check};
+  }
+
+  // The vector loop: one phi per base. The constant is splat in front of
+  // the scalar loop, so that neither loop repeats it.
+  std::optional<ValueId> splat;
+  if (k)
+    splat = emit(pre, Splat{constant(pre, *k), *elem});
+  using Incoming = std::vector<std::pair<BlockId, ValueId>>;
+  std::map<ValueId, std::pair<ValueId, ValueId>> carried; // phi, next
+  for (ValueId p : bases) {
+    ValueId phi = fn.numValues++, next = fn.numValues++;
+    Incoming incoming{{guard, inductions.at(p).next}, {vector, next}};
+    Instr P{};
+    P.dest = phi;
+    P.payload = Phi{Type::i64(), Span<std::pair<BlockId, ValueId>>::copy(
+                                     *fn.arena, incoming)};
+    fn.blocks[vector].insts.push_back(P);
+    carried[p] = {phi, next};
+  }
+  std::unordered_map<ValueId, ValueId> vec;
+  for (const auto &[load, p] : loads)
+    vec[load] = emit(vector, Load{carried.at(p).first, 0, Type::v128()});
+  ValueId a = vec.at(lhs->second.load);
+  ValueId other = k ? *splat : vec.at(rhs->second.load);
+  // A lane that stops the loop is nonzero.
+  ValueId mask = stop == ICmpCond::EQ
+                     ? emit(vector, VecCmpEq{a, other, *elem})
+                     : emit(vector, VecBinOp{BinOpKind::Xor, a, other, *elem});
+  ValueId any = emit(vector, ReduceUMax{mask, *elem});
+  ValueId found = emit(vector, ICmp{ICmpCond::NE, any,
+                                    emit(vector, Const{*elem, 0})});
+  ValueId sixteen = constant(vector, 16);
+  for (const auto &[p, c] : carried) {
+    Instr I{};
+    I.dest = c.second;
+    I.payload = BinOp{BinOpKind::Add, c.first, sixteen, Type::i64()};
+    fn.blocks[vector].insts.push_back(I);
+  }
+  fn.blocks[vector].term.kind = TermKind::CondGoto;
+  fn.blocks[vector].term.data = TermCondGoto{found, middle, vector};
+  fn.blocks[vector].preds = {guard, vector};
+
+  // The scalar loop resumes at the vector holding the stopping element and
+  // finds it within 16 bytes.
+  std::unordered_map<ValueId, ValueId> resume;
+  ValueId iterations = binop(
+      middle, BinOpKind::LShr,
+      binop(middle, BinOpKind::Sub, carried.at(bases[0]).first, first),
+      constant(middle, logSize));
+  for (const auto &[p, ind] : inductions) {
+    if (carried.count(p)) {
+      resume[p] = carried.at(p).first;
+      continue;
+    }
+    unsigned logStride = *exactLog2(static_cast<uint64_t>(std::abs(ind.step)));
+    ValueId advance = logStride ? binop(middle, BinOpKind::Shl, iterations,
+                                        constant(middle, logStride))
+                                : iterations;
+    resume[p] = binop(middle, ind.step > 0 ? BinOpKind::Add : BinOpKind::Sub,
+                      ind.next, advance);
+  }
+  fn.blocks[middle].term.kind = TermKind::Goto;
+  fn.blocks[middle].term.data = TermGoto{b};
+  fn.blocks[middle].preds = {vector};
+
+  auto &loopTerm = std::get<TermCondGoto>(fn.blocks[b].term.data);
+  (loopTerm.t == b ? loopTerm.t : loopTerm.f) = check;
+  for (auto &I : fn.blocks[b].insts) {
+    auto *P = std::get_if<Phi>(&I.payload);
+    if (!P)
+      break;
+    Incoming incoming;
+    for (const auto &in : P->incoming) {
+      incoming.push_back({in.first == b ? check : in.first, in.second});
+      if (in.first == b && guard != check)
+        incoming.push_back({guard, in.second});
+    }
+    incoming.push_back({middle, resume.at(*I.dest)});
+    P->incoming = Span<std::pair<BlockId, ValueId>>::copy(*fn.arena,
+                                                          incoming);
+  }
+  auto &preds = fn.blocks[b].preds;
+  std::replace(preds.begin(), preds.end(), b, check);
+  if (guard != check)
+    preds.push_back(guard);
+  preds.push_back(middle);
+  return true;
+}
+
+size_t LoopIdiomRecognition::run(Function &fn) {
+  // The blocks added for each loop are laid out right after it.
+  auto n = static_cast<BlockId>(fn.blocks.size());
+  std::vector<std::vector<BlockId>> after(n);
+  size_t changes = 0;
+  for (BlockId b = 0; b < n; ++b) {
+    BlockId first = static_cast<BlockId>(fn.blocks.size());
+    if (!recognizeSearch(fn, b))
+      continue;
+    for (BlockId id = first; id < fn.blocks.size(); ++id)
+      after[b].push_back(id);
+    ++changes;
+  }
+  if (!changes)
+    return 0;
+  std::vector<BlockId> order;
+  for (BlockId b = 0; b < n; ++b) {
+    order.push_back(b);
+    order.insert(order.end(), after[b].begin(), after[b].end());
+  }
+  reorderBlocks(fn, order);
+  return changes;
+}
+
+size_t LoopUnrolling::run(Function &fn) {
+  size_t changes = 0;
+  // The copies of each unrolled loop, laid out right after it.
+  std::vector<std::vector<BlockId>> after(fn.blocks.size());
+  for (BlockId b = 0; b < after.size(); ++b) {
+    if (fn.blocks[b].term.kind != TermKind::CondGoto)
+      continue;
+    auto t = std::get<TermCondGoto>(fn.blocks[b].term.data);
+    bool backIsTrue = t.t == b;
+    BlockId exit = backIsTrue ? t.f : t.t;
+    if ((t.t != b && t.f != b) || exit == b)
+      continue;
+    size_t size = 0, numPhis = 0;
+    for (const auto &I : fn.blocks[b].insts) {
+      if (std::holds_alternative<Phi>(I.payload))
+        ++numPhis;
+      else
+        ++size;
+      if (std::holds_alternative<ExitIf>(I.payload))
+        size = budget;
+    }
+    size_t factor = size ? std::min<size_t>(kMaxFactor, budget / size) : 0;
+    if (factor < 2)
+      continue;
+
+    // versions[k] maps the values of the loop block to their counterparts
+    // in copy k; values defined outside the loop map to themselves.
+    std::vector<std::unordered_map<ValueId, ValueId>> versions(factor);
+    auto in = [&](size_t k, ValueId v) {
+      auto it = versions[k].find(v);
+      return it == versions[k].end() ? v : it->second;
+    };
+    auto backValue = [&](const Phi &phi) {
+      for (const auto &inc : phi.incoming)
+        if (inc.first == b)
+          return inc.second;
+      return ValueId{0};
+    };
+    std::vector<BlockId> copies{b};
+    for (size_t k = 1; k < factor; ++k) {
+      BlockId id = fn.addBlock(fn.blocks[b].start).id;
+      fn.blocks[id].preds.push_back(copies.back());
+      copies.push_back(id);
+      // Each copy starts with the values the previous one ends with.
+      for (const auto &I : fn.blocks[b].insts)
+        if (auto *phi = std::get_if<Phi>(&I.payload))
+          versions[k][*I.dest] = in(k - 1, backValue(*phi));
+      for (const auto &I : fn.blocks[b].insts) {
+        if (std::holds_alternative<Phi>(I.payload))
+          continue;
+        Instr C = I;
+        forEachUse(C, [&](ValueId &v) { v = in(k, v); });
+        if (C.dest) {
+          versions[k][*C.dest] = fn.numValues++;
+          C.dest = versions[k][*I.dest];
+        }
+        fn.blocks[id].insts.push_back(C);
+      }
+    }
+    // Chain the copies: each one falls back to the next, the last one to the
+    // original block, and all of them may leave the loop.
+    for (size_t k = 0; k < factor; ++k) {
+      BlockId next = copies[(k + 1) % factor];
+      TermCondGoto c{in(k, t.cond), backIsTrue ? next : exit,
+                     backIsTrue ? exit : next};
+      fn.blocks[copies[k]].term.kind = TermKind::CondGoto;
+      fn.blocks[copies[k]].term.data = c;
+    }
+    auto &preds = fn.blocks[b].preds;
+    std::replace(preds.begin(), preds.end(), b, copies.back());
+    for (auto &I : fn.blocks[b].insts) {
+      auto *phi = std::get_if<Phi>(&I.payload);
+      if (!phi)
+        continue;
+      for (auto &inc : phi->incoming)
+        if (inc.first == b)
+          inc = {copies.back(), in(factor - 1, inc.second)};
+    }
+
+    // The exit is now entered from every copy. Its phis and the uses of loop
+    // values past it merge the copies' versions. Such uses only exist if the
+    // loop is the exit's sole predecessor, as they must be dominated by it.
+    auto &exitBlock = fn.blocks[exit];
+    exitBlock.preds.insert(exitBlock.preds.end(), copies.begin() + 1,
+                           copies.end());
+    size_t oldPhis = 0;
+    for (auto &I : exitBlock.insts) {
+      auto *phi = std::get_if<Phi>(&I.payload);
+      if (!phi)
+        break;
+      ++oldPhis;
+      std::vector<std::pair<BlockId, ValueId>> incoming(phi->incoming.begin(),
+                                                        phi->incoming.end());
+      for (const auto &inc : phi->incoming)
+        if (inc.first == b)
+          for (size_t k = 1; k < factor; ++k)
+            incoming.push_back({copies[k], in(k, inc.second)});
+      phi->incoming = Span<std::pair<BlockId, ValueId>>::copy(*fn.arena,
+                                                              incoming);
+    }
+    std::unordered_map<ValueId, Type> types;
+    for (const auto &I : fn.blocks[b].insts)
+      if (I.dest)
+        types[*I.dest] = resultType(I);
+    std::unordered_map<ValueId, ValueId> merged;
+    std::vector<Instr> newPhis;
+    auto mergeOutside = [&](ValueId &v) {
+      if (!versions[1].count(v))
+        return;
+      auto [it, inserted] = merged.emplace(v, 0);
+      if (inserted) {
+        std::vector<std::pair<BlockId, ValueId>> incoming;
+        for (size_t k = 0; k < factor; ++k)
+          incoming.push_back({copies[k], in(k, v)});
+        Instr P{};
+        P.dest = it->second = fn.numValues++;
+        P.payload = Phi{types.at(v), Span<std::pair<BlockId, ValueId>>::copy(
+                                         *fn.arena, incoming)};
+        newPhis.push_back(P);
+      }
+      v = it->second;
+    };
+    for (auto &bb : fn.blocks) {
+      if (std::count(copies.begin(), copies.end(), bb.id))
+        continue;
+      for (size_t i = bb.id == exit ? oldPhis : 0; i < bb.insts.size(); ++i)
+        forEachUse(bb.insts[i], mergeOutside);
+      forEachUse(bb.term, mergeOutside);
+    }
+    auto &exitInsts = fn.blocks[exit].insts;
+    exitInsts.insert(exitInsts.begin() + oldPhis, newPhis.data(),
+                     newPhis.data() + newPhis.size());
+    after[b].assign(copies.begin() + 1, copies.end());
+    ++changes;
+  }
+  if (!changes)
+    return 0;
+  std::vector<BlockId> order;
+  for (BlockId b = 0; b < after.size(); ++b) {
+    order.push_back(b);
+    order.insert(order.end(), after[b].begin(), after[b].end());
+  }
+  reorderBlocks(fn, order);
+  return changes;
+}
+
+size_t DeadCodeElimination::run(Function &fn) {
+  DefUse du(fn);
+  std::vector<bool> live(fn.numValues, false);
+  std::vector<ValueId> worklist;
+  auto markLive = [&](ValueId &v) {
+    if (v < live.size() && !live[v]) {
+      live[v] = true;
+      worklist.push_back(v);
+    }
+  };
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts)
+      if (!I.dest)
+        forEachUse(I, markLive); // WriteReg, Store and ExitIf
+    forEachUse(bb.term, markLive);
+  }
+  while (!worklist.empty()) {
+    ValueId v = worklist.back();
+    worklist.pop_back();
+    if (Instr *I = du.def(v))
+      forEachUse(*I, markLive);
+  }
+
+  size_t changes = 0;
+  for (auto &bb : fn.blocks) {
+    auto before = bb.insts.size();
+    bb.insts.erase(std::remove_if(bb.insts.begin(), bb.insts.end(),
+                                  [&](const Instr &I) {
+                                    return I.dest && *I.dest < live.size() &&
+                                           !live[*I.dest];
+                                  }),
+                   bb.insts.end());
+    changes += before - bb.insts.size();
+  }
+  return changes;
+}
+
+} // namespace riscy::ir
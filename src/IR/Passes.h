@@ -0,0 +1,179 @@
+#pragma once
+
+#include "IR/PassManager.h"
+
+namespace riscy::ir {
+
+// Replaces operations on constants with their result and conditional
+// branches on a constant with a direct branch.
+class ConstantFolding : public FunctionPass {
+public:
+  const char *name() const override { return "constfold"; }
+  size_t run(Function &fn) override;
+};
+
+// Replaces loads from constant addresses in read-only memory (code and
+// read-only data of the image) with the value stored there.
+class ConstantLoadFolding : public FunctionPass {
+public:
+  explicit ConstantLoadFolding(ReadOnlyMemory memory)
+      : memory(std::move(memory)) {}
+  const char *name() const override { return "loadfold"; }
+  size_t run(Function &fn) override;
+
+private:
+  ReadOnlyMemory memory;
+};
+
+// Forwards values through no-op conversions (ext/trunc to the same type,
+// trunc of an extension back to the original type), collapses chains of
+// the same conversion, and replaces phis that merge a single value.
+class CopyPropagation : public FunctionPass {
+public:
+  const char *name() const override { return "copyprop"; }
+  size_t run(Function &fn) override;
+};
+
+// Applies algebraic identities (x + 0, x & x, x - x, ...), moves constants
+// to the right of commutative operations and reassociates
+// `(x op c1) op c2` into `x op (c1 op c2)`.
+class AlgebraicSimplify : public FunctionPass {
+public:
+  const char *name() const override { return "simplify"; }
+  size_t run(Function &fn) override;
+};
+
+// Removes sign extensions from 32 bits of values that are already
+// sign-extended: results of W operations and 32-bit loads, small constants,
+// and phis and bitwise operations of such values. The 64-bit idiom
+// `(x << 32) >> 32` becomes an extension.
+class SignExtensionElimination : public FunctionPass {
+public:
+  const char *name() const override { return "sext"; }
+  size_t run(Function &fn) override;
+};
+
+// Uses the known bits of values to fold operations whose result they fix
+// (including range checks), drop masks and `(x << k) >> k` idioms that keep
+// every bit, drop extensions of truncated values that already fit, and
+// compare booleans directly instead of their widened form.
+class KnownBitsSimplification : public FunctionPass {
+public:
+  const char *name() const override { return "knownbits"; }
+  size_t run(Function &fn) override;
+};
+
+// Global value numbering of pure operations over the dominator tree: an
+// operation equal to one in a dominating block is replaced by it. Constants
+// are only shared within a block, as they are cheaper to rematerialize than
+// to keep in a register. Guest register reads and loads are never merged.
+class GVN : public FunctionPass {
+public:
+  const char *name() const override { return "gvn"; }
+  size_t run(Function &fn) override;
+};
+
+// Forwards stored and loaded values to later loads of the same bytes and
+// removes stores that are overwritten before anything can read them, within
+// each block (and so within superblocks). Addresses are compared as a base
+// value plus a constant offset; accesses off different bases may alias.
+class LoadStoreOptimization : public FunctionPass {
+public:
+  const char *name() const override { return "memopt"; }
+  size_t run(Function &fn) override;
+};
+
+// Promotes the frame slots of a function to SSA values (mem2reg for the
+// guest stack). Slots are addressed off the stack pointer the function is
+// entered with and lie below it. Promotion requires that no address derived
+// from that pointer escapes other than through registers on the way out, as
+// nothing else can then reach the slots while the function runs. Slots are
+// loaded at the entry when needed and stored back on every exit.
+class StackPromotion : public FunctionPass {
+public:
+  const char *name() const override { return "mem2reg"; }
+  size_t run(Function &fn) override;
+};
+
+// Turns small branches that only compute values into selects: a block ending
+// in a conditional goto whose arms (one for a hammock, two for a diamond)
+// are entered from it alone, hold at most kMaxArmSize pure operations and
+// go on to the same join block. The arms are moved into the branching block
+// and the join's phis become selects on the branch condition. A join that
+// is then only entered from the branching block is merged into it.
+class IfConversion : public FunctionPass {
+public:
+  static constexpr size_t kMaxArmSize = 4;
+  static constexpr size_t kMaxSelects = 4;
+
+  const char *name() const override { return "ifconvert"; }
+  size_t run(Function &fn) override;
+};
+
+// Moves loop-invariant computations out of natural loops into the block that
+// enters the loop, when there is only one: pure operations on values defined
+// outside the loop, constants that take more than one instruction to build,
+// and loads in the loop header from invariant addresses that no store in the
+// loop may overwrite, if the loop is entered unconditionally.
+class LoopInvariantCodeMotion : public FunctionPass {
+public:
+  const char *name() const override { return "licm"; }
+  size_t run(Function &fn) override;
+};
+
+// Recognizes the search loops of string and memory routines (strlen,
+// memchr, memcmp-style loops): single-block loops that step through arrays
+// of bytes, halfwords or words until an element equals (or differs from) a
+// constant or the element of another array. Once the next element is 16-byte
+// aligned, a vector loop compares 16 bytes at a time and hands the vector
+// with the stopping element back to the original loop. Copy and fill loops
+// are counted and left to LoopVectorization.
+class LoopIdiomRecognition : public FunctionPass {
+public:
+  static constexpr size_t kMaxBases = 2;
+
+  const char *name() const override { return "idioms"; }
+  size_t run(Function &fn) override;
+};
+
+// Vectorizes counted single-block loops whose memory accesses step through
+// arrays of one element size, one element per iteration: lane-wise Add, Sub,
+// And, Or and Xor between loaded elements and invariants, stores of them,
+// and sums into an i64 accumulator. The vector loop runs 16 bytes at a time
+// when the trip count is computable, large enough and the stored ranges do
+// not overlap the others at run time; the original loop finishes the last
+// iterations, at least one of them, so values used after it need no merge.
+class LoopVectorization : public FunctionPass {
+public:
+  static constexpr size_t kMaxVectorValues = 12;
+  static constexpr size_t kMaxAliasChecks = 4;
+
+  const char *name() const override { return "vectorize"; }
+  size_t run(Function &fn) override;
+};
+
+// Unrolls loops made of a single block that branches back to itself, so that
+// consecutive iterations chain their values without phi copies and expose
+// redundancies to later passes. Every copy keeps its exit test. The loop is
+// copied up to kMaxFactor times within `budget` instructions.
+class LoopUnrolling : public FunctionPass {
+public:
+  static constexpr size_t kMaxFactor = 4;
+
+  explicit LoopUnrolling(size_t budget = 32) : budget(budget) {}
+  const char *name() const override { return "unroll"; }
+  size_t run(Function &fn) override;
+
+private:
+  size_t budget;
+};
+
+// Removes value-producing instructions whose result is never used,
+// including cycles of phis that only feed each other.
+class DeadCodeElimination : public FunctionPass {
+public:
+  const char *name() const override { return "dce"; }
+  size_t run(Function &fn) override;
+};
+
+} // namespace riscy::ir
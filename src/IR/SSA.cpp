@@ -0,0 +1,154 @@
+#include "IR/SSA.h"
+
+#include <algorithm>
+#include <optional>
+
+namespace riscy::ir {
+
+SSABuilder::SSABuilder(Function &fn, EntryRead entryRead, VarType varType)
+    : fn(fn), entryRead(std::move(entryRead)), varType(std::move(varType)),
+      currentDef(fn.blocks.size()), incompletePhis(fn.blocks.size()),
+      sealed(fn.blocks.size(), false) {
+  // Nothing can be added to a block without predecessors.
+  for (const auto &bb : fn.blocks)
+    if (bb.preds.empty())
+      sealed[bb.id] = true;
+}
+
+void SSABuilder::writeVariable(Var var, BlockId block, ValueId value) {
+  currentDef[block][var] = value;
+}
+
+ValueId SSABuilder::readVariable(Var var, BlockId block) {
+  auto it = currentDef[block].find(var);
+  if (it != currentDef[block].end())
+    return resolve(it->second);
+  return readVariableRecursive(var, block);
+}
+
+ValueId SSABuilder::readVariableRecursive(Var var, BlockId block) {
+  const auto &preds = fn.blocks[block].preds;
+  ValueId val = 0;
+  if (!sealed[block]) {
+    // Operands are added once all predecessors are known.
+    val = newPhi(block, var);
+    incompletePhis[block][var] = val;
+  } else if (preds.empty()) {
+    val = entryRead(block, var);
+  } else if (preds.size() == 1) {
+    val = readVariable(var, preds.front());
+  } else {
+    // Break cycles through loops with an operandless phi.
+    val = newPhi(block, var);
+    writeVariable(var, block, val);
+    val = addPhiOperands(val);
+  }
+  writeVariable(var, block, val);
+  return val;
+}
+
+ValueId SSABuilder::newPhi(BlockId block, Var var) {
+  ValueId id = fn.numValues++;
+  PhiInfo info{};
+  info.block = block;
+  info.var = var;
+  phis.emplace(id, std::move(info));
+  return id;
+}
+
+ValueId SSABuilder::addPhiOperands(ValueId phi) {
+  BlockId block = phis.at(phi).block;
+  Var var = phis.at(phi).var;
+  for (BlockId pred : fn.blocks[block].preds) {
+    ValueId v = readVariable(var, pred);
+    phis.at(phi).incoming.push_back({pred, v});
+    auto it = phis.find(v);
+    if (it != phis.end() && v != phi)
+      it->second.users.push_back(phi);
+  }
+  return tryRemoveTrivialPhi(phi);
+}
+
+ValueId SSABuilder::tryRemoveTrivialPhi(ValueId phi) {
+  std::optional<ValueId> same;
+  for (const auto &in : phis.at(phi).incoming) {
+    ValueId v = resolve(in.second);
+    if (v == phi || (same && v == *same))
+      continue;
+    if (same)
+      return phi; // merges at least two values
+    same = v;
+  }
+  // A phi that only references itself sits in a cycle unreachable from any
+  // entry; keep it rather than invent a value.
+  if (!same)
+    return phi;
+
+  auto &info = phis.at(phi);
+  info.dead = true;
+  replacedBy[phi] = *same;
+  std::vector<ValueId> users = std::move(info.users);
+  auto sameIt = phis.find(*same);
+  if (sameIt != phis.end())
+    sameIt->second.users.insert(sameIt->second.users.end(), users.begin(),
+                                users.end());
+  // Removing this phi may make the phis that used it trivial in turn.
+  for (ValueId u : users)
+    if (u != phi && !phis.at(u).dead)
+      tryRemoveTrivialPhi(u);
+  return resolve(*same);
+}
+
+ValueId SSABuilder::resolve(ValueId v) const {
+  for (auto it = replacedBy.find(v); it != replacedBy.end();
+       it = replacedBy.find(v))
+    v = it->second;
+  return v;
+}
+
+void SSABuilder::sealBlock(BlockId block) {
+  if (sealed[block])
+    return;
+  auto pending = std::move(incompletePhis[block]);
+  incompletePhis[block].clear();
+  for (const auto &kv : pending)
+    addPhiOperands(kv.second);
+  sealed[block] = true;
+}
+
+void SSABuilder::finish() {
+  for (BlockId b = 0; b < fn.blocks.size(); ++b)
+    sealBlock(b);
+
+  auto rewrite = [&](ValueId &v) { v = resolve(v); };
+  for (auto &bb : fn.blocks) {
+    for (auto &I : bb.insts)
+      forEachUse(I, rewrite);
+    forEachUse(bb.term, rewrite);
+  }
+
+  // Materialise the surviving phis in value order at the top of each block.
+  std::vector<ValueId> live;
+  for (const auto &kv : phis)
+    if (!kv.second.dead)
+      live.push_back(kv.first);
+  std::sort(live.begin(), live.end());
+  std::vector<std::vector<Instr>> heads(fn.blocks.size());
+  for (ValueId id : live) {
+    const auto &info = phis.at(id);
+    auto incoming = info.incoming;
+    for (auto &in : incoming)
+      in.second = resolve(in.second);
+    Type ty = varType ? varType(info.var) : Type::i64();
+    Phi phi{ty, Span<std::pair<BlockId, ValueId>>::copy(*fn.arena, incoming)};
+    Instr I{};
+    I.dest = id;
+    I.payload = std::move(phi);
+    heads[info.block].push_back(std::move(I));
+  }
+  for (auto &bb : fn.blocks)
+    bb.insts.insert(bb.insts.begin(), heads[bb.id].data(),
+                    heads[bb.id].data() + heads[bb.id].size());
+}
+
+} // namespace riscy::ir
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "IR/IR.h"
+
+namespace riscy::ir {
+
+// On-the-fly SSA construction over numbered variables (Braun et al., "Simple
+// and Efficient Construction of Static Single Assignment Form", CC 2013).
+//
+// Blocks and their `preds` must exist up front; instructions are appended by
+// the client while it reports variable reads and writes per block. Reads in
+// a block without predecessors call `entryRead`, which must materialise the
+// incoming value (e.g. a ReadReg) and return it. Phis are kept aside until
+// finish(), which drops the trivial ones, rewrites every operand and places
+// the remaining phis at the top of their blocks. Variables are i64 unless
+// `varType` gives their type.
+class SSABuilder {
+public:
+  using Var = uint32_t;
+  using EntryRead = std::function<ValueId(BlockId, Var)>;
+  using VarType = std::function<Type(Var)>;
+
+  SSABuilder(Function &fn, EntryRead entryRead, VarType varType = nullptr);
+
+  void writeVariable(Var var, BlockId block, ValueId value);
+  ValueId readVariable(Var var, BlockId block);
+  // Declares that every predecessor of `block` has been filled.
+  void sealBlock(BlockId block);
+  bool isSealed(BlockId block) const { return sealed[block]; }
+  void finish();
+
+private:
+  struct PhiInfo {
+    BlockId block = 0;
+    Var var = 0;
+    std::vector<std::pair<BlockId, ValueId>> incoming;
+    std::vector<ValueId> users; // phis that use this phi
+    bool dead = false;
+  };
+
+  ValueId readVariableRecursive(Var var, BlockId block);
+  ValueId newPhi(BlockId block, Var var);
+  ValueId addPhiOperands(ValueId phi);
+  ValueId tryRemoveTrivialPhi(ValueId phi);
+  ValueId resolve(ValueId v) const;
+
+  Function &fn;
+  EntryRead entryRead;
+  VarType varType;
+  std::vector<std::unordered_map<Var, ValueId>> currentDef;
+  std::vector<std::unordered_map<Var, ValueId>> incompletePhis;
+  std::vector<bool> sealed;
+  std::unordered_map<ValueId, PhiInfo> phis;
+  std::unordered_map<ValueId, ValueId> replacedBy;
+};
+
+} // namespace riscy::ir
@@ -24,20 +24,34 @@ bool CFGBuilder::isCondBranch(Opcode op) {
 
 bool CFGBuilder::isJump(Opcode op) { return op == Opcode::JAL; }
 
+// ra and t0 are the link registers of the standard calling convention.
+bool CFGBuilder::isLinkReg(uint8_t reg) { return reg == 1 || reg == 5; }
+
+bool CFGBuilder::isCall(const DecodedInst &inst) {
+  return inst.opcode == Opcode::JAL &&
+         isLinkReg(std::get<Reg>(inst.operands[0]).index);
+}
+
+bool CFGBuilder::isIndirectCall(const DecodedInst &inst) {
+  return inst.opcode == Opcode::JALR && !inst.operands.empty() &&
+         isLinkReg(std::get<Reg>(inst.operands[0]).index);
+}
+
 bool CFGBuilder::isIndirect(const DecodedInst &inst) {
-  return inst.opcode == Opcode::JALR && !isReturn(inst);
+  return inst.opcode == Opcode::JALR && !isReturn(inst) &&
+         !isIndirectCall(inst);
 }
 
 bool CFGBuilder::isReturn(const DecodedInst &inst) {
   if (inst.opcode != Opcode::JALR || inst.operands.size() < 2)
     return false;
   // JALR rd, offset(rs1)
-  // Return is encoded as JALR x0, 0(ra)
+  // Return is encoded as JALR x0, 0(ra), or through t0 for calls linked there
   const auto &rd = std::get<Reg>(inst.operands[0]);
   if (!std::holds_alternative<Mem>(inst.operands[1]))
     return false;
   const auto &m = std::get<Mem>(inst.operands[1]);
-  return rd.index == 0 && m.base == 1 /*ra*/ && m.offset == 0;
+  return rd.index == 0 && isLinkReg(m.base) && m.offset == 0;
 }
 
 bool CFGBuilder::isTrap(Opcode op) {
@@ -45,11 +59,16 @@ bool CFGBuilder::isTrap(Opcode op) {
 }
 
 bool CFGBuilder::isTerminator(const DecodedInst &inst) {
-  return isCondBranch(inst.opcode) || isJump(inst.opcode) || isIndirect(inst) ||
-         isReturn(inst) || isTrap(inst.opcode);
+  return isCondBranch(inst.opcode) || isJump(inst.opcode) ||
+         inst.opcode == Opcode::JALR || isTrap(inst.opcode);
 }
 
 CFG CFGBuilder::build(const MemoryReader &mem, uint64_t entry) const {
+  return build(mem, entry, {});
+}
+
+CFG CFGBuilder::build(const MemoryReader &mem, uint64_t entry,
+                      const std::vector<uint64_t> &roots) const {
   CFG cfg{};
   cfg.entry = entry;
   Decoder dec;
@@ -58,6 +77,14 @@ CFG CFGBuilder::build(const MemoryReader &mem, uint64_t entry) const {
   std::unordered_set<uint64_t> leaders;
   worklist.push(entry);
   leaders.insert(entry);
+  for (uint64_t r : roots) {
+    uint32_t word = 0;
+    if ((r & 3) != 0 || !mem.read32(r, word))
+      continue;
+    cfg.roots.push_back(r);
+    if (leaders.insert(r).second)
+      worklist.push(r);
+  }
 
   auto enqueue = [&](uint64_t addr) {
     if (leaders.insert(addr).second) {
@@ -106,11 +133,25 @@ CFG CFGBuilder::build(const MemoryReader &mem, uint64_t entry) const {
         // operands: rd, imm
         int64_t off = getImm(inst.operands[1]);
         uint64_t t = inst.pc + static_cast<uint64_t>(off);
+        if (isCall(inst)) {
+          // The callee returns to pc+4, which starts a new block.
+          bb.term = TermKind::Call;
+          bb.succs = {t, inst.pc + 4};
+          enqueue(t);
+          enqueue(inst.pc + 4);
+          break;
+        }
         bb.term = TermKind::Jump;
         bb.succs = {t};
         enqueue(t);
         break;
       }
+      if (isIndirectCall(inst)) {
+        bb.term = TermKind::IndirectCall;
+        bb.succs = {inst.pc + 4};
+        enqueue(inst.pc + 4);
+        break;
+      }
       if (isIndirect(inst)) {
         bb.term = TermKind::IndirectJump;
         break;
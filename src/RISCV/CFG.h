@@ -17,8 +17,10 @@ enum class TermKind {
   Branch,       // conditional branch with two successors
   Jump,         // direct jump
   IndirectJump, // JALR to non-RA; resolved at runtime via jump table
-  Return,       // JALR x0, 0(ra)
-  Trap          // ECALL/EBREAK or decode failure
+  Return,       // JALR x0, 0(ra) or 0(t0)
+  Trap,         // ECALL/EBREAK or decode failure
+  Call,         // JAL ra/t0, f: succs = {callee, return continuation}
+  IndirectCall  // JALR ra/t0, off(rs1): succs = {return continuation}
 };
 
 struct BasicBlock {
@@ -26,10 +28,20 @@ struct BasicBlock {
   std::vector<DecodedInst> insts;
   TermKind term = TermKind::None;
   std::vector<uint64_t> succs; // 0,1, or 2 successors depending on term
+
+  // Return continuation of a call-site block, or 0 if this is not one.
+  uint64_t returnSite() const {
+    if (term == TermKind::Call && succs.size() == 2)
+      return succs[1];
+    if (term == TermKind::IndirectCall && succs.size() == 1)
+      return succs[0];
+    return 0;
+  }
 };
 
 struct CFG {
   uint64_t entry = 0;
+  std::vector<uint64_t> roots; // extra roots beyond entry (e.g. from a profile)
   std::vector<BasicBlock> blocks;
   std::unordered_map<uint64_t, size_t> indexByAddr;
 };
@@ -37,10 +49,18 @@ struct CFG {
 class CFGBuilder {
 public:
   CFG build(const MemoryReader &mem, uint64_t entry) const;
+  // Like build(), but also seeds discovery with extra roots such as indirect
+  // targets recorded by the runtime. Unreadable or misaligned roots are
+  // ignored.
+  CFG build(const MemoryReader &mem, uint64_t entry,
+            const std::vector<uint64_t> &roots) const;
 
 private:
   static bool isCondBranch(Opcode op);
   static bool isJump(Opcode op);
+  static bool isLinkReg(uint8_t reg);
+  static bool isCall(const DecodedInst &inst);
+  static bool isIndirectCall(const DecodedInst &inst);
   static bool isIndirect(const DecodedInst &inst);
   static bool isReturn(const DecodedInst &inst);
   static bool isTrap(Opcode op);
@@ -0,0 +1,142 @@
+#include "RISCV/CFGSimplifier.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace riscy::riscv {
+
+std::unordered_set<uint64_t> CFGSimplifier::pinnedBlocks(const CFG &cfg) {
+  std::unordered_set<uint64_t> pinned{cfg.entry};
+  pinned.insert(cfg.roots.begin(), cfg.roots.end());
+  for (const auto &bb : cfg.blocks) {
+    if (bb.term == TermKind::Call)
+      pinned.insert(bb.succs[0]);
+    if (uint64_t ret = bb.returnSite())
+      pinned.insert(ret);
+  }
+  return pinned;
+}
+
+bool CFGSimplifier::isTrampoline(const BasicBlock &bb) {
+  // A lone `jal x0, target`; a JAL that links has a side effect.
+  return bb.term == TermKind::Jump && bb.insts.size() == 1 &&
+         bb.insts[0].opcode == Opcode::JAL &&
+         std::get<Reg>(bb.insts[0].operands[0]).index == 0;
+}
+
+size_t CFGSimplifier::threadJumps(CFG &cfg) {
+  size_t threaded = 0;
+  for (auto &bb : cfg.blocks) {
+    for (auto &s : bb.succs) {
+      // Follow the trampoline chain; the step bound stops on `j .` cycles.
+      uint64_t t = s;
+      for (size_t steps = 0; steps < cfg.blocks.size(); ++steps) {
+        auto it = cfg.indexByAddr.find(t);
+        if (it == cfg.indexByAddr.end() ||
+            !isTrampoline(cfg.blocks[it->second]))
+          break;
+        t = cfg.blocks[it->second].succs[0];
+      }
+      if (t != s) {
+        s = t;
+        ++threaded;
+      }
+    }
+  }
+  return threaded;
+}
+
+size_t CFGSimplifier::removeUnreachable(
+    CFG &cfg, const std::unordered_set<uint64_t> &pinned) {
+  std::vector<bool> keep(cfg.blocks.size(), false);
+  std::vector<size_t> work;
+  for (auto pc : pinned) {
+    auto it = cfg.indexByAddr.find(pc);
+    if (it != cfg.indexByAddr.end() && !keep[it->second]) {
+      keep[it->second] = true;
+      work.push_back(it->second);
+    }
+  }
+  while (!work.empty()) {
+    size_t i = work.back();
+    work.pop_back();
+    for (auto s : cfg.blocks[i].succs) {
+      auto it = cfg.indexByAddr.find(s);
+      if (it != cfg.indexByAddr.end() && !keep[it->second]) {
+        keep[it->second] = true;
+        work.push_back(it->second);
+      }
+    }
+  }
+  size_t removed = std::count(keep.begin(), keep.end(), false);
+  if (removed)
+    compact(cfg, keep);
+  return removed;
+}
+
+size_t CFGSimplifier::mergeChains(CFG &cfg,
+                                  const std::unordered_set<uint64_t> &pinned) {
+  // Predecessor edge counts; merging B into A moves B's out-edges to A, so
+  // the counts of everything else stay valid.
+  std::unordered_map<uint64_t, size_t> preds;
+  for (const auto &bb : cfg.blocks)
+    for (auto s : bb.succs)
+      ++preds[s];
+
+  std::vector<bool> keep(cfg.blocks.size(), true);
+  std::vector<size_t> order(cfg.blocks.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return cfg.blocks[a].start < cfg.blocks[b].start;
+  });
+
+  size_t merged = 0;
+  for (size_t i : order) {
+    if (!keep[i])
+      continue;
+    auto &a = cfg.blocks[i];
+    while ((a.term == TermKind::Fallthrough || a.term == TermKind::Jump) &&
+           a.succs.size() == 1) {
+      uint64_t t = a.succs[0];
+      auto it = cfg.indexByAddr.find(t);
+      if (it == cfg.indexByAddr.end() || it->second == i ||
+          !keep[it->second] || pinned.count(t) || preds[t] != 1)
+        break;
+      auto &b = cfg.blocks[it->second];
+      a.insts.insert(a.insts.end(), b.insts.begin(), b.insts.end());
+      a.term = b.term;
+      a.succs = b.succs;
+      keep[it->second] = false;
+      ++merged;
+    }
+  }
+  if (merged)
+    compact(cfg, keep);
+  return merged;
+}
+
+void CFGSimplifier::compact(CFG &cfg, const std::vector<bool> &keep) {
+  std::vector<BasicBlock> blocks;
+  blocks.reserve(cfg.blocks.size());
+  for (size_t i = 0; i < cfg.blocks.size(); ++i)
+    if (keep[i])
+      blocks.push_back(std::move(cfg.blocks[i]));
+  cfg.blocks = std::move(blocks);
+  cfg.indexByAddr.clear();
+  for (size_t i = 0; i < cfg.blocks.size(); ++i)
+    cfg.indexByAddr[cfg.blocks[i].start] = i;
+}
+
+SimplifyStats CFGSimplifier::run(CFG &cfg) const {
+  SimplifyStats stats;
+  stats.blocksBefore = cfg.blocks.size();
+  auto pinned = pinnedBlocks(cfg);
+  stats.edgesThreaded = threadJumps(cfg);
+  stats.blocksUnreachable = removeUnreachable(cfg, pinned);
+  stats.blocksMerged = mergeChains(cfg, pinned);
+  stats.blocksAfter = cfg.blocks.size();
+  return stats;
+}
+
+} // namespace riscy::riscv
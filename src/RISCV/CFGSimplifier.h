@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include "RISCV/CFG.h"
+
+namespace riscy::riscv {
+
+struct SimplifyStats {
+  size_t blocksBefore = 0;
+  size_t blocksAfter = 0;
+  size_t edgesThreaded = 0;  // edges redirected past a trampoline
+  size_t blocksMerged = 0;   // blocks folded into their only predecessor
+  size_t blocksUnreachable = 0;
+};
+
+// Cleans up a CFG before lifting so fewer native blocks are emitted:
+//  - threads edges through trampolines (blocks holding only `j target`),
+//  - removes blocks no longer reachable,
+//  - merges single-successor blocks into a successor that has no other
+//    predecessor.
+// Blocks the runtime or other blocks may enter by address are pinned and
+// keep their own label: the entry, extra roots, call targets, and return
+// continuations.
+class CFGSimplifier {
+public:
+  SimplifyStats run(CFG &cfg) const;
+
+private:
+  static std::unordered_set<uint64_t> pinnedBlocks(const CFG &cfg);
+  static bool isTrampoline(const BasicBlock &bb);
+  static size_t threadJumps(CFG &cfg);
+  static size_t removeUnreachable(CFG &cfg,
+                                  const std::unordered_set<uint64_t> &pinned);
+  static size_t mergeChains(CFG &cfg,
+                            const std::unordered_set<uint64_t> &pinned);
+  static void compact(CFG &cfg, const std::vector<bool> &keep);
+};
+
+} // namespace riscy::riscv
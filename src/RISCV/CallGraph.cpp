@@ -0,0 +1,153 @@
+#include "RISCV/CallGraph.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+
+namespace riscy::riscv {
+
+bool CallGraph::isRecursive(size_t fn) const {
+  if (sccs[sccOf[fn]].size() > 1)
+    return true;
+  const auto &callees = functions[fn].callees;
+  return std::binary_search(callees.begin(), callees.end(),
+                            functions[fn].entry);
+}
+
+// Walks the body of the function at `entry`. Edges into another function's
+// entry are recorded as callees rather than followed.
+static Function
+walkFunction(const CFG &cfg, uint64_t entry,
+             const std::unordered_set<uint64_t> &entries) {
+  Function fn;
+  fn.entry = entry;
+  std::unordered_set<uint64_t> seen{entry};
+  std::unordered_set<uint64_t> callees;
+  std::vector<uint64_t> work{entry};
+
+  auto follow = [&](uint64_t t) {
+    if (t != entry && entries.count(t)) {
+      callees.insert(t);
+      return;
+    }
+    if (cfg.indexByAddr.count(t) && seen.insert(t).second)
+      work.push_back(t);
+  };
+
+  while (!work.empty()) {
+    uint64_t pc = work.back();
+    work.pop_back();
+    const auto &bb = cfg.blocks[cfg.indexByAddr.at(pc)];
+    switch (bb.term) {
+    case TermKind::Call:
+      callees.insert(bb.succs[0]);
+      follow(bb.returnSite());
+      break;
+    case TermKind::IndirectCall:
+      fn.hasIndirectCalls = true;
+      follow(bb.returnSite());
+      break;
+    case TermKind::Return:
+    case TermKind::IndirectJump:
+    case TermKind::Trap:
+      break;
+    default:
+      for (auto s : bb.succs)
+        follow(s);
+      break;
+    }
+  }
+
+  fn.blocks.assign(seen.begin(), seen.end());
+  std::sort(fn.blocks.begin(), fn.blocks.end());
+  // Keep the entry first; it need not be the lowest address.
+  auto it = std::find(fn.blocks.begin(), fn.blocks.end(), entry);
+  std::rotate(fn.blocks.begin(), it, it + 1);
+  fn.callees.assign(callees.begin(), callees.end());
+  std::sort(fn.callees.begin(), fn.callees.end());
+  return fn;
+}
+
+CallGraph CallGraphBuilder::build(const CFG &cfg) const {
+  CallGraph cg;
+
+  std::unordered_set<uint64_t> entries;
+  if (cfg.indexByAddr.count(cfg.entry))
+    entries.insert(cfg.entry);
+  for (const auto &bb : cfg.blocks)
+    if (bb.term == TermKind::Call && cfg.indexByAddr.count(bb.succs[0]))
+      entries.insert(bb.succs[0]);
+
+  std::vector<uint64_t> order(entries.begin(), entries.end());
+  std::sort(order.begin(), order.end());
+  std::unordered_set<uint64_t> covered;
+  for (auto e : order) {
+    cg.functions.push_back(walkFunction(cfg, e, entries));
+    covered.insert(cg.functions.back().blocks.begin(),
+                   cg.functions.back().blocks.end());
+  }
+  // Roots that no function reaches (e.g. functions only called through a
+  // pointer) become functions of their own.
+  for (auto r : cfg.roots) {
+    if (covered.count(r) || !cfg.indexByAddr.count(r))
+      continue;
+    entries.insert(r);
+    cg.functions.push_back(walkFunction(cfg, r, entries));
+    covered.insert(cg.functions.back().blocks.begin(),
+                   cg.functions.back().blocks.end());
+  }
+
+  std::sort(cg.functions.begin(), cg.functions.end(),
+            [](const Function &a, const Function &b) {
+              return a.entry < b.entry;
+            });
+  for (size_t i = 0; i < cg.functions.size(); ++i)
+    cg.indexByEntry[cg.functions[i].entry] = i;
+
+  // Tarjan's algorithm; SCCs are emitted callees-first.
+  const size_t n = cg.functions.size();
+  const size_t unvisited = SIZE_MAX;
+  std::vector<size_t> index(n, unvisited), low(n, 0);
+  std::vector<bool> onStack(n, false);
+  std::vector<size_t> stack;
+  size_t counter = 0;
+  cg.sccOf.assign(n, 0);
+
+  std::function<void(size_t)> connect = [&](size_t v) {
+    index[v] = low[v] = counter++;
+    stack.push_back(v);
+    onStack[v] = true;
+    for (auto c : cg.functions[v].callees) {
+      auto it = cg.indexByEntry.find(c);
+      if (it == cg.indexByEntry.end())
+        continue;
+      size_t w = it->second;
+      if (index[w] == unvisited) {
+        connect(w);
+        low[v] = std::min(low[v], low[w]);
+      } else if (onStack[w]) {
+        low[v] = std::min(low[v], index[w]);
+      }
+    }
+    if (low[v] != index[v])
+      return;
+    std::vector<size_t> scc;
+    size_t w;
+    do {
+      w = stack.back();
+      stack.pop_back();
+      onStack[w] = false;
+      cg.sccOf[w] = cg.sccs.size();
+      scc.push_back(w);
+    } while (w != v);
+    std::sort(scc.begin(), scc.end());
+    cg.sccs.push_back(std::move(scc));
+  };
+  for (size_t v = 0; v < n; ++v)
+    if (index[v] == unvisited)
+      connect(v);
+
+  return cg;
+}
+
+} // namespace riscy::riscv
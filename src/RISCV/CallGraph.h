@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "RISCV/CFG.h"
+
+namespace riscy::riscv {
+
+struct Function {
+  uint64_t entry = 0;
+  std::vector<uint64_t> blocks;  // block starts; entry first, then sorted
+  std::vector<uint64_t> callees; // direct call and tail-call targets, sorted
+  bool hasIndirectCalls = false;
+
+  bool isLeaf() const { return callees.empty() && !hasIndirectCalls; }
+};
+
+struct CallGraph {
+  std::vector<Function> functions; // sorted by entry
+  std::unordered_map<uint64_t, size_t> indexByEntry;
+  // Strongly connected components in reverse topological order, so callees
+  // come before their callers.
+  std::vector<std::vector<size_t>> sccs;
+  std::vector<size_t> sccOf; // function index -> index into sccs
+
+  // True if the function can reach itself through direct calls.
+  bool isRecursive(size_t fn) const;
+};
+
+// Partitions a CFG into functions and links them by their direct call edges.
+// Function entries are the CFG entry, every direct call target, and any
+// extra root that no other function reaches. A function body is everything
+// reachable from its entry without following call edges; direct jumps to
+// another function's entry are treated as tail calls.
+class CallGraphBuilder {
+public:
+  CallGraph build(const CFG &cfg) const;
+};
+
+} // namespace riscy::riscv
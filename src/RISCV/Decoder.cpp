@@ -209,15 +209,16 @@ bool Decoder::decodeNext(const MemoryReader &mem, uint64_t pc,
       return true;
     }
     case 0x5: { // SRLI/SRAI
-      const auto f7 = funct7(insn);
-      if (f7 == 0x00) {
+      // RV64 shift amounts take six bits, leaving a six-bit funct field.
+      const auto f6 = funct7(insn) >> 1;
+      if (f6 == 0x00) {
         outInst.opcode = Opcode::SRLI;
         outInst.operands = {
             Reg{rd(insn)}, Reg{rs1(insn)},
             Imm{static_cast<std::int64_t>(getBits(insn, 25, 20))}};
         return true;
       }
-      if (f7 == 0x20) {
+      if (f6 == 0x10) {
         outInst.opcode = Opcode::SRAI;
         outInst.operands = {
             Reg{rd(insn)}, Reg{rs1(insn)},
@@ -1,5 +1,15 @@
 #include "RISCV/Lifter.h"
 
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "IR/SSA.h"
+
 namespace riscy::riscv {
 
 static inline int64_t getImm(const Operand &op) {
@@ -10,9 +20,7 @@ static inline uint8_t getReg(const Operand &op) {
 }
 static inline const Mem &getMem(const Operand &op) { return std::get<Mem>(op); }
 
-static inline ir::ValueId nextId(std::vector<ir::Instr> &insts) {
-  return static_cast<ir::ValueId>(insts.size());
-}
+static inline bool isX0(uint8_t reg) { return reg == 0; }
 
 static ir::Instr createConst(ir::Type ty, uint64_t v, ir::ValueId id) {
   ir::Instr I{};
@@ -65,424 +73,993 @@ static ir::Instr createStore(ir::Type ty, ir::ValueId v, ir::ValueId base,
   return I;
 }
 
-static ir::Instr createGetPC(ir::ValueId id) {
-  ir::Instr I{};
-  I.dest = id;
-  I.payload = ir::GetPC{};
-  return I;
-}
+namespace {
 
-ir::Block Lifter::lift(const BasicBlock &bbIn) const {
-  ir::Block out{};
-  out.start = bbIn.start;
+// Where lifted instructions go and how guest registers are accessed. Block
+// and trace units cache registers locally; function units route them through
+// SSA construction.
+struct LiftState {
+  ir::Block *out = nullptr;
+  // Function-wide value counter; without one, values are numbered by their
+  // instruction index in `out`.
+  ir::ValueId *numValues = nullptr;
+  std::function<ir::ValueId(uint8_t)> readReg;
+  std::function<void(uint8_t, ir::ValueId)> writeReg;
+  // Masked JALR target, consumed by the indirect jump/call terminator.
+  std::optional<ir::ValueId> indirectTarget;
 
-  auto readReg = [&](uint8_t r) {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createReadReg(r, id));
+  ir::ValueId nextId() {
+    if (numValues)
+      return (*numValues)++;
+    return static_cast<ir::ValueId>(out->insts.size());
+  }
+  ir::ValueId imm(ir::Type ty, uint64_t v) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(createConst(ty, v, id));
     return id;
-  };
-  auto writeReg = [&](uint8_t r, ir::ValueId v) {
-    if (!isX0(r))
-      out.insts.push_back(createWriteReg(r, v));
-  };
-  auto imm = [&](ir::Type ty, uint64_t v) {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createConst(ty, v, id));
+  }
+  ir::ValueId bin(ir::BinOpKind k, ir::Type ty, ir::ValueId a, ir::ValueId b) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(createBin(k, ty, a, b, id));
     return id;
-  };
-  auto bin = [&](ir::BinOpKind k, ir::Type ty, ir::ValueId a, ir::ValueId b) {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createBin(k, ty, a, b, id));
+  }
+  ir::ValueId trunc(ir::ValueId v, ir::Type to) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(ir::Instr{id, ir::Trunc{v, to}});
     return id;
-  };
-  auto icmp = [&](ir::ICmpCond c, ir::ValueId a, ir::ValueId b) {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createIcmp(c, a, b, id));
+  }
+  ir::ValueId zext(ir::ValueId v, ir::Type to) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(ir::Instr{id, ir::ZExt{v, to}});
     return id;
-  };
-  auto load = [&](ir::Type ty, ir::ValueId base, int64_t off) {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createLoad(ty, base, off, id));
+  }
+  ir::ValueId sext(ir::ValueId v, ir::Type to) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(ir::Instr{id, ir::SExt{v, to}});
     return id;
-  };
-  auto store = [&](ir::Type ty, ir::ValueId v, ir::ValueId base, int64_t off) {
-    out.insts.push_back(createStore(ty, v, base, off));
-  };
-  auto getpc = [&]() {
-    ir::ValueId id = nextId(out.insts);
-    out.insts.push_back(createGetPC(id));
+  }
+  // RV64 W ops compute on the low 32 bits of `rs1` and an i32 operand `b`
+  // and sign-extend the result back to a register.
+  ir::ValueId wop(ir::BinOpKind k, uint8_t rs1, ir::ValueId b) {
+    auto a = trunc(readReg(rs1), ir::Type::i32());
+    return sext(bin(k, ir::Type::i32(), a, b), ir::Type::i64());
+  }
+  ir::ValueId icmp(ir::ICmpCond c, ir::ValueId a, ir::ValueId b) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(createIcmp(c, a, b, id));
     return id;
-  };
+  }
+  ir::ValueId load(ir::Type ty, ir::ValueId base, int64_t off) {
+    ir::ValueId id = nextId();
+    out->insts.push_back(createLoad(ty, base, off, id));
+    return id;
+  }
+  void store(ir::Type ty, ir::ValueId v, ir::ValueId base, int64_t off) {
+    out->insts.push_back(createStore(ty, v, base, off));
+  }
+};
+
+} // namespace
 
-  for (const auto &inst : bbIn.insts) {
+// The branch condition of a block is the last ICmp lifted into it.
+static std::optional<ir::ValueId> lastICmp(const ir::Block &bb) {
+  for (auto it = bb.insts.rbegin(); it != bb.insts.rend(); ++it)
+    if (it->dest && std::holds_alternative<ir::ICmp>(it->payload))
+      return *it->dest;
+  return std::nullopt;
+}
+
+static void liftInst(LiftState &S, const DecodedInst &inst) {
+  switch (inst.opcode) {
+  case Opcode::ADDI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), immv);
+    auto sum = S.bin(ir::BinOpKind::Add, ir::Type::i64(), v1, c);
+    S.writeReg(rd, sum);
+    break;
+  }
+  case Opcode::ADDIW:
+  case Opcode::SLLIW:
+  case Opcode::SRLIW:
+  case Opcode::SRAIW: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint32_t>(getImm(inst.operands[2]));
+    auto k = inst.opcode == Opcode::ADDIW   ? ir::BinOpKind::Add
+             : inst.opcode == Opcode::SLLIW ? ir::BinOpKind::Shl
+             : inst.opcode == Opcode::SRLIW ? ir::BinOpKind::LShr
+                                            : ir::BinOpKind::AShr;
+    S.writeReg(rd, S.wop(k, rs1, S.imm(ir::Type::i32(), immv)));
+    break;
+  }
+  case Opcode::ADD: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto sum = S.bin(ir::BinOpKind::Add, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, sum);
+    break;
+  }
+  case Opcode::ADDW:
+  case Opcode::SUBW:
+  case Opcode::SLLW:
+  case Opcode::SRLW:
+  case Opcode::SRAW: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto k = inst.opcode == Opcode::ADDW   ? ir::BinOpKind::Add
+             : inst.opcode == Opcode::SUBW ? ir::BinOpKind::Sub
+             : inst.opcode == Opcode::SLLW ? ir::BinOpKind::Shl
+             : inst.opcode == Opcode::SRLW ? ir::BinOpKind::LShr
+                                           : ir::BinOpKind::AShr;
+    auto b = S.trunc(S.readReg(rs2), ir::Type::i32());
+    S.writeReg(rd, S.wop(k, rs1, b));
+    break;
+  }
+  case Opcode::SUB: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto diff = S.bin(ir::BinOpKind::Sub, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, diff);
+    break;
+  }
+  case Opcode::AND: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::And, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::OR: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::Or, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::XOR: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::Xor, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::ANDI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), immv);
+    auto r = S.bin(ir::BinOpKind::And, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::ORI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), immv);
+    auto r = S.bin(ir::BinOpKind::Or, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::XORI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), immv);
+    auto r = S.bin(ir::BinOpKind::Xor, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SLLI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), sh);
+    auto r = S.bin(ir::BinOpKind::Shl, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SRLI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), sh);
+    auto r = S.bin(ir::BinOpKind::LShr, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SRAI: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), sh);
+    auto r = S.bin(ir::BinOpKind::AShr, ir::Type::i64(), v1, c);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SLL: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::Shl, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SRL: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::LShr, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SRA: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto r = S.bin(ir::BinOpKind::AShr, ir::Type::i64(), v1, v2);
+    S.writeReg(rd, r);
+    break;
+  }
+  case Opcode::SLT:
+  case Opcode::SLTU: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto rs2 = getReg(inst.operands[2]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    auto cc =
+        inst.opcode == Opcode::SLT ? ir::ICmpCond::SLT : ir::ICmpCond::ULT;
+    S.writeReg(rd, S.zext(S.icmp(cc, v1, v2), ir::Type::i64()));
+    break;
+  }
+  case Opcode::SLTI:
+  case Opcode::SLTIU: {
+    auto rd = getReg(inst.operands[0]);
+    auto rs1 = getReg(inst.operands[1]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
+    auto v1 = S.readReg(rs1);
+    auto c = S.imm(ir::Type::i64(), immv);
+    auto cc =
+        inst.opcode == Opcode::SLTI ? ir::ICmpCond::SLT : ir::ICmpCond::ULT;
+    S.writeReg(rd, S.zext(S.icmp(cc, v1, c), ir::Type::i64()));
+    break;
+  }
+  case Opcode::LB:
+  case Opcode::LBU:
+  case Opcode::LH:
+  case Opcode::LHU: {
+    auto rd = getReg(inst.operands[0]);
+    const auto &m = getMem(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    bool half = inst.opcode == Opcode::LH || inst.opcode == Opcode::LHU;
+    auto v = S.load(half ? ir::Type::i16() : ir::Type::i8(), base, m.offset);
+    bool sign = inst.opcode == Opcode::LB || inst.opcode == Opcode::LH;
+    S.writeReg(rd, sign ? S.sext(v, ir::Type::i64())
+                        : S.zext(v, ir::Type::i64()));
+    break;
+  }
+  case Opcode::LW: {
+    auto rd = getReg(inst.operands[0]);
+    const auto &m = getMem(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto v32 = S.load(ir::Type::i32(), base, m.offset);
+    // sign-extend to i64 in RV64 for LW
+    S.writeReg(rd, S.sext(v32, ir::Type::i64()));
+    break;
+  }
+  case Opcode::LWU: {
+    auto rd = getReg(inst.operands[0]);
+    const auto &m = getMem(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto v32 = S.load(ir::Type::i32(), base, m.offset);
+    S.writeReg(rd, S.zext(v32, ir::Type::i64()));
+    break;
+  }
+  case Opcode::LD: {
+    auto rd = getReg(inst.operands[0]);
+    const auto &m = getMem(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto v = S.load(ir::Type::i64(), base, m.offset);
+    S.writeReg(rd, v);
+    break;
+  }
+  case Opcode::SB:
+  case Opcode::SH: {
+    const auto &m = getMem(inst.operands[0]);
+    auto rs = getReg(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto val = S.readReg(rs);
+    S.store(inst.opcode == Opcode::SH ? ir::Type::i16() : ir::Type::i8(), val,
+            base, m.offset);
+    break;
+  }
+  case Opcode::SW: {
+    const auto &m = getMem(inst.operands[0]); // Mem first for stores
+    auto rs = getReg(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto val = S.readReg(rs);
+    S.store(ir::Type::i32(), val, base, m.offset);
+    break;
+  }
+  case Opcode::SD: {
+    const auto &m = getMem(inst.operands[0]);
+    auto rs = getReg(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto val = S.readReg(rs);
+    S.store(ir::Type::i64(), val, base, m.offset);
+    break;
+  }
+  case Opcode::BEQ:
+  case Opcode::BNE:
+  case Opcode::BLT:
+  case Opcode::BGE:
+  case Opcode::BLTU:
+  case Opcode::BGEU: {
+    // Handled after loop as terminator, but compute compare now.
+    // We still build the compare value to reuse as terminator condition.
+    auto rs1 = getReg(inst.operands[0]);
+    auto rs2 = getReg(inst.operands[1]);
+    auto v1 = S.readReg(rs1);
+    auto v2 = S.readReg(rs2);
+    ir::ICmpCond c{};
     switch (inst.opcode) {
-    case Opcode::ADDI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), immv);
-      auto sum = bin(ir::BinOpKind::Add, ir::Type::i64(), v1, c);
-      writeReg(rd, sum);
-      break;
-    }
-    case Opcode::ADDIW: {
-      // RV64: 32-bit add with sign-extension to 64-bit
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), immv);
-      auto sum64 = bin(ir::BinOpKind::Add, ir::Type::i64(), v1, c);
-      // trunc to i32 then sext back to i64
-      ir::ValueId t32 = nextId(out.insts);
-      out.insts.push_back(ir::Instr{t32, ir::Trunc{sum64, ir::Type::i32()}});
-      ir::ValueId t64 = nextId(out.insts);
-      out.insts.push_back(ir::Instr{t64, ir::SExt{t32, ir::Type::i64()}});
-      writeReg(rd, t64);
+    case Opcode::BEQ:
+      c = ir::ICmpCond::EQ;
       break;
-    }
-    case Opcode::ADD: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto sum = bin(ir::BinOpKind::Add, ir::Type::i64(), v1, v2);
-      writeReg(rd, sum);
+    case Opcode::BNE:
+      c = ir::ICmpCond::NE;
       break;
-    }
-    case Opcode::ADDW: {
-      // RV64: 32-bit add with sign-extension to 64-bit
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto sum64 = bin(ir::BinOpKind::Add, ir::Type::i64(), v1, v2);
-      ir::ValueId t32 = nextId(out.insts);
-      out.insts.push_back(ir::Instr{t32, ir::Trunc{sum64, ir::Type::i32()}});
-      ir::ValueId t64 = nextId(out.insts);
-      out.insts.push_back(ir::Instr{t64, ir::SExt{t32, ir::Type::i64()}});
-      writeReg(rd, t64);
+    case Opcode::BLT:
+      c = ir::ICmpCond::SLT;
       break;
-    }
-    case Opcode::SUB: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto diff = bin(ir::BinOpKind::Sub, ir::Type::i64(), v1, v2);
-      writeReg(rd, diff);
+    case Opcode::BGE:
+      c = ir::ICmpCond::SGE;
       break;
-    }
-    case Opcode::AND: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::And, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
+    case Opcode::BLTU:
+      c = ir::ICmpCond::ULT;
       break;
-    }
-    case Opcode::OR: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::Or, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
+    case Opcode::BGEU:
+      c = ir::ICmpCond::UGE;
       break;
+    default:
+      c = ir::ICmpCond::EQ;
     }
-    case Opcode::XOR: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::Xor, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
-      break;
+    // Save the compare as last value for use by terminator.
+    (void)S.icmp(c, v1, v2);
+    break;
+  }
+  case Opcode::LUI: {
+    auto rd = getReg(inst.operands[0]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[1]));
+    S.writeReg(rd, S.imm(ir::Type::i64(), immv));
+    break;
+  }
+  case Opcode::AUIPC: {
+    // The PC is known at translation time, so the result is a constant that
+    // folds with the ADDI/load that completes the pair.
+    auto rd = getReg(inst.operands[0]);
+    auto immv = static_cast<uint64_t>(getImm(inst.operands[1]));
+    S.writeReg(rd, S.imm(ir::Type::i64(), inst.pc + immv));
+    break;
+  }
+  case Opcode::JAL: {
+    auto rd = getReg(inst.operands[0]);
+    if (!isX0(rd)) {
+      auto ra = S.imm(ir::Type::i64(), inst.pc + 4);
+      S.writeReg(rd, ra);
     }
-    case Opcode::ANDI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), immv);
-      auto r = bin(ir::BinOpKind::And, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+    // terminator handled after loop
+    break;
+  }
+  case Opcode::JALR: {
+    auto rd = getReg(inst.operands[0]);
+    const auto &m = getMem(inst.operands[1]);
+    auto base = S.readReg(m.base);
+    auto off = S.imm(ir::Type::i64(), static_cast<uint64_t>(m.offset));
+    auto tgt = S.bin(ir::BinOpKind::Add, ir::Type::i64(), base, off);
+    // clear LSB: target &= ~1
+    auto ones = S.imm(ir::Type::i64(), ~1ull);
+    auto tgtMasked = S.bin(ir::BinOpKind::And, ir::Type::i64(), tgt, ones);
+    // write return address if rd != x0
+    if (!isX0(rd)) {
+      auto ra = S.imm(ir::Type::i64(), inst.pc + 4);
+      S.writeReg(rd, ra);
     }
-    case Opcode::ORI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), immv);
-      auto r = bin(ir::BinOpKind::Or, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+    S.indirectTarget = tgtMasked;
+    break;
+  }
+  case Opcode::ECALL:
+  case Opcode::EBREAK:
+    // no-op here; terminator set later
+    break;
+  default:
+    // For now, ignore unimplemented ops in the skeleton.
+    break;
+  }
+}
+
+// Lowers the terminators that leave the unit or function regardless of the
+// surrounding layout.
+static bool liftExitTerminator(const BasicBlock &bbIn, const LiftState &S,
+                               ir::Terminator &term) {
+  switch (bbIn.term) {
+  case TermKind::IndirectJump:
+    term.kind = ir::TermKind::BrIndirect;
+    term.data = ir::TermBrIndirect{S.indirectTarget.value_or(0)};
+    return true;
+  case TermKind::Call: {
+    ir::TermCall t{};
+    t.target = bbIn.succs.size() > 0 ? bbIn.succs[0] : 0;
+    t.ret = bbIn.returnSite();
+    term.kind = ir::TermKind::Call;
+    term.data = t;
+    return true;
+  }
+  case TermKind::IndirectCall: {
+    ir::TermCallIndirect t{};
+    t.target = S.indirectTarget.value_or(0);
+    t.ret = bbIn.returnSite();
+    term.kind = ir::TermKind::CallIndirect;
+    term.data = t;
+    return true;
+  }
+  case TermKind::Return:
+    term.kind = ir::TermKind::Ret;
+    return true;
+  case TermKind::Trap:
+    term.kind = ir::TermKind::Trap;
+    return true;
+  default:
+    return false;
+  }
+}
+
+RegSet Lifter::liveIn(uint64_t pc) const {
+  return liveness ? liveness->liveIn(pc) : RegSet{}.set();
+}
+
+RegSet Lifter::liveOut(const BasicBlock &bb) const {
+  return liveness ? liveness->liveOut(bb) : RegSet{}.set();
+}
+
+// Turns the branch ending `bbIn` into a side exit, given that execution stays
+// on the trace by continuing at `next`. Only the `writebacks` of registers
+// live at the exit's target are kept.
+void Lifter::addSideExit(const BasicBlock &bbIn, uint64_t next,
+                         const std::vector<ir::WriteReg> &writebacks,
+                         ir::Block &out) const {
+  if (bbIn.term != TermKind::Branch || bbIn.succs.size() != 2 ||
+      bbIn.succs[0] == bbIn.succs[1])
+    return;
+  // The branch condition is the last ICmp, as for the CBr terminator.
+  for (int i = static_cast<int>(out.insts.size()) - 1; i >= 0; --i) {
+    auto &I = out.insts[i];
+    if (!I.dest || !std::holds_alternative<ir::ICmp>(I.payload))
+      continue;
+    uint64_t exit = bbIn.succs[0];
+    if (next == bbIn.succs[0]) {
+      // The trace follows the taken edge; exit when the branch falls through.
+      auto &cmp = std::get<ir::ICmp>(I.payload);
+      cmp.cond = ir::inverse(cmp.cond);
+      exit = bbIn.succs[1];
     }
-    case Opcode::XORI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), immv);
-      auto r = bin(ir::BinOpKind::Xor, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+    RegSet live = liveIn(exit);
+    std::vector<ir::WriteReg> kept;
+    for (const auto &w : writebacks)
+      if (live[w.reg])
+        kept.push_back(w);
+    ir::Instr E{};
+    E.payload = ir::ExitIf{
+        *I.dest, exit, ir::Span<ir::WriteReg>::copy(out.insts.arena(), kept)};
+    out.insts.push_back(E);
+    return;
+  }
+}
+
+ir::Block Lifter::lift(const BasicBlock &bb) const { return liftBlocks({&bb}); }
+
+ir::Block Lifter::lift(const CFG &cfg, const Trace &trace) const {
+  std::vector<const BasicBlock *> bbs;
+  bbs.reserve(trace.blocks.size());
+  for (auto pc : trace.blocks)
+    bbs.push_back(&cfg.blocks[cfg.indexByAddr.at(pc)]);
+  return liftBlocks(bbs);
+}
+
+ir::Block
+Lifter::liftBlocks(const std::vector<const BasicBlock *> &bbs) const {
+  ir::Block out{};
+  out.start = bbs.front()->start;
+  size_t guestInsts = 0;
+  for (const auto *bb : bbs)
+    guestInsts += bb->insts.size();
+  out.insts.reserve(kInstrsPerGuestInst * guestInsts + 8);
+  LiftState S{};
+  S.out = &out;
+
+  // Guest register cache: the current value of each register in this unit
+  // and whether RiscyGuestState still holds an older one. Registers are
+  // loaded on first use and dirty ones are stored once, at exits.
+  std::array<std::optional<ir::ValueId>, 32> regVal{};
+  std::array<bool, 32> dirty{};
+  std::array<size_t, 32> lastUse{};
+  size_t clock = 0;
+  // Bound the cached values so the unit never needs more registers than the
+  // allocator has; the least recently used register is evicted first.
+  auto makeRoom = [&]() {
+    size_t cached = 0;
+    int victim = -1;
+    for (int r = 1; r < 32; ++r) {
+      if (!regVal[r])
+        continue;
+      ++cached;
+      if (victim < 0 || lastUse[r] < lastUse[victim])
+        victim = r;
     }
-    case Opcode::SLLI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), sh);
-      auto r = bin(ir::BinOpKind::Shl, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+    if (cached < kMaxCachedRegs)
+      return;
+    if (dirty[victim])
+      out.insts.push_back(createWriteReg(victim, *regVal[victim]));
+    regVal[victim].reset();
+    dirty[victim] = false;
+  };
+  S.readReg = [&](uint8_t r) {
+    if (isX0(r))
+      return S.imm(ir::Type::i64(), 0);
+    lastUse[r] = ++clock;
+    if (!regVal[r]) {
+      makeRoom();
+      ir::ValueId id = S.nextId();
+      out.insts.push_back(createReadReg(r, id));
+      regVal[r] = id;
     }
-    case Opcode::SRLI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), sh);
-      auto r = bin(ir::BinOpKind::LShr, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+    return *regVal[r];
+  };
+  S.writeReg = [&](uint8_t r, ir::ValueId v) {
+    if (isX0(r))
+      return;
+    if (!regVal[r])
+      makeRoom();
+    lastUse[r] = ++clock;
+    regVal[r] = v;
+    dirty[r] = true;
+  };
+  auto dirtyRegs = [&]() {
+    std::vector<ir::WriteReg> w;
+    for (uint8_t r = 1; r < 32; ++r)
+      if (dirty[r])
+        w.push_back(ir::WriteReg{r, *regVal[r]});
+    return w;
+  };
+  // Stores the dirty registers that are `live`; the others are dropped.
+  auto flush = [&](RegSet live) {
+    for (const auto &w : dirtyRegs()) {
+      if (live[w.reg])
+        out.insts.push_back(createWriteReg(w.reg, w.value));
+      dirty[w.reg] = false;
     }
-    case Opcode::SRAI: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto sh = static_cast<uint64_t>(getImm(inst.operands[2]));
-      auto v1 = readReg(rs1);
-      auto c = imm(ir::Type::i64(), sh);
-      auto r = bin(ir::BinOpKind::AShr, ir::Type::i64(), v1, c);
-      writeReg(rd, r);
-      break;
+  };
+
+  for (size_t k = 0; k < bbs.size(); ++k) {
+    const BasicBlock &bbIn = *bbs[k];
+    for (const auto &inst : bbIn.insts)
+      liftInst(S, inst);
+    // Inside a trace, leave through a side exit unless control continues
+    // to the next block of the trace. The exit stores the dirty registers
+    // itself, so the on-trace path keeps them cached.
+    if (k + 1 < bbs.size())
+      addSideExit(bbIn, bbs[k + 1]->start, dirtyRegs(), out);
+  }
+
+  const BasicBlock &bbIn = *bbs.back();
+  // Every terminator leaves the unit.
+  flush(liveOut(bbIn));
+
+  if (liftExitTerminator(bbIn, S, out.term))
+    return out;
+  switch (bbIn.term) {
+  case TermKind::Branch: {
+    ir::TermCBr t{};
+    t.cond = lastICmp(out).value_or(0);
+    t.t = bbIn.succs.size() > 0 ? bbIn.succs[0] : 0;
+    t.f = bbIn.succs.size() > 1 ? bbIn.succs[1] : 0;
+    out.term.kind = ir::TermKind::CBr;
+    out.term.data = t;
+    break;
+  }
+  default: {
+    // Jumps and fallthroughs; treat a missing terminator the same way.
+    ir::TermBr t{};
+    t.target = bbIn.succs.empty() ? 0 : bbIn.succs[0];
+    out.term.kind = ir::TermKind::Br;
+    out.term.data = t;
+    break;
+  }
+  }
+
+  return out;
+}
+
+// The size in guest instructions of `callee` if it can be copied into its
+// call sites: a leaf that leaves ra alone and only reads it to return, so
+// that every return continues right after the call and the return address
+// stays in ra alone.
+static std::optional<size_t> inlinableSize(const CFG &cfg,
+                                           const Function &callee) {
+  if (!callee.isLeaf())
+    return std::nullopt;
+  std::unordered_set<uint64_t> own(callee.blocks.begin(), callee.blocks.end());
+  size_t size = 0;
+  for (auto pc : callee.blocks) {
+    const BasicBlock &bb = cfg.blocks[cfg.indexByAddr.at(pc)];
+    size += bb.insts.size();
+    for (const auto &inst : bb.insts) {
+      RegSet uses, defs;
+      if (bb.term != TermKind::Return || &inst != &bb.insts.back())
+        regUsesDefs(inst, uses, defs);
+      if (uses[1] || defs[1])
+        return std::nullopt;
     }
-    case Opcode::SLL: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::Shl, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
+    switch (bb.term) {
+    case TermKind::Branch:
+    case TermKind::Jump:
+    case TermKind::Fallthrough:
+      for (auto succ : bb.succs)
+        if (!own.count(succ))
+          return std::nullopt;
       break;
-    }
-    case Opcode::SRL: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::LShr, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
+    case TermKind::Return:
+      if (getMem(bb.insts.back().operands[1]).base != 1)
+        return std::nullopt;
       break;
+    default:
+      return std::nullopt;
     }
-    case Opcode::SRA: {
-      auto rd = getReg(inst.operands[0]);
-      auto rs1 = getReg(inst.operands[1]);
-      auto rs2 = getReg(inst.operands[2]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      auto r = bin(ir::BinOpKind::AShr, ir::Type::i64(), v1, v2);
-      writeReg(rd, r);
-      break;
+  }
+  return size;
+}
+
+// Picks the direct calls of `fn` to inline, by the address of their block.
+// Calls inside a loop are hot and may inline larger callees; they are
+// considered first, smallest callee first, until the growth budget is spent.
+std::unordered_map<uint64_t, const Function *>
+Lifter::inlineSites(const CFG &cfg, const Function &fn) const {
+  std::unordered_map<uint64_t, const Function *> sites;
+  if (!inlineFrom)
+    return sites;
+  std::unordered_set<uint64_t> own(fn.blocks.begin(), fn.blocks.end());
+  auto blockAt = [&](uint64_t pc) -> const BasicBlock & {
+    return cfg.blocks[cfg.indexByAddr.at(pc)];
+  };
+  // Successors within the function; calls continue at their return site.
+  auto localSuccs = [&](const BasicBlock &bb) {
+    std::vector<uint64_t> succs = bb.succs;
+    if (bb.returnSite())
+      succs = {bb.returnSite()};
+    succs.erase(std::remove_if(succs.begin(), succs.end(),
+                               [&](uint64_t pc) { return !own.count(pc); }),
+                succs.end());
+    return succs;
+  };
+  auto inLoop = [&](uint64_t pc) {
+    std::unordered_set<uint64_t> seen;
+    std::vector<uint64_t> work = localSuccs(blockAt(pc));
+    while (!work.empty()) {
+      uint64_t cur = work.back();
+      work.pop_back();
+      if (cur == pc)
+        return true;
+      if (!seen.insert(cur).second)
+        continue;
+      for (auto succ : localSuccs(blockAt(cur)))
+        work.push_back(succ);
     }
-    case Opcode::LW: {
-      auto rd = getReg(inst.operands[0]);
-      const auto &m = getMem(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto v32 = load(ir::Type::i32(), base, m.offset);
-      // sign-extend to i64 in RV64 for LW
-      ir::Instr I{};
-      ir::ValueId id = nextId(out.insts);
-      I.dest = id;
-      I.payload = ir::SExt{v32, ir::Type::i64()};
-      out.insts.push_back(std::move(I));
-      writeReg(rd, id);
-      break;
+    return false;
+  };
+
+  struct Candidate {
+    bool hot;
+    size_t size;
+    uint64_t site;
+    const Function *callee;
+  };
+  std::vector<Candidate> candidates;
+  for (auto pc : fn.blocks) {
+    const BasicBlock &bb = blockAt(pc);
+    if (bb.term != TermKind::Call || bb.succs.size() != 2 ||
+        getReg(bb.insts.back().operands[0]) != 1)
+      continue;
+    auto it = inlineFrom->indexByEntry.find(bb.succs[0]);
+    if (it == inlineFrom->indexByEntry.end())
+      continue;
+    const Function &callee = inlineFrom->functions[it->second];
+    auto size = inlinableSize(cfg, callee);
+    if (!size || *size > kInlineMaxHotSize)
+      continue;
+    bool hot = inLoop(pc);
+    if (hot || *size <= kInlineMaxSize)
+      candidates.push_back({hot, *size, pc, &callee});
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate &a, const Candidate &b) {
+              if (a.hot != b.hot)
+                return a.hot;
+              return a.size != b.size ? a.size < b.size : a.site < b.site;
+            });
+  size_t growth = 0;
+  for (const auto &c : candidates) {
+    if (growth + c.size > kInlineMaxGrowth)
+      continue;
+    growth += c.size;
+    sites[c.site] = c.callee;
+  }
+  return sites;
+}
+
+std::vector<uint64_t> Lifter::inlinedReturns(const CFG &cfg,
+                                             const Function &fn) const {
+  std::vector<uint64_t> returns;
+  for (const auto &site : inlineSites(cfg, fn)) {
+    uint64_t ret = cfg.blocks[cfg.indexByAddr.at(site.first)].returnSite();
+    if (!liveIn(ret)[1])
+      returns.push_back(ret);
+  }
+  std::sort(returns.begin(), returns.end());
+  return returns;
+}
+
+ir::Function
+Lifter::lift(const CFG &cfg, const Function &fn,
+             const std::unordered_set<uint64_t> &external) const {
+  ir::Function out{};
+  out.entry = fn.entry;
+  auto addBlock = [&](uint64_t start, bool ext) {
+    ir::Block &b = out.addBlock(start);
+    b.external = ext;
+    return b.id;
+  };
+  auto setGoto = [&](ir::BlockId from, ir::BlockId to) {
+    out.blocks[from].term.kind = ir::TermKind::Goto;
+    out.blocks[from].term.data = ir::TermGoto{to};
+    out.blocks[to].preds.push_back(from);
+  };
+
+  // Layout: every guest block gets a body block, preceded by an entry block
+  // if it can be entered by address. Entry blocks load the registers the
+  // function reads from RiscyGuestState and fall into the body. An inlined
+  // call is followed by a copy of each block of its callee.
+  struct Body {
+    ir::BlockId id;
+    const BasicBlock *bb;
+    // For a copy of an inlined callee's block: the copies of its blocks and
+    // where its returns continue. For an inlined call: the callee's copies.
+    const std::unordered_map<uint64_t, ir::BlockId> *callee = nullptr;
+    uint64_t returnTo = 0;
+    bool inlined = false;
+  };
+  auto sites = inlineSites(cfg, fn);
+  std::deque<std::unordered_map<uint64_t, ir::BlockId>> copies;
+  std::unordered_map<uint64_t, ir::BlockId> bodyOf;
+  std::vector<Body> bodies;
+  for (auto pc : fn.blocks) {
+    std::optional<ir::BlockId> ext;
+    if (external.count(pc))
+      ext = addBlock(pc, true);
+    ir::BlockId id = addBlock(pc, false);
+    if (ext)
+      setGoto(*ext, id);
+    bodyOf[pc] = id;
+    const BasicBlock *bb = &cfg.blocks[cfg.indexByAddr.at(pc)];
+    auto site = sites.find(pc);
+    if (site == sites.end()) {
+      bodies.push_back({id, bb});
+      continue;
     }
-    case Opcode::LWU: {
-      auto rd = getReg(inst.operands[0]);
-      const auto &m = getMem(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto v32 = load(ir::Type::i32(), base, m.offset);
-      ir::Instr I{};
-      ir::ValueId id = nextId(out.insts);
-      I.dest = id;
-      I.payload = ir::ZExt{v32, ir::Type::i64()};
-      out.insts.push_back(std::move(I));
-      writeReg(rd, id);
-      break;
+    auto &copy = copies.emplace_back();
+    bodies.push_back({id, bb, &copy});
+    for (auto calleePc : site->second->blocks) {
+      copy[calleePc] = addBlock(calleePc, false);
+      bodies.push_back({copy[calleePc],
+                        &cfg.blocks[cfg.indexByAddr.at(calleePc)], &copy,
+                        bb->returnSite(), true});
     }
-    case Opcode::LD: {
-      auto rd = getReg(inst.operands[0]);
-      const auto &m = getMem(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto v = load(ir::Type::i64(), base, m.offset);
-      writeReg(rd, v);
-      break;
+  }
+
+  // Edges within the function become gotos. Edges that leave it go through
+  // an exit block that stores the registers back and branches by address.
+  std::vector<ir::BlockId> leaving;
+  auto edgeTo = [&](ir::BlockId from, uint64_t pc) {
+    auto it = bodyOf.find(pc);
+    if (it != bodyOf.end()) {
+      out.blocks[it->second].preds.push_back(from);
+      return it->second;
     }
-    case Opcode::SW: {
-      const auto &m = getMem(inst.operands[0]); // Mem first for stores
-      auto rs = getReg(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto val = readReg(rs);
-      store(ir::Type::i32(), val, base, m.offset);
-      break;
+    ir::BlockId id = addBlock(pc, false);
+    out.blocks[id].preds.push_back(from);
+    out.blocks[id].term.kind = ir::TermKind::Br;
+    out.blocks[id].term.data = ir::TermBr{pc};
+    leaving.push_back(id);
+    return id;
+  };
+  // Edges of an inlined callee's block stay within its copies.
+  auto localEdge = [&](const Body &b, uint64_t pc) {
+    if (!b.inlined)
+      return edgeTo(b.id, pc);
+    ir::BlockId to = b.callee->at(pc);
+    out.blocks[to].preds.push_back(b.id);
+    return to;
+  };
+  for (const auto &b : bodies) {
+    ir::BlockId id = b.id;
+    const BasicBlock *bb = b.bb;
+    if (bb->term == TermKind::Branch && bb->succs.size() == 2 &&
+        bb->succs[0] != bb->succs[1]) {
+      ir::TermCondGoto t{};
+      t.t = localEdge(b, bb->succs[0]);
+      t.f = localEdge(b, bb->succs[1]);
+      out.blocks[id].term.kind = ir::TermKind::CondGoto;
+      out.blocks[id].term.data = t;
+      continue;
     }
-    case Opcode::SD: {
-      const auto &m = getMem(inst.operands[0]);
-      auto rs = getReg(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto val = readReg(rs);
-      store(ir::Type::i64(), val, base, m.offset);
+    switch (bb->term) {
+    case TermKind::Branch:
+    case TermKind::Jump:
+    case TermKind::Fallthrough:
+    case TermKind::None: {
+      ir::BlockId to = localEdge(b, bb->succs.empty() ? 0 : bb->succs[0]);
+      out.blocks[id].term.kind = ir::TermKind::Goto;
+      out.blocks[id].term.data = ir::TermGoto{to};
       break;
     }
-    case Opcode::BEQ:
-    case Opcode::BNE:
-    case Opcode::BLT:
-    case Opcode::BGE:
-    case Opcode::BLTU:
-    case Opcode::BGEU: {
-      // Handled after loop as terminator, but compute compare now.
-      // We still build the compare value to reuse as terminator condition.
-      auto rs1 = getReg(inst.operands[0]);
-      auto rs2 = getReg(inst.operands[1]);
-      auto v1 = readReg(rs1);
-      auto v2 = readReg(rs2);
-      ir::ICmpCond c{};
-      switch (inst.opcode) {
-      case Opcode::BEQ:
-        c = ir::ICmpCond::EQ;
-        break;
-      case Opcode::BNE:
-        c = ir::ICmpCond::NE;
-        break;
-      case Opcode::BLT:
-        c = ir::ICmpCond::SLT;
+    case TermKind::Call:
+      if (b.callee) {
+        setGoto(id, b.callee->at(bb->succs[0]));
         break;
-      case Opcode::BGE:
-        c = ir::ICmpCond::SGE;
-        break;
-      case Opcode::BLTU:
-        c = ir::ICmpCond::ULT;
-        break;
-      case Opcode::BGEU:
-        c = ir::ICmpCond::UGE;
-        break;
-      default:
-        c = ir::ICmpCond::EQ;
       }
-      // Save the compare as last value for use by terminator.
-      (void)icmp(c, v1, v2);
-      break;
-    }
-    case Opcode::AUIPC: {
-      auto rd = getReg(inst.operands[0]);
-      auto immv = static_cast<uint64_t>(getImm(inst.operands[1]));
-      auto pcv = getpc();
-      auto c = imm(ir::Type::i64(), immv);
-      auto sum = bin(ir::BinOpKind::Add, ir::Type::i64(), pcv, c);
-      writeReg(rd, sum);
-      break;
-    }
-    case Opcode::JAL: {
-      auto rd = getReg(inst.operands[0]);
-      auto ra = imm(ir::Type::i64(), inst.pc + 4);
-      writeReg(rd, ra);
-      // terminator handled after loop
+      leaving.push_back(id);
       break;
-    }
-    case Opcode::JALR: {
-      auto rd = getReg(inst.operands[0]);
-      const auto &m = getMem(inst.operands[1]);
-      auto base = readReg(m.base);
-      auto off = imm(ir::Type::i64(), static_cast<uint64_t>(m.offset));
-      auto tgt = bin(ir::BinOpKind::Add, ir::Type::i64(), base, off);
-      // clear LSB: target &= ~1
-      auto ones = imm(ir::Type::i64(), ~1ull);
-      auto tgtMasked = bin(ir::BinOpKind::And, ir::Type::i64(), tgt, ones);
-      // write return address if rd != x0
-      auto ra = imm(ir::Type::i64(), inst.pc + 4);
-      writeReg(rd, ra);
-      // Save target id as last value for terminator usage
-      (void)tgtMasked;
-      break;
-    }
-    case Opcode::ECALL:
-    case Opcode::EBREAK:
-      // no-op here; terminator set later
+    case TermKind::Return:
+      if (b.inlined) {
+        out.blocks[id].term.kind = ir::TermKind::Goto;
+        out.blocks[id].term.data = ir::TermGoto{edgeTo(id, b.returnTo)};
+        break;
+      }
+      leaving.push_back(id);
       break;
     default:
-      // For now, ignore unimplemented ops in the skeleton.
+      // Calls, returns, indirect jumps and traps leave the function; the
+      // terminator is set once the block is lifted.
+      leaving.push_back(id);
       break;
     }
   }
 
-  // Terminator from bbIn.term and last instruction context
-  switch (bbIn.term) {
-  case TermKind::Branch: {
-    // Find the last ICmp value (it should be the last value-producing instr)
-    ir::ValueId cond = 0;
-    for (int i = static_cast<int>(out.insts.size()) - 1; i >= 0; --i) {
-      if (out.insts[i].dest &&
-          std::holds_alternative<ir::ICmp>(out.insts[i].payload)) {
-        cond = *out.insts[i].dest;
-        break;
-      }
+  ir::SSABuilder ssa(out, [&](ir::BlockId b, ir::SSABuilder::Var reg) {
+    ir::ValueId id = out.numValues++;
+    auto &insts = out.blocks[b].insts;
+    insts.insert(insts.begin(), createReadReg(static_cast<uint8_t>(reg), id));
+    return id;
+  });
+
+  // Only body blocks define registers. Seal a block as soon as all of its
+  // predecessors are lifted, which keeps most loop headers' phis complete.
+  std::vector<bool> filled(out.blocks.size(), true);
+  for (const auto &b : bodies)
+    filled[b.id] = false;
+  auto trySeal = [&](ir::BlockId b) {
+    for (auto p : out.blocks[b].preds)
+      if (!filled[p])
+        return;
+    ssa.sealBlock(b);
+  };
+  std::array<bool, 32> written{};
+  for (const auto &b : bodies) {
+    ir::BlockId id = b.id;
+    const BasicBlock *bb = b.bb;
+    LiftState S{};
+    S.out = &out.blocks[id];
+    S.out->insts.reserve(kInstrsPerGuestInst * bb->insts.size() + 4);
+    S.numValues = &out.numValues;
+    ir::BlockId cur = id;
+    S.readReg = [&](uint8_t r) {
+      if (isX0(r))
+        return S.imm(ir::Type::i64(), 0);
+      return ssa.readVariable(r, cur);
+    };
+    S.writeReg = [&](uint8_t r, ir::ValueId v) {
+      if (isX0(r))
+        return;
+      written[r] = true;
+      ssa.writeVariable(r, cur, v);
+    };
+    for (const auto &inst : bb->insts)
+      liftInst(S, inst);
+    auto &term = out.blocks[id].term;
+    if (term.kind == ir::TermKind::CondGoto)
+      std::get<ir::TermCondGoto>(term.data).cond =
+          lastICmp(out.blocks[id]).value_or(0);
+    else if (term.kind == ir::TermKind::None)
+      liftExitTerminator(*bb, S, term);
+
+    filled[id] = true;
+    trySeal(id);
+    if (term.kind == ir::TermKind::Goto)
+      trySeal(std::get<ir::TermGoto>(term.data).target);
+    if (term.kind == ir::TermKind::CondGoto) {
+      trySeal(std::get<ir::TermCondGoto>(term.data).t);
+      trySeal(std::get<ir::TermCondGoto>(term.data).f);
     }
-    ir::TermCBr t{};
-    t.cond = cond;
-    t.t = bbIn.succs.size() > 0 ? bbIn.succs[0] : 0;
-    t.f = bbIn.succs.size() > 1 ? bbIn.succs[1] : 0;
-    out.term.kind = ir::TermKind::CBr;
-    out.term.data = t;
-    break;
   }
-  case TermKind::Jump: {
-    ir::TermBr t{};
-    t.target = bbIn.succs.empty() ? 0 : bbIn.succs[0];
-    out.term.kind = ir::TermKind::Br;
-    out.term.data = t;
-    break;
-  }
-  case TermKind::IndirectJump: {
-    // Find the last produced value (the masked target from JALR lowering)
-    ir::ValueId target = 0;
-    if (!out.insts.empty() && out.insts.back().dest)
-      target = *out.insts.back().dest;
-    ir::TermBrIndirect t{target};
-    out.term.kind = ir::TermKind::BrIndirect;
-    out.term.data = t;
-    break;
-  }
-  case TermKind::Return: {
-    out.term.kind = ir::TermKind::Ret;
-    break;
-  }
-  case TermKind::Trap: {
-    out.term.kind = ir::TermKind::Trap;
-    break;
-  }
-  case TermKind::Fallthrough:
-  case TermKind::None: {
-    // Treat as unconditional branch to successor if present.
-    ir::TermBr t{};
-    t.target = bbIn.succs.empty() ? 0 : bbIn.succs[0];
-    out.term.kind = ir::TermKind::Br;
-    out.term.data = t;
-    break;
+  for (const auto &bb : out.blocks)
+    ssa.sealBlock(bb.id);
+
+  // Store every register the function may have changed before leaving it,
+  // unless the code control goes to writes it before reading it.
+  std::unordered_map<ir::BlockId, const BasicBlock *> guestOf;
+  for (const auto &b : bodies)
+    guestOf[b.id] = b.bb;
+  for (auto id : leaving) {
+    auto body = guestOf.find(id);
+    RegSet live =
+        body != guestOf.end()
+            ? liveOut(*body->second)
+            : liveIn(std::get<ir::TermBr>(out.blocks[id].term.data).target);
+    for (uint8_t r = 1; r < 32; ++r)
+      if (written[r] && live[r])
+        out.blocks[id].insts.push_back(
+            createWriteReg(r, ssa.readVariable(r, id)));
   }
+  ssa.finish();
+
+  // Registers that still hold their incoming value need no store.
+  std::unordered_map<ir::ValueId, uint8_t> incoming;
+  for (const auto &bb : out.blocks)
+    for (const auto &I : bb.insts)
+      if (auto *rr = std::get_if<ir::ReadReg>(&I.payload))
+        incoming[*I.dest] = rr->reg;
+  for (auto id : leaving) {
+    auto &insts = out.blocks[id].insts;
+    auto unchanged = [&](const ir::Instr &I) {
+      auto *w = std::get_if<ir::WriteReg>(&I.payload);
+      if (!w)
+        return false;
+      auto it = incoming.find(w->value);
+      return it != incoming.end() && it->second == w->reg;
+    };
+    insts.erase(std::remove_if(insts.begin(), insts.end(), unchanged),
+                insts.end());
   }
 
   return out;
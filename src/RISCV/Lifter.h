@@ -1,17 +1,72 @@
 #pragma once
 
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 #include "IR/IR.h"
 #include "RISCV/CFG.h"
+#include "RISCV/CallGraph.h"
+#include "RISCV/RegLiveness.h"
+#include "RISCV/Trace.h"
 
 namespace riscy::riscv {
 
-// Block-local lifter: converts a RISC-V BasicBlock into a minimal IR block.
+// Converts RISC-V code into IR: a BasicBlock or a trace of them into a single
+// IR block, or a whole function into an SSA ir::Function.
 class Lifter {
 public:
+  Lifter() = default;
+  // With `liveness`, registers are only stored back on exits where they may
+  // be read before being written again.
+  explicit Lifter(const RegLiveness *liveness) : liveness(liveness) {}
+  // With `inlineFrom` as well, function units copy the small leaf functions
+  // of that call graph into their call sites.
+  Lifter(const RegLiveness *liveness, const CallGraph *inlineFrom)
+      : liveness(liveness), inlineFrom(inlineFrom) {}
+
   ir::Block lift(const BasicBlock &bb) const;
+  // Lifts a trace into one IR block. Branches that stay on the trace become
+  // ExitIf side exits; the last block supplies the terminator.
+  ir::Block lift(const CFG &cfg, const Trace &trace) const;
+  // Lifts a function with its guest registers in SSA form across blocks.
+  // Blocks whose start is in `external` can also be entered by address, with
+  // the registers in RiscyGuestState; all other entries are internal edges.
+  // Registers are stored back only where control leaves the function.
+  // Inlined calls and returns are internal edges too.
+  ir::Function lift(const CFG &cfg, const Function &fn,
+                    const std::unordered_set<uint64_t> &external) const;
+  // The return sites of the calls in `fn` that its unit inlines and where ra
+  // is dead. Control no longer returns there by address, so they need not
+  // be external.
+  std::vector<uint64_t> inlinedReturns(const CFG &cfg,
+                                       const Function &fn) const;
 
 private:
-  static inline bool isX0(uint8_t reg) { return reg == 0; }
+  // Most guest registers kept in SSA values at once within a unit.
+  static constexpr size_t kMaxCachedRegs = 16;
+  // Typical IR instructions per guest instruction, to size blocks up front.
+  static constexpr size_t kInstrsPerGuestInst = 3;
+
+  // Inlining cost model, in guest instructions: callees up to
+  // kInlineMaxSize are inlined anywhere, up to kInlineMaxHotSize at call
+  // sites inside a loop, and inlining grows a function by kInlineMaxGrowth
+  // at most.
+  static constexpr size_t kInlineMaxSize = 12;
+  static constexpr size_t kInlineMaxHotSize = 40;
+  static constexpr size_t kInlineMaxGrowth = 160;
+
+  const RegLiveness *liveness = nullptr;
+  const CallGraph *inlineFrom = nullptr;
+
+  RegSet liveIn(uint64_t pc) const;
+  RegSet liveOut(const BasicBlock &bb) const;
+  void addSideExit(const BasicBlock &bbIn, uint64_t next,
+                   const std::vector<ir::WriteReg> &writebacks,
+                   ir::Block &out) const;
+  std::unordered_map<uint64_t, const Function *>
+  inlineSites(const CFG &cfg, const Function &fn) const;
+  ir::Block liftBlocks(const std::vector<const BasicBlock *> &bbs) const;
 };
 
 } // namespace riscy::riscv
@@ -179,6 +179,12 @@ std::string formatBlock(const BasicBlock &bb) {
   case TermKind::Trap:
     os << "trap";
     break;
+  case TermKind::Call:
+    os << "call";
+    break;
+  case TermKind::IndirectCall:
+    os << "icall";
+    break;
   }
   if (!bb.succs.empty()) {
     os << "; succs: ";
@@ -192,4 +198,30 @@ std::string formatBlock(const BasicBlock &bb) {
   return os.str();
 }
 
+std::string formatCallGraph(const CallGraph &cg) {
+  std::ostringstream os;
+  for (size_t i = 0; i < cg.functions.size(); ++i) {
+    const auto &fn = cg.functions[i];
+    os << "func 0x" << std::hex << fn.entry << std::dec << ": "
+       << fn.blocks.size() << " blocks, scc " << cg.sccOf[i];
+    if (fn.isLeaf())
+      os << ", leaf";
+    if (cg.isRecursive(i))
+      os << ", recursive";
+    if (fn.hasIndirectCalls)
+      os << ", icall";
+    os << "\n";
+    if (!fn.callees.empty()) {
+      os << "  calls: ";
+      for (size_t j = 0; j < fn.callees.size(); ++j) {
+        if (j)
+          os << ", ";
+        os << "0x" << std::hex << fn.callees[j] << std::dec;
+      }
+      os << "\n";
+    }
+  }
+  return os.str();
+}
+
 } // namespace riscy::riscv
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "RISCV/CFG.h"
+#include "RISCV/CallGraph.h"
 #include "RISCV/DecodedInst.h"
 
 namespace riscy::riscv {
@@ -9,5 +10,6 @@ const char *opcodeName(Opcode op);
 std::string formatOperand(const Operand &op);
 std::string formatInst(const DecodedInst &inst);
 std::string formatBlock(const BasicBlock &bb);
+std::string formatCallGraph(const CallGraph &cg);
 
 } // namespace riscy::riscv
@@ -0,0 +1,146 @@
+#include "RISCV/RegLiveness.h"
+
+namespace riscy::riscv {
+
+static RegSet allRegs() {
+  RegSet all;
+  all.set();
+  all.reset(0);
+  return all;
+}
+
+// sp, gp, tp and s0-s11, which survive a call under the psABI.
+static RegSet preservedRegs() {
+  RegSet regs;
+  for (uint8_t r : {2, 3, 4, 8, 9})
+    regs.set(r);
+  for (uint8_t r = 18; r <= 27; ++r)
+    regs.set(r);
+  return regs;
+}
+
+// Whether `bb` ends in a JALR linking through or returning to ra, rather
+// than t0, which millicode routines use with their own conventions.
+static bool linksThroughRa(const BasicBlock &bb) {
+  if (bb.insts.empty() || bb.insts.back().opcode != Opcode::JALR)
+    return false;
+  const auto &ops = bb.insts.back().operands;
+  if (bb.term == TermKind::Return) {
+    const auto *m = ops.size() > 1 ? std::get_if<Mem>(&ops[1]) : nullptr;
+    return m && m->base == 1;
+  }
+  const auto *r = ops.empty() ? nullptr : std::get_if<Reg>(&ops[0]);
+  return r && r->index == 1;
+}
+
+void regUsesDefs(const DecodedInst &inst, RegSet &uses, RegSet &defs) {
+  switch (inst.opcode) {
+  case Opcode::ECALL:
+  case Opcode::EBREAK:
+  case Opcode::UNKNOWN:
+    uses |= allRegs();
+    return;
+  default:
+    break;
+  }
+  // Stores and branches name no destination.
+  bool hasDest = true;
+  switch (inst.opcode) {
+  case Opcode::SB:
+  case Opcode::SH:
+  case Opcode::SW:
+  case Opcode::SD:
+  case Opcode::BEQ:
+  case Opcode::BNE:
+  case Opcode::BLT:
+  case Opcode::BGE:
+  case Opcode::BLTU:
+  case Opcode::BGEU:
+    hasDest = false;
+    break;
+  default:
+    break;
+  }
+  for (size_t i = 0; i < inst.operands.size(); ++i) {
+    const auto &op = inst.operands[i];
+    if (const auto *r = std::get_if<Reg>(&op)) {
+      if (hasDest && i == 0)
+        defs.set(r->index);
+      else
+        uses.set(r->index);
+    } else if (const auto *m = std::get_if<Mem>(&op)) {
+      uses.set(m->base);
+    }
+  }
+  uses.reset(0);
+  defs.reset(0);
+}
+
+RegLiveness::RegLiveness(const CFG &cfg, bool assumeAbi)
+    : cfg(cfg), assumeAbi(assumeAbi), in(cfg.blocks.size()) {
+  // Upward-exposed uses and definitions of each block.
+  std::vector<RegSet> uses(cfg.blocks.size()), defs(cfg.blocks.size());
+  for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+    for (const auto &inst : cfg.blocks[b].insts) {
+      RegSet u, d;
+      regUsesDefs(inst, u, d);
+      uses[b] |= u & ~defs[b];
+      defs[b] |= d;
+    }
+  }
+  // Iterate to the least fixed point. Blocks are discovered roughly in flow
+  // order, so visiting them in reverse converges quickly.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t b = cfg.blocks.size(); b-- > 0;) {
+      RegSet live = uses[b] | (liveOut(cfg.blocks[b]) & ~defs[b]);
+      if (live != in[b]) {
+        in[b] = live;
+        changed = true;
+      }
+    }
+  }
+}
+
+RegSet RegLiveness::liveIn(uint64_t pc) const {
+  auto it = cfg.indexByAddr.find(pc);
+  if (it == cfg.indexByAddr.end())
+    return allRegs();
+  return in[it->second];
+}
+
+RegSet RegLiveness::liveOut(const BasicBlock &bb) const {
+  switch (bb.term) {
+  case TermKind::Fallthrough:
+  case TermKind::Branch:
+  case TermKind::Jump: {
+    if (bb.succs.empty())
+      return allRegs();
+    RegSet live;
+    for (auto s : bb.succs)
+      live |= liveIn(s);
+    return live;
+  }
+  case TermKind::Call:
+    // The return continuation is reached through the callee's returns.
+    return bb.succs.empty() ? allRegs() : liveIn(bb.succs[0]);
+  case TermKind::Return:
+    // a0 and a1 carry the return value.
+    if (assumeAbi && linksThroughRa(bb))
+      return preservedRegs().set(10).set(11);
+    return allRegs();
+  case TermKind::IndirectCall:
+    // The callee reads its arguments in a0-a7 and returns through ra.
+    if (assumeAbi && linksThroughRa(bb)) {
+      RegSet live = preservedRegs().set(1);
+      for (uint8_t r = 10; r <= 17; ++r)
+        live.set(r);
+      return live;
+    }
+    return allRegs();
+  default:
+    return allRegs();
+  }
+}
+
+} // namespace riscy::riscv
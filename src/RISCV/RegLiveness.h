@@ -0,0 +1,44 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+#include "RISCV/CFG.h"
+
+namespace riscy::riscv {
+
+// A set of guest registers, bit N for xN. x0 is never a member.
+using RegSet = std::bitset<32>;
+
+// Adds the registers `inst` reads to `uses` and the ones it writes to
+// `defs`. Traps read every register.
+void regUsesDefs(const DecodedInst &inst, RegSet &uses, RegSet &defs);
+
+// Backward liveness of guest registers over the CFG: a register is live at
+// a point if some path from there may read it before writing it. Control
+// that leaves the known code (returns, indirect jumps, traps, addresses
+// outside the CFG) reads every register, as does an indirect call. Direct
+// calls flow into the callee, whose returns keep everything live.
+//
+// With `assumeAbi`, the guest is trusted to follow the RISC-V psABI calling
+// convention: returns through ra only keep the return values and the
+// registers the caller may rely on (sp, gp, tp, s0-s11), and indirect calls
+// through ra only read the arguments on top of those.
+class RegLiveness {
+public:
+  explicit RegLiveness(const CFG &cfg, bool assumeAbi = false);
+
+  // Registers live on entry to the block at `pc`; every register for an
+  // address outside the CFG.
+  RegSet liveIn(uint64_t pc) const;
+  // Registers live when control leaves `bb` through its terminator.
+  RegSet liveOut(const BasicBlock &bb) const;
+
+private:
+  const CFG &cfg;
+  bool assumeAbi;
+  std::vector<RegSet> in;
+};
+
+} // namespace riscy::riscv
@@ -0,0 +1,133 @@
+#include "RISCV/Trace.h"
+
+#include <algorithm>
+#include <deque>
+
+namespace riscy::riscv {
+
+// Targets of DFS back-edges, walked from the entry and every extra root.
+std::unordered_set<uint64_t> TraceBuilder::loopHeaders(const CFG &cfg) {
+  std::unordered_set<uint64_t> headers;
+  enum class Mark { None, OnStack, Done };
+  std::vector<Mark> mark(cfg.blocks.size(), Mark::None);
+  // (block index, next successor to visit)
+  std::vector<std::pair<size_t, size_t>> stack;
+
+  std::vector<uint64_t> starts{cfg.entry};
+  starts.insert(starts.end(), cfg.roots.begin(), cfg.roots.end());
+  for (auto pc : starts) {
+    auto it = cfg.indexByAddr.find(pc);
+    if (it == cfg.indexByAddr.end() || mark[it->second] != Mark::None)
+      continue;
+    mark[it->second] = Mark::OnStack;
+    stack.push_back({it->second, 0});
+    while (!stack.empty()) {
+      auto &[i, next] = stack.back();
+      const auto &bb = cfg.blocks[i];
+      if (next == bb.succs.size()) {
+        mark[i] = Mark::Done;
+        stack.pop_back();
+        continue;
+      }
+      uint64_t s = bb.succs[next++];
+      auto sit = cfg.indexByAddr.find(s);
+      if (sit == cfg.indexByAddr.end())
+        continue;
+      if (mark[sit->second] == Mark::OnStack) {
+        headers.insert(s);
+      } else if (mark[sit->second] == Mark::None) {
+        mark[sit->second] = Mark::OnStack;
+        stack.push_back({sit->second, 0});
+      }
+    }
+  }
+  return headers;
+}
+
+// Picks the successor a trace continues into; returns false if `bb` ends the
+// trace.
+static bool likelySuccessor(const BasicBlock &bb, uint64_t &next) {
+  switch (bb.term) {
+  case TermKind::None:
+  case TermKind::Fallthrough:
+  case TermKind::Jump:
+    if (bb.succs.size() != 1)
+      return false;
+    next = bb.succs[0];
+    return true;
+  case TermKind::Branch: {
+    if (bb.succs.size() != 2 || bb.insts.empty())
+      return false;
+    // Backward taken, forward not taken.
+    uint64_t branchPC = bb.insts.back().pc;
+    next = bb.succs[0] <= branchPC ? bb.succs[0] : bb.succs[1];
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+std::vector<Trace> TraceBuilder::build(const CFG &cfg) const {
+  std::unordered_set<uint64_t> heads;
+  std::deque<uint64_t> work;
+  auto addHead = [&](uint64_t pc) {
+    if (cfg.indexByAddr.count(pc) && heads.insert(pc).second)
+      work.push_back(pc);
+  };
+
+  addHead(cfg.entry);
+  for (auto r : cfg.roots)
+    addHead(r);
+  std::vector<uint64_t> seeds;
+  for (const auto &bb : cfg.blocks) {
+    if (bb.term == TermKind::Call)
+      seeds.push_back(bb.succs[0]);
+    if (uint64_t ret = bb.returnSite())
+      seeds.push_back(ret);
+  }
+  for (auto h : loopHeaders(cfg))
+    seeds.push_back(h);
+  std::sort(seeds.begin(), seeds.end());
+  for (auto s : seeds)
+    addHead(s);
+
+  std::vector<Trace> traces;
+  while (!work.empty()) {
+    Trace t;
+    t.entry = work.front();
+    work.pop_front();
+    std::unordered_set<uint64_t> inTrace;
+    size_t insts = 0;
+    uint64_t pc = t.entry;
+    while (true) {
+      const auto &bb = cfg.blocks[cfg.indexByAddr.at(pc)];
+      t.blocks.push_back(pc);
+      inTrace.insert(pc);
+      insts += bb.insts.size();
+      uint64_t next = 0;
+      if (!likelySuccessor(bb, next) || !cfg.indexByAddr.count(next) ||
+          heads.count(next) || inTrace.count(next) ||
+          t.blocks.size() >= opts.maxBlocks ||
+          insts + cfg.blocks[cfg.indexByAddr.at(next)].insts.size() >
+              opts.maxInsts)
+        break;
+      pc = next;
+    }
+
+    // Every edge leaving the trace must land on a head.
+    for (size_t i = 0; i < t.blocks.size(); ++i) {
+      const auto &bb = cfg.blocks[cfg.indexByAddr.at(t.blocks[i])];
+      for (auto s : bb.succs)
+        if (i + 1 == t.blocks.size() || s != t.blocks[i + 1])
+          addHead(s);
+    }
+    traces.push_back(std::move(t));
+  }
+
+  std::sort(traces.begin(), traces.end(),
+            [](const Trace &a, const Trace &b) { return a.entry < b.entry; });
+  return traces;
+}
+
+} // namespace riscy::riscv
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+#include "RISCV/CFG.h"
+
+namespace riscy::riscv {
+
+// A superblock: a single-entry chain of CFG blocks along a likely path.
+// Control enters only at the first block; every other block is reached from
+// its predecessor in the chain, and branches off the chain are side exits.
+struct Trace {
+  uint64_t entry = 0;
+  std::vector<uint64_t> blocks; // entry first, in execution order
+};
+
+struct TraceOptions {
+  size_t maxBlocks = 16;
+  size_t maxInsts = 128;
+};
+
+// Grows traces from every block that must be enterable by address: the
+// entry, extra roots, call targets, return continuations, loop headers and
+// the targets of side exits. A trace follows fallthroughs, direct jumps and
+// the predicted direction of conditional branches (backward taken, forward
+// not taken). It stops at calls, returns, indirect jumps, traps, loop
+// headers and other trace heads, so a block inside a trace may also be
+// copied into later traces (tail duplication) but never gains a second
+// entry.
+class TraceBuilder {
+public:
+  explicit TraceBuilder(TraceOptions opts = {}) : opts(opts) {}
+
+  // Returns one trace per head, sorted by entry address.
+  std::vector<Trace> build(const CFG &cfg) const;
+
+private:
+  TraceOptions opts;
+
+  static std::unordered_set<uint64_t> loopHeaders(const CFG &cfg);
+};
+
+} // namespace riscy::riscv
@@ -13,14 +13,59 @@ static int find_block(uint64_t pc) {
   return -1;
 }
 
+// Indirect-target profile: open-addressed table of dispatched PCs and hit
+// counts. Entries beyond capacity are dropped rather than grown.
+#define RISCY_PROFILE_CAP 4096
+static FILE *profile_file;
+static uint64_t profile_pcs[RISCY_PROFILE_CAP];
+static uint64_t profile_hits[RISCY_PROFILE_CAP];
+
+static void profile_count(uint64_t pc) {
+  uint64_t h = (pc >> 2) * 0x9E3779B97F4A7C15ull;
+  for (unsigned n = 0; n < RISCY_PROFILE_CAP; ++n) {
+    unsigned i = (unsigned)((h + n) % RISCY_PROFILE_CAP);
+    if (profile_hits[i] == 0) { profile_pcs[i] = pc; profile_hits[i] = 1; return; }
+    if (profile_pcs[i] == pc) { profile_hits[i]++; return; }
+  }
+}
+
+void riscy_profile_open(const char *path) {
+  if (profile_file || !path || !*path) return;
+  profile_file = fopen(path, "a");
+  if (!profile_file) {
+    fprintf(stderr, "riscy: cannot open profile %s\n", path);
+    return;
+  }
+  fprintf(profile_file, "# riscy indirect-target profile\n");
+  atexit(riscy_profile_flush);
+}
+
+void riscy_profile_flush(void) {
+  if (!profile_file) return;
+  for (unsigned i = 0; i < RISCY_PROFILE_CAP; ++i) {
+    if (profile_hits[i] == 0) continue;
+    fprintf(profile_file, "hit 0x%llx %llu\n", (unsigned long long)profile_pcs[i],
+            (unsigned long long)profile_hits[i]);
+    profile_hits[i] = 0;
+  }
+  fflush(profile_file);
+}
+
 void riscy_indirect_jump(RiscyGuestState* st, uint64_t target_pc) {
   int idx = find_block(target_pc);
   printf("ijump target=0x%llx idx=%d\n", (unsigned long long)target_pc, idx);
   fflush(stdout);
   if (idx < 0) {
+    // Record the miss before trapping so the next translation can use it as
+    // a CFG root.
+    if (profile_file) {
+      fprintf(profile_file, "miss 0x%llx\n", (unsigned long long)target_pc);
+      riscy_profile_flush();
+    }
     __asm__ __volatile__("brk #0");
     return;
   }
+  if (profile_file) profile_count(target_pc);
   void (*fn)(RiscyGuestState*) = riscy_block_ptrs[idx];
   fn(st);
   printf("ijump return from idx=%d\n", idx);
@@ -32,6 +77,32 @@ void riscy_trace(uint64_t pc) {
   fflush(stdout);
 }
 
+void riscy_hle_memcpy(RiscyGuestState* st) {
+  memcpy(st->mem + st->x[10], st->mem + st->x[11], (size_t)st->x[12]);
+}
+
+void riscy_hle_memset(RiscyGuestState* st) {
+  memset(st->mem + st->x[10], (int)st->x[11], (size_t)st->x[12]);
+}
+
+void riscy_hle_strlen(RiscyGuestState* st) {
+  st->x[10] = strlen((const char *)(st->mem + st->x[10]));
+}
+
+void riscy_hle_memcmp(RiscyGuestState* st) {
+  int r = memcmp(st->mem + st->x[10], st->mem + st->x[11], (size_t)st->x[12]);
+  st->x[10] = (uint64_t)(int64_t)r;
+}
+
+void riscy_hle_muldi3(RiscyGuestState* st) {
+  st->x[10] = st->x[10] * st->x[11];
+}
+
+void riscy_hle_udivdi3(RiscyGuestState* st) {
+  // Division by zero yields all ones, as with divu.
+  st->x[10] = st->x[11] ? st->x[10] / st->x[11] : ~(uint64_t)0;
+}
+
 // Standalone entry point to run translated code
 static int parse_u64(const char *s, uint64_t *out) {
   if (!s || !out) return -1;
@@ -65,8 +136,13 @@ int main(int argc, char **argv) {
   int dump_count = 0;
   for (int i = 0; i < 32; ++i) dump_regs[i] = -1;
   int next_arg_to_a = 0; // positional args become a0..a7
+  const char *profile = NULL; // --profile=<path>, else $RISCY_PROFILE
   for (int i = 1; i < argc; ++i) {
     if (strcmp(argv[i], "--verbose") == 0) { verbose = 1; continue; }
+    if (strncmp(argv[i], "--profile=", 10) == 0) {
+      profile = argv[i] + 10;
+      continue;
+    }
     if (strncmp(argv[i], "--dump=", 7) == 0) {
       const char *list = argv[i] + 7;
       const char *p = list;
@@ -112,6 +188,7 @@ int main(int argc, char **argv) {
     }
     // unrecognized args ignored for forward-compat
   }
+  riscy_profile_open(profile ? profile : getenv("RISCY_PROFILE"));
   if (verbose) {
     printf(
         "runner: start_pc=0x%llx image_base=0x%llx blocks=%llu sp=0x%llx\n",
@@ -6,10 +6,15 @@
 extern "C" {
 #endif
 
+// Spill slots for values the register allocator could not keep in host
+// registers (see AArch64/RegAlloc.h).
+#define RISCY_SPILL_SLOTS 1024
+
 typedef struct RiscyGuestState {
   uint64_t x[32];
   uint8_t *mem;      // guest memory base
   uint64_t mem_size; // size in bytes
+  uint64_t spill[RISCY_SPILL_SLOTS];
 } RiscyGuestState;
 
 // External tables provided by emitted assembly
@@ -22,6 +27,23 @@ extern const uint64_t riscy_entry_pc;
 void riscy_indirect_jump(RiscyGuestState *st, uint64_t target_pc);
 void riscy_trace(uint64_t pc);
 
+// Indirect-target profile. Once opened, unresolved dispatch targets are
+// appended as `miss 0x<pc>` lines, and resolved targets are summarised as
+// `hit 0x<pc> <count>` lines when the profile is flushed. `riscy --roots`
+// reads the file back as extra CFG roots.
+void riscy_profile_open(const char *path);
+void riscy_profile_flush(void);
+
+// High-level emulation of guest library functions (`riscy --hle`). Each takes
+// its arguments from a0-a2 (x[10..12]), treats pointers as guest addresses
+// and returns its result in a0, using the host's libc where one exists.
+void riscy_hle_memcpy(RiscyGuestState *st);
+void riscy_hle_memset(RiscyGuestState *st);
+void riscy_hle_strlen(RiscyGuestState *st);
+void riscy_hle_memcmp(RiscyGuestState *st);
+void riscy_hle_muldi3(RiscyGuestState *st);
+void riscy_hle_udivdi3(RiscyGuestState *st);
+
 // Entry: x0=state, x1=start PC (also provided as asm label riscy_entry)
 void riscy_entry(RiscyGuestState *st, uint64_t start_pc);
 
@@ -0,0 +1,964 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "AArch64/Emitter.h"
+#include "AArch64/ISel.h"
+#include "AArch64/Liveness.h"
+#include "AArch64/RegAlloc.h"
+#include "IR/IR.h"
+#include "RISCV/CFG.h"
+#include "RISCV/Lifter.h"
+
+namespace ir = riscy::ir;
+namespace a64 = riscy::aarch64;
+namespace riscv = riscy::riscv;
+
+namespace {
+
+// Builds an IR block at 0x1000 one instruction at a time, numbering the
+// values in order.
+struct IRBuilder {
+  ir::Block bb;
+  ir::ValueId next = 0;
+
+  explicit IRBuilder(uint64_t start = 0x1000) { bb.start = start; }
+
+  template <typename P> ir::ValueId def(const P &payload) {
+    ir::Instr I{};
+    I.dest = next;
+    I.payload = payload;
+    bb.insts.push_back(I);
+    return next++;
+  }
+  template <typename P> void emit(const P &payload) {
+    ir::Instr I{};
+    I.payload = payload;
+    bb.insts.push_back(I);
+  }
+  ir::ValueId reg(uint8_t r) { return def(ir::ReadReg{r}); }
+  ir::ValueId imm(uint64_t value, ir::Type ty = ir::Type::i64()) {
+    return def(ir::Const{ty, value});
+  }
+  ir::ValueId bin(ir::BinOpKind kind, ir::ValueId lhs, ir::ValueId rhs,
+                  ir::Type ty = ir::Type::i64()) {
+    return def(ir::BinOp{kind, lhs, rhs, ty});
+  }
+  ir::ValueId cmp(ir::ICmpCond cond, ir::ValueId lhs, ir::ValueId rhs) {
+    return def(ir::ICmp{cond, lhs, rhs});
+  }
+  void write(uint8_t r, ir::ValueId v) { emit(ir::WriteReg{r, v}); }
+  void branch(ir::ValueId cond, uint64_t t, uint64_t f) {
+    bb.term.kind = ir::TermKind::CBr;
+    bb.term.data = ir::TermCBr{cond, t, f};
+  }
+  void jump(uint64_t target) {
+    bb.term.kind = ir::TermKind::Br;
+    bb.term.data = ir::TermBr{target};
+  }
+
+  a64::Block select() const { return a64::ISel().select(bb); }
+};
+
+// The vreg ISel gives IR value `v`.
+a64::VReg vreg(ir::ValueId v) { return v + 1; }
+
+size_t count(const a64::Block &b, a64::Op op) {
+  size_t n = 0;
+  for (const auto &I : b.instrs)
+    n += I.op == op;
+  return n;
+}
+
+const a64::Instr *find(const a64::Block &b, a64::Op op) {
+  for (const auto &I : b.instrs)
+    if (I.op == op)
+      return &I;
+  return nullptr;
+}
+
+a64::VReg regOp(const a64::Instr &I, size_t i) {
+  return std::get<a64::OpRegV>(I.ops[i]).id;
+}
+
+uint64_t immOp(const a64::Instr &I, size_t i) {
+  return std::get<a64::OpImm>(I.ops[i]).value;
+}
+
+// Allocates registers for each unit and emits them in order.
+std::string emitUnits(const std::vector<std::vector<a64::Block>> &units) {
+  std::vector<a64::RegAssignment> assignments;
+  for (const auto &unit : units)
+    assignments.push_back(
+        a64::RegAlloc().allocate(unit, a64::Liveness().analyze(unit)));
+  return a64::Emitter().emit(units, assignments, 0x1000).text;
+}
+
+} // namespace
+
+TEST_CASE("ISel: compares with zero become cbz and cbnz", "[isel]") {
+  for (auto cond : {ir::ICmpCond::EQ, ir::ICmpCond::NE}) {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto zero = b.imm(0);
+    b.branch(b.cmp(cond, zero, a), 0x2000, 0x3000);
+    auto out = b.select();
+    INFO(ir::toString(b.bb));
+    REQUIRE(out.term.kind == a64::TermKind::CBr);
+    auto t = std::get<a64::TermCBr>(out.term.data);
+    CHECK(t.test == (cond == ir::ICmpCond::EQ ? a64::BranchTest::Zero
+                                              : a64::BranchTest::NonZero));
+    CHECK(t.cond == vreg(a));
+    CHECK_FALSE(t.w);
+    // Neither the compare nor the zero is computed.
+    CHECK(count(out, a64::Op::Cmp) == 0);
+    CHECK(out.instrs.size() == 1);
+  }
+}
+
+TEST_CASE("ISel: single-bit masks and sign tests become tbz and tbnz",
+          "[isel]") {
+  SECTION("bit set") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto bit = b.bin(ir::BinOpKind::And, a, b.imm(8));
+    b.branch(b.cmp(ir::ICmpCond::NE, bit, b.imm(0)), 0x2000, 0x3000);
+    auto out = b.select();
+    auto t = std::get<a64::TermCBr>(out.term.data);
+    CHECK(t.test == a64::BranchTest::BitSet);
+    CHECK(t.bit == 3);
+    CHECK(t.cond == vreg(a));
+    CHECK(count(out, a64::Op::And) == 0);
+  }
+  SECTION("bit clear, mask first") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto bit = b.bin(ir::BinOpKind::And, b.imm(1ull << 63), a);
+    b.branch(b.cmp(ir::ICmpCond::EQ, bit, b.imm(0)), 0x2000, 0x3000);
+    auto t = std::get<a64::TermCBr>(b.select().term.data);
+    CHECK(t.test == a64::BranchTest::BitClear);
+    CHECK(t.bit == 63);
+    CHECK(t.cond == vreg(a));
+  }
+  SECTION("sign of a 64-bit value") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    b.branch(b.cmp(ir::ICmpCond::SLT, a, b.imm(0)), 0x2000, 0x3000);
+    auto t = std::get<a64::TermCBr>(b.select().term.data);
+    CHECK(t.test == a64::BranchTest::BitSet);
+    CHECK(t.bit == 63);
+    CHECK_FALSE(t.w);
+  }
+  SECTION("sign of a 32-bit value") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto sum = b.bin(ir::BinOpKind::Add, a, a, ir::Type::i32());
+    b.branch(b.cmp(ir::ICmpCond::SGE, sum, b.imm(0, ir::Type::i32())), 0x2000,
+             0x3000);
+    auto t = std::get<a64::TermCBr>(b.select().term.data);
+    CHECK(t.test == a64::BranchTest::BitClear);
+    CHECK(t.bit == 31);
+    CHECK(t.w);
+  }
+  SECTION("side exits") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto bit = b.bin(ir::BinOpKind::And, a, b.imm(0x10));
+    b.emit(ir::ExitIf{b.cmp(ir::ICmpCond::EQ, bit, b.imm(0)), 0x2000, {}});
+    b.jump(0x1004);
+    auto out = b.select();
+    const auto *tbz = find(out, a64::Op::Tbz);
+    REQUIRE(tbz);
+    CHECK(regOp(*tbz, 0) == vreg(a));
+    CHECK(immOp(*tbz, 1) == 4);
+    CHECK(std::get<a64::OpLabel>(tbz->ops[2]).name == "__riscy_block_0x2000");
+  }
+}
+
+TEST_CASE("ISel: masks that are used again or have several bits stay",
+          "[isel]") {
+  SECTION("mask also written back") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto bit = b.bin(ir::BinOpKind::And, a, b.imm(8));
+    b.write(5, bit);
+    b.branch(b.cmp(ir::ICmpCond::NE, bit, b.imm(0)), 0x2000, 0x3000);
+    auto out = b.select();
+    auto t = std::get<a64::TermCBr>(out.term.data);
+    CHECK(t.test == a64::BranchTest::NonZero);
+    CHECK(t.cond == vreg(bit));
+    CHECK(count(out, a64::Op::And) == 1);
+  }
+  SECTION("two bits") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto bits = b.bin(ir::BinOpKind::And, a, b.imm(6));
+    b.branch(b.cmp(ir::ICmpCond::EQ, bits, b.imm(0)), 0x2000, 0x3000);
+    auto out = b.select();
+    auto t = std::get<a64::TermCBr>(out.term.data);
+    CHECK(t.test == a64::BranchTest::Zero);
+    CHECK(t.cond == vreg(bits));
+  }
+}
+
+TEST_CASE("Emitter: conditional branches invert to fall through", "[emit]") {
+  // a & 4 != 0 ? t : f, with the next block at 0x1004.
+  auto select = [](uint64_t t, uint64_t f) {
+    IRBuilder b;
+    auto bit = b.bin(ir::BinOpKind::And, b.reg(10), b.imm(4));
+    b.branch(b.cmp(ir::ICmpCond::NE, bit, b.imm(0)), t, f);
+    return b.select();
+  };
+  IRBuilder next(0x1004);
+  next.bb.term.kind = ir::TermKind::Ret;
+
+  SECTION("true target next") {
+    auto text = emitUnits({{select(0x1004, 0x2000)}, {next.select()}});
+    INFO(text);
+    CHECK(text.find(", #2, __riscy_block_0x2000\n") != std::string::npos);
+    CHECK(text.find("  tbz ") != std::string::npos);
+    CHECK(text.find("tbnz") == std::string::npos);
+    CHECK(text.find("b __riscy_block_0x1004") == std::string::npos);
+  }
+  SECTION("false target next") {
+    auto text = emitUnits({{select(0x2000, 0x1004)}, {next.select()}});
+    INFO(text);
+    CHECK(text.find("  tbnz ") != std::string::npos);
+    CHECK(text.find(", #2, __riscy_block_0x2000\n") != std::string::npos);
+    CHECK(text.find("b __riscy_block_0x1004") == std::string::npos);
+  }
+  SECTION("neither target next") {
+    auto text = emitUnits({{select(0x2000, 0x3000)}, {next.select()}});
+    INFO(text);
+    CHECK(text.find(", #2, __riscy_block_0x2000\n  b __riscy_block_0x3000\n") !=
+          std::string::npos);
+  }
+}
+
+TEST_CASE("Emitter: tbz and tbnz out of reach branch around a b", "[emit]") {
+  // Block 0x1000 tests bit 2 and skips `adds` additions to 0x9000.
+  auto emitSkip = [](int adds) {
+    IRBuilder head;
+    auto bit = head.bin(ir::BinOpKind::And, head.reg(10), head.imm(4));
+    head.branch(head.cmp(ir::ICmpCond::NE, bit, head.imm(0)), 0x9000, 0x1004);
+    IRBuilder body(0x1004);
+    auto a = body.reg(10), sum = body.reg(11);
+    for (int i = 0; i < adds; ++i)
+      sum = body.bin(ir::BinOpKind::Add, sum, a);
+    body.write(11, sum);
+    body.jump(0x9000);
+    IRBuilder tail(0x9000);
+    tail.bb.term.kind = ir::TermKind::Ret;
+    return emitUnits({{head.select()}, {body.select()}, {tail.select()}});
+  };
+
+  auto text = emitSkip(100);
+  CHECK(text.find(", #2, __riscy_block_0x9000\n") != std::string::npos);
+  CHECK(text.find("__riscy_relax") == std::string::npos);
+
+  // 9000 instructions are more than the 32KiB tbnz reaches.
+  text = emitSkip(9000);
+  auto tbz = text.find("  tbz ");
+  REQUIRE(tbz != std::string::npos);
+  auto end = text.find("\n", text.find("\n", text.find("\n", tbz) + 1) + 1);
+  INFO(text.substr(tbz, end - tbz));
+  CHECK(text.find("tbnz") == std::string::npos);
+  CHECK(text.find(", #2, __riscy_relax_0\n  b __riscy_block_0x9000\n"
+                  "__riscy_relax_0:\n") != std::string::npos);
+}
+
+namespace {
+
+const a64::OpMem &memOp(const a64::Instr &I) {
+  return std::get<a64::OpMem>(I.ops[1]);
+}
+
+// The first `op` that accesses guest memory rather than the guest state.
+const a64::Instr *findAccess(const a64::Block &b, a64::Op op) {
+  for (const auto &I : b.instrs)
+    if (I.op == op && memOp(I).base.id != 0)
+      return &I;
+  return nullptr;
+}
+
+// The Adds that compute a host address from a guest one in x21.
+std::vector<const a64::Instr *> hostAdds(const a64::Block &b) {
+  std::vector<const a64::Instr *> adds;
+  for (const auto &I : b.instrs)
+    if (I.op == a64::Op::Add && I.ops.size() == 3 &&
+        std::holds_alternative<a64::OpRegP>(I.ops[2]) &&
+        std::get<a64::OpRegP>(I.ops[2]).id == 21)
+      adds.push_back(&I);
+  return adds;
+}
+
+} // namespace
+
+TEST_CASE("ISel: a single guest access adds x21 itself", "[isel]") {
+  SECTION("64-bit base") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    b.def(ir::Load{a, 0, ir::Type::i64()});
+    auto out = b.select();
+    const auto *ldr = findAccess(out, a64::Op::LdrX);
+    REQUIRE(ldr);
+    CHECK(memOp(*ldr).guest);
+    CHECK_FALSE(memOp(*ldr).uxtw);
+    CHECK(memOp(*ldr).base.id == vreg(a));
+    CHECK(hostAdds(out).empty());
+  }
+  SECTION("32-bit base") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto addr = b.bin(ir::BinOpKind::Add, a, a, ir::Type::i32());
+    b.emit(ir::Store{a, addr, 0, ir::Type::i32()});
+    auto out = b.select();
+    const auto *str = findAccess(out, a64::Op::StrW);
+    REQUIRE(str);
+    CHECK(memOp(*str).guest);
+    CHECK(memOp(*str).uxtw);
+    CHECK(memOp(*str).base.id == vreg(addr));
+  }
+  SECTION("base zero-extended from 32 bits") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto w = b.def(ir::Load{a, 8, ir::Type::i32()});
+    auto addr = b.def(ir::ZExt{w, ir::Type::i64()});
+    b.def(ir::Load{addr, 0, ir::Type::i64()});
+    auto out = b.select();
+    const auto *ldr = findAccess(out, a64::Op::LdrX);
+    REQUIRE(ldr);
+    CHECK(memOp(*ldr).guest);
+    CHECK(memOp(*ldr).uxtw);
+    CHECK(memOp(*ldr).base.id == vreg(w));
+    // Only the access uses the extension, so it is not computed.
+    CHECK(count(out, a64::Op::Mov) == 0);
+  }
+  SECTION("zero-extended base that is also written back") {
+    IRBuilder b;
+    auto a = b.reg(10);
+    auto w = b.def(ir::Load{a, 8, ir::Type::i32()});
+    auto addr = b.def(ir::ZExt{w, ir::Type::i64()});
+    b.def(ir::Load{addr, 0, ir::Type::i64()});
+    b.write(5, addr);
+    auto out = b.select();
+    const auto *ldr = findAccess(out, a64::Op::LdrX);
+    REQUIRE(ldr);
+    CHECK(memOp(*ldr).uxtw);
+    CHECK(memOp(*ldr).base.id == vreg(w));
+    CHECK(count(out, a64::Op::Mov) == 1);
+  }
+}
+
+TEST_CASE("ISel: pointers loaded by lwu are read with uxtw", "[isel]") {
+  // lwu x5, 16(x10); ld x5, 0(x5); ret
+  auto inst = [](uint64_t pc, riscv::Opcode op, riscv::Operand a,
+                 riscv::Operand b) {
+    riscv::DecodedInst di{};
+    di.pc = pc;
+    di.opcode = op;
+    di.operands = {a, b};
+    return di;
+  };
+  riscv::BasicBlock bb{};
+  bb.start = 0x1000;
+  bb.insts = {
+      inst(0x1000, riscv::Opcode::LWU, riscv::Reg{5}, riscv::Mem{10, 16}),
+      inst(0x1004, riscv::Opcode::LD, riscv::Reg{5}, riscv::Mem{5, 0}),
+      inst(0x1008, riscv::Opcode::JALR, riscv::Reg{0}, riscv::Mem{1, 0})};
+  bb.term = riscv::TermKind::Return;
+  auto irbb = riscv::Lifter().lift(bb);
+  INFO(ir::toString(irbb));
+  auto out = a64::ISel().select(irbb);
+
+  // The ld reads the pointer from the register of the 32-bit load, and the
+  // zero-extension that only it used is gone.
+  const auto *lwu = find(out, a64::Op::LdrW);
+  REQUIRE(lwu);
+  const auto *ld = findAccess(out, a64::Op::LdrX);
+  REQUIRE(ld);
+  CHECK(memOp(*ld).guest);
+  CHECK(memOp(*ld).uxtw);
+  CHECK(memOp(*ld).base.id == regOp(*lwu, 0));
+  for (const auto &I : out.instrs)
+    if (I.op == a64::Op::Mov && std::holds_alternative<a64::OpRegV>(I.ops[1]))
+      CHECK(regOp(I, 1) != regOp(*lwu, 0));
+}
+
+TEST_CASE("ISel: guest offsets fold into the access if they fit", "[isel]") {
+  struct Case {
+    int64_t offset;
+    ir::Type ty;
+    bool fits;
+  };
+  // Scaled unsigned 12 bits, or unscaled signed 9 bits.
+  const Case cases[] = {
+      {16, ir::Type::i64(), true},      {32760, ir::Type::i64(), true},
+      {32768, ir::Type::i64(), false},  {12, ir::Type::i64(), true},
+      {260, ir::Type::i64(), false},    {-256, ir::Type::i64(), true},
+      {-264, ir::Type::i64(), false},   {4095, ir::Type::i8(), true},
+      {4096, ir::Type::i8(), false},    {8190, ir::Type::i16(), true},
+      {16384, ir::Type::i32(), false},
+  };
+  for (const auto &c : cases) {
+    IRBuilder b;
+    auto a = b.reg(10);
+    b.def(ir::Load{a, c.offset, c.ty});
+    auto out = b.select();
+    INFO("offset " << c.offset << ", type " << static_cast<int>(c.ty.kind));
+    const auto &load = out.instrs.back();
+    const auto &mem = memOp(load);
+    auto adds = hostAdds(out);
+    if (c.fits) {
+      REQUIRE(adds.size() == 1);
+      CHECK(regOp(*adds[0], 1) == vreg(a));
+      CHECK(mem.base.id == regOp(*adds[0], 0));
+      CHECK(mem.offset == c.offset);
+      CHECK_FALSE(mem.guest);
+    } else {
+      // The offset is materialized and added to the guest address instead.
+      CHECK(adds.empty());
+      CHECK(mem.guest);
+      CHECK(mem.offset == 0);
+      const auto &add = out.instrs[out.instrs.size() - 2];
+      REQUIRE(add.op == a64::Op::Add);
+      CHECK(regOp(add, 0) == mem.base.id);
+      CHECK(regOp(add, 1) == vreg(a));
+    }
+  }
+}
+
+TEST_CASE("ISel: accesses off one base share its host address", "[isel]") {
+  IRBuilder b;
+  auto a = b.reg(10);
+  auto v = b.reg(11);
+  auto plus16 = b.bin(ir::BinOpKind::Add, a, b.imm(16));
+  auto minus8 = b.bin(ir::BinOpKind::Sub, a, b.imm(8));
+  b.def(ir::Load{a, 0, ir::Type::i64()});
+  b.def(ir::Load{plus16, 8, ir::Type::i64()});
+  b.emit(ir::Store{v, minus8, 4, ir::Type::i32()});
+  b.emit(ir::Store{v, a, 40000, ir::Type::i8()});
+  auto out = b.select();
+
+  auto adds = hostAdds(out);
+  REQUIRE(adds.size() == 1);
+  CHECK(regOp(*adds[0], 1) == vreg(a));
+  a64::VReg host = regOp(*adds[0], 0);
+  std::vector<int32_t> offsets;
+  for (const auto &I : out.instrs) {
+    if ((I.op != a64::Op::LdrX && I.op != a64::Op::StrW &&
+         I.op != a64::Op::StrB) ||
+        memOp(I).base.id == 0)
+      continue;
+    if (memOp(I).base.id == host && !memOp(I).guest)
+      offsets.push_back(memOp(I).offset);
+    else
+      CHECK(I.op == a64::Op::StrB);
+  }
+  // The byte store is too far from the base to share it.
+  CHECK(offsets == std::vector<int32_t>{0, 24, -4});
+}
+
+TEST_CASE("ISel: 32-bit bases do not share a host address", "[isel]") {
+  IRBuilder b;
+  auto a = b.reg(10);
+  auto addr = b.bin(ir::BinOpKind::Add, a, a, ir::Type::i32());
+  b.def(ir::Load{addr, 0, ir::Type::i64()});
+  b.def(ir::Load{addr, 0, ir::Type::i32()});
+  auto out = b.select();
+  CHECK(hostAdds(out).empty());
+  for (auto op : {a64::Op::LdrX, a64::Op::LdrW}) {
+    const auto *ldr = findAccess(out, op);
+    REQUIRE(ldr);
+    CHECK(memOp(*ldr).guest);
+    CHECK(memOp(*ldr).uxtw);
+  }
+}
+
+namespace {
+
+// The instruction computing `kind` of a register and `value`, both of type
+// `ty`: a 32-bit sum for i32, else a guest register.
+a64::Instr selectWithConstant(ir::BinOpKind kind, uint64_t value,
+                              ir::Type ty = ir::Type::i64()) {
+  IRBuilder b;
+  auto x = b.reg(10);
+  if (ty.kind == ir::TypeKind::I32)
+    x = b.bin(ir::BinOpKind::Add, x, x, ty);
+  auto r = b.bin(kind, x, b.imm(value, ty), ty);
+  b.write(5, r);
+  auto out = b.select();
+  for (const auto &I : out.instrs)
+    if (!I.ops.empty() && std::holds_alternative<a64::OpRegV>(I.ops[0]) &&
+        regOp(I, 0) == vreg(r))
+      return I;
+  FAIL("no instruction defines the result");
+  return {};
+}
+
+bool hasImmediate(const a64::Instr &I) {
+  return std::holds_alternative<a64::OpImm>(I.ops.back());
+}
+
+// The instructions that materialize `value` into a register.
+std::vector<a64::Instr> materialize(uint64_t value) {
+  IRBuilder b;
+  b.write(5, b.imm(value));
+  auto out = b.select();
+  out.instrs.pop_back(); // the StrX of x5
+  return out.instrs;
+}
+
+} // namespace
+
+TEST_CASE("ISel: logical immediates", "[isel]") {
+  struct Case {
+    uint64_t value;
+    bool encodable;
+  };
+  const Case cases64[] = {
+      {0, false},
+      {~0ull, false},
+      {0x5555555555555555, true},  // 2-bit elements
+      {0xaaaaaaaaaaaaaaaa, true},
+      {0x0ff00ff00ff00ff0, true},  // 16-bit elements
+      {0x0ff00ff00ff00ff1, false}, // elements differ
+      {0x0000ffff0000ffff, true},  // 32-bit elements
+      {0xf00000000000000f, true},  // a run that wraps around
+      {0x8000000000000001, true},
+      {0x00000000f000000f, false}, // two runs in a 64-bit element
+      {0x7fffffffffffffff, true},
+      {0x0000000000000ff0, true},
+      {0x0000000000000ff5, false},
+  };
+  for (auto kind : {ir::BinOpKind::And, ir::BinOpKind::Or, ir::BinOpKind::Xor})
+    for (const auto &c : cases64) {
+      INFO("0x" << std::hex << c.value);
+      auto I = selectWithConstant(kind, c.value);
+      CHECK(hasImmediate(I) == c.encodable);
+      CHECK_FALSE(I.w);
+      if (c.encodable)
+        CHECK(immOp(I, 2) == c.value);
+    }
+
+  // Only the low half of a 32-bit operation counts.
+  const Case cases32[] = {
+      {0, false},
+      {0xffffffff, false},
+      {0x55555555, true},
+      {0xf000000f, true}, // wraps around within 32 bits
+      {0x0000ffff, true},
+      {0x0ff00ff0, true},
+      {0xf00ff00f, true},
+      {0x0ff00ff1, false},
+  };
+  for (const auto &c : cases32) {
+    INFO("0x" << std::hex << c.value);
+    auto I = selectWithConstant(ir::BinOpKind::And, c.value, ir::Type::i32());
+    CHECK(hasImmediate(I) == c.encodable);
+    CHECK(I.w);
+  }
+}
+
+TEST_CASE("ISel: constants take the fewest instructions", "[isel]") {
+  using a64::Op;
+  SECTION("one instruction") {
+    for (uint64_t v : {0ull, 0xffffull, 0x5555555555555555ull,
+                       0xffff0000ffff0000ull}) {
+      INFO("0x" << std::hex << v);
+      auto seq = materialize(v);
+      REQUIRE(seq.size() == 1);
+      CHECK(seq[0].op == Op::Mov);
+      CHECK(immOp(seq[0], 1) == v);
+    }
+    auto movz = materialize(0x12340000);
+    REQUIRE(movz.size() == 1);
+    CHECK(movz[0].op == Op::MovZ);
+    CHECK(immOp(movz[0], 1) == 0x1234);
+    CHECK(immOp(movz[0], 2) == 16);
+
+    auto ones = materialize(~0ull);
+    REQUIRE(ones.size() == 1);
+    CHECK(ones[0].op == Op::MovN);
+    CHECK(immOp(ones[0], 1) == 0);
+
+    auto movn = materialize(0xffffffffffff1234);
+    REQUIRE(movn.size() == 1);
+    CHECK(movn[0].op == Op::MovN);
+    CHECK(immOp(movn[0], 1) == 0xedcb);
+    CHECK(immOp(movn[0], 2) == 0);
+  }
+  SECTION("zero or one background") {
+    auto seq = materialize(0x0000123400005678);
+    REQUIRE(seq.size() == 2);
+    CHECK(seq[0].op == Op::MovZ);
+    CHECK(immOp(seq[0], 1) == 0x5678);
+    CHECK(seq[1].op == Op::MovK);
+    CHECK(immOp(seq[1], 1) == 0x1234);
+    CHECK(immOp(seq[1], 2) == 32);
+
+    seq = materialize(0xffff1234ffff5678);
+    REQUIRE(seq.size() == 2);
+    CHECK(seq[0].op == Op::MovN);
+    CHECK(immOp(seq[0], 1) == 0xa987);
+    CHECK(seq[1].op == Op::MovK);
+    CHECK(immOp(seq[1], 1) == 0x1234);
+    CHECK(immOp(seq[1], 2) == 32);
+
+    seq = materialize(0x123456789abcdef0);
+    REQUIRE(seq.size() == 4);
+    CHECK(seq[0].op == Op::MovZ);
+    for (size_t i = 1; i < 4; ++i) {
+      CHECK(seq[i].op == Op::MovK);
+      CHECK(immOp(seq[i], 2) == 16 * i);
+    }
+  }
+  SECTION("logical immediate patched by one movk") {
+    auto seq = materialize(0x5555555555551234);
+    REQUIRE(seq.size() == 2);
+    CHECK(seq[0].op == Op::Mov);
+    CHECK(immOp(seq[0], 1) == 0x5555555555555555);
+    CHECK(seq[1].op == Op::MovK);
+    CHECK(immOp(seq[1], 1) == 0x1234);
+    CHECK(immOp(seq[1], 2) == 0);
+  }
+}
+
+TEST_CASE("ISel: arithmetic immediates and compares with their negation",
+          "[isel]") {
+  using a64::Op;
+  SECTION("add and sub") {
+    auto I = selectWithConstant(ir::BinOpKind::Add, 4095);
+    CHECK(I.op == Op::Add);
+    CHECK(immOp(I, 2) == 4095);
+    I = selectWithConstant(ir::BinOpKind::Add, 0x123000);
+    CHECK(I.op == Op::Add);
+    CHECK(immOp(I, 2) == 0x123000);
+    I = selectWithConstant(ir::BinOpKind::Add, static_cast<uint64_t>(-3));
+    CHECK(I.op == Op::Sub);
+    CHECK(immOp(I, 2) == 3);
+    I = selectWithConstant(ir::BinOpKind::Sub, static_cast<uint64_t>(-4096));
+    CHECK(I.op == Op::Add);
+    CHECK(immOp(I, 2) == 4096);
+    I = selectWithConstant(ir::BinOpKind::Add, 4097);
+    CHECK(I.op == Op::Add);
+    CHECK_FALSE(hasImmediate(I));
+  }
+
+  // Branches on a compare of a register and `value`, in either order.
+  auto compare = [](uint64_t value, bool constantFirst,
+                    ir::Type ty = ir::Type::i64()) {
+    IRBuilder b;
+    auto x = b.reg(10);
+    if (ty.kind == ir::TypeKind::I32)
+      x = b.bin(ir::BinOpKind::Add, x, x, ty);
+    auto c = b.imm(value, ty);
+    b.branch(constantFirst ? b.cmp(ir::ICmpCond::SLT, c, x)
+                           : b.cmp(ir::ICmpCond::SLT, x, c),
+             0x2000, 0x3000);
+    auto out = b.select();
+    REQUIRE(!out.instrs.empty());
+    REQUIRE(out.term.kind == a64::TermKind::CBr);
+    return std::pair{out.instrs.back(),
+                     std::get<a64::TermCBr>(out.term.data).cc};
+  };
+  SECTION("cmp") {
+    auto [cmp, cc] = compare(5, false);
+    CHECK(cmp.op == Op::Cmp);
+    CHECK(immOp(cmp, 1) == 5);
+    CHECK(cc == a64::Cond::LT);
+  }
+  SECTION("cmn") {
+    auto [cmn, cc] = compare(static_cast<uint64_t>(-5), false);
+    CHECK(cmn.op == Op::Cmn);
+    CHECK(immOp(cmn, 1) == 5);
+    CHECK(cc == a64::Cond::LT);
+    CHECK_FALSE(cmn.w);
+  }
+  SECTION("cmn with the constant first") {
+    auto [cmn, cc] = compare(static_cast<uint64_t>(-0x7000), true);
+    CHECK(cmn.op == Op::Cmn);
+    CHECK(immOp(cmn, 1) == 0x7000);
+    CHECK(cc == a64::Cond::GT);
+  }
+  SECTION("32-bit cmn") {
+    auto [cmn, cc] = compare(0xfffffffb, false, ir::Type::i32());
+    CHECK(cmn.op == Op::Cmn);
+    CHECK(immOp(cmn, 1) == 5);
+    CHECK(cmn.w);
+  }
+  SECTION("the most negative value stays in a register") {
+    auto [cmp, cc] = compare(1ull << 63, false);
+    CHECK(cmp.op == Op::Cmp);
+    CHECK(std::holds_alternative<a64::OpRegV>(cmp.ops[1]));
+  }
+}
+
+namespace {
+
+using ir::BinOpKind;
+
+// The bitfield instruction `op` of `out` taking `width` bits at `lsb` of
+// `src`, or null.
+const a64::Instr *findField(const a64::Block &out, a64::Op op, ir::ValueId src,
+                            uint64_t lsb, uint64_t width) {
+  for (const auto &I : out.instrs)
+    if (I.op == op && regOp(I, 1) == vreg(src) && immOp(I, 2) == lsb &&
+        immOp(I, 3) == width)
+      return &I;
+  return nullptr;
+}
+
+bool hasShifts(const a64::Block &out) {
+  return count(out, a64::Op::Lsl) + count(out, a64::Op::Lsr) +
+             count(out, a64::Op::Asr) >
+         0;
+}
+
+// (x << a) >> b for a logical or arithmetic right shift.
+a64::Block shiftPair(uint64_t a, uint64_t b, BinOpKind right,
+                     ir::ValueId &x) {
+  IRBuilder bb;
+  x = bb.reg(10);
+  auto shl = bb.bin(BinOpKind::Shl, x, bb.imm(a));
+  bb.write(5, bb.bin(right, shl, bb.imm(b)));
+  return bb.select();
+}
+
+} // namespace
+
+TEST_CASE("ISel: shift pairs become bitfield extracts", "[isel]") {
+  using a64::Op;
+  ir::ValueId x = 0;
+  struct Case {
+    uint64_t a, b;
+    BinOpKind right;
+    Op op;
+    uint64_t lsb, width;
+  };
+  const Case cases[] = {
+      {8, 16, BinOpKind::LShr, Op::Ubfx, 8, 48},
+      {32, 40, BinOpKind::AShr, Op::Sbfx, 8, 24},
+      {16, 8, BinOpKind::LShr, Op::Ubfiz, 8, 48},
+      {56, 8, BinOpKind::AShr, Op::Sbfiz, 48, 8},
+      {0, 63, BinOpKind::LShr, Op::Ubfx, 63, 1},  // lsb + width == 64
+      {63, 63, BinOpKind::AShr, Op::Sbfx, 0, 1},  // sign of bit 0
+      {63, 0, BinOpKind::LShr, Op::Ubfiz, 63, 1}, // a shift of 0
+  };
+  for (const auto &c : cases) {
+    INFO("<< " << c.a << " >> " << c.b);
+    auto out = shiftPair(c.a, c.b, c.right, x);
+    CHECK(findField(out, c.op, x, c.lsb, c.width));
+    CHECK_FALSE(hasShifts(out));
+  }
+}
+
+TEST_CASE("ISel: masks of shifts become bitfield moves", "[isel]") {
+  using a64::Op;
+  SECTION("ubfx at the top") {
+    IRBuilder b;
+    auto x = b.reg(10);
+    auto hi = b.bin(BinOpKind::LShr, x, b.imm(60));
+    b.write(5, b.bin(BinOpKind::And, b.imm(0xf), hi));
+    auto out = b.select();
+    CHECK(findField(out, Op::Ubfx, x, 60, 4));
+    CHECK(count(out, Op::And) == 0);
+  }
+  SECTION("32-bit ubfx") {
+    IRBuilder b;
+    auto x = b.bin(BinOpKind::Add, b.reg(10), b.reg(11), ir::Type::i32());
+    auto hi = b.bin(BinOpKind::AShr, x, b.imm(4, ir::Type::i32()),
+                    ir::Type::i32());
+    b.write(5, b.bin(BinOpKind::And, hi, b.imm(0xfff, ir::Type::i32()),
+                     ir::Type::i32()));
+    auto out = b.select();
+    const auto *ubfx = findField(out, Op::Ubfx, x, 4, 12);
+    REQUIRE(ubfx);
+    CHECK(ubfx->w);
+  }
+  SECTION("a field past the top does not match") {
+    IRBuilder b;
+    auto x = b.reg(10);
+    auto hi = b.bin(BinOpKind::LShr, x, b.imm(61));
+    b.write(5, b.bin(BinOpKind::And, hi, b.imm(0xf)));
+    auto out = b.select();
+    CHECK(count(out, Op::Ubfx) == 0);
+    CHECK(count(out, Op::Lsr) == 1);
+    CHECK(count(out, Op::And) == 1);
+  }
+  SECTION("ubfiz") {
+    IRBuilder b;
+    auto x = b.reg(10);
+    auto lo = b.bin(BinOpKind::And, x, b.imm(0xff));
+    b.write(5, b.bin(BinOpKind::Shl, lo, b.imm(8)));
+    CHECK(findField(b.select(), Op::Ubfiz, x, 8, 8));
+  }
+  SECTION("ubfiz drops the bits shifted out") {
+    IRBuilder b;
+    auto x = b.reg(10);
+    auto lo = b.bin(BinOpKind::And, x, b.imm(0xffff));
+    b.write(5, b.bin(BinOpKind::Shl, lo, b.imm(56)));
+    CHECK(findField(b.select(), Op::Ubfiz, x, 56, 8));
+  }
+  SECTION("a shift used again stays") {
+    IRBuilder b;
+    auto x = b.reg(10);
+    auto hi = b.bin(BinOpKind::LShr, x, b.imm(8));
+    b.write(6, hi);
+    b.write(5, b.bin(BinOpKind::And, hi, b.imm(0xff)));
+    auto out = b.select();
+    CHECK(count(out, Op::Ubfx) == 0);
+    CHECK(count(out, Op::Lsr) == 1);
+  }
+}
+
+TEST_CASE("ISel: masked ors become bitfield inserts", "[isel]") {
+  using a64::Op;
+  // (y & keep) | t, with t built from x by `field`.
+  auto insert = [](uint64_t keep, auto field, ir::ValueId &x,
+                   ir::ValueId &y) {
+    IRBuilder b;
+    x = b.reg(10);
+    y = b.reg(11);
+    auto kept = b.bin(BinOpKind::And, y, b.imm(keep));
+    b.write(5, b.bin(BinOpKind::Or, field(b, x), kept));
+    return b.select();
+  };
+  auto maskShift = [](uint64_t mask, uint64_t shift) {
+    return [=](IRBuilder &b, ir::ValueId x) {
+      auto lo = b.bin(BinOpKind::And, x, b.imm(mask));
+      return shift ? b.bin(BinOpKind::Shl, lo, b.imm(shift)) : lo;
+    };
+  };
+  ir::ValueId x = 0, y = 0;
+  SECTION("field in the middle") {
+    auto out = insert(~0xff00ull, maskShift(0xff, 8), x, y);
+    const auto *bfi = findField(out, Op::Bfi, x, 8, 8);
+    REQUIRE(bfi);
+    // The insert merges into a copy of y.
+    const auto *copy = find(out, Op::Mov);
+    REQUIRE(copy);
+    CHECK(regOp(*copy, 1) == vreg(y));
+    CHECK(regOp(*copy, 0) == regOp(*bfi, 0));
+    CHECK(count(out, Op::And) == 0);
+    CHECK(count(out, Op::Orr) == 0);
+    CHECK_FALSE(hasShifts(out));
+  }
+  SECTION("field at bit 0") {
+    auto out = insert(~0xfffull, maskShift(0xfff, 0), x, y);
+    CHECK(findField(out, Op::Bfi, x, 0, 12));
+  }
+  SECTION("field at the top needs no mask") {
+    auto out = insert(0x00ffffffffffffffull,
+                      [](IRBuilder &b, ir::ValueId x) {
+                        return b.bin(BinOpKind::Shl, x, b.imm(56));
+                      },
+                      x, y);
+    CHECK(findField(out, Op::Bfi, x, 56, 8));
+  }
+  SECTION("a field shifted elsewhere does not match") {
+    auto out = insert(~0xff00ull, maskShift(0xff, 4), x, y);
+    CHECK(count(out, Op::Bfi) == 0);
+    CHECK(count(out, Op::Orr) == 1);
+  }
+  SECTION("a cleared field that is not one run does not match") {
+    auto out = insert(~0xf0f0ull, maskShift(0xff, 4), x, y);
+    CHECK(count(out, Op::Bfi) == 0);
+  }
+}
+
+TEST_CASE("ISel: operations shift their last operand", "[isel]") {
+  using a64::Op;
+  // kind(x, y shift k), with the shifted operand first if `swap`.
+  auto shifted = [](BinOpKind kind, BinOpKind shift, uint64_t k, bool swap,
+                    bool reuse = false) {
+    IRBuilder b;
+    auto x = b.reg(10), y = b.reg(11);
+    auto s = b.bin(shift, y, b.imm(k));
+    if (reuse)
+      b.write(6, s);
+    b.write(5, swap ? b.bin(kind, s, x) : b.bin(kind, x, s));
+    return b.select();
+  };
+  struct Case {
+    BinOpKind kind, shift;
+    uint64_t k;
+    bool swap;
+    Op op;
+    a64::Shift expected;
+  };
+  const Case cases[] = {
+      {BinOpKind::Add, BinOpKind::Shl, 3, false, Op::Add, a64::Shift::LSL},
+      {BinOpKind::Add, BinOpKind::Shl, 3, true, Op::Add, a64::Shift::LSL},
+      {BinOpKind::Sub, BinOpKind::LShr, 63, false, Op::Sub, a64::Shift::LSR},
+      {BinOpKind::And, BinOpKind::AShr, 1, true, Op::And, a64::Shift::ASR},
+      {BinOpKind::Or, BinOpKind::Shl, 0, false, Op::Orr, a64::Shift::LSL},
+      {BinOpKind::Xor, BinOpKind::LShr, 32, false, Op::Eor, a64::Shift::LSR},
+  };
+  for (const auto &c : cases) {
+    INFO("shift by " << c.k << (c.swap ? ", shifted operand first" : ""));
+    auto out = shifted(c.kind, c.shift, c.k, c.swap);
+    const auto *I = find(out, c.op);
+    REQUIRE(I);
+    // x and y are the values 0 and 1.
+    CHECK(regOp(*I, 1) == vreg(0));
+    CHECK(regOp(*I, 2) == vreg(1));
+    CHECK(I->shift == c.expected);
+    CHECK(I->amount == c.k);
+    CHECK_FALSE(hasShifts(out));
+  }
+
+  SECTION("a shifted minuend does not match") {
+    auto out = shifted(BinOpKind::Sub, BinOpKind::Shl, 3, true);
+    CHECK(count(out, Op::Lsl) == 1);
+    CHECK(find(out, Op::Sub)->amount == 0);
+  }
+  SECTION("a shift used again stays") {
+    auto out = shifted(BinOpKind::Add, BinOpKind::Shl, 3, false, true);
+    CHECK(count(out, Op::Lsl) == 1);
+    CHECK(find(out, Op::Add)->amount == 0);
+  }
+}
+
+TEST_CASE("RegAlloc: vectors spill to 16-byte slots", "[regalloc]") {
+  // 30 splats that are all live until a chain of adds sums them: more than
+  // the SIMD registers the allocator hands out.
+  IRBuilder b;
+  auto a = b.reg(10);
+  std::vector<ir::ValueId> splats;
+  for (int i = 0; i < 30; ++i)
+    splats.push_back(b.def(ir::Splat{a, ir::Type::i64()}));
+  auto sum = splats[0];
+  for (int i = 1; i < 30; ++i)
+    sum = b.def(ir::VecBinOp{ir::BinOpKind::Add, sum, splats[i],
+                             ir::Type::i64()});
+  b.emit(ir::Store{sum, a, 0, ir::Type::v128()});
+  b.bb.term.kind = ir::TermKind::Ret;
+  std::vector<a64::Block> unit{b.select()};
+  auto asg = a64::RegAlloc().allocate(unit, a64::Liveness().analyze(unit));
+
+  std::vector<int32_t> offsets;
+  for (auto [v, off] : asg.spill)
+    if (v & a64::kVecRegBit)
+      offsets.push_back(off);
+  REQUIRE_FALSE(offsets.empty());
+  std::sort(offsets.begin(), offsets.end());
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    CHECK(offsets[i] % 16 == 0);
+    if (i)
+      CHECK(offsets[i] - offsets[i - 1] >= 16);
+  }
+  // The scratch registers stay free for staging.
+  for (auto [v, p] : asg.v2p)
+    if (v & a64::kVecRegBit)
+      CHECK(p < 30);
+
+  auto text = emitUnits({unit});
+  INFO(text);
+  CHECK(text.find("  str q30, [x0, #") != std::string::npos);
+  CHECK(text.find("  ldr q30, [x0, #") != std::string::npos);
+}
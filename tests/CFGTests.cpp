@@ -5,6 +5,9 @@
 
 #include "MemoryReaders.h"
 #include "RISCV/CFG.h"
+#include "RISCV/CFGSimplifier.h"
+#include "RISCV/CallGraph.h"
+#include "RISCV/Trace.h"
 #include "TestUtils.h"
 
 TEST_CASE("CFG: simple branches and jumps", "[cfg]") {
@@ -12,8 +15,8 @@ TEST_CASE("CFG: simple branches and jumps", "[cfg]") {
   // Layout (base = 0x1000):
   // 0x1000: ADDI x1, x0, 1
   // 0x1004: BEQ x0, x0, +16   -> 0x1014 (block2)
-  // 0x1008: JAL x1, +20       -> 0x101C (block3)
-  // 0x100C: (unused)
+  // 0x1008: JAL x1, +20       -> 0x101C (block3), returns to 0x100C
+  // 0x100C: NOP               (return continuation)
   // 0x1010: (unused)
   // 0x1014: SUB x2, x1, x0    (block2)
   // 0x1018: ECALL             (trap)
@@ -61,14 +64,21 @@ TEST_CASE("CFG: simple branches and jumps", "[cfg]") {
 
   // Block at 0x1008 should be created due to branch fallthrough leader or
   // explicit jump origin We did not build a separate block starting at 0x1008;
-  // JAL terminates the block at 0x1008. Ensure JAL successor
+  // JAL terminates the block at 0x1008. JAL x1 is a call, so its successors
+  // are the callee and the return continuation.
   {
     // Build a block starting at 0x1008 should exist due to fallthrough enqueue
     REQUIRE(cfg.indexByAddr.count(base + 0x08) == 1);
     const auto &b1 = cfg.blocks[cfg.indexByAddr[base + 0x08]];
-    CHECK(b1.term == riscy::riscv::TermKind::Jump);
-    REQUIRE(b1.succs.size() == 1);
+    CHECK(b1.term == riscy::riscv::TermKind::Call);
+    REQUIRE(b1.succs.size() == 2);
     CHECK(b1.succs[0] == base + 0x1C);
+    CHECK(b1.succs[1] == base + 0x0C);
+    CHECK(b1.returnSite() == base + 0x0C);
+    // The continuation is a block of its own that falls into 0x1014.
+    REQUIRE(cfg.indexByAddr.count(base + 0x0C) == 1);
+    const auto &cont = cfg.blocks[cfg.indexByAddr[base + 0x0C]];
+    CHECK(cont.term == riscy::riscv::TermKind::Fallthrough);
   }
 
   // Block 0x1014 ends with trap
@@ -85,3 +95,206 @@ TEST_CASE("CFG: simple branches and jumps", "[cfg]") {
     CHECK(b3.succs.empty());
   }
 }
+
+TEST_CASE("CFG: extra roots seed discovery", "[cfg]") {
+  std::vector<unsigned char> code;
+  // 0x1000: ADDI x1, x0, 1
+  // 0x1004: EBREAK            (entry block ends here)
+  // 0x1008: ADDI x2, x0, 2    (only reachable indirectly; profile root)
+  // 0x100C: ADDI x3, x0, 3    (profile root in the middle of straight code)
+  // 0x1010: ECALL
+  appendWordLE(code, encodeI(1, 0, 0x0, 1, 0x13));
+  appendWordLE(code, 0x00100073);
+  appendWordLE(code, encodeI(2, 0, 0x0, 2, 0x13));
+  appendWordLE(code, encodeI(3, 0, 0x0, 3, 0x13));
+  appendWordLE(code, 0x00000073);
+
+  uint64_t base = 0x1000;
+  riscy::SpanMemoryReader mem(base, code.data(), code.size());
+  riscy::riscv::CFGBuilder builder;
+
+  // Without roots only the entry block is discovered.
+  REQUIRE(builder.build(mem, base).blocks.size() == 1);
+
+  // Misaligned and out-of-range roots are dropped.
+  riscy::riscv::CFG cfg =
+      builder.build(mem, base, {base + 0x8, base + 0xC, base + 0x2, 0x9000});
+  REQUIRE(cfg.roots.size() == 2);
+  REQUIRE(cfg.blocks.size() == 3);
+  REQUIRE(cfg.indexByAddr.count(base + 0x8) == 1);
+  REQUIRE(cfg.indexByAddr.count(base + 0xC) == 1);
+
+  // A root splits straight-line code: 0x1008 falls through into 0x100C.
+  const auto &b1 = cfg.blocks[cfg.indexByAddr[base + 0x8]];
+  CHECK(b1.insts.size() == 1);
+  CHECK(b1.term == riscy::riscv::TermKind::Fallthrough);
+  REQUIRE(b1.succs.size() == 1);
+  CHECK(b1.succs[0] == base + 0xC);
+  CHECK(cfg.blocks[cfg.indexByAddr[base + 0xC]].term ==
+        riscy::riscv::TermKind::Trap);
+}
+
+TEST_CASE("CallGraph: functions, call edges and SCCs", "[cfg]") {
+  std::vector<unsigned char> code;
+  // main:
+  // 0x2000: JAL ra, f           (call)
+  // 0x2004: JALR ra, 0(a5)      (indirect call)
+  // 0x2008: JAL t0, leaf        (call through the alternate link register)
+  // 0x200C: EBREAK
+  // f:
+  // 0x2010: BEQ a0, x0, +12     -> 0x201C
+  // 0x2014: JAL ra, g           (call)
+  // 0x2018: JALR x0, 0(ra)      (ret)
+  // 0x201C: JALR x0, 0(ra)      (ret)
+  // g:
+  // 0x2020: ADDI a0, a0, -1
+  // 0x2024: JAL x0, f           (tail call)
+  // leaf:
+  // 0x2028: ADDI a0, a0, 1
+  // 0x202C: JALR x0, 0(t0)      (ret)
+  appendWordLE(code, encodeJ(0x10, 1, 0x6F));
+  appendWordLE(code, encodeI(0, 15, 0x0, 1, 0x67));
+  appendWordLE(code, encodeJ(0x20, 5, 0x6F));
+  appendWordLE(code, 0x00100073);
+  appendWordLE(code, encodeB(12, 0, 10, 0x0, 0x63));
+  appendWordLE(code, encodeJ(0x0C, 1, 0x6F));
+  appendWordLE(code, encodeI(0, 1, 0x0, 0, 0x67));
+  appendWordLE(code, encodeI(0, 1, 0x0, 0, 0x67));
+  appendWordLE(code, encodeI(-1, 10, 0x0, 10, 0x13));
+  appendWordLE(code, encodeJ(-0x14, 0, 0x6F));
+  appendWordLE(code, encodeI(1, 10, 0x0, 10, 0x13));
+  appendWordLE(code, encodeI(0, 5, 0x0, 0, 0x67));
+
+  uint64_t base = 0x2000;
+  riscy::SpanMemoryReader mem(base, code.data(), code.size());
+  riscy::riscv::CFGBuilder builder;
+  riscy::riscv::CFG cfg = builder.build(mem, base);
+
+  const auto &icall = cfg.blocks[cfg.indexByAddr[base + 0x4]];
+  CHECK(icall.term == riscy::riscv::TermKind::IndirectCall);
+  CHECK(icall.returnSite() == base + 0x8);
+  CHECK(cfg.blocks[cfg.indexByAddr[base + 0x8]].term ==
+        riscy::riscv::TermKind::Call);
+  CHECK(cfg.blocks[cfg.indexByAddr[base + 0x20]].term ==
+        riscy::riscv::TermKind::Jump);
+  CHECK(cfg.blocks[cfg.indexByAddr[base + 0x28]].term ==
+        riscy::riscv::TermKind::Return);
+
+  riscy::riscv::CallGraphBuilder cgBuilder;
+  auto cg = cgBuilder.build(cfg);
+  REQUIRE(cg.functions.size() == 4);
+  size_t mainFn = cg.indexByEntry.at(base);
+  size_t f = cg.indexByEntry.at(base + 0x10);
+  size_t g = cg.indexByEntry.at(base + 0x20);
+  size_t leaf = cg.indexByEntry.at(base + 0x28);
+
+  // Call-site blocks continue into their return sites; callees are not part
+  // of the caller's body.
+  CHECK(cg.functions[mainFn].blocks ==
+        std::vector<uint64_t>{base, base + 0x4, base + 0x8, base + 0xC});
+  CHECK(cg.functions[mainFn].callees ==
+        std::vector<uint64_t>{base + 0x10, base + 0x28});
+  CHECK(cg.functions[mainFn].hasIndirectCalls);
+  CHECK(cg.functions[f].blocks.size() == 4);
+  CHECK(cg.functions[g].callees == std::vector<uint64_t>{base + 0x10});
+  CHECK(cg.functions[leaf].isLeaf());
+
+  // f and g form a cycle through g's tail call.
+  CHECK(cg.sccOf[f] == cg.sccOf[g]);
+  CHECK(cg.isRecursive(f));
+  CHECK(cg.isRecursive(g));
+  CHECK_FALSE(cg.isRecursive(mainFn));
+  CHECK_FALSE(cg.isRecursive(leaf));
+  // Callees come before callers.
+  CHECK(cg.sccOf[f] < cg.sccOf[mainFn]);
+  CHECK(cg.sccOf[leaf] < cg.sccOf[mainFn]);
+}
+
+TEST_CASE("CFGSimplifier: threading, unreachable removal and merging",
+          "[cfg]") {
+  std::vector<unsigned char> code;
+  // 0x3000: BEQ a0, x0, +16     -> 0x3010 (trampoline)
+  // 0x3004: ADDI x2, x0, 2
+  // 0x3008: JAL x0, +12         -> 0x3014 (only predecessor of 0x3014)
+  // 0x300C: EBREAK              (never reached)
+  // 0x3010: JAL x0, +8          -> 0x3018
+  // 0x3014: ADDI x3, x0, 3
+  // 0x3018: ECALL
+  appendWordLE(code, encodeB(16, 0, 10, 0x0, 0x63));
+  appendWordLE(code, encodeI(2, 0, 0x0, 2, 0x13));
+  appendWordLE(code, encodeJ(12, 0, 0x6F));
+  appendWordLE(code, 0x00100073);
+  appendWordLE(code, encodeJ(8, 0, 0x6F));
+  appendWordLE(code, encodeI(3, 0, 0x0, 3, 0x13));
+  appendWordLE(code, 0x00000073);
+
+  uint64_t base = 0x3000;
+  riscy::SpanMemoryReader mem(base, code.data(), code.size());
+  riscy::riscv::CFGBuilder builder;
+  riscy::riscv::CFGSimplifier simplifier;
+
+  riscy::riscv::CFG cfg = builder.build(mem, base);
+  REQUIRE(cfg.blocks.size() == 5);
+  auto stats = simplifier.run(cfg);
+  CHECK(stats.blocksBefore == 5);
+  CHECK(stats.blocksAfter == 3);
+  CHECK(stats.edgesThreaded == 1);
+  CHECK(stats.blocksUnreachable == 1);
+  CHECK(stats.blocksMerged == 1);
+
+  // The branch now targets 0x3018 directly.
+  const auto &b0 = cfg.blocks[cfg.indexByAddr.at(base)];
+  REQUIRE(b0.succs.size() == 2);
+  CHECK(b0.succs[0] == base + 0x18);
+  CHECK(cfg.indexByAddr.count(base + 0x10) == 0);
+
+  // 0x3014 was folded into 0x3004, which now falls through to 0x3018.
+  CHECK(cfg.indexByAddr.count(base + 0x14) == 0);
+  const auto &b1 = cfg.blocks[cfg.indexByAddr.at(base + 0x4)];
+  CHECK(b1.insts.size() == 3);
+  CHECK(b1.term == riscy::riscv::TermKind::Fallthrough);
+  REQUIRE(b1.succs.size() == 1);
+  CHECK(b1.succs[0] == base + 0x18);
+
+  // Roots keep their own block.
+  riscy::riscv::CFG rooted = builder.build(mem, base, {base + 0x14});
+  auto rootedStats = simplifier.run(rooted);
+  CHECK(rootedStats.blocksMerged == 0);
+  CHECK(rooted.indexByAddr.count(base + 0x14) == 1);
+}
+
+TEST_CASE("TraceBuilder: loop bodies become their own superblock", "[cfg]") {
+  std::vector<unsigned char> code;
+  // 0x4000: ADDI x5, x0, 0
+  // 0x4004: BGE x5, a0, +12     -> 0x4010 (forward: predicted not taken)
+  // 0x4008: ADDI x5, x5, 1
+  // 0x400C: JAL x0, -8          -> 0x4004 (back-edge)
+  // 0x4010: JALR x0, 0(ra)
+  appendWordLE(code, encodeI(0, 0, 0x0, 5, 0x13));
+  appendWordLE(code, encodeB(12, 10, 5, 0x5, 0x63));
+  appendWordLE(code, encodeI(1, 5, 0x0, 5, 0x13));
+  appendWordLE(code, encodeJ(-8, 0, 0x6F));
+  appendWordLE(code, encodeI(0, 1, 0x0, 0, 0x67));
+
+  uint64_t base = 0x4000;
+  riscy::SpanMemoryReader mem(base, code.data(), code.size());
+  riscy::riscv::CFGBuilder builder;
+  riscy::riscv::CFG cfg = builder.build(mem, base);
+
+  riscy::riscv::TraceBuilder tracer;
+  auto traces = tracer.build(cfg);
+  REQUIRE(traces.size() == 3);
+
+  // The entry stops before the loop; the loop trace starts at the body and
+  // runs through the loop test, so the whole iteration is one unit.
+  CHECK(traces[0].entry == base);
+  CHECK(traces[0].blocks == std::vector<uint64_t>{base});
+  CHECK(traces[1].entry == base + 0x8);
+  CHECK(traces[1].blocks == std::vector<uint64_t>{base + 0x8, base + 0x4});
+  CHECK(traces[2].blocks == std::vector<uint64_t>{base + 0x10});
+
+  // A size limit of one block degenerates to block-at-a-time translation.
+  riscy::riscv::TraceBuilder single({1, 128});
+  for (const auto &t : single.build(cfg))
+    CHECK(t.blocks.size() == 1);
+}
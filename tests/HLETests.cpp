@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+#include "ELFImage.h"
+#include "HLE.h"
+#include "TestUtils.h"
+
+namespace {
+
+struct TestSymbol {
+  std::string name;
+  uint64_t addr = 0;
+  uint64_t size = 0;
+};
+
+template <typename T> void appendLE(std::vector<char> &buf, T v) {
+  for (size_t i = 0; i < sizeof(T); ++i)
+    buf.push_back(static_cast<char>((static_cast<uint64_t>(v) >> (8 * i)) &
+                                    0xFF));
+}
+
+// Writes a minimal RV64 executable with `code` in .text at `base` and
+// `syms` as global function symbols, and returns its path.
+std::filesystem::path writeElf(const std::string &name, uint64_t base,
+                               const std::vector<unsigned char> &code,
+                               const std::vector<TestSymbol> &syms) {
+  std::string strtab(1, '\0');
+  std::vector<char> symtab(24, '\0');
+  for (const auto &sym : syms) {
+    appendLE<uint32_t>(symtab, static_cast<uint32_t>(strtab.size()));
+    symtab.push_back(0x12); // STB_GLOBAL, STT_FUNC
+    symtab.push_back(0);
+    appendLE<uint16_t>(symtab, 1); // .text
+    appendLE<uint64_t>(symtab, sym.addr);
+    appendLE<uint64_t>(symtab, sym.size);
+    strtab += sym.name + '\0';
+  }
+  const std::string shstrtab("\0.text\0.symtab\0.strtab\0.shstrtab\0", 33);
+
+  std::vector<char> elf(64, '\0');
+  uint64_t textOff = elf.size();
+  elf.insert(elf.end(), code.begin(), code.end());
+  uint64_t symOff = elf.size();
+  elf.insert(elf.end(), symtab.begin(), symtab.end());
+  uint64_t strOff = elf.size();
+  elf.insert(elf.end(), strtab.begin(), strtab.end());
+  uint64_t shstrOff = elf.size();
+  elf.insert(elf.end(), shstrtab.begin(), shstrtab.end());
+  while (elf.size() % 8)
+    elf.push_back(0);
+  uint64_t shOff = elf.size();
+
+  auto section = [&elf](uint32_t nameOff, uint32_t type, uint64_t flags,
+                        uint64_t addr, uint64_t off, uint64_t size,
+                        uint32_t link, uint32_t info, uint64_t entsize) {
+    appendLE(elf, nameOff);
+    appendLE(elf, type);
+    appendLE(elf, flags);
+    appendLE(elf, addr);
+    appendLE(elf, off);
+    appendLE(elf, size);
+    appendLE(elf, link);
+    appendLE(elf, info);
+    appendLE<uint64_t>(elf, 4);
+    appendLE(elf, entsize);
+  };
+  section(0, 0, 0, 0, 0, 0, 0, 0, 0);
+  section(1, 1, 6, base, textOff, code.size(), 0, 0, 0); // ALLOC | EXECINSTR
+  section(7, 2, 0, 0, symOff, symtab.size(), 3, 1, 24);
+  section(15, 3, 0, 0, strOff, strtab.size(), 0, 0, 0);
+  section(23, 3, 0, 0, shstrOff, shstrtab.size(), 0, 0, 0);
+
+  // ELF64, little-endian, executable for RISC-V with five sections.
+  const unsigned char ident[] = {0x7f, 'E', 'L', 'F', 2, 1, 1};
+  std::memcpy(elf.data(), ident, sizeof(ident));
+  std::vector<char> header;
+  appendLE<uint16_t>(header, 2);   // e_type
+  appendLE<uint16_t>(header, 243); // e_machine
+  appendLE<uint32_t>(header, 1);   // e_version
+  appendLE<uint64_t>(header, base);
+  appendLE<uint64_t>(header, 0); // e_phoff
+  appendLE<uint64_t>(header, shOff);
+  appendLE<uint32_t>(header, 0);  // e_flags
+  appendLE<uint16_t>(header, 64); // e_ehsize
+  appendLE<uint16_t>(header, 56); // e_phentsize
+  appendLE<uint16_t>(header, 0);  // e_phnum
+  appendLE<uint16_t>(header, 64); // e_shentsize
+  appendLE<uint16_t>(header, 5);  // e_shnum
+  appendLE<uint16_t>(header, 4);  // e_shstrndx
+  std::memcpy(elf.data() + 16, header.data(), header.size());
+
+  auto path = std::filesystem::temp_directory_path() / name;
+  std::ofstream(path, std::ios::binary).write(elf.data(), elf.size());
+  return path;
+}
+
+std::filesystem::path writeTable(const std::string &name,
+                                 const std::string &text) {
+  auto path = std::filesystem::temp_directory_path() / name;
+  std::ofstream(path) << text;
+  return path;
+}
+
+// addi a0, a0, 1; ret
+std::vector<unsigned char> incrementCode() {
+  std::vector<unsigned char> code;
+  appendWordLE(code, encodeI(1, 10, 0x0, 10, 0x13));
+  appendWordLE(code, encodeI(0, 1, 0x0, 0, 0x67));
+  return code;
+}
+
+riscy::ELFImage loadElf(const std::filesystem::path &path) {
+  riscy::ELFImage image;
+  std::string err;
+  REQUIRE(image.load(path, err));
+  return image;
+}
+
+} // namespace
+
+TEST_CASE("HLE: fingerprint of a known function", "[hle]") {
+  auto image = loadElf(
+      writeElf("riscy_hle_known.elf", 0x10000, incrementCode(),
+               {{"memcpy", 0x10000, 8}, {"empty", 0x10000, 0}}));
+  const auto &fns = image.functionSymbols();
+  REQUIRE(fns.size() == 2);
+  for (const auto &fn : fns) {
+    if (fn.name == "memcpy")
+      CHECK(riscy::fingerprint(image, fn) == 0xc06f9cf74ab3d847ull);
+    else
+      CHECK(riscy::fingerprint(image, fn) == 0);
+  }
+  // Outside the image.
+  CHECK(riscy::fingerprint(image, {"memcpy", 0x20000, 8}) == 0);
+}
+
+TEST_CASE("HLE: fingerprints ignore where the linker placed the code",
+          "[hle]") {
+  // auipc t0, hi; addi t0, t0, lo; jal ra, off; ret
+  auto code = [](uint32_t hi, int32_t lo, int32_t off, int32_t addend) {
+    std::vector<unsigned char> c;
+    appendWordLE(c, encodeU(hi, 5, 0x17));
+    appendWordLE(c, encodeI(lo, 5, 0x0, 5, 0x13));
+    appendWordLE(c, encodeJ(off, 1, 0x6F));
+    appendWordLE(c, encodeI(addend, 10, 0x0, 10, 0x13));
+    appendWordLE(c, encodeI(0, 1, 0x0, 0, 0x67));
+    return c;
+  };
+  auto hashAt = [](const std::string &name, uint64_t base,
+                   const std::vector<unsigned char> &c) {
+    auto image = loadElf(writeElf(name, base, c, {{"strlen", base, 20}}));
+    return riscy::fingerprint(image, image.functionSymbols().at(0));
+  };
+  uint64_t a = hashAt("riscy_hle_a.elf", 0x10000, code(1, 16, 64, 1));
+  uint64_t b = hashAt("riscy_hle_b.elf", 0x48000, code(7, -32, -2048, 1));
+  CHECK(a == b);
+  // Immediates that are not PC-relative still count.
+  uint64_t c = hashAt("riscy_hle_c.elf", 0x10000, code(1, 16, 64, 2));
+  CHECK(a != c);
+}
+
+TEST_CASE("HLE: malformed tables are rejected", "[hle]") {
+  riscy::HLETable table;
+  std::string err;
+  CHECK_FALSE(table.load(std::filesystem::temp_directory_path() /
+                             "riscy_hle_missing_table.txt",
+                         err));
+  CHECK(err.find("failed to open HLE table") != std::string::npos);
+
+  auto missing = writeTable("riscy_hle_nohash.txt",
+                            "# comment\n\nmemcpy 0x1\nstrlen  # no hash\n");
+  CHECK_FALSE(table.load(missing, err));
+  CHECK(err.find(":4: missing fingerprint for 'strlen'") != std::string::npos);
+
+  auto bad = writeTable("riscy_hle_badhash.txt", "memset zz\n");
+  CHECK_FALSE(table.load(bad, err));
+  CHECK(err.find(":1: bad fingerprint 'zz'") != std::string::npos);
+
+  auto good = writeTable("riscy_hle_good.txt",
+                         "# builds\nmemcpy 0x1 # old\nmemcpy 0x2\n\n");
+  CHECK(table.load(good, err));
+}
+
+TEST_CASE("HLE: only listed fingerprints of known routines match", "[hle]") {
+  // memcpy at 0x10000 and a byte-identical function that is not a routine
+  // at 0x10008; memset is an alias of memcpy's code but with another hash
+  // in the table.
+  auto code = incrementCode();
+  auto copy = incrementCode();
+  code.insert(code.end(), copy.begin(), copy.end());
+  auto image = loadElf(writeElf("riscy_hle_match.elf", 0x10000, code,
+                                {{"memcpy", 0x10000, 8},
+                                 {"memset", 0x10000, 8},
+                                 {"increment", 0x10008, 8}}));
+
+  riscy::HLETable table;
+  table.add("memcpy", 0x1234);
+  table.add("memcpy", 0xc06f9cf74ab3d847ull);
+  table.add("memset", 0x1234);
+  table.add("increment", 0xc06f9cf74ab3d847ull);
+  auto matches = table.match(image);
+  REQUIRE(matches.size() == 1);
+  CHECK(matches[0].addr == 0x10000);
+  CHECK(matches[0].size == 8);
+  CHECK(std::string(matches[0].routine->symbol) == "memcpy");
+  CHECK(std::string(matches[0].routine->thunk) == "riscy_hle_memcpy");
+
+  // A mismatching fingerprint keeps the guest function.
+  riscy::HLETable other;
+  other.add("memcpy", 0x1234);
+  CHECK(other.match(image).empty());
+}
+
+TEST_CASE("HLE: aliases of one function match once", "[hle]") {
+  auto image = loadElf(writeElf("riscy_hle_alias.elf", 0x10000,
+                                incrementCode(),
+                                {{"memcpy", 0x10000, 8},
+                                 {"memmove", 0x10000, 8},
+                                 {"memset", 0x10000, 8},
+                                 {"memcpy", 0x10000, 8}}));
+  riscy::HLETable table;
+  table.add("memcpy", 0xc06f9cf74ab3d847ull);
+  table.add("memset", 0xc06f9cf74ab3d847ull);
+  auto matches = table.match(image);
+  REQUIRE(matches.size() == 1);
+  CHECK(matches[0].addr == 0x10000);
+  CHECK(matches[0].size == 8);
+}
@@ -1,6 +1,12 @@
 #include "catch2/catch_all.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+
 #include "IR/IR.h"
+#include "IR/PassManager.h"
 #include "RISCV/CFG.h"
 #include "RISCV/Lifter.h"
 
@@ -14,6 +20,60 @@ mkInst(uint64_t pc, riscy::riscv::Opcode op,
   return di;
 }
 
+// jalr x0, 0(x1)
+static riscy::riscv::DecodedInst mkRet(uint64_t pc) {
+  return mkInst(pc, riscy::riscv::Opcode::JALR,
+                {riscy::riscv::Reg{0}, riscy::riscv::Mem{1, 0}});
+}
+
+// A block starting at its first instruction. Two successors make it end in
+// a branch, one in a fallthrough and none in a return.
+static riscy::riscv::BasicBlock
+mkBlock(std::vector<riscy::riscv::DecodedInst> insts,
+        std::vector<uint64_t> succs) {
+  riscy::riscv::BasicBlock bb{};
+  bb.start = insts.front().pc;
+  bb.insts = std::move(insts);
+  bb.term = succs.size() == 2   ? riscy::riscv::TermKind::Branch
+            : succs.size() == 1 ? riscy::riscv::TermKind::Fallthrough
+                                : riscy::riscv::TermKind::Return;
+  bb.succs = std::move(succs);
+  return bb;
+}
+
+// Lifts `blocks` as one function entered at the first of them.
+static riscy::ir::Function
+liftFunction(const std::vector<riscy::riscv::BasicBlock> &blocks) {
+  riscy::riscv::CFG cfg{};
+  riscy::riscv::Function fn{};
+  cfg.entry = fn.entry = blocks.front().start;
+  for (const auto &bb : blocks) {
+    cfg.indexByAddr[bb.start] = cfg.blocks.size();
+    cfg.blocks.push_back(bb);
+    fn.blocks.push_back(bb.start);
+  }
+  return riscy::riscv::Lifter().lift(cfg, fn, {fn.entry});
+}
+
+static riscy::ir::Function optimize(riscy::ir::Function fn,
+                                    size_t unrollBudget = 32) {
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm, nullptr, unrollBudget);
+  pm.run(fn);
+  return fn;
+}
+
+// Lifts and optimizes a single-block loop whose last instruction branches
+// back to its first and otherwise falls into a return.
+static riscy::ir::Function
+liftLoop(std::vector<riscy::riscv::DecodedInst> insts,
+         size_t unrollBudget = 32) {
+  uint64_t start = insts.front().pc, exit = insts.back().pc + 4;
+  return optimize(liftFunction({mkBlock(std::move(insts), {start, exit}),
+                                mkBlock({mkRet(exit)}, {})}),
+                  unrollBudget);
+}
+
 TEST_CASE("Lifter: ADDI + BEQ lowers to IR", "[ir]") {
   // Build a small BB: x5 = x6 + 42; if (x5 == x7) goto T else F
   // Using RV encodings: we directly use decoded form.
@@ -37,9 +97,16 @@ TEST_CASE("Lifter: ADDI + BEQ lowers to IR", "[ir]") {
   auto s = riscy::ir::toString(irbb);
   INFO(s);
   REQUIRE(irbb.start == 0x1000);
-  // Expect at least: readreg x6, const 42, add, writereg x5, readreg x5,
-  // readreg x7, icmp eq, cbr
-  REQUIRE(irbb.insts.size() >= 7);
+  // Expect: readreg x6, const 42, add, readreg x7, icmp eq, writereg x5, cbr.
+  // x5 is read back from the register cache, not from guest state.
+  REQUIRE(irbb.insts.size() == 6);
+  size_t reads = 0, writes = 0;
+  for (const auto &I : irbb.insts) {
+    reads += std::holds_alternative<riscy::ir::ReadReg>(I.payload);
+    writes += std::holds_alternative<riscy::ir::WriteReg>(I.payload);
+  }
+  CHECK(reads == 2);
+  CHECK(writes == 1);
   REQUIRE(irbb.term.kind == riscy::ir::TermKind::CBr);
   auto t = std::get<riscy::ir::TermCBr>(irbb.term.data);
   REQUIRE(t.t == 0x100c);
@@ -61,3 +128,852 @@ TEST_CASE("Lifter: JALR lowers to br_indirect and ra write", "[ir]") {
   INFO(s);
   REQUIRE(irbb.term.kind == riscy::ir::TermKind::BrIndirect);
 }
+
+TEST_CASE("Lifter: JALR x0 uses the masked target, not a link value", "[ir]") {
+  // jalr x0, 8(x5)
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x3000;
+  bb.insts.push_back(mkInst(0x3000, riscy::riscv::Opcode::JALR,
+                            {riscy::riscv::Reg{0}, riscy::riscv::Mem{5, 8}}));
+  bb.term = riscy::riscv::TermKind::IndirectJump;
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  auto s = riscy::ir::toString(irbb);
+  INFO(s);
+  REQUIRE(irbb.term.kind == riscy::ir::TermKind::BrIndirect);
+  auto t = std::get<riscy::ir::TermBrIndirect>(irbb.term.data);
+  REQUIRE(t.target < irbb.insts.size());
+  const auto &def = irbb.insts[t.target];
+  REQUIRE(std::holds_alternative<riscy::ir::BinOp>(def.payload));
+  CHECK(std::get<riscy::ir::BinOp>(def.payload).kind ==
+        riscy::ir::BinOpKind::And);
+  // No link register write for rd == x0.
+  for (const auto &I : irbb.insts)
+    CHECK_FALSE(std::holds_alternative<riscy::ir::WriteReg>(I.payload));
+}
+
+TEST_CASE("Lifter: byte and halfword loads extend, stores narrow", "[ir]") {
+  // lb x5, 3(x10); lhu x6, -2(x10); sb x5, 0(x11); sh x6, 4(x11); ret
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x1000;
+  bb.insts.push_back(mkInst(0x1000, riscy::riscv::Opcode::LB,
+                            {riscy::riscv::Reg{5}, riscy::riscv::Mem{10, 3}}));
+  bb.insts.push_back(mkInst(0x1004, riscy::riscv::Opcode::LHU,
+                            {riscy::riscv::Reg{6}, riscy::riscv::Mem{10, -2}}));
+  bb.insts.push_back(mkInst(0x1008, riscy::riscv::Opcode::SB,
+                            {riscy::riscv::Mem{11, 0}, riscy::riscv::Reg{5}}));
+  bb.insts.push_back(mkInst(0x100c, riscy::riscv::Opcode::SH,
+                            {riscy::riscv::Mem{11, 4}, riscy::riscv::Reg{6}}));
+  bb.insts.push_back(mkInst(0x1010, riscy::riscv::Opcode::JALR,
+                            {riscy::riscv::Reg{0}, riscy::riscv::Mem{1, 0}}));
+  bb.term = riscy::riscv::TermKind::Return;
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  INFO(riscy::ir::toString(irbb));
+
+  std::vector<const riscy::ir::Load *> loads;
+  std::vector<const riscy::ir::Store *> stores;
+  for (const auto &I : irbb.insts) {
+    if (auto *L = std::get_if<riscy::ir::Load>(&I.payload))
+      loads.push_back(L);
+    if (auto *S = std::get_if<riscy::ir::Store>(&I.payload))
+      stores.push_back(S);
+  }
+  REQUIRE(loads.size() == 2);
+  CHECK(loads[0]->ty.kind == riscy::ir::TypeKind::I8);
+  CHECK(loads[0]->offset == 3);
+  CHECK(loads[1]->ty.kind == riscy::ir::TypeKind::I16);
+  CHECK(loads[1]->offset == -2);
+
+  // lb sign-extends and lhu zero-extends to 64 bits, and the stores take
+  // the extended values.
+  REQUIRE(stores.size() == 2);
+  CHECK(stores[0]->ty.kind == riscy::ir::TypeKind::I8);
+  CHECK(stores[0]->offset == 0);
+  CHECK(stores[1]->ty.kind == riscy::ir::TypeKind::I16);
+  CHECK(stores[1]->offset == 4);
+  const auto &b = irbb.insts[stores[0]->value].payload;
+  const auto &h = irbb.insts[stores[1]->value].payload;
+  REQUIRE(std::holds_alternative<riscy::ir::SExt>(b));
+  REQUIRE(std::holds_alternative<riscy::ir::ZExt>(h));
+  CHECK(std::get<riscy::ir::SExt>(b).to.kind == riscy::ir::TypeKind::I64);
+  CHECK(std::get<riscy::ir::ZExt>(h).to.kind == riscy::ir::TypeKind::I64);
+  CHECK(std::holds_alternative<riscy::ir::Load>(
+      irbb.insts[std::get<riscy::ir::SExt>(b).src].payload));
+  CHECK(std::holds_alternative<riscy::ir::Load>(
+      irbb.insts[std::get<riscy::ir::ZExt>(h).src].payload));
+}
+
+TEST_CASE("Lifter: trace branches become side exits", "[ir]") {
+  // 0x1000: addi x9, x9, 1
+  // 0x1004: beq x5, x7, +0xffc (taken -> 0x2000, on trace)
+  // 0x2000: addi x8, x8, 1; ret
+  riscy::riscv::CFG cfg{};
+  riscy::riscv::BasicBlock a{};
+  a.start = 0x1000;
+  a.insts.push_back(mkInst(
+      0x1000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{9}, riscy::riscv::Reg{9}, riscy::riscv::Imm{1}}));
+  a.insts.push_back(mkInst(
+      0x1004, riscy::riscv::Opcode::BEQ,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{7}, riscy::riscv::Imm{0xffc}}));
+  a.term = riscy::riscv::TermKind::Branch;
+  a.succs = {0x2000, 0x1008};
+  riscy::riscv::BasicBlock b{};
+  b.start = 0x2000;
+  b.insts.push_back(mkInst(
+      0x2000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{8}, riscy::riscv::Reg{8}, riscy::riscv::Imm{1}}));
+  b.term = riscy::riscv::TermKind::Return;
+  cfg.blocks = {a, b};
+  cfg.indexByAddr = {{0x1000, 0}, {0x2000, 1}};
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(cfg, riscy::riscv::Trace{0x1000, {0x1000, 0x2000}});
+  INFO(riscy::ir::toString(irbb));
+  REQUIRE(irbb.start == 0x1000);
+  REQUIRE(irbb.term.kind == riscy::ir::TermKind::Ret);
+
+  // The trace follows the taken edge, so the exit fires on the inverted
+  // condition and leaves to the fallthrough.
+  const riscy::ir::ExitIf *exit = nullptr;
+  for (const auto &I : irbb.insts)
+    if (auto *e = std::get_if<riscy::ir::ExitIf>(&I.payload))
+      exit = e;
+  REQUIRE(exit != nullptr);
+  CHECK(exit->target == 0x1008);
+  // Only the exit path stores x9; the trace keeps it cached until the end.
+  REQUIRE(exit->writebacks.size() == 1);
+  CHECK(exit->writebacks[0].reg == 9);
+  size_t writes = 0;
+  for (const auto &I : irbb.insts)
+    writes += std::holds_alternative<riscy::ir::WriteReg>(I.payload);
+  CHECK(writes == 2); // x8 and x9 before the ret
+  const auto &cmp = std::get<riscy::ir::ICmp>(irbb.insts[exit->cond].payload);
+  CHECK(cmp.cond == riscy::ir::ICmpCond::NE);
+}
+
+TEST_CASE("Lifter: guest registers are cached across a unit", "[ir]") {
+  // add x5, x5, x0; add x5, x5, x5; sub x6, x5, x0
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x5000;
+  bb.insts.push_back(mkInst(
+      0x5000, riscy::riscv::Opcode::ADD,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{5}, riscy::riscv::Reg{0}}));
+  bb.insts.push_back(mkInst(
+      0x5004, riscy::riscv::Opcode::ADD,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{5}, riscy::riscv::Reg{5}}));
+  bb.insts.push_back(mkInst(
+      0x5008, riscy::riscv::Opcode::SUB,
+      {riscy::riscv::Reg{6}, riscy::riscv::Reg{5}, riscy::riscv::Reg{0}}));
+  bb.term = riscy::riscv::TermKind::Return;
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  INFO(riscy::ir::toString(irbb));
+
+  // One load of x5, none of x0, and one store per dirty register at the end.
+  std::vector<uint8_t> reads, writes;
+  for (const auto &I : irbb.insts) {
+    if (auto *r = std::get_if<riscy::ir::ReadReg>(&I.payload))
+      reads.push_back(r->reg);
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes.push_back(w->reg);
+  }
+  CHECK(reads == std::vector<uint8_t>{5});
+  CHECK(writes == std::vector<uint8_t>{5, 6});
+  CHECK(std::holds_alternative<riscy::ir::WriteReg>(irbb.insts.back().payload));
+}
+
+TEST_CASE("Lifter: dead guest registers are not stored back", "[ir]") {
+  // 0x1000: addi x9, x9, 1; addi x10, x0, 5; j 0x2000
+  // 0x2000: addi x10, x0, 7; add x11, x9, x10; ret
+  riscy::riscv::CFG cfg{};
+  riscy::riscv::BasicBlock a{};
+  a.start = 0x1000;
+  a.insts.push_back(mkInst(
+      0x1000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{9}, riscy::riscv::Reg{9}, riscy::riscv::Imm{1}}));
+  a.insts.push_back(mkInst(
+      0x1004, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{10}, riscy::riscv::Reg{0}, riscy::riscv::Imm{5}}));
+  a.insts.push_back(mkInst(0x1008, riscy::riscv::Opcode::JAL,
+                           {riscy::riscv::Reg{0}, riscy::riscv::Imm{0xff8}}));
+  a.term = riscy::riscv::TermKind::Jump;
+  a.succs = {0x2000};
+  riscy::riscv::BasicBlock b{};
+  b.start = 0x2000;
+  b.insts.push_back(mkInst(
+      0x2000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{10}, riscy::riscv::Reg{0}, riscy::riscv::Imm{7}}));
+  b.insts.push_back(mkInst(
+      0x2004, riscy::riscv::Opcode::ADD,
+      {riscy::riscv::Reg{11}, riscy::riscv::Reg{9}, riscy::riscv::Reg{10}}));
+  b.insts.push_back(mkInst(0x2008, riscy::riscv::Opcode::JALR,
+                           {riscy::riscv::Reg{0}, riscy::riscv::Mem{1, 0}}));
+  b.term = riscy::riscv::TermKind::Return;
+  cfg.blocks = {a, b};
+  cfg.indexByAddr = {{0x1000, 0}, {0x2000, 1}};
+
+  riscy::riscv::RegLiveness liveness(cfg);
+  auto in = liveness.liveIn(0x2000);
+  CHECK(in[9]);
+  CHECK_FALSE(in[10]);
+  CHECK(in[1]);
+  // Returns leave the known code, so everything but x0 is live there.
+  CHECK(liveness.liveOut(cfg.blocks[1]).count() == 31);
+
+  // x10 is overwritten at 0x2000 before anything reads it.
+  riscy::riscv::Lifter lifter(&liveness);
+  auto irbb = lifter.lift(cfg.blocks[0]);
+  INFO(riscy::ir::toString(irbb));
+  std::vector<uint8_t> writes;
+  for (const auto &I : irbb.insts)
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes.push_back(w->reg);
+  CHECK(writes == std::vector<uint8_t>{9});
+
+  // Under the psABI, the return only keeps a0/a1 and the preserved registers.
+  riscy::riscv::RegLiveness abi(cfg, true);
+  auto out = abi.liveOut(cfg.blocks[1]);
+  CHECK(out[2]);
+  CHECK(out[8]);
+  CHECK(out[10]);
+  CHECK(out[11]);
+  CHECK_FALSE(out[5]);
+  CHECK_FALSE(out[12]);
+  CHECK_FALSE(abi.liveIn(0x2000)[11]);
+}
+
+TEST_CASE("Lifter: functions keep guest registers in SSA values", "[ir]") {
+  // 0x1000: addi x5, x5, 1; bne x5, x6, 0x1000
+  // 0x1008: ret
+  auto irfn = liftFunction(
+      {mkBlock({mkInst(0x1000, riscy::riscv::Opcode::ADDI,
+                       {riscy::riscv::Reg{5}, riscy::riscv::Reg{5},
+                        riscy::riscv::Imm{1}}),
+                mkInst(0x1004, riscy::riscv::Opcode::BNE,
+                       {riscy::riscv::Reg{5}, riscy::riscv::Reg{6},
+                        riscy::riscv::Imm{-4}})},
+               {0x1000, 0x1008}),
+       mkBlock({mkRet(0x1008)}, {})});
+  INFO(riscy::ir::toString(irfn));
+
+  // An entry block loads the registers, then falls into the loop body.
+  REQUIRE(irfn.blocks.size() == 3);
+  const auto &entry = irfn.blocks[0];
+  const auto &body = irfn.blocks[1];
+  const auto &ret = irfn.blocks[2];
+  CHECK(entry.external);
+  CHECK_FALSE(body.external);
+  CHECK(body.preds == std::vector<riscy::ir::BlockId>{0, 1});
+  REQUIRE(body.term.kind == riscy::ir::TermKind::CondGoto);
+  auto t = std::get<riscy::ir::TermCondGoto>(body.term.data);
+  CHECK(t.t == 1);
+  CHECK(t.f == 2);
+
+  // x5 is carried around the loop by a phi; only the entry block reads
+  // guest state and only the return stores x5 back.
+  REQUIRE_FALSE(body.insts.empty());
+  const auto *phi = std::get_if<riscy::ir::Phi>(&body.insts[0].payload);
+  REQUIRE(phi != nullptr);
+  CHECK(phi->incoming.size() == 2);
+  for (const auto &bb : irfn.blocks)
+    for (const auto &I : bb.insts)
+      if (std::holds_alternative<riscy::ir::ReadReg>(I.payload))
+        CHECK(bb.id == 0);
+  std::vector<uint8_t> writes;
+  for (const auto &I : ret.insts)
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes.push_back(w->reg);
+  CHECK(writes == std::vector<uint8_t>{5});
+  CHECK(ret.term.kind == riscy::ir::TermKind::Ret);
+}
+
+TEST_CASE("Lifter: small leaf functions are inlined into their callers",
+          "[ir]") {
+  // 0x1000: addi x10, x0, 5; jal ra, 0x2000
+  // 0x1008: addi x10, x10, 1; ld ra, 8(sp); ret
+  // 0x2000: addi x10, x10, 3; ret
+  riscy::riscv::CFG cfg{};
+  riscy::riscv::BasicBlock call{};
+  call.start = 0x1000;
+  call.insts.push_back(mkInst(
+      0x1000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{10}, riscy::riscv::Reg{0}, riscy::riscv::Imm{5}}));
+  call.insts.push_back(
+      mkInst(0x1004, riscy::riscv::Opcode::JAL,
+             {riscy::riscv::Reg{1}, riscy::riscv::Imm{0xffc}}));
+  call.term = riscy::riscv::TermKind::Call;
+  call.succs = {0x2000, 0x1008};
+  riscy::riscv::BasicBlock after{};
+  after.start = 0x1008;
+  after.insts.push_back(mkInst(
+      0x1008, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{10}, riscy::riscv::Reg{10}, riscy::riscv::Imm{1}}));
+  after.insts.push_back(
+      mkInst(0x100c, riscy::riscv::Opcode::LD,
+             {riscy::riscv::Reg{1}, riscy::riscv::Mem{2, 8}}));
+  after.insts.push_back(mkInst(
+      0x1010, riscy::riscv::Opcode::JALR,
+      {riscy::riscv::Reg{0}, riscy::riscv::Mem{1, 0}}));
+  after.term = riscy::riscv::TermKind::Return;
+  riscy::riscv::BasicBlock leaf{};
+  leaf.start = 0x2000;
+  leaf.insts.push_back(mkInst(
+      0x2000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{10}, riscy::riscv::Reg{10}, riscy::riscv::Imm{3}}));
+  leaf.insts.push_back(mkInst(
+      0x2004, riscy::riscv::Opcode::JALR,
+      {riscy::riscv::Reg{0}, riscy::riscv::Mem{1, 0}}));
+  leaf.term = riscy::riscv::TermKind::Return;
+  cfg.entry = 0x1000;
+  cfg.blocks = {call, after, leaf};
+  cfg.indexByAddr = {{0x1000, 0}, {0x1008, 1}, {0x2000, 2}};
+
+  riscy::riscv::CallGraph cg{};
+  riscy::riscv::Function caller{};
+  caller.entry = 0x1000;
+  caller.blocks = {0x1000, 0x1008};
+  caller.callees = {0x2000};
+  riscy::riscv::Function callee{};
+  callee.entry = 0x2000;
+  callee.blocks = {0x2000};
+  cg.functions = {caller, callee};
+  cg.indexByEntry = {{0x1000, 0}, {0x2000, 1}};
+
+  riscy::riscv::RegLiveness liveness(cfg);
+  // Without the call graph, the call leaves the unit.
+  riscy::riscv::Lifter plain(&liveness);
+  auto outlined = plain.lift(cfg, caller, {0x1000});
+  CHECK(std::any_of(outlined.blocks.begin(), outlined.blocks.end(),
+                    [](const riscy::ir::Block &bb) {
+                      return bb.term.kind == riscy::ir::TermKind::Call;
+                    }));
+  CHECK(plain.inlinedReturns(cfg, caller).empty());
+
+  // Inlined, the callee's block sits between the call and its return site.
+  // ra is reloaded there, so the return site need not be external.
+  riscy::riscv::Lifter lifter(&liveness, &cg);
+  CHECK(lifter.inlinedReturns(cfg, caller) == std::vector<uint64_t>{0x1008});
+  auto irfn = lifter.lift(cfg, caller, {0x1000});
+  INFO(riscy::ir::toString(irfn));
+  REQUIRE(irfn.blocks.size() == 4);
+  const auto &copy = irfn.blocks[2];
+  CHECK(copy.start == 0x2000);
+  CHECK(copy.preds == std::vector<riscy::ir::BlockId>{1});
+  REQUIRE(copy.term.kind == riscy::ir::TermKind::Goto);
+  CHECK(std::get<riscy::ir::TermGoto>(copy.term.data).target == 3);
+  for (const auto &bb : irfn.blocks)
+    CHECK(bb.term.kind != riscy::ir::TermKind::Call);
+
+  // The constants flow through the callee: x10 = 5 + 3 + 1.
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm, nullptr);
+  pm.run(irfn);
+  std::map<riscy::ir::ValueId, uint64_t> consts;
+  std::optional<riscy::ir::ValueId> a0;
+  for (const auto &bb : irfn.blocks)
+    for (const auto &I : bb.insts) {
+      if (auto *c = std::get_if<riscy::ir::Const>(&I.payload))
+        consts[*I.dest] = c->value;
+      if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload);
+          w && w->reg == 10)
+        a0 = w->value;
+    }
+  REQUIRE(a0);
+  CHECK(consts[*a0] == 9);
+}
+
+TEST_CASE("Passes: constants fold through guest register chains", "[ir]") {
+  // addi x5, x0, 3; addi x5, x5, 4; add x6, x5, x0
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x3000;
+  bb.insts.push_back(mkInst(
+      0x3000, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{0}, riscy::riscv::Imm{3}}));
+  bb.insts.push_back(mkInst(
+      0x3004, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{5}, riscy::riscv::Imm{4}}));
+  bb.insts.push_back(mkInst(
+      0x3008, riscy::riscv::Opcode::ADD,
+      {riscy::riscv::Reg{6}, riscy::riscv::Reg{5}, riscy::riscv::Reg{0}}));
+  bb.term = riscy::riscv::TermKind::Fallthrough;
+  bb.succs = {0x300c};
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm);
+  CHECK(pm.run(irbb) > 0);
+  INFO(riscy::ir::toString(irbb));
+
+  // Both registers are written the same constant and no arithmetic is left.
+  std::optional<riscy::ir::ValueId> seven;
+  std::vector<uint8_t> writes;
+  for (const auto &I : irbb.insts) {
+    CHECK_FALSE(std::holds_alternative<riscy::ir::BinOp>(I.payload));
+    if (auto *c = std::get_if<riscy::ir::Const>(&I.payload); c && c->value == 7)
+      seven = I.dest;
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload)) {
+      writes.push_back(w->reg);
+      CHECK(seven);
+      CHECK(w->value == seven.value_or(~0u));
+    }
+  }
+  CHECK(writes == std::vector<uint8_t>{5, 6});
+  REQUIRE(irbb.term.kind == riscy::ir::TermKind::Br);
+
+  // Constant folding runs first and does the work; passes added to the
+  // pipeline later must not disturb that.
+  const auto &stats = pm.stats();
+  REQUIRE_FALSE(stats.empty());
+  CHECK(stats.front().name == "constfold");
+  CHECK(stats.front().changes > 0);
+  CHECK(stats.front().runs >= 1);
+  std::vector<std::string> names;
+  for (const auto &st : stats)
+    names.push_back(st.name);
+  for (const char *name : {"copyprop", "gvn", "dce"})
+    CHECK(std::count(names.begin(), names.end(), name) == 1);
+}
+
+TEST_CASE("InstrList: blocks share their function's arena", "[ir]") {
+  riscy::ir::Function fn{};
+  fn.addBlock(0x1000);
+  fn.addBlock(0x1004);
+  CHECK(fn.blocks[0].insts.arenaPtr() == fn.arena);
+  CHECK(fn.blocks[1].insts.arenaPtr() == fn.arena);
+
+  auto mkConst = [](riscy::ir::ValueId id, uint64_t v) {
+    riscy::ir::Instr I{};
+    I.dest = id;
+    I.payload = riscy::ir::Const{riscy::ir::Type::i64(), v};
+    return I;
+  };
+  for (riscy::ir::ValueId i = 0; i < 100; ++i)
+    fn.blocks[i % 2].insts.push_back(mkConst(i, i));
+  auto &insts = fn.blocks[0].insts;
+  insts.insert(insts.begin(), mkConst(100, 100));
+  insts.erase(insts.begin() + 1, insts.begin() + 3);
+  REQUIRE(insts.size() == 49);
+  CHECK(*insts.front().dest == 100);
+  CHECK(*insts[1].dest == 4);
+  CHECK(*insts.back().dest == 98);
+  CHECK(fn.blocks[1].insts.size() == 50);
+  CHECK(fn.arena->bytesAllocated() >= 99 * sizeof(riscy::ir::Instr));
+}
+
+TEST_CASE("Passes: auipc + lw from read-only data folds to a constant",
+          "[ir]") {
+  // auipc x5, 0x1000; lw x6, -8(x5)  => x6 = *(int32_t *)0x1ff8
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x1000;
+  bb.insts.push_back(mkInst(0x1000, riscy::riscv::Opcode::AUIPC,
+                            {riscy::riscv::Reg{5}, riscy::riscv::Imm{0x1000}}));
+  bb.insts.push_back(mkInst(
+      0x1004, riscy::riscv::Opcode::LW,
+      {riscy::riscv::Reg{6}, riscy::riscv::Mem{5, -8}}));
+  bb.term = riscy::riscv::TermKind::Fallthrough;
+  bb.succs = {0x1008};
+
+  const unsigned char rodata[4] = {0xf9, 0xff, 0xff, 0xff}; // -7
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(
+      pm, [&](uint64_t addr, void *dst, size_t size) {
+        if (addr < 0x1ff8 || addr + size > 0x1ff8 + sizeof(rodata))
+          return false;
+        std::memcpy(dst, rodata + (addr - 0x1ff8), size);
+        return true;
+      });
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  pm.run(irbb);
+  INFO(riscy::ir::toString(irbb));
+
+  std::map<riscy::ir::ValueId, uint64_t> consts;
+  std::map<uint8_t, uint64_t> writes;
+  for (const auto &I : irbb.insts) {
+    CHECK_FALSE(std::holds_alternative<riscy::ir::Load>(I.payload));
+    CHECK_FALSE(std::holds_alternative<riscy::ir::GetPC>(I.payload));
+    if (auto *c = std::get_if<riscy::ir::Const>(&I.payload))
+      consts[*I.dest] = c->value;
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload)) {
+      REQUIRE(consts.count(w->value));
+      writes[w->reg] = consts[w->value];
+    }
+  }
+  CHECK(writes[5] == 0x2000);
+  CHECK(writes[6] == static_cast<uint64_t>(-7));
+}
+
+TEST_CASE("Passes: W results are sign-extended once", "[ir]") {
+  // addw x5, x10, x11; slli x6, x5, 32; srai x6, x6, 32; addiw x7, x6, 0
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x4000;
+  bb.insts.push_back(mkInst(
+      0x4000, riscy::riscv::Opcode::ADDW,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{10}, riscy::riscv::Reg{11}}));
+  bb.insts.push_back(mkInst(
+      0x4004, riscy::riscv::Opcode::SLLI,
+      {riscy::riscv::Reg{6}, riscy::riscv::Reg{5}, riscy::riscv::Imm{32}}));
+  bb.insts.push_back(mkInst(
+      0x4008, riscy::riscv::Opcode::SRAI,
+      {riscy::riscv::Reg{6}, riscy::riscv::Reg{6}, riscy::riscv::Imm{32}}));
+  bb.insts.push_back(mkInst(
+      0x400c, riscy::riscv::Opcode::ADDIW,
+      {riscy::riscv::Reg{7}, riscy::riscv::Reg{6}, riscy::riscv::Imm{0}}));
+  bb.term = riscy::riscv::TermKind::Fallthrough;
+  bb.succs = {0x4010};
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm);
+  pm.run(irbb);
+  INFO(riscy::ir::toString(irbb));
+
+  int sexts = 0;
+  std::optional<riscy::ir::ValueId> sum;
+  std::map<uint8_t, riscy::ir::ValueId> writes;
+  for (const auto &I : irbb.insts) {
+    if (std::holds_alternative<riscy::ir::SExt>(I.payload))
+      ++sexts;
+    if (auto *B = std::get_if<riscy::ir::BinOp>(&I.payload)) {
+      // The add is done on the low halves.
+      CHECK(B->kind == riscy::ir::BinOpKind::Add);
+      CHECK(B->ty.kind == riscy::ir::TypeKind::I32);
+      sum = I.dest;
+    }
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes[w->reg] = w->value;
+  }
+  REQUIRE(sum);
+  CHECK(sexts == 1);
+  CHECK(writes.size() == 3);
+  CHECK(writes[6] == writes[5]);
+  CHECK(writes[7] == writes[5]);
+}
+
+TEST_CASE("Passes: known bits remove masks, idioms and checks", "[ir]") {
+  // andi x5, x10, 0xff; andi x6, x5, 0x1ff; sltiu x7, x5, 256;
+  // slli x8, x5, 32; srai x8, x8, 32
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x4000;
+  bb.insts.push_back(mkInst(
+      0x4000, riscy::riscv::Opcode::ANDI,
+      {riscy::riscv::Reg{5}, riscy::riscv::Reg{10}, riscy::riscv::Imm{0xff}}));
+  bb.insts.push_back(mkInst(
+      0x4004, riscy::riscv::Opcode::ANDI,
+      {riscy::riscv::Reg{6}, riscy::riscv::Reg{5}, riscy::riscv::Imm{0x1ff}}));
+  bb.insts.push_back(mkInst(
+      0x4008, riscy::riscv::Opcode::SLTIU,
+      {riscy::riscv::Reg{7}, riscy::riscv::Reg{5}, riscy::riscv::Imm{256}}));
+  bb.insts.push_back(mkInst(
+      0x400c, riscy::riscv::Opcode::SLLI,
+      {riscy::riscv::Reg{8}, riscy::riscv::Reg{5}, riscy::riscv::Imm{32}}));
+  bb.insts.push_back(mkInst(
+      0x4010, riscy::riscv::Opcode::SRAI,
+      {riscy::riscv::Reg{8}, riscy::riscv::Reg{8}, riscy::riscv::Imm{32}}));
+  bb.term = riscy::riscv::TermKind::Fallthrough;
+  bb.succs = {0x4014};
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm);
+  pm.run(irbb);
+  INFO(riscy::ir::toString(irbb));
+
+  // Only the first mask remains; the bound check is always true.
+  std::map<uint8_t, riscy::ir::ValueId> writes;
+  std::map<riscy::ir::ValueId, uint64_t> consts;
+  size_t ands = 0, shifts = 0;
+  for (const auto &I : irbb.insts) {
+    if (auto *b = std::get_if<riscy::ir::BinOp>(&I.payload)) {
+      ands += b->kind == riscy::ir::BinOpKind::And;
+      shifts += b->kind == riscy::ir::BinOpKind::Shl ||
+                b->kind == riscy::ir::BinOpKind::AShr;
+    }
+    if (auto *c = std::get_if<riscy::ir::Const>(&I.payload))
+      consts[*I.dest] = c->value;
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes[w->reg] = w->value;
+  }
+  CHECK(ands == 1);
+  CHECK(shifts == 0);
+  CHECK(writes[6] == writes[5]);
+  CHECK(writes[8] == writes[5]);
+  REQUIRE(consts.count(writes[7]));
+  CHECK(consts[writes[7]] == 1);
+}
+
+TEST_CASE("Passes: stack reloads are forwarded and dead stores dropped",
+          "[ir]") {
+  // sd x10, 8(x2); addi x8, x2, 16; ld x11, -8(x8); lw x12, 8(x2);
+  // sd x13, 8(x2); sd x14, 8(x2)
+  riscy::riscv::BasicBlock bb{};
+  bb.start = 0x5000;
+  bb.insts.push_back(
+      mkInst(0x5000, riscy::riscv::Opcode::SD,
+             {riscy::riscv::Mem{2, 8}, riscy::riscv::Reg{10}}));
+  bb.insts.push_back(mkInst(
+      0x5004, riscy::riscv::Opcode::ADDI,
+      {riscy::riscv::Reg{8}, riscy::riscv::Reg{2}, riscy::riscv::Imm{16}}));
+  bb.insts.push_back(
+      mkInst(0x5008, riscy::riscv::Opcode::LD,
+             {riscy::riscv::Reg{11}, riscy::riscv::Mem{8, -8}}));
+  bb.insts.push_back(
+      mkInst(0x500c, riscy::riscv::Opcode::LW,
+             {riscy::riscv::Reg{12}, riscy::riscv::Mem{2, 8}}));
+  bb.insts.push_back(
+      mkInst(0x5010, riscy::riscv::Opcode::SD,
+             {riscy::riscv::Mem{2, 8}, riscy::riscv::Reg{13}}));
+  bb.insts.push_back(
+      mkInst(0x5014, riscy::riscv::Opcode::SD,
+             {riscy::riscv::Mem{2, 8}, riscy::riscv::Reg{14}}));
+  bb.term = riscy::riscv::TermKind::Fallthrough;
+  bb.succs = {0x5018};
+
+  riscy::riscv::Lifter lifter;
+  auto irbb = lifter.lift(bb);
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(pm);
+  pm.run(irbb);
+  INFO(riscy::ir::toString(irbb));
+
+  std::map<uint8_t, riscy::ir::ValueId> reads, writes;
+  std::vector<riscy::ir::ValueId> stored;
+  for (const auto &I : irbb.insts) {
+    CHECK_FALSE(std::holds_alternative<riscy::ir::Load>(I.payload));
+    if (auto *r = std::get_if<riscy::ir::ReadReg>(&I.payload))
+      reads[r->reg] = *I.dest;
+    if (auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload))
+      writes[w->reg] = w->value;
+    if (auto *s = std::get_if<riscy::ir::Store>(&I.payload))
+      stored.push_back(s->value);
+  }
+  CHECK(writes[11] == reads[10]);
+  CHECK(stored == std::vector<riscy::ir::ValueId>{reads[14]});
+}
+
+TEST_CASE("Passes: frame slots of a loop are promoted to SSA values",
+          "[ir]") {
+  // 0x1000: addi x2, x2, -16; sw x0, 12(x2)
+  // 0x1008: lw x5, 12(x2); addiw x5, x5, 1; sw x5, 12(x2); bne x5, x10, -12
+  // 0x1018: addi x2, x2, 16; ret
+  auto prologue = mkBlock(
+      {mkInst(0x1000, riscy::riscv::Opcode::ADDI,
+              {riscy::riscv::Reg{2}, riscy::riscv::Reg{2},
+               riscy::riscv::Imm{-16}}),
+       mkInst(0x1004, riscy::riscv::Opcode::SW,
+              {riscy::riscv::Mem{2, 12}, riscy::riscv::Reg{0}})},
+      {0x1008});
+  auto loop = mkBlock(
+      {mkInst(0x1008, riscy::riscv::Opcode::LW,
+              {riscy::riscv::Reg{5}, riscy::riscv::Mem{2, 12}}),
+       mkInst(0x100c, riscy::riscv::Opcode::ADDIW,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{5},
+               riscy::riscv::Imm{1}}),
+       mkInst(0x1010, riscy::riscv::Opcode::SW,
+              {riscy::riscv::Mem{2, 12}, riscy::riscv::Reg{5}}),
+       mkInst(0x1014, riscy::riscv::Opcode::BNE,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{10},
+               riscy::riscv::Imm{-12}})},
+      {0x1008, 0x1018});
+  auto exit = mkBlock({mkInst(0x1018, riscy::riscv::Opcode::ADDI,
+                              {riscy::riscv::Reg{2}, riscy::riscv::Reg{2},
+                               riscy::riscv::Imm{16}}),
+                       mkRet(0x101c)},
+                      {});
+  auto irfn = optimize(liftFunction({prologue, loop, exit}));
+  INFO(riscy::ir::toString(irfn));
+
+  // The counter lives in a phi; its final value is stored on the way out.
+  size_t stores = 0;
+  for (const auto &bb : irfn.blocks) {
+    for (const auto &I : bb.insts) {
+      CHECK_FALSE(std::holds_alternative<riscy::ir::Load>(I.payload));
+      if (std::holds_alternative<riscy::ir::Store>(I.payload)) {
+        CHECK(bb.term.kind == riscy::ir::TermKind::Ret);
+        ++stores;
+      }
+    }
+  }
+  CHECK(stores == 1);
+}
+
+TEST_CASE("Passes: small branches become selects", "[ir]") {
+  // 0x1000: bge x10, x11, 8
+  // 0x1004: addi x10, x11, 0
+  // 0x1008: ret
+  auto entry = mkBlock({mkInst(0x1000, riscy::riscv::Opcode::BGE,
+                               {riscy::riscv::Reg{10}, riscy::riscv::Reg{11},
+                                riscy::riscv::Imm{8}})},
+                       {0x1008, 0x1004});
+  auto arm = mkBlock({mkInst(0x1004, riscy::riscv::Opcode::ADDI,
+                             {riscy::riscv::Reg{10}, riscy::riscv::Reg{11},
+                              riscy::riscv::Imm{0}})},
+                     {0x1008});
+  auto irfn =
+      optimize(liftFunction({entry, arm, mkBlock({mkRet(0x1008)}, {})}));
+  INFO(riscy::ir::toString(irfn));
+
+  // max(x10, x11) is computed without a branch, in the block that returns.
+  size_t selects = 0;
+  for (const auto &bb : irfn.blocks) {
+    CHECK(bb.term.kind != riscy::ir::TermKind::CondGoto);
+    for (const auto &I : bb.insts) {
+      auto *S = std::get_if<riscy::ir::Select>(&I.payload);
+      if (!S)
+        continue;
+      ++selects;
+      CHECK(bb.term.kind == riscy::ir::TermKind::Ret);
+      for (const auto &J : bb.insts)
+        if (J.dest == S->cond)
+          CHECK(std::holds_alternative<riscy::ir::ICmp>(J.payload));
+    }
+  }
+  CHECK(selects == 1);
+}
+
+TEST_CASE("Passes: loop invariants are hoisted and small loops unrolled",
+          "[ir]") {
+  // 0x1000: lui x7, 0x12345; add x5, x5, x7; bne x5, x6, 0x1000
+  // 0x100c: ret
+  auto irfn = liftLoop(
+      {mkInst(0x1000, riscy::riscv::Opcode::LUI,
+              {riscy::riscv::Reg{7}, riscy::riscv::Imm{0x12345000}}),
+       mkInst(0x1004, riscy::riscv::Opcode::ADD,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{5},
+               riscy::riscv::Reg{7}}),
+       mkInst(0x1008, riscy::riscv::Opcode::BNE,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{6},
+               riscy::riscv::Imm{-8}})});
+  INFO(riscy::ir::toString(irfn));
+
+  // The lui result is built once, before the loop.
+  for (const auto &bb : irfn.blocks)
+    for (const auto &I : bb.insts)
+      if (auto *c = std::get_if<riscy::ir::Const>(&I.payload))
+        if (c->value == 0x12345000)
+          CHECK(bb.external);
+
+  // The loop body is copied; each copy may leave, so the final x5 merges
+  // the sums of all of them.
+  std::vector<riscy::ir::BlockId> copies;
+  const riscy::ir::Block *ret = nullptr;
+  for (const auto &bb : irfn.blocks) {
+    if (bb.start == 0x1000 && !bb.external)
+      copies.push_back(bb.id);
+    if (bb.term.kind == riscy::ir::TermKind::Ret)
+      ret = &bb;
+  }
+  REQUIRE(copies.size() >= 2);
+  REQUIRE(ret != nullptr);
+  CHECK(ret->preds == copies);
+  const riscy::ir::Phi *x5 = nullptr;
+  for (const auto &I : ret->insts) {
+    auto *w = std::get_if<riscy::ir::WriteReg>(&I.payload);
+    if (!w || w->reg != 5)
+      continue;
+    for (const auto &J : ret->insts)
+      if (J.dest == w->value)
+        x5 = std::get_if<riscy::ir::Phi>(&J.payload);
+  }
+  REQUIRE(x5 != nullptr);
+  CHECK(x5->incoming.size() == copies.size());
+}
+
+TEST_CASE("Passes: counted loops over arrays are vectorized", "[ir]") {
+  // 0x1000: ld x7, 0(x5); add x7, x7, x6; sd x7, 0(x5); addi x5, x5, 8
+  // 0x1010: bne x5, x8, 0x1000
+  // 0x1014: ret
+  auto irfn = liftLoop(
+      {mkInst(0x1000, riscy::riscv::Opcode::LD,
+              {riscy::riscv::Reg{7}, riscy::riscv::Mem{5, 0}}),
+       mkInst(0x1004, riscy::riscv::Opcode::ADD,
+              {riscy::riscv::Reg{7}, riscy::riscv::Reg{7},
+               riscy::riscv::Reg{6}}),
+       mkInst(0x1008, riscy::riscv::Opcode::SD,
+              {riscy::riscv::Mem{5, 0}, riscy::riscv::Reg{7}}),
+       mkInst(0x100c, riscy::riscv::Opcode::ADDI,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{5},
+               riscy::riscv::Imm{8}}),
+       mkInst(0x1010, riscy::riscv::Opcode::BNE,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{8},
+               riscy::riscv::Imm{-16}})},
+      0);
+  INFO(riscy::ir::toString(irfn));
+
+  // A vector loop adds the splatted x6 to two elements at a time; the
+  // original loop is kept for the last elements.
+  size_t vectorLoops = 0, scalarLoops = 0, splats = 0;
+  for (const auto &bb : irfn.blocks) {
+    bool vectorLoad = false, vectorAdd = false, vectorStore = false;
+    bool scalarLoad = false;
+    for (const auto &I : bb.insts) {
+      if (auto *L = std::get_if<riscy::ir::Load>(&I.payload)) {
+        vectorLoad |= L->ty.kind == riscy::ir::TypeKind::V128;
+        scalarLoad |= L->ty.kind == riscy::ir::TypeKind::I64;
+      }
+      if (auto *S = std::get_if<riscy::ir::Store>(&I.payload))
+        vectorStore |= S->ty.kind == riscy::ir::TypeKind::V128;
+      if (auto *V = std::get_if<riscy::ir::VecBinOp>(&I.payload))
+        vectorAdd |= V->kind == riscy::ir::BinOpKind::Add &&
+                     V->lane.kind == riscy::ir::TypeKind::I64;
+      splats += std::holds_alternative<riscy::ir::Splat>(I.payload);
+    }
+    if (vectorLoad) {
+      CHECK(vectorAdd);
+      CHECK(vectorStore);
+      ++vectorLoops;
+    }
+    scalarLoops += scalarLoad;
+  }
+  CHECK(vectorLoops == 1);
+  CHECK(scalarLoops == 1);
+  CHECK(splats == 1);
+}
+
+TEST_CASE("Passes: strlen-style search loops compare whole vectors",
+          "[ir]") {
+  // 0x1000: lbu x7, 0(x5); addi x5, x5, 1; bne x7, x0, 0x1000
+  // 0x100c: ret
+  auto irfn = liftLoop(
+      {mkInst(0x1000, riscy::riscv::Opcode::LBU,
+              {riscy::riscv::Reg{7}, riscy::riscv::Mem{5, 0}}),
+       mkInst(0x1004, riscy::riscv::Opcode::ADDI,
+              {riscy::riscv::Reg{5}, riscy::riscv::Reg{5},
+               riscy::riscv::Imm{1}}),
+       mkInst(0x1008, riscy::riscv::Opcode::BNE,
+              {riscy::riscv::Reg{7}, riscy::riscv::Reg{0},
+               riscy::riscv::Imm{-8}})},
+      0);
+  INFO(riscy::ir::toString(irfn));
+
+  // A vector loop compares 16 bytes with zero at a time and hands the
+  // vector holding the terminator back to the byte loop.
+  size_t vectorLoops = 0, byteLoads = 0;
+  for (const auto &bb : irfn.blocks) {
+    bool vectorLoad = false, compare = false, reduce = false;
+    for (const auto &I : bb.insts) {
+      if (auto *L = std::get_if<riscy::ir::Load>(&I.payload)) {
+        vectorLoad |= L->ty.kind == riscy::ir::TypeKind::V128;
+        byteLoads += L->ty.kind == riscy::ir::TypeKind::I8;
+      }
+      if (auto *C = std::get_if<riscy::ir::VecCmpEq>(&I.payload))
+        compare |= C->lane.kind == riscy::ir::TypeKind::I8;
+      reduce |= std::holds_alternative<riscy::ir::ReduceUMax>(I.payload);
+    }
+    if (vectorLoad) {
+      CHECK(compare);
+      CHECK(reduce);
+      ++vectorLoops;
+    }
+  }
+  CHECK(vectorLoops == 1);
+  CHECK(byteLoads == 1);
+}
@@ -4,19 +4,75 @@
 #include "AArch64/Emitter.h"
 #include "AArch64/ISel.h"
 #include "ELFImage.h"
+#include "HLE.h"
 #include "IR/IR.h"
+#include "IR/PassManager.h"
 #include "MemoryReaders.h"
 #include "RISCV/CFG.h"
+#include "RISCV/CFGSimplifier.h"
+#include "RISCV/CallGraph.h"
 #include "RISCV/DecodedInst.h"
 #include "RISCV/Decoder.h"
 #include "RISCV/Lifter.h"
 #include "RISCV/Printer.h"
+#include "RISCV/RegLiveness.h"
+#include "RISCV/Trace.h"
 #include <fstream>
+#include <sstream>
+#include <unordered_set>
+
+// Read extra CFG roots from a runtime profile (`miss 0x<pc>` / `hit 0x<pc> N`
+// lines) or a plain list of addresses, one per line. '#' starts a comment.
+static bool loadRoots(const std::string &path, std::vector<uint64_t> &roots,
+                      std::string &err) {
+  std::ifstream is(path);
+  if (!is) {
+    err = "failed to open roots file: " + path;
+    return false;
+  }
+  std::string line;
+  unsigned lineNo = 0;
+  while (std::getline(is, line)) {
+    ++lineNo;
+    line = line.substr(0, line.find('#'));
+    std::istringstream ls(line);
+    std::string tok;
+    if (!(ls >> tok))
+      continue;
+    if (tok == "miss" || tok == "hit") {
+      if (!(ls >> tok)) {
+        err = path + ":" + std::to_string(lineNo) + ": missing address";
+        return false;
+      }
+    }
+    try {
+      roots.push_back(std::stoull(tok, nullptr, 0));
+    } catch (const std::exception &) {
+      err = path + ":" + std::to_string(lineNo) + ": bad address '" + tok + "'";
+      return false;
+    }
+  }
+  return true;
+}
 
 int main(int argc, char **argv) {
   bool dumpCfg = false;
   bool dumpIR = false;
+  bool dumpCallGraph = false;
+  bool simplify = true;
+  bool useTraces = true;
+  bool useSSA = true;
+  bool optimize = true;
+  bool assumeAbi = false;
+  bool unroll = true;
+  bool vectorize = true;
+  bool inlineCalls = true;
+  bool printPassStats = false;
+  bool printStats = false;
+  bool printFingerprints = false;
   std::string outAsm;
+  riscy::HLETable hle;
+  std::vector<uint64_t> roots;
   int argi = 1;
   while (argi < argc && argv[argi][0] == '-') {
     std::string flag = argv[argi];
@@ -24,23 +80,73 @@ int main(int argc, char **argv) {
       dumpCfg = true;
     } else if (flag == "--ir") {
       dumpIR = true;
+    } else if (flag == "--callgraph") {
+      dumpCallGraph = true;
+    } else if (flag == "--no-simplify") {
+      simplify = false;
+    } else if (flag == "--no-traces") {
+      useTraces = false;
+    } else if (flag == "--no-ssa") {
+      useSSA = false;
+    } else if (flag == "--no-opt") {
+      optimize = false;
+    } else if (flag == "--assume-abi") {
+      assumeAbi = true;
+    } else if (flag == "--no-unroll") {
+      unroll = false;
+    } else if (flag == "--no-vectorize") {
+      vectorize = false;
+    } else if (flag == "--no-inline") {
+      inlineCalls = false;
+    } else if (flag == "--stats") {
+      printStats = true;
+    } else if (flag == "--pass-stats") {
+      printPassStats = true;
+    } else if (flag == "--fingerprints") {
+      printFingerprints = true;
     } else if (flag == "--aarch64") {
       if (argi + 1 >= argc) {
         std::cerr << "--aarch64 requires an output path argument\n";
         return 1;
       }
       outAsm = argv[++argi];
+    } else if (flag == "--roots") {
+      if (argi + 1 >= argc) {
+        std::cerr << "--roots requires a profile path argument\n";
+        return 1;
+      }
+      std::string err;
+      if (!loadRoots(argv[++argi], roots, err)) {
+        std::cerr << err << "\n";
+        return 1;
+      }
+    } else if (flag == "--hle") {
+      if (argi + 1 >= argc) {
+        std::cerr << "--hle requires a table path argument\n";
+        return 1;
+      }
+      std::string err;
+      if (!hle.load(argv[++argi], err)) {
+        std::cerr << err << "\n";
+        return 1;
+      }
     } else {
       std::cerr << "unknown flag: " << flag << "\n";
-      std::cerr
-          << "usage: riscy [--cfg] [--ir] [--aarch64 <out.s>] <input-elf>\n";
+      std::cerr << "usage: riscy [--cfg] [--ir] [--callgraph] [--no-simplify] "
+                   "[--no-traces] [--no-ssa] [--no-opt] [--no-unroll] "
+                   "[--no-vectorize] [--no-inline] [--assume-abi] [--stats] "
+                   "[--pass-stats] [--fingerprints] [--aarch64 <out.s>] "
+                   "[--roots <profile>] [--hle <table>] <input-elf>\n";
       return 1;
     }
     ++argi;
   }
   if (argc - argi < 1) {
-    std::cerr
-        << "usage: riscy [--cfg] [--ir] [--aarch64 <out.s>] <input-elf>\n";
+    std::cerr << "usage: riscy [--cfg] [--ir] [--callgraph] [--no-simplify] "
+                 "[--no-traces] [--no-ssa] [--no-opt] [--no-unroll] "
+                 "[--no-vectorize] [--no-inline] [--assume-abi] [--stats] "
+                 "[--pass-stats] [--fingerprints] [--aarch64 <out.s>] "
+                 "[--roots <profile>] [--hle <table>] <input-elf>\n";
     return 1;
   }
 
@@ -52,9 +158,37 @@ int main(int argc, char **argv) {
     std::cerr << err << "\n";
     return 1;
   }
+  if (printFingerprints) {
+    // In --hle table format, for the functions the runtime could replace.
+    for (const auto &fn : image.functionSymbols())
+      for (const auto &r : riscy::hleRoutines())
+        if (fn.name == r.symbol)
+          std::cout << fn.name << " 0x" << std::hex
+                    << riscy::fingerprint(image, fn) << std::dec << "\n";
+  }
+  // Guest library functions replaced by thunks into the runtime.
+  auto emulated = hle.match(image);
+  auto isEmulated = [&emulated](uint64_t pc) {
+    for (const auto &m : emulated)
+      if (pc >= m.addr && pc < m.addr + m.size)
+        return true;
+    return false;
+  };
+
   riscy::ElfMemoryReaderAdapter mem(image);
   riscy::riscv::CFGBuilder builder;
-  auto cfg = builder.build(mem, image.getEntry());
+  auto cfg = builder.build(mem, image.getEntry(), roots);
+  if (simplify) {
+    riscy::riscv::CFGSimplifier simplifier;
+    auto stats = simplifier.run(cfg);
+    if (printStats) {
+      std::cout << "simplify: " << stats.blocksBefore << " -> "
+                << stats.blocksAfter << " blocks (" << stats.blocksMerged
+                << " merged, " << stats.blocksUnreachable
+                << " unreachable, " << stats.edgesThreaded
+                << " edges threaded)\n";
+    }
+  }
 
   // Collect blocks in address order once
   std::vector<uint64_t> addrs;
@@ -63,50 +197,193 @@ int main(int argc, char **argv) {
     addrs.push_back(kv.first);
   std::sort(addrs.begin(), addrs.end());
 
+  // Function units: every function of the call graph becomes one SSA unit.
+  // Blocks that can be entered by address keep their __riscy_block_ label in
+  // the function that contains them first; blocks outside every function are
+  // translated on their own.
+  riscy::riscv::CallGraph cg;
+  std::vector<std::unordered_set<uint64_t>> ownedEntries;
+  std::vector<uint64_t> loose;
+  if (useSSA || dumpCallGraph)
+    cg = riscy::riscv::CallGraphBuilder().build(cfg);
+  // Guest register liveness lets the lifter skip dead register stores, and
+  // the call graph lets it inline small leaf functions. Emulated functions
+  // are left to their thunks.
+  riscy::riscv::RegLiveness liveness(cfg, assumeAbi);
+  riscy::riscv::CallGraph inlinable = cg;
+  for (const auto &m : emulated)
+    inlinable.indexByEntry.erase(m.addr);
+  riscy::riscv::Lifter lifter(optimize || assumeAbi ? &liveness : nullptr,
+                              optimize && inlineCalls ? &inlinable : nullptr);
+  if (useSSA) {
+    std::unordered_set<uint64_t> external(cfg.roots.begin(), cfg.roots.end());
+    external.insert(cfg.entry);
+    for (const auto &fn : cg.functions)
+      external.insert(fn.entry);
+    // Calls return by address unless their callee is inlined; a call block
+    // shared by several functions needs every one of them to inline it.
+    for (const auto &fn : cg.functions) {
+      if (isEmulated(fn.entry))
+        continue;
+      auto inlined = lifter.inlinedReturns(cfg, fn);
+      for (auto pc : fn.blocks) {
+        uint64_t ret = cfg.blocks[cfg.indexByAddr[pc]].returnSite();
+        if (ret && !std::binary_search(inlined.begin(), inlined.end(), ret))
+          external.insert(ret);
+      }
+    }
+    std::unordered_set<uint64_t> inFunction;
+    for (const auto &fn : cg.functions)
+      inFunction.insert(fn.blocks.begin(), fn.blocks.end());
+    for (auto a : addrs) {
+      if (inFunction.count(a) || isEmulated(a))
+        continue;
+      loose.push_back(a);
+      const auto &bb = cfg.blocks[cfg.indexByAddr[a]];
+      external.insert(bb.succs.begin(), bb.succs.end());
+    }
+    // The thunks own the entries of emulated functions.
+    std::unordered_set<uint64_t> owned;
+    for (const auto &m : emulated)
+      owned.insert(m.addr);
+    for (const auto &fn : cg.functions) {
+      ownedEntries.emplace_back();
+      if (isEmulated(fn.entry))
+        continue;
+      for (auto pc : fn.blocks)
+        if (external.count(pc) && owned.insert(pc).second)
+          ownedEntries.back().insert(pc);
+    }
+  }
+
+  // IR optimization between lifting and instruction selection.
+  riscy::ir::PassManager pm;
+  riscy::ir::addStandardPipeline(
+      pm,
+      [&image](uint64_t addr, void *dst, size_t size) {
+        return image.readReadOnly(addr, dst, size);
+      },
+      unroll ? 32 : 0, vectorize);
+  auto liftFunction = [&](size_t i) {
+    auto irfn = lifter.lift(cfg, cg.functions[i], ownedEntries[i]);
+    if (optimize)
+      pm.run(irfn);
+    return irfn;
+  };
+  auto liftUnit = [&](riscy::ir::Block bb) {
+    if (optimize)
+      pm.run(bb);
+    return bb;
+  };
+
   if (dumpCfg || dumpIR) {
     for (auto a : addrs) {
       const auto &bb = cfg.blocks[cfg.indexByAddr[a]];
       if (dumpCfg) {
         std::cout << riscy::riscv::formatBlock(bb);
       }
-      if (dumpIR) {
-        riscy::riscv::Lifter lifter;
-        auto irbb = lifter.lift(bb);
-        std::cout << riscy::ir::toString(irbb);
-      }
+      if (dumpIR && !useSSA && !isEmulated(a))
+        std::cout << riscy::ir::toString(liftUnit(lifter.lift(bb)));
+    }
+    if (dumpIR && useSSA) {
+      for (size_t i = 0; i < cg.functions.size(); ++i)
+        if (!isEmulated(cg.functions[i].entry))
+          std::cout << riscy::ir::toString(liftFunction(i));
+      for (auto a : loose)
+        std::cout << riscy::ir::toString(
+            liftUnit(lifter.lift(cfg.blocks[cfg.indexByAddr[a]])));
     }
   }
 
+  if (dumpCallGraph)
+    std::cout << riscy::riscv::formatCallGraph(cg);
+
   if (!outAsm.empty()) {
-    // Lower all blocks and emit assembly
-    riscy::riscv::Lifter lifter;
-    std::vector<riscy::aarch64::Block> blocks;
-    std::vector<riscy::aarch64::RegAssignment> assigns;
-    blocks.reserve(addrs.size());
-    assigns.reserve(addrs.size());
     riscy::aarch64::ISel isel;
     riscy::aarch64::Liveness live;
     riscy::aarch64::RegAlloc ra;
+    std::vector<std::vector<riscy::aarch64::Block>> units;
+    std::vector<riscy::aarch64::RegAssignment> assigns;
     bool dumpLive = std::getenv("RISCY_DUMP_LIVENESS") != nullptr;
-    for (auto a : addrs) {
-      const auto &bb = cfg.blocks[cfg.indexByAddr[a]];
-      auto irbb = lifter.lift(bb);
-      auto blk = isel.select(irbb);
-      auto lv = live.analyze(blk);
+    auto addUnit = [&](uint64_t pc, std::vector<riscy::aarch64::Block> blks) {
+      auto lv = live.analyze(blks);
       if (dumpLive) {
-        std::cout << "-- Liveness for block 0x" << std::hex << a << std::dec
-                  << " (" << blk.instrs.size() << " instrs)\n";
+        size_t n = 0;
+        for (const auto &b : blks)
+          n += b.instrs.size();
+        std::cout << "-- Liveness for unit 0x" << std::hex << pc << std::dec
+                  << " (" << n << " instrs)\n";
         for (const auto &kv : lv) {
           std::cout << "  v" << kv.first << ": [" << kv.second.start << ", "
                     << kv.second.end << "]\n";
         }
       }
-      auto asg = ra.allocate(blk, lv);
-      blocks.push_back(std::move(blk));
-      assigns.push_back(std::move(asg));
+      assigns.push_back(ra.allocate(blks, lv));
+      units.push_back(std::move(blks));
+    };
+
+    if (useSSA) {
+      size_t phis = 0, spilled = 0;
+      for (size_t i = 0; i < cg.functions.size(); ++i) {
+        if (isEmulated(cg.functions[i].entry))
+          continue;
+        auto irfn = liftFunction(i);
+        for (const auto &bb : irfn.blocks)
+          for (const auto &I : bb.insts)
+            phis += std::holds_alternative<riscy::ir::Phi>(I.payload);
+        addUnit(irfn.entry, isel.select(irfn));
+        spilled += assigns.back().spill.size();
+      }
+      for (auto a : loose)
+        addUnit(a, {isel.select(
+                       liftUnit(lifter.lift(cfg.blocks[cfg.indexByAddr[a]])))});
+      if (printStats) {
+        std::cout << "ssa: " << cg.functions.size() << " functions, " << phis
+                  << " phis, " << spilled << " spilled values, "
+                  << loose.size() << " blocks outside functions\n";
+      }
+    } else {
+      // Translation units: superblocks, or one unit per block.
+      std::vector<riscy::riscv::Trace> traces;
+      if (useTraces) {
+        riscy::riscv::TraceBuilder tracer;
+        traces = tracer.build(cfg);
+      } else {
+        for (auto a : addrs)
+          traces.push_back({a, {a}});
+      }
+      traces.erase(std::remove_if(traces.begin(), traces.end(),
+                                  [&](const riscy::riscv::Trace &t) {
+                                    return isEmulated(t.entry);
+                                  }),
+                   traces.end());
+      if (printStats) {
+        size_t traced = 0;
+        for (const auto &t : traces)
+          traced += t.blocks.size();
+        std::cout << "traces: " << traces.size() << " units covering "
+                  << traced << " blocks (" << cfg.blocks.size()
+                  << " in CFG)\n";
+      }
+      for (const auto &trace : traces)
+        addUnit(trace.entry, {isel.select(liftUnit(lifter.lift(cfg, trace)))});
+    }
+
+    // Each emulated function is a single block entered by its guest address
+    // that tail-calls the runtime, so the thunk returns to the guest caller.
+    for (const auto &m : emulated) {
+      riscy::aarch64::Block thunk;
+      thunk.guest_pc = m.addr;
+      std::string target = "_" + std::string(m.routine->thunk);
+      thunk.term = {riscy::aarch64::TermKind::Br,
+                    riscy::aarch64::TermBr{target}};
+      addUnit(m.addr, {std::move(thunk)});
     }
+    if (printStats && !emulated.empty())
+      std::cout << "hle: " << emulated.size() << " functions emulated\n";
+
     riscy::aarch64::Emitter emitter;
-    auto mod = emitter.emit(blocks, assigns, image.getEntry());
+    auto mod = emitter.emit(units, assigns, image.getEntry());
     std::ofstream os(outAsm);
     if (!os) {
       std::cerr << "failed to open output asm: " << outAsm << "\n";
@@ -116,5 +393,8 @@ int main(int argc, char **argv) {
     std::cout << "wrote AArch64 assembly to " << outAsm << "\n";
   }
 
+  if (printPassStats)
+    std::cout << "passes:\n" << pm.formatStats();
+
   return 0;
 }